@@ -0,0 +1,603 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/**
+ * @file
+ *
+ * Local cache of compile results.  Client-side only.
+ *
+ * The cache directory holds KEY.result files with the compiler messages
+ * and output files of a compile, keyed by the hash of the preprocessed
+ * source and the flags, and KEY.manifest files keyed by the hash of the
+ * unpreprocessed source and the flags. A manifest lists the files the
+ * preprocessor read with their hashes, and the result key they led to.
+ * Files are created under a temporary name and renamed, so concurrent
+ * compiles never see partial entries.
+ **/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <vector>
+
+#include "client.h"
+#include "cache.h"
+#include "services/util.h"
+
+using namespace std;
+
+#define RESULT_MAGIC 0x31524349 // "ICR1"
+#define DEFAULT_CACHE_SIZE 1024 // MB
+// how often a client checks the size of the cache
+#define CLEANUP_INTERVAL 60
+// a temporary file this old belongs to a client that died
+#define STALE_TMP_AGE 3600
+
+namespace
+{
+
+struct ResultHeader {
+    uint32_t magic;
+    uint32_t out_len;
+    uint32_t err_len;
+    uint32_t obj_len;
+    uint32_t dwo_len;
+    uint32_t dep_len;
+};
+
+struct CachedFile {
+    string name;
+    time_t mtime;
+    size_t size;
+
+    bool operator<(const CachedFile &other) const {
+        return mtime < other.mtime;
+    }
+};
+
+}
+
+static void hash_string(md5_state_t *state, const string &s)
+{
+    // the trailing 0 separates the fields
+    md5_append(state, reinterpret_cast<const md5_byte_t *>(s.c_str()), s.size() + 1);
+}
+
+/* The result can't be reused if the source expands to something
+   different every time.  */
+static bool uses_time_macros(const string &data)
+{
+    return data.find("__TIME__") != string::npos
+           || data.find("__DATE__") != string::npos
+           || data.find("__TIMESTAMP__") != string::npos;
+}
+
+/* The position of the opening quote of the file name if the line of DATA
+   at POS is a line marker, # 1 "foo.h" 1 or #line 1 "foo.h", npos for
+   other directives like #pragma message "...".  */
+static size_t line_marker_file(const string &data, size_t pos, size_t eol)
+{
+    if (pos >= eol || data[pos] != '#') {
+        return string::npos;
+    }
+
+    ++pos;
+
+    while (pos < eol && (data[pos] == ' ' || data[pos] == '\t')) {
+        ++pos;
+    }
+
+    if (data.compare(pos, 4, "line") == 0) {
+        pos += 4;
+    }
+
+    while (pos < eol && (data[pos] == ' ' || data[pos] == '\t')) {
+        ++pos;
+    }
+
+    size_t digits = pos;
+
+    while (pos < eol && isdigit((unsigned char) data[pos])) {
+        ++pos;
+    }
+
+    if (pos == digits || pos >= eol || (data[pos] != ' ' && data[pos] != '\t')) {
+        return string::npos;
+    }
+
+    while (pos < eol && (data[pos] == ' ' || data[pos] == '\t')) {
+        ++pos;
+    }
+
+    return pos < eol && data[pos] == '"' ? pos : string::npos;
+}
+
+void parse_line_markers(const string &data, const string &cwd, list<string> &files)
+{
+    set<string> seen;
+    size_t pos = 0;
+
+    while (pos < data.size()) {
+        size_t eol = data.find('\n', pos);
+
+        if (eol == string::npos) {
+            eol = data.size();
+        }
+
+        size_t quote = line_marker_file(data, pos, eol);
+
+        if (quote != string::npos) {
+            string file;
+
+            for (size_t i = quote + 1; i < eol && data[i] != '"'; ++i) {
+                if (data[i] == '\\' && i + 1 < eol) {
+                    ++i;
+                }
+
+                file += data[i];
+            }
+
+            // <built-in>, <command-line> and such are no files
+            if (!file.empty() && file[0] != '<') {
+                if (file[0] != '/') {
+                    file = cwd + '/' + file;
+                }
+
+                if (seen.insert(file).second) {
+                    files.push_back(file);
+                }
+            }
+        }
+
+        pos = eol + 1;
+    }
+}
+
+ResultCache::ResultCache()
+    : size_limit(0)
+    , start_time(0)
+    , have_output(false)
+{
+}
+
+bool ResultCache::init(const CompileJob &_job)
+{
+    const char *env = getenv("ICECC_CACHE_DIR");
+
+    if (!env || !*env) {
+        return false;
+    }
+
+    job = _job;
+    compiler = find_compiler(job);
+
+    // a cached result is only valid for the same compiler
+    struct stat st;
+
+    if (compiler.empty() || stat(compiler.c_str(), &st) != 0) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    hash_string(&state, "direct");
+    hashCommon(&state);
+
+    string source;
+
+    if (!read_file(job.inputFile(), source)) {
+        return false;
+    }
+
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(source.data()), source.size());
+
+    if (!uses_time_macros(source)) {
+        direct_key = md5_hex(&state);
+    }
+
+    size_limit = DEFAULT_CACHE_SIZE;
+
+    if (const char *size = getenv("ICECC_CACHE_SIZE")) {
+        size_limit = atoi(size);
+    }
+
+    size_limit *= 1024 * 1024;
+
+    if (!size_limit || (mkdir(env, 0777) != 0 && errno != EEXIST)) {
+        return false;
+    }
+
+    // the dependency file is written by the preprocessor, a cached result
+    // has to bring it along
+    list<string> flags = job.localFlags();
+    bool have_dep_file = false;
+    string dep_file_flag;
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        if (*it == "-MD" || *it == "-MMD") {
+            have_dep_file = true;
+        } else if (*it == "-MF") {
+            list<string>::const_iterator next = it;
+
+            if (++next != flags.end()) {
+                dep_file_flag = *next;
+            }
+        }
+    }
+
+    if (have_dep_file) {
+        dep_file = !dep_file_flag.empty() ? dep_file_flag
+                   : job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".d";
+    }
+
+    dir = env;
+    start_time = time(0);
+    return true;
+}
+
+void ResultCache::hashCommon(md5_state_t *state) const
+{
+    struct stat st;
+    stat(compiler.c_str(), &st);
+
+    hash_string(state, compiler);
+    hash_string(state, toString(st.st_size));
+    hash_string(state, toString(st.st_mtime));
+
+    const char *version = getenv("ICECC_VERSION");
+    hash_string(state, version ? version : "");
+
+    // these change what the preprocessor finds
+    static const char *const env_vars[] = {
+        "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH", 0
+    };
+
+    for (int i = 0; env_vars[i]; ++i) {
+        const char *value = getenv(env_vars[i]);
+        hash_string(state, value ? value : "");
+    }
+
+    hash_string(state, job.language() == CompileJob::Lang_CXX ? "c++" : "c");
+    list<string> flags = job.allFlags();
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        hash_string(state, *it);
+    }
+
+    // these end up in debug info and dependency files
+    hash_string(state, job.inputFile());
+    hash_string(state, job.outputFile());
+    hash_string(state, job.workingDirectory());
+}
+
+bool ResultCache::lookupDirect()
+{
+    if (direct_key.empty()) {
+        return false;
+    }
+
+    ifstream manifest((dir + '/' + direct_key + ".manifest").c_str());
+    string line, result_key;
+
+    if (!getline(manifest, line) || line != "icecc-manifest 1" || !getline(manifest, result_key)) {
+        return false;
+    }
+
+    while (getline(manifest, line)) {
+        // md5 size mtime path
+        char md5[33];
+        unsigned long long size;
+        long long mtime;
+        int path_offset = 0;
+
+        if (sscanf(line.c_str(), "%32s %llu %lld %n", md5, &size, &mtime, &path_offset) != 3
+                || !path_offset) {
+            return false;
+        }
+
+        string path = line.substr(path_offset);
+        struct stat st;
+
+        if (stat(path.c_str(), &st) != 0 || (unsigned long long) st.st_size != size) {
+            return false;
+        }
+
+        // a file that kept its time stamp since the compile is unchanged
+        if (mtime && st.st_mtime == mtime) {
+            continue;
+        }
+
+        string data;
+
+        if (!read_file(path, data)) {
+            return false;
+        }
+
+        md5_state_t state;
+        md5_init(&state);
+        md5_append(&state, reinterpret_cast<const md5_byte_t *>(data.data()), data.size());
+
+        if (md5_hex(&state) != md5) {
+            return false;
+        }
+    }
+
+    if (!restore(result_key)) {
+        return false;
+    }
+
+    utimes((dir + '/' + direct_key + ".manifest").c_str(), 0);
+    trace() << "cache hit (direct) for " << job.inputFile() << endl;
+    return true;
+}
+
+bool ResultCache::lookupPreprocessed(const string &preproc_file)
+{
+    string data;
+
+    if (!read_file(preproc_file, data)) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    hash_string(&state, "preprocessed");
+    hashCommon(&state);
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(data.data()), data.size());
+    preprocessed_key = md5_hex(&state);
+
+    includes.clear();
+    parse_line_markers(data, job.workingDirectory(), includes);
+
+    if (!restore(preprocessed_key)) {
+        return false;
+    }
+
+    trace() << "cache hit (preprocessed) for " << job.inputFile() << endl;
+    storeManifest();
+    return true;
+}
+
+void ResultCache::setOutput(const string &_out, const string &_err)
+{
+    out = _out;
+    err = _err;
+    have_output = true;
+}
+
+bool ResultCache::restore(const string &key)
+{
+    string result_file = dir + '/' + key + ".result";
+    string data;
+
+    if (!read_file(result_file, data) || data.size() < sizeof(ResultHeader)) {
+        return false;
+    }
+
+    ResultHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+
+    if (header.magic != RESULT_MAGIC
+            || sizeof(header) + size_t(header.out_len) + header.err_len + header.obj_len
+               + header.dwo_len + header.dep_len != data.size()) {
+        return false;
+    }
+
+    size_t offset = sizeof(header);
+    string cached_out = data.substr(offset, header.out_len);
+    offset += header.out_len;
+    string cached_err = data.substr(offset, header.err_len);
+    offset += header.err_len;
+
+    if ((!cached_out.empty() || !cached_err.empty()) && output_needs_workaround(job)) {
+        return false;
+    }
+
+    string dwo_file = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+    mode_t mask = umask(0);
+    umask(mask);
+    mode_t mode = 0666 & ~mask;
+
+    if (!write_file_atomic(job.outputFile(), data.substr(offset, header.obj_len), mode)) {
+        return false;
+    }
+
+    offset += header.obj_len;
+
+    if (job.dwarfFissionEnabled()
+            && !write_file_atomic(dwo_file, data.substr(offset, header.dwo_len), mode)) {
+        return false;
+    }
+
+    offset += header.dwo_len;
+
+    if (!dep_file.empty()
+            && !write_file_atomic(dep_file, data.substr(offset, header.dep_len), mode)) {
+        return false;
+    }
+
+    // the modification time is the last use
+    utimes(result_file.c_str(), 0);
+
+    ignore_result(write(STDOUT_FILENO, cached_out.c_str(), cached_out.size()));
+
+    if (colorify_wanted(job)) {
+        colorify_output(cached_err);
+    } else {
+        ignore_result(write(STDERR_FILENO, cached_err.c_str(), cached_err.size()));
+    }
+
+    return true;
+}
+
+void ResultCache::store()
+{
+    if (preprocessed_key.empty() || !have_output) {
+        return;
+    }
+
+    string obj, dwo, dep;
+    string dwo_file = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+
+    if (!read_file(job.outputFile(), obj)
+            || (job.dwarfFissionEnabled() && !read_file(dwo_file, dwo))
+            || (!dep_file.empty() && !read_file(dep_file, dep))) {
+        return;
+    }
+
+    ResultHeader header;
+    header.magic = RESULT_MAGIC;
+    header.out_len = out.size();
+    header.err_len = err.size();
+    header.obj_len = obj.size();
+    header.dwo_len = dwo.size();
+    header.dep_len = dep.size();
+
+    string data(reinterpret_cast<const char *>(&header), sizeof(header));
+    data += out;
+    data += err;
+    data += obj;
+    data += dwo;
+    data += dep;
+
+    if (!write_file_atomic(dir + '/' + preprocessed_key + ".result", data, 0644)) {
+        log_warning() << "failed to store result in " << dir << endl;
+        return;
+    }
+
+    storeManifest();
+    cleanup();
+}
+
+void ResultCache::storeManifest()
+{
+    if (direct_key.empty()) {
+        return;
+    }
+
+    string manifest = "icecc-manifest 1\n" + preprocessed_key + "\n";
+
+    for (list<string>::const_iterator it = includes.begin(); it != includes.end(); ++it) {
+        string data;
+        struct stat st;
+
+        if (stat(it->c_str(), &st) != 0 || !read_file(*it, data) || uses_time_macros(data)) {
+            return;
+        }
+
+        md5_state_t state;
+        md5_init(&state);
+        md5_append(&state, reinterpret_cast<const md5_byte_t *>(data.data()), data.size());
+
+        // a file changed during the compile could have the same time
+        // stamp as its next version, hash it every time then
+        time_t mtime = st.st_mtime < start_time - 1 ? st.st_mtime : 0;
+
+        manifest += md5_hex(&state) + " " + toString(st.st_size) + " "
+                    + toString(mtime) + " " + *it + "\n";
+    }
+
+    write_file_atomic(dir + '/' + direct_key + ".manifest", manifest, 0644);
+}
+
+void ResultCache::cleanup()
+{
+    string stamp = dir + "/.cleanup";
+    struct stat st;
+    time_t now = time(0);
+
+    if (stat(stamp.c_str(), &st) == 0 && now - st.st_mtime < CLEANUP_INTERVAL) {
+        return;
+    }
+
+    // only one client at a time needs to do this
+    int fd = open(stamp.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    utimes(stamp.c_str(), 0);
+
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    vector<CachedFile> files;
+    size_t total = 0;
+
+    for (struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        string name = ent->d_name;
+        string path = dir + '/' + name;
+
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (name.compare(0, 5, ".tmp.") == 0) {
+            if (now - st.st_mtime > STALE_TMP_AGE) {
+                unlink(path.c_str());
+            }
+
+            continue;
+        }
+
+        if (name[0] == '.') {
+            continue;
+        }
+
+        CachedFile file;
+        file.name = path;
+        file.mtime = st.st_mtime;
+        file.size = st.st_size;
+        files.push_back(file);
+        total += file.size;
+    }
+
+    closedir(d);
+
+    if (total <= size_limit) {
+        return;
+    }
+
+    sort(files.begin(), files.end());
+
+    for (vector<CachedFile>::const_iterator it = files.begin();
+            it != files.end() && total > size_limit / 10 * 9; ++it) {
+        if (unlink(it->name.c_str()) == 0) {
+            total -= it->size;
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CLIENT_CACHE_H
+#define ICECREAM_CLIENT_CACHE_H
+
+#include <sys/types.h>
+#include <list>
+#include <string>
+
+#include <job.h>
+#include "md5.h"
+
+// A local cache of compile results, used if $ICECC_CACHE_DIR is set.
+// A result is found either without running the preprocessor, from the
+// hashes of the source and of the files it included the last time
+// (the manifest), or from the hash of the preprocessed source.
+class ResultCache
+{
+public:
+    ResultCache();
+
+    // false if the cache is disabled or can't be used for JOB
+    bool init(const CompileJob &job);
+    bool enabled() const {
+        return !dir.empty();
+    }
+
+    // restores the output files and compiler messages if the source and
+    // the files it includes didn't change since the result was stored
+    bool lookupDirect();
+    // the same for the preprocessed source in PREPROC_FILE
+    bool lookupPreprocessed(const std::string &preproc_file);
+
+    // what the compiler printed for the compile to be stored
+    void setOutput(const std::string &out, const std::string &err);
+    // the compile of the preprocessed source succeeded, keep the result
+    void store();
+
+private:
+    void hashCommon(md5_state_t *state) const;
+    bool restore(const std::string &key);
+    void storeManifest();
+    void cleanup();
+
+    CompileJob job;
+    std::string compiler;
+    std::string dir;
+    size_t size_limit;
+    time_t start_time;
+    std::string dep_file;
+    // the key hashed from the source and the flags
+    std::string direct_key;
+    // the key hashed from the preprocessed source and the flags
+    std::string preprocessed_key;
+    // files the preprocessor read, from its line markers
+    std::list<std::string> includes;
+    bool have_output;
+    std::string out;
+    std::string err;
+};
+
+// Appends the files named in the line markers of the preprocessed DATA
+// to FILES, each once, relative ones in CWD.
+void parse_line_markers(const std::string &data, const std::string &cwd,
+                        std::list<std::string> &files);
+
+#endif
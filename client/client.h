@@ -37,6 +37,7 @@
 #include "util.h"
 
 class MsgChannel;
+class ResultCache;
 
 extern std::string remote_daemon;
 
@@ -49,6 +50,7 @@ extern bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
 
 /* In cpp.cpp.  */
 extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1);
+extern bool dcc_is_preprocessed(const std::string &sfile);
 
 /* In local.cpp.  */
 extern int build_local(CompileJob &job, MsgChannel *daemon, struct rusage *usage = 0);
@@ -58,7 +60,14 @@ extern bool compiler_only_rewrite_includes(const CompileJob &job);
 extern std::string compiler_path_lookup(const std::string &compiler);
 
 /* In remote.cpp - permill is the probability it will be compiled three times */
-extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill);
+extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill,
+                        ResultCache *cache = 0);
+
+/* In remote.cpp - compiles the front of JOBS on one server, together with
+   as many of the others as the server takes. Removes the jobs that are done
+   and returns the worst exit status.  */
+extern int build_remote_batch(std::list<CompileJob> &jobs, MsgChannel *local_daemon,
+                              const Environments &envs);
 
 /* safeguard.cpp */
 extern void dcc_increment_safeguard(void);
@@ -0,0 +1,2052 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/**
+ * @file
+ *
+ * Environment creation, the same files and the same hash as
+ * icecc-create-env. The files are copied into a temporary directory, where
+ * the binaries are stripped and ldconfig creates etc/ld.so.cache, and then
+ * read once in sorted order: each file is hashed while it is written to the
+ * tarball, which gzip compresses as it is written. The environment hash is
+ * the md5 sum of the md5 sums of the files, one hex sum per line, like
+ * "md5sum | md5sum" in the script.
+ **/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "client.h"
+#include "createenv.h"
+#include "md5.h"
+#include "platform.h"
+#include "services/util.h"
+
+using namespace std;
+
+#define TAR_BLOCK 512
+// what GNU tar pads the archive to
+#define TAR_RECORD (20 * TAR_BLOCK)
+
+namespace
+{
+
+// what the dynamic linker needs to know about a binary
+struct ElfInfo {
+    bool elf;
+    bool dynamic;
+    unsigned char elf_class;
+    unsigned int machine;
+    string interp;
+    vector<string> needed;
+    vector<string> rpath;
+    vector<string> runpath;
+
+    ElfInfo()
+        : elf(false)
+        , dynamic(false)
+        , elf_class(0)
+        , machine(0)
+    {}
+};
+
+struct EnvFile {
+    string target; // the name in the environment, without the leading /
+    string md5;
+};
+
+bool operator<(const EnvFile &a, const EnvFile &b)
+{
+    // the order of sort(1)
+    return strcoll(a.target.c_str(), b.target.c_str()) < 0;
+}
+
+}
+
+static string dir_name(const string &path)
+{
+    string::size_type pos = path.rfind('/');
+
+    if (pos == string::npos) {
+        return ".";
+    }
+
+    return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+static string base_name(const string &path)
+{
+    string::size_type pos = path.rfind('/');
+    return pos == string::npos ? path : path.substr(pos + 1);
+}
+
+static bool is_file(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// the abs_path() of icecc-create-env: the path with its directory resolved
+static string abs_path(const string &path)
+{
+    struct stat st;
+    char buf[PATH_MAX];
+
+    if (stat(path.c_str(), &st) != 0) {
+        return path;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        return realpath(path.c_str(), buf) ? string(buf) : path;
+    }
+
+    if (!realpath(dir_name(path).c_str(), buf)) {
+        return path;
+    }
+
+    string dir = buf;
+    return (dir == "/" ? "" : dir) + "/" + base_name(path);
+}
+
+// The stdout of ARGV with the trailing newline removed, like `ARGV` in the
+// shell.
+static string run_output(const char *const argv[])
+{
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        log_perror("pipe");
+        return string();
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return string();
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execvp(argv[0], const_cast<char * const *>(argv));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    string output;
+    char buf[4096];
+
+    for (;;) {
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        output.append(buf, n);
+    }
+
+    close(fds[0]);
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    while (!output.empty() && output[output.size() - 1] == '\n') {
+        output.resize(output.size() - 1);
+    }
+
+    return output;
+}
+
+static string compiler_output(const string &compiler, const string &option)
+{
+    const char *argv[] = { compiler.c_str(), option.c_str(), NULL };
+    return run_output(argv);
+}
+
+static bool run_quiet(const vector<const char *> &args)
+{
+    vector<const char *> argv = args;
+    argv.push_back(NULL);
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork");
+        return false;
+    }
+
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+        }
+
+        execvp(argv[0], const_cast<char * const *>(&argv[0]));
+        _exit(127);
+    }
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+    return pread(fd, buf, len, offset) == (ssize_t) len;
+}
+
+static string read_cstring(int fd, off_t offset)
+{
+    string result;
+    char buf[256];
+
+    for (;;) {
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+
+        if (n <= 0) {
+            return result;
+        }
+
+        size_t len = strnlen(buf, n);
+        result.append(buf, len);
+
+        if (len < (size_t) n) {
+            return result;
+        }
+
+        offset += n;
+    }
+}
+
+static void split_paths(const string &list, vector<string> &paths)
+{
+    string::size_type start = 0;
+
+    for (;;) {
+        string::size_type end = list.find(':', start);
+        string path = list.substr(start, end == string::npos ? string::npos : end - start);
+
+        if (!path.empty()) {
+            paths.push_back(path);
+        }
+
+        if (end == string::npos) {
+            return;
+        }
+
+        start = end + 1;
+    }
+}
+
+// Reads the program headers and the dynamic section of an ELF file of the
+// byte order of this machine. False if it can't be parsed.
+template<class Ehdr, class Phdr, class Dyn>
+static bool read_elf(int fd, ElfInfo &info)
+{
+    Ehdr ehdr;
+
+    if (!pread_all(fd, &ehdr, sizeof(ehdr), 0)) {
+        return false;
+    }
+
+    info.machine = ehdr.e_machine;
+
+    if (ehdr.e_phnum == 0) {
+        return true;
+    }
+
+    if (ehdr.e_phentsize != sizeof(Phdr)) {
+        return false;
+    }
+
+    vector<Phdr> phdrs(ehdr.e_phnum);
+
+    if (!pread_all(fd, &phdrs[0], ehdr.e_phnum * sizeof(Phdr), ehdr.e_phoff)) {
+        return false;
+    }
+
+    const Phdr *dynamic = NULL;
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type == PT_INTERP) {
+            info.interp = read_cstring(fd, phdrs[i].p_offset);
+        } else if (phdrs[i].p_type == PT_DYNAMIC) {
+            dynamic = &phdrs[i];
+        }
+    }
+
+    if (!dynamic) {
+        return true;
+    }
+
+    vector<Dyn> dyns(dynamic->p_filesz / sizeof(Dyn));
+
+    if (dyns.empty() || !pread_all(fd, &dyns[0], dyns.size() * sizeof(Dyn), dynamic->p_offset)) {
+        return false;
+    }
+
+    unsigned long strtab = 0;
+    unsigned long flags_1 = 0;
+    vector<unsigned long> needed, rpath, runpath;
+
+    for (size_t i = 0; i < dyns.size() && dyns[i].d_tag != DT_NULL; ++i) {
+        unsigned long value = dyns[i].d_un.d_val;
+
+        switch (dyns[i].d_tag) {
+        case DT_STRTAB:
+            strtab = value;
+            break;
+        case DT_NEEDED:
+            needed.push_back(value);
+            break;
+        case DT_RPATH:
+            rpath.push_back(value);
+            break;
+        case DT_RUNPATH:
+            runpath.push_back(value);
+            break;
+        case DT_FLAGS_1:
+            flags_1 = value;
+            break;
+        }
+    }
+
+    // file(1) calls static-pie binaries static, and so does icecc-create-env
+    if (info.interp.empty() && (flags_1 & DF_1_PIE)) {
+        return true;
+    }
+
+    info.dynamic = true;
+
+    // the string table is given by its address, find it in the file
+    off_t strtab_offset = -1;
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type == PT_LOAD && strtab >= phdrs[i].p_vaddr
+                && strtab < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+            strtab_offset = strtab - phdrs[i].p_vaddr + phdrs[i].p_offset;
+            break;
+        }
+    }
+
+    if (strtab_offset < 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < needed.size(); ++i) {
+        info.needed.push_back(read_cstring(fd, strtab_offset + needed[i]));
+    }
+
+    for (size_t i = 0; i < rpath.size(); ++i) {
+        split_paths(read_cstring(fd, strtab_offset + rpath[i]), info.rpath);
+    }
+
+    for (size_t i = 0; i < runpath.size(); ++i) {
+        split_paths(read_cstring(fd, strtab_offset + runpath[i]), info.runpath);
+    }
+
+    return true;
+}
+
+// False if PATH can't be read, or is an ELF file that can't be parsed.
+static bool elf_info(const string &path, ElfInfo &info)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    unsigned char ident[EI_NIDENT];
+    bool ok = true;
+
+    if (pread_all(fd, ident, sizeof(ident), 0) && !memcmp(ident, ELFMAG, SELFMAG)) {
+        info.elf = true;
+        info.elf_class = ident[EI_CLASS];
+
+        union {
+            unsigned short s;
+            unsigned char c[2];
+        } order;
+        order.s = 1;
+        bool native_order = ident[EI_DATA] == (order.c[0] ? ELFDATA2LSB : ELFDATA2MSB);
+
+        if (!native_order) {
+            ok = false;
+        } else if (ident[EI_CLASS] == ELFCLASS64) {
+            ok = read_elf<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(fd, info);
+        } else if (ident[EI_CLASS] == ELFCLASS32) {
+            ok = read_elf<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(fd, info);
+        } else {
+            ok = false;
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+namespace
+{
+
+// The files of the environment, collected the way add_file() of
+// icecc-create-env does.
+class EnvBuilder
+{
+public:
+    EnvBuilder(bool quiet);
+
+    void addFile(const string &path, const string &name = string());
+    bool searchAddFile(const string &compiler, const string &file_name);
+    void addClangIncludes(const string &clang);
+    void addLdSoConf();
+    string write(const string &dir);
+
+private:
+    bool resolveLibrary(const string &name, const ElfInfo &info, const string &origin,
+                        const vector<string> &inherited_rpath, string &result);
+    bool dependencies(const string &path, vector<string> &libs);
+    bool lddDependencies(const string &path, vector<string> &libs);
+    const ElfInfo &cachedInfo(const string &path, bool &ok);
+    bool copyFiles(const string &tempdir, vector<EnvFile> &files);
+    bool writeTar(const string &tempdir, vector<EnvFile> &files, int out, string &hash);
+
+    // the compile that needs the environment only mentions it in the log
+    bool quiet;
+    // name=path entries, or just path if it goes to the same place
+    vector<string> entries;
+    vector<pair<string, string> > target_files;
+    map<string, ElfInfo> infos;
+    map<string, bool> info_ok;
+    // the dynamic linker of each ELF class and machine
+    map<pair<unsigned char, unsigned int>, string> interpreters;
+    vector<string> system_dirs;
+    string ld_so_conf;
+};
+
+}
+
+static void read_ld_so_conf(const string &file, vector<string> &dirs, int depth)
+{
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f || depth > 10) {
+        if (f) {
+            fclose(f);
+        }
+
+        return;
+    }
+
+    char line[PATH_MAX];
+
+    while (fgets(line, sizeof(line), f)) {
+        if (char *comment = strchr(line, '#')) {
+            *comment = '\0';
+        }
+
+        char *save = NULL;
+        char *word = strtok_r(line, " \t\n:,", &save);
+
+        if (!word) {
+            continue;
+        }
+
+        if (!strcmp(word, "include")) {
+            while (char *pattern = strtok_r(NULL, " \t\n", &save)) {
+                string full = pattern[0] == '/' ? pattern : dir_name(file) + "/" + pattern;
+                glob_t g;
+
+                if (glob(full.c_str(), 0, NULL, &g) == 0) {
+                    for (size_t i = 0; i < g.gl_pathc; ++i) {
+                        read_ld_so_conf(g.gl_pathv[i], dirs, depth + 1);
+                    }
+                }
+
+                globfree(&g);
+            }
+        } else if (word[0] == '/') {
+            dirs.push_back(word);
+        }
+    }
+
+    fclose(f);
+}
+
+EnvBuilder::EnvBuilder(bool _quiet)
+    : quiet(_quiet)
+{
+    // what the dynamic linker finds through ld.so.cache, and the trusted
+    // directories after that
+    read_ld_so_conf("/etc/ld.so.conf", system_dirs, 0);
+    system_dirs.push_back("/lib64");
+    system_dirs.push_back("/usr/lib64");
+    system_dirs.push_back("/lib");
+    system_dirs.push_back("/usr/lib");
+}
+
+const ElfInfo &EnvBuilder::cachedInfo(const string &path, bool &ok)
+{
+    map<string, ElfInfo>::iterator it = infos.find(path);
+
+    if (it == infos.end()) {
+        it = infos.insert(make_pair(path, ElfInfo())).first;
+        info_ok[path] = elf_info(path, it->second);
+    }
+
+    ok = info_ok[path];
+    return it->second;
+}
+
+static string expand_origin(const string &dir, const string &origin, unsigned char elf_class)
+{
+    string result = dir;
+    static const char *const origins[] = { "${ORIGIN}", "$ORIGIN" };
+    static const char *const libs[] = { "${LIB}", "$LIB" };
+
+    for (int i = 0; i < 2; ++i) {
+        string::size_type pos;
+
+        while ((pos = result.find(origins[i])) != string::npos) {
+            result.replace(pos, strlen(origins[i]), origin);
+        }
+
+        while ((pos = result.find(libs[i])) != string::npos) {
+            result.replace(pos, strlen(libs[i]), elf_class == ELFCLASS64 ? "lib64" : "lib");
+        }
+    }
+
+    return result;
+}
+
+// Finds the library NAME needed by a binary with INFO the way the dynamic
+// linker does: its RPATH and those of the binaries that loaded it (unless it
+// has a RUNPATH), LD_LIBRARY_PATH, its RUNPATH, and the system directories.
+bool EnvBuilder::resolveLibrary(const string &name, const ElfInfo &info, const string &origin,
+                                const vector<string> &inherited_rpath, string &result)
+{
+    if (name.find('/') != string::npos) {
+        result = name;
+        return is_file(result);
+    }
+
+    vector<string> dirs;
+
+    if (info.runpath.empty()) {
+        for (size_t i = 0; i < info.rpath.size(); ++i) {
+            dirs.push_back(expand_origin(info.rpath[i], origin, info.elf_class));
+        }
+
+        dirs.insert(dirs.end(), inherited_rpath.begin(), inherited_rpath.end());
+    }
+
+    if (const char *env = getenv("LD_LIBRARY_PATH")) {
+        split_paths(env, dirs);
+    }
+
+    for (size_t i = 0; i < info.runpath.size(); ++i) {
+        dirs.push_back(expand_origin(info.runpath[i], origin, info.elf_class));
+    }
+
+    dirs.insert(dirs.end(), system_dirs.begin(), system_dirs.end());
+
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        string candidate = dirs[i] + "/" + name;
+
+        if (!is_file(candidate)) {
+            continue;
+        }
+
+        // a library of another architecture is skipped, like ld.so does
+        bool ok;
+        const ElfInfo &lib = cachedInfo(candidate, ok);
+
+        if (ok && lib.elf && lib.elf_class == info.elf_class && lib.machine == info.machine) {
+            result = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// The libraries ldd would list for PATH, in the order the dynamic linker
+// loads them. False if one of them can't be found the way ld.so would, in
+// which case ldd itself has to be asked.
+bool EnvBuilder::dependencies(const string &path, vector<string> &libs)
+{
+    bool ok;
+    const ElfInfo &top = cachedInfo(path, ok);
+
+    if (!ok) {
+        return false;
+    }
+
+    // ldd loads a library without an interpreter with the dynamic linker of
+    // its architecture, known from the binaries seen before
+    pair<unsigned char, unsigned int> arch(top.elf_class, top.machine);
+    string interp = top.interp;
+
+    if (!interp.empty()) {
+        interpreters[arch] = interp;
+    } else if (interpreters.count(arch)) {
+        interp = interpreters[arch];
+    } else {
+        return false;
+    }
+
+    // a library that is loaded already, the dynamic linker itself to begin
+    // with, is not searched for again
+    map<string, string> loaded;
+    loaded[base_name(interp)] = interp;
+
+    // breadth first, each library with the RPATHs of the chain that loaded it
+    vector<pair<string, vector<string> > > queue;
+    queue.push_back(make_pair(path, vector<string>()));
+
+    for (size_t pos = 0; pos < queue.size(); ++pos) {
+        string current = queue[pos].first;
+        vector<string> inherited = queue[pos].second;
+        const ElfInfo &info = cachedInfo(current, ok);
+
+        if (!ok) {
+            return false;
+        }
+
+        char buf[PATH_MAX];
+        string origin = realpath(current.c_str(), buf) ? dir_name(buf) : dir_name(current);
+
+        if (info.runpath.empty()) {
+            for (size_t i = 0; i < info.rpath.size(); ++i) {
+                inherited.push_back(expand_origin(info.rpath[i], origin, info.elf_class));
+            }
+        }
+
+        for (size_t i = 0; i < info.needed.size(); ++i) {
+            string lib;
+            map<string, string>::const_iterator found = loaded.find(info.needed[i]);
+
+            if (found != loaded.end()) {
+                lib = found->second;
+            } else if (resolveLibrary(info.needed[i], info, origin, queue[pos].second, lib)) {
+                loaded[info.needed[i]] = lib;
+            } else {
+                return false;
+            }
+
+            if (find(libs.begin(), libs.end(), lib) == libs.end()) {
+                libs.push_back(lib);
+                queue.push_back(make_pair(lib, inherited));
+            }
+        }
+    }
+
+    if (find(libs.begin(), libs.end(), interp) == libs.end()) {
+        libs.push_back(interp);
+    }
+
+    return true;
+}
+
+// What icecc-create-env gets from ldd, used for the binaries that
+// dependencies() doesn't understand.
+bool EnvBuilder::lddDependencies(const string &path, vector<string> &libs)
+{
+    trace() << "asking ldd for the libraries of " << path << endl;
+    const char *argv[] = { "ldd", path.c_str(), NULL };
+    string output = run_output(argv);
+    string::size_type start = 0;
+
+    while (start < output.size()) {
+        string::size_type end = output.find('\n', start);
+        string line = output.substr(start, end == string::npos ? string::npos : end - start);
+        start = end == string::npos ? output.size() : end + 1;
+
+        // "libc.so.6 => /lib/libc.so.6 (0x...)" or "/lib/ld-linux.so.2 (0x...)"
+        string::size_type slash = line.find('/');
+
+        if (slash == string::npos) {
+            continue;
+        }
+
+        string::size_type space = line.find(' ', slash);
+        libs.push_back(line.substr(slash, space == string::npos ? string::npos : space - slash));
+    }
+
+    return true;
+}
+
+// the add_file() of icecc-create-env
+void EnvBuilder::addFile(const string &path, const string &_name)
+{
+    string name = _name.empty() ? path : _name;
+
+    if (name.empty() || path.empty()) {
+        return;
+    }
+
+    if (access(path.c_str(), F_OK) != 0) {
+        log_warning() << "not adding missing file " << path << endl;
+        return;
+    }
+
+    string entry = name == path ? path : name + "=" + path;
+
+    for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (*it == entry || (it->size() > entry.size()
+                             && it->compare(it->size() - entry.size() - 1, string::npos,
+                                            "=" + entry) == 0)) {
+            return;
+        }
+    }
+
+    if (quiet) {
+        trace() << "adding file " << entry << endl;
+    } else {
+        printf("adding file %s\n", entry.c_str());
+    }
+
+    entries.push_back(entry);
+    target_files.push_back(make_pair(name, path));
+
+    if (access(path.c_str(), X_OK) != 0) {
+        return;
+    }
+
+    bool ok;
+    const ElfInfo &info = cachedInfo(path, ok);
+
+    if (ok && !info.elf) {
+        return;
+    }
+
+    if (ok && !info.dynamic) {
+        return;
+    }
+
+    vector<string> libs;
+
+    if (!ok || !dependencies(path, libs)) {
+        libs.clear();
+        lddDependencies(path, libs);
+    }
+
+    for (vector<string>::const_iterator it = libs.begin(); it != libs.end(); ++it) {
+        string lib = *it;
+
+        if (!is_file(lib)) {
+            continue;
+        }
+
+        // Check whether the same library also exists in the parent directory,
+        // and prefer that on the assumption that it is a more generic one.
+        string::size_type first = lib.find('/', 1);
+        string::size_type last = lib.rfind('/');
+
+        if (lib[0] == '/' && first != string::npos && first < last) {
+            string baselib = lib.substr(0, first) + lib.substr(last);
+
+            if (is_file(baselib)) {
+                lib = baselib;
+            }
+        }
+
+        addFile(lib);
+    }
+}
+
+// the search_addfile() of icecc-create-env
+bool EnvBuilder::searchAddFile(const string &compiler, const string &file_name)
+{
+    string file = compiler_output(compiler, "-print-prog-name=" + file_name);
+
+    if (file.empty() || file == file_name || access(file.c_str(), F_OK) != 0) {
+        file = compiler_output(compiler, "-print-file-name=" + file_name);
+    }
+
+    if (access(file.c_str(), F_OK) != 0) {
+        return false;
+    }
+
+    // The file goes to the same path where the compiler found it, unless
+    // that is relative to the compiler, which is /usr/bin in the environment.
+    string installdir = dir_name(file);
+    string abs_installdir = abs_path(installdir);
+
+    if (installdir != abs_installdir) {
+        string compiler_basedir = abs_path(dir_name(dir_name(compiler)));
+        string::size_type pos = abs_installdir.find(compiler_basedir);
+
+        if (pos != string::npos && !compiler_basedir.empty()) {
+            abs_installdir.replace(pos, compiler_basedir.size(), "/usr");
+        }
+
+        installdir = abs_installdir;
+    }
+
+    addFile(file, installdir + "/" + file_name);
+    return true;
+}
+
+static void find_files(const string &dir, vector<string> &files)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    while (struct dirent *ent = readdir(d)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        string path = dir + "/" + ent->d_name;
+        struct stat st;
+
+        if (lstat(path.c_str(), &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            find_files(path, files);
+        } else if (S_ISREG(st.st_mode)) {
+            files.push_back(path);
+        }
+    }
+
+    closedir(d);
+}
+
+// clang always uses its internal .h files
+void EnvBuilder::addClangIncludes(const string &clang)
+{
+    string includes = dir_name(compiler_output(clang, "-print-file-name=include/limits.h"));
+    string prefix = dir_name(dir_name(clang));
+    vector<string> files;
+
+    find_files(includes, files);
+
+    for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        // the path without .., moved from the prefix of clang to /usr
+        string destfile = abs_path(*it);
+        string::size_type pos = destfile.find(prefix);
+
+        if (pos != string::npos) {
+            destfile.replace(pos, prefix.size(), "/usr");
+        }
+
+        addFile(*it, destfile);
+    }
+}
+
+// For ldconfig -r to work, ld.so.conf must not contain relative paths in
+// include directives. A copy with them made absolute, written the way the
+// `while read directive path` loop of icecc-create-env writes it.
+void EnvBuilder::addLdSoConf()
+{
+    FILE *in = fopen("/etc/ld.so.conf", "r");
+
+    if (!in) {
+        return;
+    }
+
+    char tmpl[] = "/tmp/icecc_ld_so_confXXXXXX";
+    int fd = mkstemp(tmpl);
+
+    if (fd < 0) {
+        log_perror("mkstemp");
+        fclose(in);
+        return;
+    }
+
+    string out;
+    string line;
+    int c;
+
+    while ((c = fgetc(in)) != EOF) {
+        if (c != '\n') {
+            line += (char) c;
+            continue;
+        }
+
+        // read(1) drops backslashes and splits the first word off
+        string unescaped;
+
+        for (string::size_type i = 0; i < line.size(); ++i) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                ++i;
+            }
+
+            unescaped += line[i];
+        }
+
+        const char *blanks = " \t";
+        string::size_type start = unescaped.find_first_not_of(blanks);
+        string directive, path;
+
+        if (start != string::npos) {
+            string::size_type end = unescaped.find_first_of(blanks, start);
+            directive = unescaped.substr(start, end == string::npos ? string::npos : end - start);
+
+            if (end != string::npos) {
+                string::size_type path_start = unescaped.find_first_not_of(blanks, end);
+                string::size_type path_end = unescaped.find_last_not_of(blanks);
+
+                if (path_start != string::npos) {
+                    path = unescaped.substr(path_start, path_end - path_start + 1);
+                }
+            }
+        }
+
+        if (directive == "include" && (path.empty() || path[0] != '/')) {
+            path = "/etc/" + path;
+        }
+
+        out += directive + " " + path + "\n";
+        line.clear();
+    }
+
+    fclose(in);
+
+    if (::write(fd, out.data(), out.size()) != (ssize_t) out.size()) {
+        log_perror("write ld.so.conf");
+        close(fd);
+        unlink(tmpl);
+        return;
+    }
+
+    close(fd);
+    ld_so_conf = tmpl;
+    addFile(ld_so_conf, "/etc/ld.so.conf");
+}
+
+static bool make_dirs(const string &path)
+{
+    string::size_type pos = 0;
+
+    while ((pos = path.find('/', pos + 1)) != string::npos) {
+        if (mkdir(path.substr(0, pos).c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// cp -p
+static bool copy_file(const string &from, const string &to)
+{
+    int in = open(from.c_str(), O_RDONLY);
+
+    if (in < 0) {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return false;
+    }
+
+    unlink(to.c_str());
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    char buf[65536];
+    bool ok = true;
+
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0) {
+            ok = false;
+        }
+
+        if (n <= 0 || !write_fully(out, buf, n)) {
+            ok = ok && n == 0;
+            break;
+        }
+    }
+
+    struct timeval times[2];
+    times[0].tv_sec = st.st_atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = st.st_mtime;
+    times[1].tv_usec = 0;
+
+    if (fchmod(out, st.st_mode & 07777) != 0 || futimes(out, times) != 0) {
+        ok = false;
+    }
+
+    close(in);
+    close(out);
+    return ok;
+}
+
+static void remove_tree(const string &path)
+{
+    struct stat st;
+
+    if (lstat(path.c_str(), &st) != 0) {
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        unlink(path.c_str());
+        return;
+    }
+
+    if (DIR *d = opendir(path.c_str())) {
+        while (struct dirent *ent = readdir(d)) {
+            if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+                remove_tree(path + "/" + ent->d_name);
+            }
+        }
+
+        closedir(d);
+    }
+
+    rmdir(path.c_str());
+}
+
+// Copies the files into TEMPDIR, strips the binaries and creates the
+// ld.so.cache, and fills FILES with their names in the environment.
+bool EnvBuilder::copyFiles(const string &tempdir, vector<EnvFile> &files)
+{
+    vector<string> binaries;
+
+    for (vector<pair<string, string> >::const_iterator it = target_files.begin();
+            it != target_files.end(); ++it) {
+        string target = tempdir + it->first;
+
+        if (!make_dirs(target) || !copy_file(it->second, target)) {
+            log_error() << "failed to copy " << it->second << " to " << target << endl;
+            return false;
+        }
+
+        EnvFile file;
+        file.target = it->first.substr(1);
+        files.push_back(file);
+
+        bool ok;
+        const ElfInfo &info = cachedInfo(it->second, ok);
+
+        if (info.elf && access(target.c_str(), X_OK) == 0) {
+            binaries.push_back(target);
+        }
+    }
+
+    // strip(1) handles them all at once
+    if (!binaries.empty()) {
+        vector<const char *> args;
+        args.push_back("strip");
+        args.push_back("-s");
+
+        for (vector<string>::const_iterator it = binaries.begin(); it != binaries.end(); ++it) {
+            args.push_back(it->c_str());
+        }
+
+        run_quiet(args);
+    }
+
+    if (access("/sbin/ldconfig", X_OK) == 0) {
+        string cachedir = tempdir + "/var/cache/ldconfig/";
+        make_dirs(cachedir);
+        mkdir(cachedir.c_str(), 0755);
+
+        vector<const char *> args;
+        args.push_back("/sbin/ldconfig");
+        args.push_back("-r");
+        args.push_back(tempdir.c_str());
+
+        if (!run_quiet(args)) {
+            log_warning() << "ldconfig -r " << tempdir << " failed" << endl;
+        }
+
+        EnvFile file;
+        file.target = "etc/ld.so.cache";
+        files.push_back(file);
+    }
+
+    return true;
+}
+
+static void tar_octal(char *field, size_t size, unsigned long long value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%0*llo", (int) size - 1, value);
+    // only the last SIZE - 1 digits, the field has no room for more
+    size_t len = strlen(buffer);
+    memcpy(field, buffer + len - (size - 1), size - 1);
+    field[size - 1] = '\0';
+}
+
+// A header of the GNU format that tar(1) writes by default, with a
+// ././@LongLink entry before it if NAME is too long.
+static bool write_tar_header(int out, const string &name, char type, const struct stat &st,
+                             unsigned long long size)
+{
+    if (type != 'L' && name.size() >= 100) {
+        if (!write_tar_header(out, "././@LongLink", 'L', st, name.size() + 1)) {
+            return false;
+        }
+
+        vector<char> data((name.size() + 1 + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK, 0);
+        memcpy(&data[0], name.c_str(), name.size());
+
+        if (!write_fully(out, &data[0], data.size())) {
+            return false;
+        }
+    }
+
+    char header[TAR_BLOCK];
+    memset(header, 0, sizeof(header));
+    strncpy(header, name.c_str(), 99);
+    tar_octal(header + 100, 8, type == 'L' ? 0 : st.st_mode & 07777);
+    tar_octal(header + 108, 8, type == 'L' ? 0 : st.st_uid);
+    tar_octal(header + 116, 8, type == 'L' ? 0 : st.st_gid);
+    tar_octal(header + 124, 12, size);
+    tar_octal(header + 136, 12, type == 'L' ? 0 : st.st_mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar  ", 8);
+
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+
+    for (int i = 0; i < TAR_BLOCK; ++i) {
+        sum += (unsigned char) header[i];
+    }
+
+    tar_octal(header + 148, 7, sum);
+    header[155] = ' ';
+
+    return write_fully(out, header, sizeof(header));
+}
+
+// Writes the files in sorted order to the tarball OUT, and computes the
+// environment HASH from their md5 sums on the way.
+bool EnvBuilder::writeTar(const string &tempdir, vector<EnvFile> &files, int out, string &hash)
+{
+    sort(files.begin(), files.end());
+
+    md5_state_t env_state;
+    md5_init(&env_state);
+    unsigned long long written = 0;
+    vector<char> buf(65536);
+
+    for (vector<EnvFile>::iterator it = files.begin(); it != files.end(); ++it) {
+        string path = tempdir + "/" + it->target;
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            log_error() << "can't read " << path << endl;
+
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            return false;
+        }
+
+        // ustar writes the file from the archive root
+        if (!write_tar_header(out, it->target, '0', st, st.st_size)) {
+            close(fd);
+            return false;
+        }
+
+        md5_state_t state;
+        md5_init(&state);
+        unsigned long long left = st.st_size;
+
+        while (left > 0) {
+            ssize_t n = read(fd, &buf[0], min<unsigned long long>(left, buf.size()));
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                log_error() << path << " changed while it was read" << endl;
+                close(fd);
+                return false;
+            }
+
+            md5_append(&state, reinterpret_cast<const md5_byte_t *>(&buf[0]), n);
+
+            if (!write_fully(out, &buf[0], n)) {
+                close(fd);
+                return false;
+            }
+
+            left -= n;
+        }
+
+        close(fd);
+
+        size_t padding = (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK;
+        memset(&buf[0], 0, padding);
+
+        if (padding && !write_fully(out, &buf[0], padding)) {
+            return false;
+        }
+
+        written += TAR_BLOCK + st.st_size + padding;
+
+        if (it->target.size() >= 100) {
+            written += TAR_BLOCK + (it->target.size() + TAR_BLOCK) / TAR_BLOCK * TAR_BLOCK;
+        }
+
+        it->md5 = md5_hex(&state) + "\n";
+        md5_append(&env_state, reinterpret_cast<const md5_byte_t *>(it->md5.data()),
+                   it->md5.size());
+    }
+
+    // two empty blocks end the archive, then it's padded to a whole record
+    size_t end = 2 * TAR_BLOCK;
+    end += (TAR_RECORD - (written + end) % TAR_RECORD) % TAR_RECORD;
+    vector<char> zeros(end, 0);
+
+    if (!write_fully(out, &zeros[0], zeros.size())) {
+        return false;
+    }
+
+    hash = md5_hex(&env_state);
+    return true;
+}
+
+// Writes the environment to DIR and returns the name of the tarball.
+string EnvBuilder::write(const string &dir)
+{
+    char tmpl[] = "/tmp/iceccenvXXXXXX";
+
+    if (!mkdtemp(tmpl)) {
+        log_perror("mkdtemp");
+        return string();
+    }
+
+    string tempdir = tmpl;
+    vector<EnvFile> files;
+    string hash;
+    string tarball = dir + "/.iceccenv." + base_name(tempdir) + ".tar.gz";
+    bool ok = copyFiles(tempdir, files);
+
+    int out = -1;
+    int fds[2] = { -1, -1 };
+    pid_t gzip = -1;
+
+    if (ok) {
+        out = open(tarball.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        ok = out >= 0 && pipe(fds) == 0;
+    }
+
+    if (ok) {
+        flush_debug();
+        gzip = fork();
+        ok = gzip >= 0;
+    }
+
+    if (gzip == 0) {
+        close(fds[1]);
+        dup2(fds[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        // pigz compresses on all cores, if it's there
+        execlp("pigz", "pigz", "-c", NULL);
+        execlp("gzip", "gzip", "-c", NULL);
+        _exit(127);
+    }
+
+    if (ok) {
+        close(fds[0]);
+        fds[0] = -1;
+        dcc_ignore_sigpipe(1);
+        ok = writeTar(tempdir, files, fds[1], hash);
+        close(fds[1]);
+        fds[1] = -1;
+
+        int status;
+
+        while (waitpid(gzip, &status, 0) < 0 && errno == EINTR) {}
+
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        dcc_ignore_sigpipe(0);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    if (out >= 0) {
+        close(out);
+    }
+
+    remove_tree(tempdir);
+
+    if (!ld_so_conf.empty()) {
+        unlink(ld_so_conf.c_str());
+    }
+
+    string name = hash + ".tar.gz";
+
+    if (ok) {
+        if (quiet) {
+            trace() << "creating " << dir << "/" << name << endl;
+        } else {
+            printf("creating %s\n", name.c_str());
+        }
+
+        ok = rename(tarball.c_str(), (dir + "/" + name).c_str()) == 0;
+    }
+
+    if (!ok) {
+        log_error() << "Couldn't create archive" << endl;
+        unlink(tarball.c_str());
+        return string();
+    }
+
+    return name;
+}
+
+// the files that go into every environment, after the compilers
+static string finish_env(EnvBuilder &builder, const string &dir, const list<string> &extrafiles)
+{
+    for (list<string>::const_iterator it = extrafiles.begin(); it != extrafiles.end(); ++it) {
+        builder.addFile(*it);
+    }
+
+    builder.addFile("/usr/bin/objcopy");
+    builder.addLdSoConf();
+
+    fflush(stdout);
+    return builder.write(dir);
+}
+
+static void add_true(EnvBuilder &builder)
+{
+    // the daemon runs this with stdout closed, which the files must not get
+    if (fcntl(STDOUT_FILENO, F_GETFD) < 0) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        if (fd >= 0 && fd != STDOUT_FILENO) {
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+    }
+
+    // for testing the environment is usable at all
+    if (access("/bin/true", X_OK) == 0) {
+        builder.addFile("/bin/true");
+    } else if (access("/usr/bin/true", X_OK) == 0) {
+        builder.addFile("/usr/bin/true", "/bin/true");
+    }
+}
+
+static string create_env(const string &dir, bool clang, const string &first,
+                         const string &second, const list<string> &extrafiles, bool quiet)
+{
+    // the file list is sorted like sort(1) sorts it
+    setlocale(LC_COLLATE, "");
+
+    EnvBuilder builder(quiet);
+    add_true(builder);
+
+    if (clang) {
+        builder.addFile(first, "/usr/bin/clang");
+        // Older icecream remotes have /usr/bin/{gcc|g++} hardcoded and wouldn't
+        // call /usr/bin/clang at all, the wrapper calls gcc or clang depending
+        // on an extra argument added by icecream.
+        builder.addFile(second, "/usr/bin/gcc");
+        builder.addFile(second, "/usr/bin/g++");
+        builder.addFile(compiler_output(first, "-print-prog-name=as"), "/usr/bin/as");
+        builder.addClangIncludes(first);
+        return finish_env(builder, dir, extrafiles);
+    }
+
+    string gcc = abs_path(first);
+    string gpp = abs_path(second);
+
+    builder.addFile(gcc, "/usr/bin/gcc");
+    builder.addFile(gpp, "/usr/bin/g++");
+    builder.addFile(compiler_output(gcc, "-print-prog-name=cc1"), "/usr/bin/cc1");
+    builder.addFile(compiler_output(gpp, "-print-prog-name=cc1plus"), "/usr/bin/cc1plus");
+
+    string as = compiler_output(gcc, "-print-prog-name=as");
+
+    if (as == "as") {
+        builder.addFile("/usr/bin/as");
+    } else {
+        builder.addFile(as, "/usr/bin/as");
+    }
+
+    builder.searchAddFile(gcc, "specs");
+    builder.searchAddFile(gcc, "liblto_plugin.so");
+
+    return finish_env(builder, dir, extrafiles);
+}
+
+string create_gcc_env(const string &dir, const string &gcc, const string &gpp,
+                      const list<string> &extrafiles)
+{
+    return create_env(dir, false, gcc, gpp, extrafiles, false);
+}
+
+string create_clang_env(const string &dir, const string &clang, const string &wrapper,
+                        const list<string> &extrafiles)
+{
+    return create_env(dir, true, clang, wrapper, extrafiles, false);
+}
+
+bool find_native_compilers(bool clang, string &first, string &second)
+{
+    struct stat st;
+
+    if (clang) {
+        first = compiler_path_lookup("clang");
+
+        if (first.empty()) {
+            log_error() << "clang compiler not found" << endl;
+            return false;
+        }
+
+        if (lstat(PLIBDIR "/compilerwrapper", &st)) {
+            log_error() << PLIBDIR "/compilerwrapper does not exist" << endl;
+            return false;
+        }
+
+        second = PLIBDIR "/compilerwrapper";
+        return true;
+    }
+
+    // perhaps we're on gentoo
+    if (!lstat("/usr/bin/gcc-config", &st)) {
+        const char *argv[] = { "/usr/bin/gcc-config", "-B", NULL };
+        string gccpath = run_output(argv) + "/";
+        first = gccpath + "gcc";
+        second = gccpath + "g++";
+    } else {
+        first = compiler_path_lookup("gcc");
+        second = compiler_path_lookup("g++");
+    }
+
+    // both C and C++ compiler are required
+    if (first.empty() || second.empty()) {
+        log_error() << "gcc compiler not found" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+static string env_cache_dir()
+{
+    if (const char *env = getenv("ICECC_ENV_CACHE_DIR")) {
+        return strcmp(env, "no") ? env : "";
+    }
+
+    string dir;
+
+    if (const char *xdg = getenv("XDG_CACHE_HOME")) {
+        dir = xdg;
+    } else if (const char *home = getenv("HOME")) {
+        dir = string(home) + "/.cache";
+    } else {
+        return string();
+    }
+
+    mkdir(dir.c_str(), 0700);
+    return dir + "/icecc-envs";
+}
+
+// What a cache entry depends on: a "path\tinode\tsize\tmtime" line for each
+// file. False if one of them is missing.
+static bool file_stamps(const vector<string> &files, string &stamps)
+{
+    stamps.clear();
+
+    for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        struct stat st;
+
+        if (stat(it->c_str(), &st) != 0) {
+            return false;
+        }
+
+        char buf[100];
+        snprintf(buf, sizeof(buf), "\t%llu\t%llu\t%lld\n", (unsigned long long) st.st_ino,
+                 (unsigned long long) st.st_size, (long long) st.st_mtime);
+        stamps += *it + buf;
+    }
+
+    return true;
+}
+
+static bool read_text(const string &file, string &data)
+{
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f) {
+        return false;
+    }
+
+    data.clear();
+    char buf[4096];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.append(buf, n);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// An entry KEY.env has the name of the tarball in its first line, and the
+// stamps of the files it was created from after that. The tarball of the
+// entry ENTRY, or an empty string if the files changed since.
+static string valid_entry(const string &dir, const string &entry)
+{
+    string data;
+
+    if (!read_text(dir + "/" + entry, data)) {
+        return string();
+    }
+
+    string::size_type nl = data.find('\n');
+
+    if (nl == string::npos || access((dir + "/" + data.substr(0, nl)).c_str(), R_OK) != 0) {
+        return string();
+    }
+
+    vector<string> files;
+    string::size_type pos = nl + 1;
+
+    while (pos < data.size()) {
+        string::size_type tab = data.find('\t', pos);
+        string::size_type end = data.find('\n', pos);
+
+        if (tab == string::npos || end == string::npos || tab > end) {
+            return string();
+        }
+
+        files.push_back(data.substr(pos, tab - pos));
+        pos = end + 1;
+    }
+
+    string stamps;
+
+    if (!file_stamps(files, stamps) || stamps != data.substr(nl + 1)) {
+        return string();
+    }
+
+    return data.substr(0, nl);
+}
+
+// Removes the entries whose compilers changed, and the tarballs no entry
+// uses any more. Called with the cache locked.
+static void cleanup_env_cache(const string &dir)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    vector<string> tarballs;
+    vector<string> used;
+
+    while (struct dirent *ent = readdir(d)) {
+        string name = ent->d_name;
+
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".env") == 0) {
+            string tarball = valid_entry(dir, name);
+
+            if (tarball.empty()) {
+                trace() << "removing stale environment cache entry " << name << endl;
+                unlink((dir + "/" + name).c_str());
+            } else {
+                used.push_back(tarball);
+            }
+        } else if (name.size() > 7 && name.compare(name.size() - 7, 7, ".tar.gz") == 0) {
+            tarballs.push_back(name);
+        }
+    }
+
+    closedir(d);
+
+    for (vector<string>::const_iterator it = tarballs.begin(); it != tarballs.end(); ++it) {
+        if (find(used.begin(), used.end(), *it) == used.end()) {
+            trace() << "removing unused environment " << *it << endl;
+            unlink((dir + "/" + *it).c_str());
+        }
+    }
+}
+
+string cached_native_env(bool clang, const list<string> &extrafiles)
+{
+    // the environment of Mac OS X binaries is left to the daemon
+    if (determine_platform().find("Darwin") == 0) {
+        return string();
+    }
+
+    string dir = env_cache_dir();
+
+    if (dir.empty()) {
+        return string();
+    }
+
+    string first, second;
+
+    if (!find_native_compilers(clang, first, second)) {
+        return string();
+    }
+
+    vector<string> files;
+    files.push_back(first);
+    files.push_back(second);
+    files.insert(files.end(), extrafiles.begin(), extrafiles.end());
+
+    string stamps;
+
+    if (!file_stamps(files, stamps)) {
+        return string();
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    string type = clang ? "clang\n" : "gcc\n";
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(type.data()), type.size());
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(stamps.data()), stamps.size());
+    string entry = md5_hex(&state) + ".env";
+
+    string tarball = valid_entry(dir, entry);
+
+    if (!tarball.empty()) {
+        return dir + "/" + tarball;
+    }
+
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        log_perror("mkdir environment cache");
+        return string();
+    }
+
+    // one client creates environments at a time, the others wait for it
+    int lock_fd;
+
+    if (!dcc_lock_file(dir + "/lock", lock_fd)) {
+        return string();
+    }
+
+    tarball = valid_entry(dir, entry);
+
+    if (tarball.empty()) {
+        log_info() << "creating the environment of " << first << " in " << dir << endl;
+        tarball = create_env(dir, clang, first, second, extrafiles, true);
+
+        string tmp = dir + "/." + entry + ".tmp";
+        FILE *f = tarball.empty() ? NULL : fopen(tmp.c_str(), "w");
+        bool ok = f != NULL;
+
+        if (f) {
+            ok = fprintf(f, "%s\n%s", tarball.c_str(), stamps.c_str()) >= 0;
+            ok = fclose(f) == 0 && ok;
+        }
+
+        if (!ok || rename(tmp.c_str(), (dir + "/" + entry).c_str()) != 0) {
+            log_error() << "failed to add the environment to " << dir << endl;
+            unlink(tmp.c_str());
+            tarball.clear();
+        }
+
+        cleanup_env_cache(dir);
+    }
+
+    dcc_unlock(lock_fd);
+    return tarball.empty() ? string() : dir + "/" + tarball;
+}
+
+static bool read_full(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static unsigned long long tar_number(const char *field, size_t size)
+{
+    unsigned long long value = 0;
+
+    // base-256, for what doesn't fit the octal digits
+    if ((unsigned char) field[0] & 0x80) {
+        value = (unsigned char) field[0] & 0x7f;
+
+        for (size_t i = 1; i < size; ++i) {
+            value = (value << 8) | (unsigned char) field[i];
+        }
+
+        return value;
+    }
+
+    for (size_t i = 0; i < size && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + field[i] - '0';
+        }
+    }
+
+    return value;
+}
+
+// The path and size of a pax extended header, "LEN KEY=VALUE\n" records.
+static void pax_header(const string &data, string &path, unsigned long long &size)
+{
+    string::size_type pos = 0;
+
+    while (pos < data.size()) {
+        unsigned long len = strtoul(data.c_str() + pos, NULL, 10);
+        string::size_type space = data.find(' ', pos);
+
+        if (!len || space == string::npos || pos + len > data.size()) {
+            return;
+        }
+
+        string record = data.substr(space + 1, pos + len - space - 2);
+        string::size_type eq = record.find('=');
+
+        if (eq != string::npos && record.compare(0, eq, "path") == 0) {
+            path = record.substr(eq + 1);
+        } else if (eq != string::npos && record.compare(0, eq, "size") == 0) {
+            size = strtoull(record.c_str() + eq + 1, NULL, 10);
+        }
+
+        pos += len;
+    }
+}
+
+// Opens the tarball ENV for reading, through the decompressor its magic asks
+// for. PID is that of the decompressor, or 0 if there is none.
+static int open_env_tar(const string &env, pid_t &pid)
+{
+    pid = 0;
+    int fd = open(env.c_str(), O_RDONLY);
+    unsigned char magic[6];
+
+    if (fd < 0 || !read_full(fd, (char *) magic, sizeof(magic)) || lseek(fd, 0, SEEK_SET) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    const char *filter = NULL;
+
+    if (magic[0] == 037 && magic[1] == 0213) {
+        filter = "gzip";
+    } else if (!memcmp(magic, "BZh", 3)) {
+        filter = "bzip2";
+    } else if (!memcmp(magic, "\xfd" "7zXZ", 6)) {
+        filter = "xz";
+    } else if (!memcmp(magic, "\x28\xb5\x2f\xfd", 4)) {
+        filter = "zstd";
+    }
+
+    if (!filter) {
+        return fd;
+    }
+
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    pid = fork();
+
+    if (pid == 0) {
+        dup2(fd, 0);
+        dup2(fds[1], 1);
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+        execlp(filter, filter, "-dc", (char *) NULL);
+        _exit(127);
+    }
+
+    close(fd);
+    close(fds[1]);
+
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    return fds[0];
+}
+
+/* Reads the tarball ENV. With MANIFEST, its files go to MANIFEST. Otherwise
+   the contents of the files with the indexes MISSING, which are sorted, are
+   written to OUT. False if the tarball can't be read, or has anything but
+   regular files and directories.  */
+static bool scan_env_tar(const string &env, EnvManifestMsg *manifest,
+                         const vector<uint32_t> &missing, int out)
+{
+    pid_t pid;
+    int in = open_env_tar(env, pid);
+
+    if (in < 0) {
+        return false;
+    }
+
+    bool ok = false;
+    string long_name;
+    unsigned long long pax_size = 0;
+    bool have_pax_size = false;
+    size_t index = 0;
+    vector<uint32_t>::const_iterator next = missing.begin();
+    vector<char> buf(65536);
+
+    for (;;) {
+        char header[TAR_BLOCK];
+
+        if (!read_full(in, header, sizeof(header))) {
+            break;
+        }
+
+        // an empty block ends the archive
+        if (header[0] == 0) {
+            ok = true;
+            break;
+        }
+
+        char type = header[156];
+        unsigned long long size = tar_number(header + 124, 12);
+
+        if (have_pax_size) {
+            size = pax_size;
+        }
+
+        string name;
+
+        if (!long_name.empty()) {
+            name = long_name;
+        } else {
+            name.assign(header, strnlen(header, 100));
+
+            if (!memcmp(header + 257, "ustar\0", 6) && header[345]) {
+                name = string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+            }
+        }
+
+        unsigned long long padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+        if (type == 'L' || type == 'x' || type == 'g') {
+            if (padded > 65536) {
+                break;
+            }
+
+            string data(padded, '\0');
+
+            if (padded && !read_full(in, &data[0], padded)) {
+                break;
+            }
+
+            data.resize(size);
+
+            if (type == 'L') {
+                long_name = data.c_str();
+            } else if (type == 'x') {
+                pax_size = ULLONG_MAX;
+                pax_header(data, long_name, pax_size);
+                have_pax_size = pax_size != ULLONG_MAX;
+            }
+
+            continue;
+        }
+
+        long_name.clear();
+        have_pax_size = false;
+
+        if (type == '5' && size == 0) {
+            continue;
+        }
+
+        // links would need to be recreated as they are
+        if ((type != '0' && type != 0) || size > 0xffffffffULL
+                || (manifest && manifest->refs.size() >= 65536)) {
+            log_warning() << env << ": " << name << " can't be sent as a file" << endl;
+            break;
+        }
+
+        bool wanted = next != missing.end() && *next == index;
+        md5_state_t state;
+        md5_init(&state);
+        unsigned long long left = padded;
+        bool read_ok = true;
+
+        while (left > 0) {
+            size_t n = min<unsigned long long>(left, buf.size());
+
+            if (!read_full(in, &buf[0], n)) {
+                read_ok = false;
+                break;
+            }
+
+            // the padding is read, but not part of the file
+            unsigned long long data_left = left > padded - size ? left - (padded - size) : 0;
+            size_t used = min<unsigned long long>(n, data_left);
+            left -= n;
+
+            if (manifest) {
+                md5_append(&state, reinterpret_cast<const md5_byte_t *>(&buf[0]), used);
+            } else if (wanted && !write_fully(out, &buf[0], used)) {
+                read_ok = false;
+                break;
+            }
+        }
+
+        if (!read_ok) {
+            break;
+        }
+
+        if (wanted) {
+            ++next;
+        }
+
+        if (manifest) {
+            ChunkRef ref;
+            md5_finish(&state, ref.digest);
+            ref.len = size;
+            manifest->files.push_back(name);
+            manifest->modes.push_back(tar_number(header + 100, 8));
+            manifest->refs.push_back(ref);
+        }
+
+        ++index;
+    }
+
+    // the decompressor fails if the rest of the archive is not read
+    while (ok && pid > 0 && read(in, &buf[0], buf.size()) > 0) {}
+
+    close(in);
+
+    if (pid > 0) {
+        if (!ok) {
+            kill(pid, SIGTERM);
+        }
+
+        int status = 1;
+
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+        ok = ok && shell_exit_status(status) == 0;
+    }
+
+    return ok && (manifest || next == missing.end());
+}
+
+bool env_manifest(const string &env, EnvManifestMsg &manifest)
+{
+    vector<uint32_t> none;
+    return scan_env_tar(env, &manifest, none, -1);
+}
+
+int env_missing_files(const string &env, const vector<uint32_t> &missing, pid_t &pid)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    pid = fork();
+
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(scan_env_tar(env, NULL, missing, fds[1]) ? 0 : 1);
+    }
+
+    close(fds[1]);
+
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    return fds[0];
+}
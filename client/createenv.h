@@ -0,0 +1,68 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CLIENT_CREATEENV_H
+#define ICECREAM_CLIENT_CREATEENV_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <vector>
+
+class EnvManifestMsg;
+
+// Creating the environment tarball of the native compiler, the work of
+// icecc-create-env, without a shell pipeline: the dependencies of the
+// binaries are read from their ELF headers, and the files are hashed while
+// they are written to the tarball. The name of the tarball is the same hash
+// icecc-create-env computes, so both give the same environment.
+
+// Create HASH.tar.gz in DIR for the gcc compilers GCC and GPP, or for CLANG
+// with the compilerwrapper WRAPPER, and return its name, or an empty string
+// on failure. EXTRAFILES are added to the environment as they are.
+std::string create_gcc_env(const std::string &dir, const std::string &gcc,
+                           const std::string &gpp, const std::list<std::string> &extrafiles);
+std::string create_clang_env(const std::string &dir, const std::string &clang,
+                             const std::string &wrapper, const std::list<std::string> &extrafiles);
+
+// The native compilers: gcc and g++, or clang and the compilerwrapper.
+// False, with an error logged, if they are not there.
+bool find_native_compilers(bool clang, std::string &first, std::string &second);
+
+// The environment of the native compilers with EXTRAFILES from the per-user
+// cache in $ICECC_ENV_CACHE_DIR (default ~/.cache/icecc-envs), created there
+// if it's not there yet. An environment is used while the compilers and the
+// extra files keep their inode, size and mtime, so finding it needs neither
+// the daemon nor running the compiler. Empty if the cache is disabled or the
+// environment can't be created.
+std::string cached_native_env(bool clang, const std::list<std::string> &extrafiles);
+
+// The files of the environment tarball ENV with their modes and md5 sums,
+// for a host that has some of them already from other environments. False
+// if the tarball has links or anything else that is not a regular file or
+// a directory; it's sent as it is then.
+bool env_manifest(const std::string &env, EnvManifestMsg &manifest);
+
+// Returns a pipe with the contents of the files of ENV with the indexes
+// MISSING, one after the other, which a child PID reads from the tarball.
+int env_missing_files(const std::string &env, const std::vector<uint32_t> &missing, pid_t &pid);
+
+#endif
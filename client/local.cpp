@@ -37,6 +37,7 @@
 
 #include <comm.h>
 #include "client.h"
+#include "serve.h"
 
 using namespace std;
 
@@ -58,6 +59,15 @@ static string compiler_path_lookup_helper(const string &compiler, const string &
     bool after_selflink = false;
     string best_match;
 
+    /* icecc --serve may have looked it up already.  */
+    string key = "compiler " + compiler + " " + path;
+
+    if (serve_lookup(key, best_match) && !access(best_match.c_str(), X_OK)) {
+        return best_match;
+    }
+
+    best_match.clear();
+
     while (end != string::npos) {
         end = path.find_first_of(':', begin);
         string part;
@@ -101,13 +111,15 @@ static string compiler_path_lookup_helper(const string &compiler, const string &
             best_match = part;
 
             if (after_selflink) {
-                return part;
+                break;
             }
         }
     }
 
     if (best_match.empty()) {
         log_error() << "couldn't find any " << compiler << endl;
+    } else {
+        serve_remember(key, best_match);
     }
 
     return best_match;
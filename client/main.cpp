@@ -58,26 +58,49 @@
 #  include <sys/stat.h>
 #endif
 #include <sys/wait.h>
+#include <map>
 
 #include "client.h"
+#include "cache.h"
+#include "serve.h"
+#include "createenv.h"
+#include "services/util.h"
 #include "platform.h"
 
 using namespace std;
 
 extern const char *rs_program_name;
 
+/* the most jobs of --batch that go to one server at a time  */
+#define BATCH_MAX 16
+// longer lines of --batch are rejected, not split
+#define MAX_BATCH_LINE (1024 * 1024)
+
 static void dcc_show_usage(void)
 {
     printf(
         "Usage:\n"
         "   icecc [compiler] [compile options] -o OBJECT -c SOURCE\n"
         "   icecc --build-native [compilertype] [file...]\n"
+        "   icecc --batch [FILE]\n"
+        "   icecc --serve [SOCKET]\n"
+        "   icecc --capacity\n"
+        "   icecc --jobserver COMMAND [ARGS...]\n"
         "   icecc --help\n"
         "\n"
         "Options:\n"
         "   --help                     explain usage and exit\n"
         "   --version                  show version and exit\n"
         "   --build-native             create icecc environment\n"
+        "   --batch [-jN] [FILE]       compile the commands in FILE (default stdin), one per\n"
+        "                              line with shell quoting, sending small jobs in\n"
+        "                              batches to one host, N batches at a time (default\n"
+        "                              what --capacity tells)\n"
+        "   --serve [SOCKET]           take the compiles of icecc processes that have\n"
+        "                              ICECC_SERVE_SOCKET set, default ~/.icecc-serve.socket\n"
+        "   --capacity                 show how many jobs the cluster can take right now\n"
+        "   --jobserver                run COMMAND, usually make, with the jobserver of\n"
+        "                              the local daemon, or as many jobs as --capacity says\n"
         "Environment Variables:\n"
         "   ICECC                      if set to \"no\", just exec the real compiler\n"
         "   ICECC_VERSION              use a specific icecc environment, see icecc-create-env\n"
@@ -95,6 +118,16 @@ static void dcc_show_usage(void)
         "   ICECC_EXTRAFILES           additional files used in the compilation.\n"
         "   ICECC_COLOR_DIAGNOSTICS    set to 1 or 0 to override color diagnostics support.\n"
         "   ICECC_CARET_WORKAROUND     set to 1 or 0 to override gcc show caret workaround.\n"
+        "   ICECC_COMPRESSION          codec for file transfers: auto (default), none, lzo or\n"
+        "                              zstd[:level], optionally per payload, e.g. \"source=zstd:3\".\n"
+        "   ICECC_ZSTD_DICTIONARIES    directory with trained zstd dictionaries (source.zdict, ...).\n"
+        "   ICECC_CACHE_DIR            if set, keep compile results in this directory and reuse them.\n"
+        "   ICECC_CACHE_SIZE           maximum size of the result cache in MB (default 1024).\n"
+        "   ICECC_ENV_CACHE_DIR        where the client keeps the environments of the native\n"
+        "                              compiler (default ~/.cache/icecc-envs), \"no\" to let\n"
+        "                              the daemon create them.\n"
+        "   ICECC_PUMP                 if set, send the headers and let the remote host preprocess.\n"
+        "   ICECC_SERVE_SOCKET         if set, let the icecc --serve listening there compile.\n"
         "\n");
 }
 
@@ -140,27 +173,32 @@ static void dcc_client_catch_signals(void)
     signal(SIGHUP, &dcc_client_signalled);
 }
 
-static string read_output(const char *command)
+/* Runs icecc-create-env with the compiler type TYPE and the compilers
+   FIRST and SECOND.  */
+static int create_env_script(const char *type, const string &first, const string &second,
+                             const list<string> &extrafiles)
 {
-    FILE *f = popen(command, "r");
-    string output;
+    vector<char*> argv;
+    struct stat st;
 
-    if (!f) {
-        log_error() << "no pipe " << strerror(errno) << endl;
-        return output;
+    if (lstat(PLIBDIR "/icecc-create-env", &st)) {
+        log_error() << PLIBDIR "/icecc-create-env does not exist" << endl;
+        return 1;
     }
 
-    char buffer[1024];
+    argv.push_back(strdup(PLIBDIR "/icecc-create-env"));
+    argv.push_back(strdup(type));
+    argv.push_back(strdup(first.c_str()));
+    argv.push_back(strdup(second.c_str()));
 
-    while (!feof(f)) {
-        size_t bytes = fread(buffer, 1, sizeof(buffer) - 1, f);
-        buffer[bytes] = 0;
-        output += buffer;
+    for (list<string>::const_iterator it = extrafiles.begin(); it != extrafiles.end(); ++it) {
+        argv.push_back(strdup("--addfile"));
+        argv.push_back(strdup(it->c_str()));
     }
 
-    pclose(f);
-    // get rid of the endline
-    return output.substr(0, output.length() - 1);
+    argv.push_back(NULL);
+
+    return execv(argv[0], argv.data());
 }
 
 /*
@@ -180,67 +218,507 @@ static int create_native(char **args)
         extrafiles++;
     }
 
-    vector<char*> argv;
-    struct stat st;
+    list<string> extras;
 
-    if (lstat(PLIBDIR "/icecc-create-env", &st)) {
-        log_error() << PLIBDIR "/icecc-create-env does not exist" << endl;
+    for (int extracount = 0; extrafiles[extracount]; extracount++) {
+        extras.push_back(extrafiles[extracount]);
+    }
+
+    string first, second;
+
+    if (!find_native_compilers(is_clang, first, second)) {
         return 1;
     }
 
-    argv.push_back(strdup(PLIBDIR "/icecc-create-env"));
+    // the environment of Mac OS X binaries is left to icecc-create-env
+    if (machine_name.find("Darwin") == 0) {
+        return create_env_script(is_clang ? "--clang" : "--gcc", first, second, extras);
+    }
 
-    if (is_clang) {
-        string clang = compiler_path_lookup("clang");
+    string env = is_clang ? create_clang_env(".", first, second, extras)
+                 : create_gcc_env(".", first, second, extras);
 
-        if (clang.empty()) {
-            log_error() << "clang compiler not found" << endl;
-            return 1;
+    if (env.empty()) {
+        return 1;
+    }
+
+    // the daemon reads the name of the tarball from fd 5
+    string line = env + "\n";
+    ignore_result(write(5, line.c_str(), line.size()));
+    return 0;
+}
+
+/* Fills ENVS with the environments JOB can be compiled in remotely, or sets
+   LOCAL if there are none. False if the local daemon can't be talked to.  */
+static bool find_environments(const CompileJob &job, MsgChannel *local_daemon,
+                              const list<string> &extrafiles, Environments &envs, bool &local)
+{
+    if (getenv("ICECC_VERSION")) {     // if set, use it, otherwise take default
+        try {
+            envs = parse_icecc_version(job.targetPlatform(), find_prefix(job.compilerName()));
+        } catch (const std::exception &) {
+            // we just build locally
+        }
+    } else if (!extrafiles.empty() && !IS_PROTOCOL_32(local_daemon)) {
+        log_warning() << "Local daemon is too old to handle compiler plugins." << endl;
+        local = true;
+    } else {
+        string compiler = compiler_is_clang(job) ? "clang" : "gcc";
+        string native;
+
+        /* icecc --serve knows it from an earlier compile.  */
+        if (extrafiles.empty() && serve_lookup("native " + compiler, native)
+                && !::access(native.c_str(), R_OK)) {
+            envs.push_back(make_pair(job.targetPlatform(), native));
+            return true;
         }
 
-        if (lstat(PLIBDIR "/compilerwrapper", &st)) {
-            log_error() << PLIBDIR "/compilerwrapper does not exist" << endl;
-            return 1;
+        /* the environment cache of the user, without asking the daemon  */
+        native = cached_native_env(compiler == "clang", extrafiles);
+
+        if (!native.empty()) {
+            envs.push_back(make_pair(job.targetPlatform(), native));
+            trace() << "native " << native << endl;
+
+            if (extrafiles.empty()) {
+                serve_remember("native " + compiler, native);
+            }
+
+            return true;
         }
 
-        argv.push_back(strdup("--clang"));
-        argv.push_back(strdup(clang.c_str()));
-        argv.push_back(strdup(PLIBDIR "/compilerwrapper"));
-    } else { // "gcc" (default)
-        string gcc, gpp;
+        if (!local_daemon->send_msg(GetNativeEnvMsg(compiler, extrafiles))) {
+            log_warning() << "failed to write get native environment" << endl;
+            return false;
+        }
 
-        // perhaps we're on gentoo
-        if (!lstat("/usr/bin/gcc-config", &st)) {
-            string gccpath = read_output("/usr/bin/gcc-config -B") + "/";
-            gcc = gccpath + "gcc";
-            gpp = gccpath + "g++";
+        // the timeout is high because it creates the native version
+        Msg *umsg = local_daemon->get_msg(4 * 60);
+
+        if (umsg && umsg->type == M_NATIVE_ENV) {
+            native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
+        }
+
+        if (native.empty() || ::access(native.c_str(), R_OK)) {
+            log_warning() << "daemon can't determine native environment. "
+                          "Set $ICECC_VERSION to an icecc environment.\n";
         } else {
-            gcc = compiler_path_lookup("gcc");
-            gpp = compiler_path_lookup("g++");
+            envs.push_back(make_pair(job.targetPlatform(), native));
+            log_info() << "native " << native << endl;
+
+            if (extrafiles.empty()) {
+                serve_remember("native " + compiler, native);
+            }
         }
 
-        // both C and C++ compiler are required
-        if (gcc.empty() || gpp.empty()) {
-            log_error() << "gcc compiler not found" << endl;
-            return 1;
+        delete umsg;
+    }
+
+    // we set it to local so we tell the local daemon about it - avoiding file locking
+    if (envs.size() == 0) {
+        local = true;
+    }
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        trace() << "env: " << it->first << " '" << it->second << "'" << endl;
+
+        if (::access(it->second.c_str(), R_OK)) {
+            log_error() << "can't read environment " << it->second << endl;
+            local = true;
         }
+    }
 
-        argv.push_back(strdup("--gcc"));
-        argv.push_back(strdup(gcc.c_str()));
-        argv.push_back(strdup(gpp.c_str()));
+    return true;
+}
+
+/* Builds the jobs that can't go to a server, one after the other.  */
+static int build_batch_local(list<CompileJob> &jobs)
+{
+    int ret = 0;
+
+    while (!jobs.empty()) {
+        struct rusage ru;
+        /* with RU it forks, instead of execing the compiler  */
+        int status = build_local(jobs.front(), 0, &ru);
+        jobs.pop_front();
+
+        if (status != 0) {
+            ret = status;
+        }
     }
 
-    for (int extracount = 0; extrafiles[extracount]; extracount++) {
-        argv.push_back(strdup("--addfile"));
-        argv.push_back(strdup(extrafiles[extracount]));
+    return ret;
+}
+
+/* Sends JOBS, at most BATCH_MAX that share a compiler and target, to the
+   servers. Jobs that fail remotely are built locally.  */
+static int build_batch_remote(list<CompileJob> &jobs)
+{
+    int ret = 0;
+
+    /* One round per connection, the daemon gives each client one job.  */
+    while (!jobs.empty()) {
+        MsgChannel *local_daemon = connect_local_daemon();
+
+        if (!local_daemon) {
+            log_warning() << "no local daemon found" << endl;
+            break;
+        }
+
+        Environments envs;
+        bool local = false;
+        int status;
+
+        if (!find_environments(jobs.front(), local_daemon, list<string>(), envs, local)
+            || local) {
+            delete local_daemon;
+            break;
+        }
+
+        try {
+            status = build_remote_batch(jobs, local_daemon, envs);
+
+            if (status == 0) {
+                local_daemon->send_msg(EndMsg());
+            }
+        } catch (client_error &error) {
+            log_info() << "local build forced by exception: " << error.what() << endl;
+            delete local_daemon;
+            break;
+        }
+
+        delete local_daemon;
+
+        if (status != 0) {
+            ret = status;
+        }
     }
 
-    argv.push_back(NULL);
+    int status = build_batch_local(jobs);
 
-    return execv(argv[0], argv.data());
+    if (status != 0) {
+        ret = status;
+    }
+
+    return ret;
 }
 
-int main(int argc, char **argv)
+// the jobs of a batch, and whether they go to a server or are built here
+struct Batch {
+    list<CompileJob> jobs;
+    bool remote;
+};
+
+/* Builds the BATCHES in child processes, up to MAX_CHILDREN at a time, and
+   returns the last failed exit status, or 0.  */
+static int run_batches(list<Batch> &batches, unsigned int max_children)
+{
+    int ret = 0;
+    unsigned int children = 0;
+
+    while (!batches.empty() || children > 0) {
+        if (!batches.empty() && children < max_children) {
+            Batch &batch = batches.front();
+            flush_debug();
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                _exit(batch.remote ? build_batch_remote(batch.jobs)
+                                   : build_batch_local(batch.jobs));
+            }
+
+            if (pid < 0) {
+                log_perror("fork()");
+                int status = batch.remote ? build_batch_remote(batch.jobs)
+                                          : build_batch_local(batch.jobs);
+
+                if (status != 0) {
+                    ret = status;
+                }
+            } else {
+                ++children;
+            }
+
+            batches.pop_front();
+            continue;
+        }
+
+        int status;
+
+        if (waitpid(-1, &status, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("waitpid()");
+            break;
+        }
+
+        --children;
+        status = shell_exit_status(status);
+
+        if (status != 0) {
+            ret = status;
+        }
+    }
+
+    return ret;
+}
+
+/* Reads the next line of F into LINE, without the newline. It stops
+   after MAX_BATCH_LINE bytes.  */
+static bool read_batch_line(FILE *f, string &line)
+{
+    char buffer[4096];
+    line.clear();
+
+    while (line.size() <= MAX_BATCH_LINE && fgets(buffer, sizeof(buffer), f)) {
+        line += buffer;
+
+        if (line[line.size() - 1] == '\n') {
+            line.erase(line.size() - 1);
+            return true;
+        }
+    }
+
+    return !line.empty();
+}
+
+/* Reads compile commands from FILE, or stdin if it is "-", one per line
+   and quoted like for a shell, and compiles those for the same compiler
+   and target as batches on one server connection each, MAX_CHILDREN
+   batches at a time.  */
+static int build_batch(const char *file, unsigned int max_children)
+{
+    FILE *f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+
+    if (!f) {
+        log_perror("can't open batch file");
+        return EXIT_NO_SUCH_FILE;
+    }
+
+    char cwd[ PATH_MAX ];
+    string working_directory;
+
+    if (getcwd(cwd, PATH_MAX) != NULL) {
+        working_directory = cwd;
+    }
+
+    map<string, list<CompileJob> > groups;
+    list<CompileJob> local_jobs;
+    string line;
+    int line_number = 0;
+
+    while (read_batch_line(f, line)) {
+        ++line_number;
+        list<string> words;
+
+        if (line.size() > MAX_BATCH_LINE || !split_command_line(line, words)) {
+            log_error() << file << ":" << line_number << ": "
+                        << (line.size() > MAX_BATCH_LINE ? "line too long" : "unbalanced quotes")
+                        << endl;
+
+            if (f != stdin) {
+                fclose(f);
+            }
+
+            return EXIT_BAD_ARGUMENTS;
+        }
+
+        if (words.empty() || words.front()[0] == '#') {
+            continue;
+        }
+
+        vector<const char *> argv;
+        argv.push_back("icecc");
+
+        for (list<string>::const_iterator it = words.begin(); it != words.end(); ++it) {
+            argv.push_back(it->c_str());
+        }
+
+        argv.push_back(NULL);
+
+        CompileJob job;
+        job.setWorkingDirectory(working_directory);
+        job.setCompilerName(argv[1]);
+        job.setCompilerPathname(argv[1]);
+
+        list<string> extrafiles;
+
+        if (analyse_argv(&argv[0], job, false, &extrafiles) || !extrafiles.empty()) {
+            local_jobs.push_back(job);
+        } else {
+            groups[job.compilerName() + " " + job.targetPlatform()].push_back(job);
+        }
+    }
+
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    char *icecc = getenv("ICECC");
+
+    if (icecc && (!strcasecmp(icecc, "disable") || !strcasecmp(icecc, "no"))) {
+        for (map<string, list<CompileJob> >::iterator it = groups.begin(); it != groups.end(); ++it) {
+            local_jobs.splice(local_jobs.end(), it->second);
+        }
+
+        groups.clear();
+    }
+
+    list<Batch> batches;
+
+    for (map<string, list<CompileJob> >::iterator it = groups.begin(); it != groups.end(); ++it) {
+        while (!it->second.empty()) {
+            batches.push_back(Batch());
+            batches.back().remote = true;
+
+            while (!it->second.empty() && batches.back().jobs.size() < BATCH_MAX) {
+                batches.back().jobs.splice(batches.back().jobs.end(), it->second,
+                                           it->second.begin());
+            }
+        }
+    }
+
+    // the local jobs one by one, as make would run them
+    while (!local_jobs.empty()) {
+        batches.push_back(Batch());
+        batches.back().remote = false;
+        batches.back().jobs.splice(batches.back().jobs.end(), local_jobs, local_jobs.begin());
+    }
+
+    return run_batches(batches, max_children);
+}
+
+/* Asks the local daemon how many jobs the cluster can take.  */
+static bool get_capacity(CapacityMsg &capacity)
+{
+    MsgChannel *local_daemon = connect_local_daemon();
+
+    if (!local_daemon) {
+        log_error() << "no local daemon found" << endl;
+        return false;
+    }
+
+    if (!IS_PROTOCOL_43(local_daemon) || !local_daemon->send_msg(GetCapacityMsg())) {
+        log_error() << "local daemon can't tell the capacity of the cluster" << endl;
+        delete local_daemon;
+        return false;
+    }
+
+    Msg *msg = local_daemon->get_msg(10);
+    bool ok = msg && msg->type == M_CAPACITY;
+
+    if (ok) {
+        capacity = *static_cast<CapacityMsg *>(msg);
+    }
+
+    delete msg;
+    delete local_daemon;
+    return ok;
+}
+
+/* the number of parallel jobs that keeps the free slots busy  */
+static unsigned int capacity_jobs(const CapacityMsg &capacity)
+{
+    return max(1U, max(capacity.local_slots, capacity.busy + capacity.free_remote));
+}
+
+static int show_capacity()
+{
+    CapacityMsg capacity;
+
+    if (!get_capacity(capacity)) {
+        return EXIT_CONNECT_FAILED;
+    }
+
+    printf("remote_slots %u\n", capacity.total_remote);
+    printf("free_remote_slots %u\n", capacity.free_remote);
+    printf("waiting_jobs %u\n", capacity.waiting);
+    printf("local_slots %u\n", capacity.local_slots);
+    printf("running_jobs %u\n", capacity.busy);
+    printf("jobs %u\n", capacity_jobs(capacity));
+
+    if (!capacity.jobserver.empty()) {
+        printf("jobserver %s\n", capacity.jobserver.c_str());
+    }
+
+    return 0;
+}
+
+/* --batch [-jN] [FILE]: without -j, as many batches at a time as the
+   cluster can take now.  */
+static int run_batch(int argc, char **argv)
+{
+    unsigned int max_children = 0;
+
+    if (argc > 0 && !strncmp(argv[0], "-j", 2)) {
+        const char *jobs = argv[0][2] ? argv[0] + 2 : argc > 1 ? argv[1] : "";
+        char *end;
+        long value = strtol(jobs, &end, 10);
+
+        if (!*jobs || *end || value < 1) {
+            dcc_show_usage();
+            return EXIT_BAD_ARGUMENTS;
+        }
+
+        max_children = value;
+        int skip = argv[0][2] ? 1 : 2;
+        argc -= skip;
+        argv += skip;
+    }
+
+    if (!max_children) {
+        CapacityMsg capacity;
+        max_children = get_capacity(capacity) ? capacity_jobs(capacity) : 1;
+    }
+
+    return build_batch(argc > 0 ? argv[0] : "-", max_children);
+}
+
+/* Runs COMMAND with MAKEFLAGS pointing to the jobserver of the local daemon,
+   or at least with as many jobs as the cluster can take now.  */
+static int run_with_jobserver(char **command)
+{
+    if (!command[0]) {
+        dcc_show_usage();
+        return 1;
+    }
+
+    CapacityMsg capacity;
+    char flags[100] = "";
+
+    if (get_capacity(capacity)) {
+        int read_fd = -1;
+        int write_fd = -1;
+
+        if (!capacity.jobserver.empty()) {
+            read_fd = open(capacity.jobserver.c_str(), O_RDONLY);
+            write_fd = open(capacity.jobserver.c_str(), O_WRONLY);
+        }
+
+        if (read_fd >= 0 && write_fd >= 0) {
+            // --jobserver-fds for make before 4.2
+            sprintf(flags, "-j --jobserver-fds=%d,%d --jobserver-auth=%d,%d",
+                    read_fd, write_fd, read_fd, write_fd);
+        } else {
+            sprintf(flags, "-j%u", capacity_jobs(capacity));
+        }
+    }
+
+    string makeflags = flags;
+
+    if (const char *old = getenv("MAKEFLAGS")) {
+        makeflags += string(" ") + old;
+    }
+
+    setenv("MAKEFLAGS", makeflags.c_str(), 1);
+    execvp(command[0], command);
+    log_perror("execvp()");
+    return EXIT_NO_SUCH_FILE;
+}
+
+static int run_icecc(int argc, char **argv)
 {
     char *env = getenv("ICECC_DEBUG");
     int debug_level = Error;
@@ -291,6 +769,35 @@ int main(int argc, char **argv)
                 return create_native(argv + 2);
             }
 
+            if (arg == "--batch") {
+                return run_batch(argc - 2, argv + 2);
+            }
+
+            if (arg == "--capacity") {
+                return show_capacity();
+            }
+
+            if (arg == "--jobserver") {
+                return run_with_jobserver(argv + 2);
+            }
+
+            if (arg == "--serve") {
+                string path;
+
+                if (argc > 2) {
+                    path = argv[2];
+                } else if (getenv("ICECC_SERVE_SOCKET")) {
+                    path = getenv("ICECC_SERVE_SOCKET");
+                } else if (getenv("HOME")) {
+                    path = string(getenv("HOME")) + "/.icecc-serve.socket";
+                } else {
+                    log_error() << "no socket given for --serve" << endl;
+                    return 1;
+                }
+
+                return serve_clients(path, run_icecc);
+            }
+
             if (arg.size() > 0) {
                 job.setCompilerName(arg);
                 job.setCompilerPathname(arg);
@@ -385,30 +892,28 @@ int main(int argc, char **argv)
         }
     }
 
-    MsgChannel *local_daemon;
-    if (getenv("ICECC_TEST_SOCKET") == NULL) {
-        /* try several options to reach the local daemon - 3 sockets, one TCP */
-        local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
-
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("/var/run/iceccd.socket");
+    if (const char *compression = getenv("ICECC_COMPRESSION")) {
+        if (!set_default_compression(compression)) {
+            log_warning() << "ignoring invalid ICECC_COMPRESSION setting" << endl;
         }
+    }
 
-        if (!local_daemon && getenv("HOME")) {
-            string path = getenv("HOME");
-            path += "/.iceccd.socket";
-            local_daemon = Service::createChannel(path);
-        }
+    if (const char *dictionaries = getenv("ICECC_ZSTD_DICTIONARIES")) {
+        load_compression_dictionaries(dictionaries);
+    }
 
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
-        }
-    } else {
-        local_daemon = Service::createChannel(getenv("ICECC_TEST_SOCKET"));
-        if (!local_daemon) {
-            log_error() << "test socket error" << endl;
-            return EXIT_TEST_SOCKET_ERROR;
-        }
+    /* An unchanged source doesn't need the preprocessor or the daemon.  */
+    ResultCache cache;
+
+    if (!local && extrafiles.empty() && cache.init(job) && cache.lookupDirect()) {
+        return 0;
+    }
+
+    MsgChannel *local_daemon = connect_local_daemon();
+
+    if (!local_daemon && getenv("ICECC_TEST_SOCKET")) {
+        log_error() << "test socket error" << endl;
+        return EXIT_TEST_SOCKET_ERROR;
     }
 
     if (!local_daemon) {
@@ -417,58 +922,14 @@ int main(int argc, char **argv)
     }
 
     Environments envs;
+    bool no_envs = false;
 
-    if (!local) {
-        if (getenv("ICECC_VERSION")) {     // if set, use it, otherwise take default
-            try {
-                envs = parse_icecc_version(job.targetPlatform(), find_prefix(job.compilerName()));
-            } catch (std::exception) {
-                // we just build locally
-            }
-        } else if (!extrafiles.empty() && !IS_PROTOCOL_32(local_daemon)) {
-            log_warning() << "Local daemon is too old to handle compiler plugins." << endl;
-            local = true;
-        } else {
-            if (!local_daemon->send_msg(GetNativeEnvMsg(compiler_is_clang(job)
-                                        ? "clang" : "gcc", extrafiles))) {
-                log_warning() << "failed to write get native environment" << endl;
-                goto do_local_error;
-            }
-
-            // the timeout is high because it creates the native version
-            Msg *umsg = local_daemon->get_msg(4 * 60);
-            string native;
-
-            if (umsg && umsg->type == M_NATIVE_ENV) {
-                native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
-            }
-
-            if (native.empty() || ::access(native.c_str(), R_OK)) {
-                log_warning() << "daemon can't determine native environment. "
-                              "Set $ICECC_VERSION to an icecc environment.\n";
-            } else {
-                envs.push_back(make_pair(job.targetPlatform(), native));
-                log_info() << "native " << native << endl;
-            }
-
-            delete umsg;
-        }
-
-        // we set it to local so we tell the local daemon about it - avoiding file locking
-        if (envs.size() == 0) {
-            local = true;
-        }
-
-        for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
-            trace() << "env: " << it->first << " '" << it->second << "'" << endl;
-
-            if (::access(it->second.c_str(), R_OK)) {
-                log_error() << "can't read environment " << it->second << endl;
-                local = true;
-            }
-        }
+    if (!local && !find_environments(job, local_daemon, extrafiles, envs, no_envs)) {
+        goto do_local_error;
     }
 
+    local |= no_envs;
+
     int ret;
 
     if (local) {
@@ -495,7 +956,7 @@ int main(int argc, char **argv)
             // check if it should be compiled three times
             const char *s = getenv("ICECC_REPEAT_RATE");
             int rate = s ? atoi(s) : 0;
-            ret = build_remote(job, local_daemon, envs, rate);
+            ret = build_remote(job, local_daemon, envs, rate, cache.enabled() ? &cache : 0);
 
             /* We have to tell the local daemon that everything is fine and
                that the remote daemon will send the scheduler our done msg.
@@ -534,3 +995,23 @@ do_local_error:
     delete local_daemon;
     return build_local(job, 0);
 }
+
+int main(int argc, char **argv)
+{
+    /* A running icecc --serve compiles for us, it knows the compilers and
+       environments already.  */
+    if (const char *serve_socket = getenv("ICECC_SERVE_SOCKET")) {
+        bool option = argc > 1 && !strncmp(argv[1], "--", 2)
+                      && find_basename(argv[0]) == rs_program_name;
+
+        if (!option) {
+            int ret = serve_forward(serve_socket, argc, argv);
+
+            if (ret >= 0) {
+                return ret;
+            }
+        }
+    }
+
+    return run_icecc(argc, argv);
+}
@@ -0,0 +1,722 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/**
+ * @file
+ *
+ * Include scanning for pump mode.  Client-side only.
+ *
+ * The scanner follows every #include, #include_next and __has_include of
+ * the source without evaluating conditionals, so it finds a superset of
+ * the files the preprocessor reads. An #include with a macro can't be
+ * followed and the job is preprocessed locally then. The includes of every
+ * file are cached in ~/.cache/icecc-includes, keyed by its path and checked
+ * against its size and modification time, so most of the time a scan only
+ * stats the headers.
+ **/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "client.h"
+#include "pump.h"
+#include "md5.h"
+#include "services/util.h"
+
+using namespace std;
+
+#define SCAN_MAGIC "icecc-scan 1"
+
+namespace
+{
+
+// KIND is 'i' for #include and #import, 'n' for #include_next, 'h' for
+// __has_include and 'x' for __has_include_next
+struct Directive {
+    char kind;
+    bool quoted;
+    string name;
+};
+
+struct ScannedFile {
+    ChunkRef ref;
+    // an #include the scanner can't follow
+    bool computed;
+    vector<Directive> directives;
+};
+
+class IncludeScanner
+{
+public:
+    IncludeScanner(const string &cwd, const string &cache_dir)
+        : cwd(cwd)
+        , cache_dir(cache_dir)
+        , start_time(time(0)) {}
+
+    bool parseFlags(const CompileJob &job);
+    bool compilerDirs(const CompileJob &job);
+    bool scan(const CompileJob &job, PumpFilesMsg &files);
+
+private:
+    bool load(const string &path, ScannedFile &file);
+    bool exists(const string &path);
+    string absolute(const string &path) const;
+    void resolve(const Directive &directive, const string &current_dir, list<string> &found);
+
+    string cwd;
+    string cache_dir;
+    time_t start_time;
+    list<string> quote_dirs;
+    list<string> include_dirs;
+    list<string> user_system_dirs;
+    // the compiler's own directories
+    list<string> system_dirs;
+    list<string> after_dirs;
+    // where #include <...> looks, in order
+    list<string> bracket_dirs;
+    list<string> forced_files;
+    // flags that change the compiler's own directories
+    list<string> dir_flags;
+    map<string, bool> existing;
+};
+
+}
+
+static string normalize_path(const string &path)
+{
+    vector<string> parts;
+    size_t pos = 0;
+
+    while (pos <= path.size()) {
+        size_t slash = path.find('/', pos);
+
+        if (slash == string::npos) {
+            slash = path.size();
+        }
+
+        string part = path.substr(pos, slash - pos);
+
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+
+        pos = slash + 1;
+    }
+
+    string result;
+
+    for (vector<string>::const_iterator it = parts.begin(); it != parts.end(); ++it) {
+        result += '/' + *it;
+    }
+
+    return result.empty() ? "/" : result;
+}
+
+static string join_path(const string &dir, const string &name)
+{
+    if (dir.empty()) {
+        return name;
+    }
+
+    return dir[dir.size() - 1] == '/' ? dir + name : dir + '/' + name;
+}
+
+static string dir_name(const string &path)
+{
+    string::size_type slash = path.rfind('/');
+
+    if (slash == string::npos) {
+        return string();
+    }
+
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+static bool hex_to_digest(const string &hex, unsigned char digest[16])
+{
+    if (hex.size() != 32) {
+        return false;
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        unsigned int byte;
+
+        if (sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+
+        digest[i] = byte;
+    }
+
+    return true;
+}
+
+static string hash_string(const string &s)
+{
+    md5_state_t state;
+    md5_byte_t digest[16];
+    md5_init(&state);
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(s.c_str()), s.size() + 1);
+    md5_finish(&state, digest);
+    return md5_hex(digest);
+}
+
+/* Reads <name> or "name" at POS.  */
+static bool parse_include_name(const string &data, size_t pos, size_t eol, Directive &directive)
+{
+    while (pos < eol && (data[pos] == ' ' || data[pos] == '\t')) {
+        ++pos;
+    }
+
+    if (pos >= eol || (data[pos] != '<' && data[pos] != '"')) {
+        return false;
+    }
+
+    directive.quoted = data[pos] == '"';
+    size_t end = data.find(directive.quoted ? '"' : '>', pos + 1);
+
+    if (end == string::npos || end >= eol) {
+        return false;
+    }
+
+    directive.name = data.substr(pos + 1, end - pos - 1);
+    return !directive.name.empty();
+}
+
+static void parse_directives(const string &data, ScannedFile &file)
+{
+    file.computed = false;
+    file.directives.clear();
+    size_t next_has = data.find("__has_include");
+
+    for (size_t pos = 0; pos < data.size();) {
+        size_t eol = data.find('\n', pos);
+
+        if (eol == string::npos) {
+            eol = data.size();
+        }
+
+        size_t p = pos;
+
+        while (p < eol && (data[p] == ' ' || data[p] == '\t')) {
+            ++p;
+        }
+
+        if (p < eol && data[p] == '#') {
+            ++p;
+
+            while (p < eol && (data[p] == ' ' || data[p] == '\t')) {
+                ++p;
+            }
+
+            size_t start = p;
+
+            while (p < eol && (isalnum(data[p]) || data[p] == '_')) {
+                ++p;
+            }
+
+            string word = data.substr(start, p - start);
+            Directive directive;
+            directive.kind = (word == "include" || word == "import") ? 'i'
+                             : word == "include_next" ? 'n' : 0;
+
+            if (directive.kind) {
+                if (parse_include_name(data, p, eol, directive)) {
+                    file.directives.push_back(directive);
+                } else {
+                    file.computed = true;
+                }
+            }
+        }
+
+        // __has_include(<name>) checks for the file, without a macro it
+        // needs the file or its absence on the other side too
+        for (; next_has < eol; next_has = data.find("__has_include", next_has + 1)) {
+            Directive directive;
+            size_t q = next_has + strlen("__has_include");
+            directive.kind = 'h';
+
+            if (data.compare(q, 5, "_next") == 0) {
+                directive.kind = 'x';
+                q += 5;
+            }
+
+            while (q < eol && (data[q] == ' ' || data[q] == '\t')) {
+                ++q;
+            }
+
+            if (q < eol && data[q] == '(' && parse_include_name(data, q + 1, eol, directive)) {
+                file.directives.push_back(directive);
+            }
+        }
+
+        pos = eol + 1;
+    }
+}
+
+bool IncludeScanner::parseFlags(const CompileJob &job)
+{
+    list<string> flags = job.localFlags();
+    appendList(flags, job.restFlags());
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        const string &flag = *it;
+        list<string>::const_iterator next = it;
+        bool has_arg = ++next != flags.end();
+
+        if (flag == "-I" && has_arg) {
+            include_dirs.push_back(absolute(*next));
+            it = next;
+        } else if (flag == "-I-") {
+            return false;
+        } else if (flag.compare(0, 2, "-I") == 0) {
+            include_dirs.push_back(absolute(flag.substr(2)));
+        } else if (flag == "-iquote" && has_arg) {
+            quote_dirs.push_back(absolute(*next));
+            it = next;
+        } else if (flag == "-isystem" && has_arg) {
+            user_system_dirs.push_back(absolute(*next));
+            it = next;
+        } else if (flag == "-idirafter" && has_arg) {
+            after_dirs.push_back(absolute(*next));
+            it = next;
+        } else if ((flag == "-include" || flag == "-imacros") && has_arg) {
+            // not there if it's a precompiled header
+            if (!exists(absolute(*next))) {
+                return false;
+            }
+
+            forced_files.push_back(absolute(*next));
+            it = next;
+        } else if (flag.compare(0, 2, "-i") == 0 || flag.compare(0, 4, "-Wp,") == 0
+                   || flag.compare(0, 9, "--sysroot") == 0 || flag[0] == '@'
+                   || flag == "-M" || flag == "-MM" || flag == "-MG") {
+            // -iprefix, -isysroot and the like move the headers around
+            trace() << "pump mode doesn't support " << flag << endl;
+            return false;
+        } else if (flag == "-target" && has_arg) {
+            dir_flags.push_back(flag);
+            dir_flags.push_back(*next);
+            it = next;
+        } else if (flag.compare(0, 2, "-m") == 0 || flag.compare(0, 5, "-std=") == 0
+                   || flag.compare(0, 8, "-stdlib=") == 0 || flag.compare(0, 9, "--target=") == 0
+                   || flag.compare(0, 16, "--gcc-toolchain=") == 0
+                   || flag == "-nostdinc" || flag == "-nostdinc++") {
+            dir_flags.push_back(flag);
+        }
+    }
+
+    return true;
+}
+
+/* Asks the compiler where it looks for <...> includes. The answer only
+   changes with the compiler, so it's cached.  */
+bool IncludeScanner::compilerDirs(const CompileJob &job)
+{
+    string compiler = find_compiler(job);
+    struct stat st;
+
+    if (compiler.empty() || stat(compiler.c_str(), &st) != 0) {
+        return false;
+    }
+
+    const char *lang = job.language() == CompileJob::Lang_CXX ? "c++" : "c";
+    ostringstream key;
+    key << compiler << ' ' << st.st_size << ' ' << st.st_mtime << ' ' << lang;
+
+    for (list<string>::const_iterator it = dir_flags.begin(); it != dir_flags.end(); ++it) {
+        key << ' ' << *it;
+    }
+
+    string cache_file = cache_dir + "/dirs-" + hash_string(key.str());
+    string output;
+
+    if (!read_file(cache_file, output)) {
+        int pipes[2];
+
+        if (pipe(pipes) != 0) {
+            return false;
+        }
+
+        vector<string> args;
+        args.push_back(compiler);
+        args.push_back("-x");
+        args.push_back(lang);
+        args.insert(args.end(), dir_flags.begin(), dir_flags.end());
+        args.push_back("-E");
+        args.push_back("-v");
+        args.push_back("/dev/null");
+
+        vector<char *> argv;
+
+        for (vector<string>::iterator it = args.begin(); it != args.end(); ++it) {
+            argv.push_back(const_cast<char *>(it->c_str()));
+        }
+
+        argv.push_back(0);
+
+        flush_debug();
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            close(pipes[0]);
+            close(pipes[1]);
+            return false;
+        }
+
+        if (pid == 0) {
+            close(pipes[0]);
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(pipes[1], STDERR_FILENO);
+            close(pipes[1]);
+            execv(argv[0], &argv[0]);
+            _exit(1);
+        }
+
+        close(pipes[1]);
+        char buffer[4096];
+        ssize_t bytes;
+
+        while ((bytes = read(pipes[0], buffer, sizeof(buffer))) != 0) {
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                break;
+            }
+
+            output.append(buffer, bytes);
+        }
+
+        close(pipes[0]);
+        int status;
+
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+
+        size_t start = output.find("#include <...> search starts here:\n");
+        size_t end = output.find("End of search list.", start);
+
+        if (start == string::npos || end == string::npos || !WIFEXITED(status)
+                || WEXITSTATUS(status) != 0) {
+            log_warning() << "can't get the include directories of " << compiler << endl;
+            return false;
+        }
+
+        start = output.find('\n', start) + 1;
+        istringstream lines(output.substr(start, end - start));
+        output.clear();
+        string line;
+
+        while (getline(lines, line)) {
+            // clang appends " (framework directory)" on macOS
+            size_t first = line.find_first_not_of(' ');
+
+            if (first == string::npos || line.find(" (") != string::npos) {
+                continue;
+            }
+
+            char real_dir[PATH_MAX];
+
+            if (realpath(line.c_str() + first, real_dir)) {
+                output += string(real_dir) + '\n';
+            }
+        }
+
+        write_file_atomic(cache_file, output, 0600);
+    }
+
+    istringstream lines(output);
+    string line;
+
+    while (getline(lines, line)) {
+        if (!line.empty()) {
+            system_dirs.push_back(line);
+        }
+    }
+
+    bracket_dirs = include_dirs;
+    appendList(bracket_dirs, user_system_dirs);
+    appendList(bracket_dirs, system_dirs);
+    appendList(bracket_dirs, after_dirs);
+
+    // included before the source by the compiler, with glibc
+    for (list<string>::const_iterator it = system_dirs.begin(); it != system_dirs.end(); ++it) {
+        if (exists(join_path(*it, "stdc-predef.h"))) {
+            forced_files.push_back(join_path(*it, "stdc-predef.h"));
+            break;
+        }
+    }
+
+    return true;
+}
+
+string IncludeScanner::absolute(const string &path) const
+{
+    return normalize_path(path[0] == '/' ? path : join_path(cwd, path));
+}
+
+bool IncludeScanner::exists(const string &path)
+{
+    map<string, bool>::const_iterator it = existing.find(path);
+
+    if (it != existing.end()) {
+        return it->second;
+    }
+
+    struct stat st;
+    bool result = stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    existing[path] = result;
+    return result;
+}
+
+/* The cache entry of a file: the magic, its size, mtime and md5 sum, its
+   path and a line per directive, or "!" if it has a computed include.  */
+bool IncludeScanner::load(const string &path, ScannedFile &file)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0 || st.st_size > 0x7fffffff) {
+        return false;
+    }
+
+    file.ref.len = st.st_size;
+    ostringstream stamp;
+    stamp << st.st_size << ' ' << st.st_mtime;
+    string cache_file = cache_dir + "/inc-" + hash_string(path);
+    string entry;
+
+    if (read_file(cache_file, entry)) {
+        istringstream lines(entry);
+        string magic, line_path, digest, line;
+        unsigned long size;
+        long mtime;
+
+        if (getline(lines, magic) && magic == SCAN_MAGIC && lines >> size >> mtime >> digest
+                && size == (unsigned long) st.st_size && mtime == (long) st.st_mtime
+                && hex_to_digest(digest, file.ref.digest) && lines.ignore()
+                && getline(lines, line_path) && line_path == path) {
+            file.computed = false;
+            file.directives.clear();
+
+            while (getline(lines, line)) {
+                if (line == "!") {
+                    file.computed = true;
+                } else if (line.size() > 2) {
+                    Directive directive;
+                    directive.kind = line[0];
+                    directive.quoted = line[1] == '"';
+                    directive.name = line.substr(2);
+                    file.directives.push_back(directive);
+                }
+            }
+
+            return true;
+        }
+    }
+
+    string data;
+
+    if (!read_file(path, data) || data.size() != file.ref.len) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, reinterpret_cast<const md5_byte_t *>(data.data()), data.size());
+    md5_finish(&state, file.ref.digest);
+    parse_directives(data, file);
+
+    // a file changed in the same second could change again unnoticed
+    if (st.st_mtime >= start_time - 1) {
+        return true;
+    }
+
+    entry = string(SCAN_MAGIC) + '\n' + stamp.str() + ' ' + md5_hex(file.ref.digest) + '\n'
+            + path + '\n';
+
+    if (file.computed) {
+        entry += "!\n";
+    }
+
+    for (vector<Directive>::const_iterator it = file.directives.begin();
+            it != file.directives.end(); ++it) {
+        entry += string(1, it->kind) + (it->quoted ? '"' : '<') + it->name + '\n';
+    }
+
+    write_file_atomic(cache_file, entry, 0600);
+    return true;
+}
+
+/* Where the preprocessor may find DIRECTIVE. #include_next gets every
+   match, the scanner doesn't know which directory the file came from.  */
+void IncludeScanner::resolve(const Directive &directive, const string &current_dir,
+                             list<string> &found)
+{
+    if (directive.name[0] == '/') {
+        if (exists(normalize_path(directive.name))) {
+            found.push_back(normalize_path(directive.name));
+        }
+
+        return;
+    }
+
+    list<string> dirs;
+    bool next = directive.kind == 'n' || directive.kind == 'x';
+
+    if (directive.quoted || next) {
+        dirs.push_back(current_dir);
+        appendList(dirs, quote_dirs);
+    }
+
+    appendList(dirs, bracket_dirs);
+
+    for (list<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        string path = normalize_path(join_path(*it, directive.name));
+
+        if (exists(path)) {
+            found.push_back(path);
+
+            if (!next) {
+                return;
+            }
+        }
+    }
+}
+
+bool IncludeScanner::scan(const CompileJob &job, PumpFilesMsg &files)
+{
+    list<string> pending = forced_files;
+    pending.push_back(absolute(job.inputFile()));
+    set<string> seen;
+
+    while (!pending.empty()) {
+        string path = pending.front();
+        pending.pop_front();
+
+        if (!seen.insert(path).second) {
+            continue;
+        }
+
+        ScannedFile file;
+
+        if (!load(path, file)) {
+            log_warning() << "pump mode can't read " << path << endl;
+            return false;
+        }
+
+        if (file.computed) {
+            trace() << "pump mode can't follow the includes of " << path << endl;
+            return false;
+        }
+
+        files.files.push_back(path);
+        files.refs.push_back(file.ref);
+
+        for (vector<Directive>::const_iterator it = file.directives.begin();
+                it != file.directives.end(); ++it) {
+            resolve(*it, dir_name(path), pending);
+        }
+    }
+
+    files.system_dirs = system_dirs;
+    trace() << "pump mode ships " << files.files.size() << " files for " << job.inputFile()
+            << endl;
+    return true;
+}
+
+bool pump_scan(const CompileJob &job, PumpFilesMsg &files)
+{
+    const char *env = getenv("ICECC_PUMP");
+
+    if (!env || !*env || (job.language() != CompileJob::Lang_C
+                          && job.language() != CompileJob::Lang_CXX)
+            || compiler_only_rewrite_includes(job) || dcc_is_preprocessed(job.inputFile())
+            || job.workingDirectory().empty()) {
+        return false;
+    }
+
+    string cache_dir;
+
+    if (const char *xdg = getenv("XDG_CACHE_HOME")) {
+        cache_dir = xdg;
+    } else if (const char *home = getenv("HOME")) {
+        cache_dir = string(home) + "/.cache";
+    } else {
+        return false;
+    }
+
+    mkdir(cache_dir.c_str(), 0700);
+    cache_dir += "/icecc-includes";
+
+    if (mkdir(cache_dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    IncludeScanner scanner(job.workingDirectory(), cache_dir);
+    files.files.clear();
+    files.refs.clear();
+    files.system_dirs.clear();
+    return scanner.parseFlags(job) && scanner.compilerDirs(job) && scanner.scan(job, files);
+}
+
+bool pump_read_file(const PumpFilesMsg &files, size_t index, string &data)
+{
+    if (index >= files.files.size() || index >= files.refs.size()) {
+        return false;
+    }
+
+    list<string>::const_iterator it = files.files.begin();
+    advance(it, index);
+    return read_file(*it, data) && data.size() == files.refs[index].len;
+}
+
+string pump_dep_file(const CompileJob &job)
+{
+    list<string> flags = job.localFlags();
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        if (*it == "-MF" && ++it != flags.end()) {
+            return *it;
+        }
+    }
+
+    return string();
+}
@@ -0,0 +1,45 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CLIENT_PUMP_H
+#define ICECREAM_CLIENT_PUMP_H
+
+#include <stddef.h>
+#include <string>
+
+class CompileJob;
+class PumpFilesMsg;
+
+// Pump mode, used if $ICECC_PUMP is set: the remote daemon gets the source
+// and all files it may include, and runs the preprocessor itself.
+
+// Finds the files the preprocessor may read for JOB, with their md5 sums,
+// and the compiler's standard include directories. False if the job can't
+// be preprocessed remotely.
+bool pump_scan(const CompileJob &job, PumpFilesMsg &files);
+
+// Reads file INDEX of FILES into DATA. False if it can't be read or changed
+// its size since the scan.
+bool pump_read_file(const PumpFilesMsg &files, size_t index, std::string &data);
+
+// where the dependency file of JOB goes, empty if it doesn't write one
+std::string pump_dep_file(const CompileJob &job);
+
+#endif
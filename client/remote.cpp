@@ -27,6 +27,9 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 
 #ifdef __FreeBSD__
@@ -49,6 +52,9 @@
 
 #include <comm.h>
 #include "client.h"
+#include "createenv.h"
+#include "cache.h"
+#include "pump.h"
 #include "tempfile.h"
 #include "md5.h"
 #include "services/util.h"
@@ -57,6 +63,23 @@
 #define O_LARGEFILE 0
 #endif
 
+// preprocessed input up to this size is sent inside the CompileFileMsg
+#define MAX_INLINE_INPUT (64 * 1024)
+
+// content defined chunks of preprocessed input, 8k on average
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_MAX (64 * 1024)
+#define CHUNK_MASK (0x1fffU << 19)
+// chunks announced per ChunkRefsMsg
+#define CHUNK_BATCH 256
+// consecutive missing chunks are sent together up to this size
+#define CHUNK_MSG_SIZE (128 * 1024)
+
+// size of the FileChunkMsgs of a stream
+#define STREAM_CHUNK_SIZE 100000
+// preprocessed input read ahead of the network
+#define READ_AHEAD_MAX (16 * 1024 * 1024)
+
 namespace
 {
 
@@ -68,6 +91,103 @@ struct CharBufferDeleter {
     }
 };
 
+/* Keeps track of how much of the output file is written. With mmap the
+   received chunks are decompressed right into the mapped file, the size is
+   grown geometrically as we don't know it in advance. The grown range is
+   allocated first, writes to a sparse mapping on a full disk would kill us
+   with SIGBUS, so without posix_fallocate chunks are written with pwrite.  */
+class OutputFileDestination : public ChunkDestination
+{
+public:
+    OutputFileDestination(int _fd)
+        : fd(_fd)
+        , map(0)
+        , mapped(0)
+        , size(0)
+        , failed(false) {}
+
+    ~OutputFileDestination()
+    {
+        unmap();
+    }
+
+    virtual unsigned char *reserve(size_t len)
+    {
+#if defined(HAVE_MMAP) && defined(HAVE_POSIX_FALLOCATE)
+        if (failed) {
+            return 0;
+        }
+
+        if (size + len > mapped) {
+            size_t new_mapped = std::max(mapped * 2, (size + len + 65535) & ~(size_t) 65535);
+            size_t old_mapped = mapped;
+            unmap();
+
+            if (posix_fallocate(fd, old_mapped, new_mapped - old_mapped) != 0) {
+                failed = true;
+                return 0;
+            }
+
+            void *m = mmap(0, new_mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+            if (m == MAP_FAILED) {
+                failed = true;
+                return 0;
+            }
+
+            map = (unsigned char *) m;
+            mapped = new_mapped;
+        }
+
+        return map + size;
+#else
+        (void) len;
+        return 0;
+#endif
+    }
+
+    virtual void commit(size_t len)
+    {
+        size += len;
+    }
+
+    // for chunks that didn't go into the mapping
+    bool write(const unsigned char *buf, size_t len)
+    {
+        if (pwrite(fd, buf, len, size) != (ssize_t) len) {
+            return false;
+        }
+
+        size += len;
+        return true;
+    }
+
+    // cut off what was mapped in advance
+    bool finish()
+    {
+        unmap();
+        return ftruncate(fd, size) == 0;
+    }
+
+private:
+    void unmap()
+    {
+#ifdef HAVE_MMAP
+        if (map) {
+            munmap(map, mapped);
+        }
+#endif
+        map = 0;
+        mapped = 0;
+    }
+
+    int fd;
+    unsigned char *map;
+    size_t mapped;
+    size_t size;
+    bool failed;
+};
+
 }
 
 using namespace std;
@@ -250,131 +370,898 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
-static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
+/* Reads what FD has so far into DATA, without blocking, until DATA holds
+   LIMIT bytes. FD has to be non-blocking.  */
+static void read_ahead(int fd, string &data, bool &eof, size_t limit)
+{
+    while (!eof && data.size() < limit) {
+        char buffer[65536];
+        ssize_t bytes = read(fd, buffer, std::min(sizeof(buffer), limit - data.size()));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0 && errno == EAGAIN) {
+            return;
+        }
+
+        if (bytes < 0) {
+            log_perror("reading from cpp_fd");
+            close(fd);
+            throw client_error(16, "Error 16 - error reading local cpp file");
+        }
+
+        data.append(buffer, bytes);
+        eof = !bytes;
+    }
+}
+
+/* Sends what is read from CPP_FD. The input is read whenever there is
+   some, while the previous chunks are compressed and go out as the socket
+   takes them, so the preprocessor never waits for the network.  */
+static void write_server_cpp(int cpp_fd, MsgChannel *cserver, FilePayload payload)
 {
-    unsigned char buffer[100000]; // some random but huge number
-    off_t offset = 0;
+    string data;
+    size_t offset = 0;
+    bool eof = false;
     size_t uncompressed = 0;
     size_t compressed = 0;
 
-    do {
-        ssize_t bytes;
+    fcntl(cpp_fd, F_SETFL, fcntl(cpp_fd, F_GETFL) | O_NONBLOCK);
+
+    while (!eof || offset < data.size() || cserver->pendingOutput()) {
+        size_t ready = data.size() - offset;
+
+        // one chunk goes out while the next is compressed
+        if (cserver->pendingOutput() < STREAM_CHUNK_SIZE
+                && (ready >= STREAM_CHUNK_SIZE || (eof && ready))) {
+            FileChunkMsg fcmsg((unsigned char *) data.data() + offset,
+                               std::min(ready, size_t(STREAM_CHUNK_SIZE)), payload);
+
+            if (!cserver->send_msg(fcmsg, MsgChannel::SendQueued) || !cserver->flushPending()) {
+                Msg *m = cserver->get_msg(2);
+                check_for_failure(m, cserver);
+
+                log_error() << "write of source chunk to host "
+                            << cserver->name.c_str() << endl;
+                log_perror("failed ");
+                close(cpp_fd);
+                throw client_error(15, "Error 15 - write to host failed");
+            }
+
+            uncompressed += fcmsg.len;
+            compressed += fcmsg.compressed;
+            offset += fcmsg.len;
+
+            if (offset == data.size() || offset >= READ_AHEAD_MAX / 2) {
+                data.erase(0, offset);
+                offset = 0;
+            }
+
+            continue;
+        }
+
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        bool reading = !eof && data.size() - offset < READ_AHEAD_MAX;
+
+        if (reading) {
+            FD_SET(cpp_fd, &read_set);
+        }
+
+        if (cserver->pendingOutput()) {
+            FD_SET(cserver->fd, &write_set);
+        }
+
+        struct timeval tv;
+        tv.tv_sec = 20;
+        tv.tv_usec = 0;
+        int ret = select(std::max(cpp_fd, cserver->fd) + 1, &read_set, &write_set, NULL,
+                         reading ? NULL : &tv);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            log_error() << "write of source chunk to host " << cserver->name.c_str()
+                        << " timed out" << endl;
+            close(cpp_fd);
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+
+        if (FD_ISSET(cpp_fd, &read_set)) {
+            read_ahead(cpp_fd, data, eof, offset + READ_AHEAD_MAX);
+        }
+
+        if (FD_ISSET(cserver->fd, &write_set) && !cserver->flushPending()) {
+            close(cpp_fd);
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+    }
+
+    if (compressed)
+        trace() << "sent " << compressed << " bytes (" << (compressed * 100 / uncompressed) <<
+                "%)" << endl;
+
+    close(cpp_fd);
+}
+
+// Sends the manifest of the environment ENV, and the files the host asks for.
+static void transfer_env_files(const string &env, const EnvManifestMsg &manifest,
+                               MsgChannel *cserver)
+{
+    if (!cserver->send_msg(manifest)) {
+        throw client_error(6, "Error 6 - send environment to remove failed");
+    }
+
+    // the host asks once it got what it could from the peers
+    Msg *msg = cserver->get_msg(manifest.peers.empty() ? 60 : 12 * 60);
+
+    if (!msg || msg->type != M_CHUNK_REQUEST) {
+        check_for_failure(msg, cserver);
+        delete msg;
+        throw client_error(14, "Error 14 - error reading message from remote");
+    }
+
+    vector<uint32_t> missing;
+    missing.swap(static_cast<ChunkRequestMsg*>(msg)->missing);
+    delete msg;
+
+    trace() << "sending " << missing.size() << " of " << manifest.refs.size()
+            << " environment files" << endl;
+
+    if (missing.empty()) {
+        return;
+    }
+
+    for (size_t i = 0; i < missing.size(); ++i) {
+        if (missing[i] >= manifest.refs.size() || (i && missing[i] <= missing[i - 1])) {
+            throw client_error(14, "Error 14 - error reading message from remote");
+        }
+    }
+
+    pid_t pid;
+    int env_fd = env_missing_files(env, missing, pid);
+
+    if (env_fd < 0) {
+        throw client_error(5, "Error 5 - unable to open version file:\n\t" + env);
+    }
+
+    try {
+        write_server_cpp(env_fd, cserver, Payload_Environment);
+    } catch (...) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        throw;
+    }
+
+    int status = 1;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    /* What the host got is incomplete then, and it fails the install
+       with the md5 sums.  */
+    if (shell_exit_status(status) != 0) {
+        log_error() << "reading " << env << " failed" << endl;
+    }
+}
+
+/* Waits up to TIMEOUT seconds for a message from CSERVER and meanwhile
+   reads ahead from CPP_FD into DATA, the preprocessor doesn't have to stop
+   while the server answers.  */
+static Msg *get_msg_reading_ahead(MsgChannel *cserver, int timeout, int cpp_fd, string &data,
+                                  bool &eof)
+{
+    time_t deadline = time(0) + timeout;
+
+    for (;;) {
+        Msg *msg = cserver->get_msg(0);
+
+        if (msg || cserver->at_eof()) {
+            return msg;
+        }
+
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(cserver->fd, &read_set);
+        bool reading = !eof && data.size() < READ_AHEAD_MAX;
+
+        if (reading) {
+            FD_SET(cpp_fd, &read_set);
+        }
+
+        struct timeval tv;
+        tv.tv_sec = std::max(deadline - time(0), time_t(0));
+        tv.tv_usec = 0;
+        int ret = select(std::max(cpp_fd, cserver->fd) + 1, &read_set, NULL, NULL, &tv);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return 0;
+        }
+
+        if (reading && FD_ISSET(cpp_fd, &read_set)) {
+            read_ahead(cpp_fd, data, eof, READ_AHEAD_MAX);
+        }
+    }
+}
+
+/* An environment verification the job doesn't wait for. The server
+   answers it before anything else of the job.  */
+struct PendingVerify {
+    const CompileJob &job;
+    const string &hostname;
+    MsgChannel *local_daemon;
+    bool &pending;
+};
+
+/* Checks VERIFY_MSG, the result of the verification, and blacklists the
+   host for the environment if it failed.  */
+static void check_env_verified(Msg *verify_msg, PendingVerify &verify)
+{
+    if (!verify_msg || verify_msg->type != M_VERIFY_ENV_RESULT) {
+        delete verify_msg;
+        throw client_error(25, "Error 25 - other error verifying enviornment on remote");
+    }
+
+    bool ok = static_cast<VerifyEnvResultMsg*>(verify_msg)->ok;
+    delete verify_msg;
+    verify.pending = false;
+
+    if (!ok) {
+        // The remote can't handle the environment at all (e.g. kernel too old),
+        // mark it as never to be used again for this environment.
+        log_info() << "Host " << verify.hostname
+                   << " did not successfully verify environment."
+                   << endl;
+        BlacklistHostEnvMsg blacklist(verify.job.targetPlatform(),
+                                      verify.job.environmentVersion(), verify.hostname);
+        verify.local_daemon->send_msg(blacklist);
+        throw client_error(24, "Error 24 - remote " + verify.hostname
+                           + " unable to handle environment");
+    }
+
+    trace() << "Verified host " << verify.hostname << " for environment "
+            << verify.job.environmentVersion() << " (" << verify.job.targetPlatform() << ")"
+            << endl;
+}
+
+static void check_env_verified(MsgChannel *cserver, PendingVerify &verify)
+{
+    check_env_verified(cserver->get_msg(60), verify);
+}
+
+/* Reads the preprocessed input into DATA if it ends within
+   MAX_INLINE_INPUT bytes. Otherwise DATA is what was read so far and has
+   to be sent before the rest.  */
+static bool read_inline_input(int cpp_fd, string &data)
+{
+    char buffer[MAX_INLINE_INPUT + 1];
+    size_t offset = 0;
+
+    while (offset < sizeof(buffer)) {
+        ssize_t bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
+
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            log_perror("reading from cpp_fd");
+            close(cpp_fd);
+            throw client_error(16, "Error 16 - error reading local cpp file");
+        }
+
+        if (!bytes) {
+            data.assign(buffer, offset);
+            return true;
+        }
+
+        offset += bytes;
+    }
+
+    data.assign(buffer, offset);
+    return false;
+}
+
+/* A gear hash, the high bits of which depend on the last 32 bytes. The
+   table is the same everywhere, so equal content gets cut the same way on
+   all clients.  */
+static const uint32_t *gear_table()
+{
+    static uint32_t table[256];
+    static bool initialized = false;
+
+    if (!initialized) {
+        uint32_t x = 0x9e3779b9;
+
+        for (int i = 0; i < 256; ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            table[i] = x;
+        }
+
+        initialized = true;
+    }
+
+    return table;
+}
+
+/* Length of the chunk at the start of DATA. With less than CHUNK_MAX bytes
+   LEN has to be the end of the input.  */
+static size_t chunk_length(const unsigned char *data, size_t len)
+{
+    const uint32_t *gear = gear_table();
+    size_t end = std::min(len, size_t(CHUNK_MAX));
+    uint32_t hash = 0;
+
+    for (size_t i = CHUNK_MIN > 32 ? CHUNK_MIN - 32 : 0; i < end; ++i) {
+        hash = (hash << 1) + gear[data[i]];
+
+        if (i >= CHUNK_MIN && !(hash & CHUNK_MASK)) {
+            return i + 1;
+        }
+    }
+
+    return end;
+}
+
+/* Sends the preprocessed input from CPP_FD, after HEAD which was read
+   already, as chunks. The server is told the chunks by their md5 sums and
+   only gets the ones it doesn't have.  */
+static void write_server_chunks(int cpp_fd, MsgChannel *cserver, const string &head,
+                                PendingVerify &verify)
+{
+    string data = head;
+    bool eof = false;
+    bool enabled = true;
+    size_t total = 0;
+    size_t sent = 0;
+
+    fcntl(cpp_fd, F_SETFL, fcntl(cpp_fd, F_GETFL) | O_NONBLOCK);
+
+    while (enabled) {
+        ChunkRefsMsg refs;
+        size_t offset = 0;
+
+        while (refs.refs.size() < CHUNK_BATCH) {
+            if (!eof && data.size() - offset < CHUNK_MAX) {
+                read_ahead(cpp_fd, data, eof, offset + CHUNK_MAX);
+
+                if (!eof && data.size() - offset < CHUNK_MAX) {
+                    fd_set read_set;
+                    FD_ZERO(&read_set);
+                    FD_SET(cpp_fd, &read_set);
+
+                    if (select(cpp_fd + 1, &read_set, NULL, NULL, NULL) < 0 && errno != EINTR) {
+                        log_perror("select on cpp_fd");
+                        close(cpp_fd);
+                        throw client_error(16, "Error 16 - error reading local cpp file");
+                    }
+                }
+
+                continue;
+            }
+
+            if (offset == data.size()) {
+                break;
+            }
+
+            const unsigned char *chunk = (const unsigned char *) data.data() + offset;
+            ChunkRef ref;
+            ref.len = chunk_length(chunk, data.size() - offset);
+
+            md5_state_t state;
+            md5_init(&state);
+            md5_append(&state, chunk, ref.len);
+            md5_finish(&state, ref.digest);
+
+            refs.refs.push_back(ref);
+            offset += ref.len;
+        }
+
+        if (refs.refs.empty()) {
+            break;
+        }
+
+        if (!cserver->send_msg(refs)) {
+            close(cpp_fd);
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+
+        // the job may wait for the environment to be installed
+        Msg *msg = get_msg_reading_ahead(cserver, 12 * 60, cpp_fd, data, eof);
+
+        if (verify.pending && msg && msg->type == M_VERIFY_ENV_RESULT) {
+            try {
+                check_env_verified(msg, verify);
+            } catch (...) {
+                close(cpp_fd);
+                throw;
+            }
+
+            msg = get_msg_reading_ahead(cserver, 12 * 60, cpp_fd, data, eof);
+        }
+
+        if (!msg || msg->type != M_CHUNK_REQUEST) {
+            close(cpp_fd);
+            check_for_failure(msg, cserver);
+            delete msg;
+            throw client_error(14, "Error 14 - error reading message from remote");
+        }
+
+        ChunkRequestMsg *request = static_cast<ChunkRequestMsg*>(msg);
+        vector<size_t> starts(refs.refs.size() + 1, 0);
+
+        for (size_t i = 0; i < refs.refs.size(); ++i) {
+            starts[i + 1] = starts[i] + refs.refs[i].len;
+        }
+
+        for (size_t i = 0; i < request->missing.size();) {
+            size_t first = request->missing[i];
+            size_t last = first;
+
+            if (first >= refs.refs.size()) {
+                delete request;
+                close(cpp_fd);
+                throw client_error(13, "Error 13 - invalid chunk request from remote");
+            }
+
+            while (i + 1 < request->missing.size() && request->missing[i + 1] == last + 1
+                    && last + 1 < refs.refs.size()
+                    && starts[last + 2] - starts[first] <= CHUNK_MSG_SIZE) {
+                ++last;
+                ++i;
+            }
+
+            ++i;
+            FileChunkMsg fcmsg((unsigned char *) data.data() + starts[first],
+                               starts[last + 1] - starts[first], Payload_Source);
+
+            if (!cserver->send_msg(fcmsg)) {
+                delete request;
+                close(cpp_fd);
+                throw client_error(15, "Error 15 - write to host failed");
+            }
+
+            sent += fcmsg.len;
+        }
+
+        enabled = request->enabled;
+        delete request;
+        total += offset;
+        data.erase(0, offset);
+    }
+
+    if (enabled) {
+        close(cpp_fd);
+    } else {
+        // the server keeps no chunks, don't bother it with their sums
+        for (size_t offset = 0; offset < data.size(); offset += STREAM_CHUNK_SIZE) {
+            FileChunkMsg fcmsg((unsigned char *) data.data() + offset,
+                               std::min(data.size() - offset, size_t(STREAM_CHUNK_SIZE)),
+                               Payload_Source);
+
+            if (!cserver->send_msg(fcmsg)) {
+                close(cpp_fd);
+                throw client_error(15, "Error 15 - write to host failed");
+            }
+        }
+
+        write_server_cpp(cpp_fd, cserver, Payload_Source);
+    }
+
+    if (total) {
+        trace() << "sent " << sent << " of " << total << " bytes of chunks ("
+                << (sent * 100 / total) << "%)" << endl;
+    }
+}
+
+/* Sends the files of a pump mode job the server asks for.  */
+static void write_pump_files(MsgChannel *cserver, const PumpFilesMsg &files,
+                             PendingVerify &verify)
+{
+    Msg *msg = cserver->get_msg(12 * 60);
+
+    if (verify.pending && msg && msg->type == M_VERIFY_ENV_RESULT) {
+        check_env_verified(msg, verify);
+        msg = cserver->get_msg(12 * 60);
+    }
+
+    if (!msg) {
+        throw client_error(14, "Error 14 - error reading message from remote");
+    }
+
+    check_for_failure(msg, cserver);
+
+    if (msg->type != M_CHUNK_REQUEST) {
+        delete msg;
+        throw client_error(13, "Error 13 - did not get chunk request message");
+    }
+
+    ChunkRequestMsg *request = static_cast<ChunkRequestMsg*>(msg);
+    size_t sent = 0;
+
+    for (size_t i = 0; i < request->missing.size(); ++i) {
+        string data;
+
+        if (!pump_read_file(files, request->missing[i], data)) {
+            delete request;
+            throw client_error(11, "Error 11 - unable to read pump file");
+        }
+
+        FileChunkMsg fcmsg((unsigned char *) data.data(), data.size(), Payload_Source);
+
+        if (!cserver->send_msg(fcmsg)) {
+            delete request;
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+
+        sent += data.size();
+    }
+
+    trace() << "sent " << request->missing.size() << " of " << files.files.size()
+            << " pump files, " << sent << " bytes" << endl;
+    delete request;
+}
+
+static void write_inline_output(const string &output_file, const string &data)
+{
+    string tmp_file = output_file + "_icetmp";
+    int obj_fd = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, 0666);
+
+    if (obj_fd == -1) {
+        std::string errmsg("can't create ");
+        errmsg += tmp_file + ":";
+        log_perror(errmsg.c_str());
+        throw client_error(31, "Error 31 - " + errmsg);
+    }
+
+    size_t offset = 0;
+
+    while (offset < data.size()) {
+        ssize_t bytes = write(obj_fd, data.data() + offset, data.size() - offset);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            close(obj_fd);
+            unlink(tmp_file.c_str());
+            throw client_error(21, "Error 21 - error writing file");
+        }
+
+        offset += bytes;
+    }
+
+    if (close(obj_fd) != 0 || rename(tmp_file.c_str(), output_file.c_str()) != 0) {
+        unlink(tmp_file.c_str());
+        throw client_error(30, "Error 30 - error closing temp file");
+    }
+}
+
+static void receive_file(const string& output_file, MsgChannel* cserver)
+{
+    string tmp_file = output_file + "_icetmp";
+    // O_RDWR, as mapping the file for writing needs read access too
+    int obj_fd = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_LARGEFILE, 0666);
+
+    if (obj_fd == -1) {
+        std::string errmsg("can't create ");
+        errmsg += tmp_file + ":";
+        log_perror(errmsg.c_str());
+        throw client_error(31, "Error 31 - " + errmsg);
+    }
+
+    Msg* msg = 0;
+    size_t uncompressed = 0;
+    size_t compressed = 0;
+    OutputFileDestination destination(obj_fd);
+    cserver->setChunkDestination(&destination);
+
+    while (1) {
+        delete msg;
+
+        msg = cserver->get_msg(40);
+
+        if (!msg) {   // the network went down?
+            cserver->setChunkDestination(0);
+            unlink(tmp_file.c_str());
+            throw client_error(19, "Error 19 - (network failure?)");
+        }
+
+        if (msg->type == M_STATUS_TEXT) {
+            cserver->setChunkDestination(0);
+        }
+
+        check_for_failure(msg, cserver);
+
+        if (msg->type == M_END) {
+            break;
+        }
+
+        if (msg->type != M_FILE_CHUNK) {
+            cserver->setChunkDestination(0);
+            unlink(tmp_file.c_str());
+            delete msg;
+            throw client_error(20, "Error 20 - unexpcted message");
+        }
+
+        FileChunkMsg *fcmsg = dynamic_cast<FileChunkMsg*>(msg);
+        compressed += fcmsg->compressed;
+        uncompressed += fcmsg->len;
+
+        // del_buf is only set if the chunk didn't go directly into the file
+        if (fcmsg->del_buf && !destination.write(fcmsg->buffer, fcmsg->len)) {
+            cserver->setChunkDestination(0);
+            unlink(tmp_file.c_str());
+            delete msg;
+            throw client_error(21, "Error 21 - error writing file");
+        }
+    }
+
+    cserver->setChunkDestination(0);
+
+    if (uncompressed)
+        trace() << "got " << compressed << " bytes ("
+                << (compressed * 100 / uncompressed) << "%)" << endl;
+
+    delete msg;
+
+    if (!destination.finish()) {
+        close(obj_fd);
+        unlink(tmp_file.c_str());
+        throw client_error(21, "Error 21 - error writing file");
+    }
+
+    if (close(obj_fd) != 0 || rename(tmp_file.c_str(), output_file.c_str()) != 0) {
+        unlink(tmp_file.c_str());
+        throw client_error(30, "Error 30 - error closing temp file");
+    }
+}
+
+/* Sends JOB to CSERVER and waits for the result. If the local preprocessor
+   fails the connection is dropped and CSERVER set to 0.  */
+static int compile_on_server(CompileJob &job, MsgChannel *&cserver, const string &hostname,
+                             MsgChannel *local_daemon, const char *preproc_file, bool output,
+                             ResultCache *cache, bool &verify_pending, bool chunk_store,
+                             bool batch_more)
+{
+    int status = 255;
+    PendingVerify verify = { job, hostname, local_daemon, verify_pending };
+    CompileFileMsg compile_file(&job);
+    PumpFilesMsg pump_files;
+    int cpp_fd = -1;
+    pid_t cpp_pid = -1;
+
+    compile_file.batch_more = batch_more;
+    compile_file.pump = !preproc_file && IS_PROTOCOL_41(cserver)
+                        && pump_scan(job, pump_files);
+
+    if (compile_file.pump) {
+        // the server preprocesses
+    } else if (!preproc_file) {
+        int sockets[2];
+
+        if (pipe(sockets)) {
+            /* for all possible cases, this is something severe */
+            exit(errno);
+        }
+
+        /* This will fork, and return the pid of the child.  It will not
+           return for the child itself.  If it returns normally it will have
+           closed the write fd, i.e. sockets[1].  */
+        cpp_pid = call_cpp(job, sockets[1], sockets[0]);
+
+        if (cpp_pid == -1) {
+            throw client_error(18, "Error 18 - (fork error?)");
+        }
+
+        cpp_fd = sockets[0];
+    } else {
+        cpp_fd = open(preproc_file, O_RDONLY);
+
+        if (cpp_fd < 0) {
+            throw client_error(11, "Error 11 - unable to open preprocessed file");
+        }
+    }
+
+    try {
+        /* Small input is sent inside the compile request, so the job is
+           a single message.  */
+        if (IS_PROTOCOL_39(cserver) && !compile_file.pump) {
+            compile_file.input_inline = read_inline_input(cpp_fd, compile_file.input);
+        }
+
+        if (compile_file.input_inline && cpp_pid > 0) {
+            log_block wait_cpp("wait for cpp");
+
+            while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+
+            cpp_pid = -1;
+
+            if (shell_exit_status(status) != 0) {   // failure
+                close(cpp_fd);
+                delete cserver;
+                cserver = 0;
+                return shell_exit_status(status);
+            }
+        }
 
-        do {
-            bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
+        {
+            log_block b("send compile_file");
 
-            if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
-                continue;
+            if (!cserver->send_msg(compile_file)) {
+                log_info() << "write of job failed" << endl;
+                throw client_error(9, "Error 9 - error sending file to remote");
             }
+        }
 
-            if (bytes < 0) {
-                log_perror("reading from cpp_fd");
-                close(cpp_fd);
-                throw client_error(16, "Error 16 - error reading local cpp file");
+        if (compile_file.input_inline) {
+            close(cpp_fd);
+        } else if (compile_file.pump) {
+            if (!cserver->send_msg(pump_files)) {
+                throw client_error(15, "Error 15 - write to host failed");
             }
 
-            break;
-        } while (1);
-
-        offset += bytes;
-
-        if (!bytes || offset == sizeof(buffer)) {
-            if (offset) {
-                FileChunkMsg fcmsg(buffer, offset);
+            log_block bl2("write_pump_files");
+            write_pump_files(cserver, pump_files, verify);
+        } else if (IS_PROTOCOL_40(cserver) && chunk_store) {
+            log_block bl2("write_server_chunks");
+            write_server_chunks(cpp_fd, cserver, compile_file.input, verify);
+        } else {
+            if (!compile_file.input.empty()) {
+                FileChunkMsg fcmsg((unsigned char *) compile_file.input.data(),
+                                   compile_file.input.size(), Payload_Source);
 
                 if (!cserver->send_msg(fcmsg)) {
-                    Msg *m = cserver->get_msg(2);
-                    check_for_failure(m, cserver);
-
-                    log_error() << "write of source chunk to host "
-                                << cserver->name.c_str() << endl;
-                    log_perror("failed ");
-                    close(cpp_fd);
                     throw client_error(15, "Error 15 - write to host failed");
                 }
-
-                uncompressed += fcmsg.len;
-                compressed += fcmsg.compressed;
-                offset = 0;
             }
 
-            if (!bytes) {
-                break;
-            }
+            log_block bl2("write_server_cpp");
+            write_server_cpp(cpp_fd, cserver, Payload_Source);
+        }
+    } catch (...) {
+        if (cpp_pid > 0) {
+            kill(cpp_pid, SIGTERM);
         }
-    } while (1);
 
-    if (compressed)
-        trace() << "sent " << compressed << " bytes (" << (compressed * 100 / uncompressed) <<
-                "%)" << endl;
+        throw;
+    }
 
-    close(cpp_fd);
-}
+    if (cpp_pid > 0) {
+        log_block wait_cpp("wait for cpp");
 
-static void receive_file(const string& output_file, MsgChannel* cserver)
-{
-    string tmp_file = output_file + "_icetmp";
-    int obj_fd = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, 0666);
+        while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
 
-    if (obj_fd == -1) {
-        std::string errmsg("can't create ");
-        errmsg += tmp_file + ":";
-        log_perror(errmsg.c_str());
-        throw client_error(31, "Error 31 - " + errmsg);
+        if (shell_exit_status(status) != 0) {   // failure
+            delete cserver;
+            cserver = 0;
+            return shell_exit_status(status);
+        }
     }
 
-    Msg* msg = 0;
-    size_t uncompressed = 0;
-    size_t compressed = 0;
+    if (!compile_file.input_inline && !cserver->send_msg(EndMsg())) {
+        log_info() << "write of end failed" << endl;
+        throw client_error(12, "Error 12 - failed to send file to remote");
+    }
 
-    while (1) {
-        delete msg;
+    if (verify.pending) {
+        check_env_verified(cserver, verify);
+    }
 
-        msg = cserver->get_msg(40);
+    Msg *msg;
+    {
+        log_block wait_cs("wait for cs");
+        msg = cserver->get_msg(12 * 60);
 
-        if (!msg) {   // the network went down?
-            unlink(tmp_file.c_str());
-            throw client_error(19, "Error 19 - (network failure?)");
+        if (!msg) {
+            throw client_error(14, "Error 14 - error reading message from remote");
         }
+    }
 
-        check_for_failure(msg, cserver);
+    check_for_failure(msg, cserver);
 
-        if (msg->type == M_END) {
-            break;
-        }
+    if (msg->type != M_COMPILE_RESULT) {
+        log_warning() << "waited for compile result, but got " << (char)msg->type << endl;
+        delete msg;
+        throw client_error(13, "Error 13 - did not get compile response message");
+    }
 
-        if (msg->type != M_FILE_CHUNK) {
-            unlink(tmp_file.c_str());
-            delete msg;
-            throw client_error(20, "Error 20 - unexpcted message");
+    CompileResultMsg *crmsg = dynamic_cast<CompileResultMsg*>(msg);
+    assert(crmsg);
+
+    status = crmsg->status;
+
+    if (status && crmsg->was_out_of_memory) {
+        delete crmsg;
+        log_info() << "the server ran out of memory, recompiling locally" << endl;
+        throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
+    }
+
+    /* The include scan may have missed a header, the local compile
+       gives the real errors.  */
+    if (status && compile_file.pump) {
+        delete crmsg;
+        log_info() << "pump mode compile failed, recompiling locally" << endl;
+        throw remote_error(103, "Error 103 - pump mode compile failed, recompiling locally");
+    }
+
+    if (output) {
+        if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
+            delete crmsg;
+            log_info() << "command needs stdout/stderr workaround, recompiling locally" << endl;
+            throw remote_error(102, "Error 102 - command needs stdout/stderr workaround, recompiling locally");
         }
 
-        FileChunkMsg *fcmsg = dynamic_cast<FileChunkMsg*>(msg);
-        compressed += fcmsg->compressed;
-        uncompressed += fcmsg->len;
+        ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
 
-        if (write(obj_fd, fcmsg->buffer, fcmsg->len) != (ssize_t)fcmsg->len) {
-            unlink(tmp_file.c_str());
-            delete msg;
-            throw client_error(21, "Error 21 - error writing file");
+        if (colorify_wanted(job)) {
+            colorify_output(crmsg->err);
+        } else {
+            ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
+        }
+
+        if (status && (crmsg->err.length() || crmsg->out.length())) {
+            log_error() << "Compiled on " << hostname << endl;
         }
     }
 
-    if (uncompressed)
-        trace() << "got " << compressed << " bytes ("
-                << (compressed * 100 / uncompressed) << "%)" << endl;
+    if (cache && status == 0) {
+        cache->setOutput(crmsg->out, crmsg->err);
+    }
 
-    delete msg;
+    bool have_dwo_file = crmsg->have_dwo_file;
+    bool output_inline = crmsg->output_inline;
+    string object, dwo, dep;
+    object.swap(crmsg->object);
+    dwo.swap(crmsg->dwo);
+    dep.swap(crmsg->dep);
+    delete crmsg;
 
-    if (close(obj_fd) != 0 || rename(tmp_file.c_str(), output_file.c_str()) != 0) {
-        unlink(tmp_file.c_str());
-        throw client_error(30, "Error 30 - error closing temp file");
+    assert(!job.outputFile().empty());
+
+    if (status == 0) {
+        string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+
+        if (output_inline) {
+            write_inline_output(job.outputFile(), object);
+
+            if (have_dwo_file) {
+                write_inline_output(dwo_output, dwo);
+            }
+        } else {
+            receive_file(job.outputFile(), cserver);
+
+            if (have_dwo_file) {
+                receive_file(dwo_output, cserver);
+            }
+        }
+
+        // the server's preprocessor wrote the dependency file
+        if (compile_file.pump && !pump_dep_file(job).empty()) {
+            write_inline_output(pump_dep_file(job), dep);
+        }
     }
+
+    return status;
 }
 
+/* If BATCH is given, JOB is a copy of its first entry, and every job is
+   removed from it once its result is written.  */
 static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, bool output, ResultCache *cache = 0,
+                            list<CompileJob> *batch = 0)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
@@ -391,9 +1278,22 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     int status = 255;
 
     MsgChannel *cserver = 0;
+    bool verify_pending = false;
 
     try {
-        cserver = Service::createChannel(hostname, port, 10);
+        /* The local daemon may have passed a connection that is already
+           set up.  */
+        if (usecs->connection_fd >= 0) {
+            cserver = Service::createChannel(usecs->connection_fd, usecs->connection_protocol,
+                                             usecs->connection_codecs,
+                                             usecs->connection_dictionaries);
+            usecs->connection_fd = -1;
+        }
+
+        if (!cserver) {
+            cserver = Service::createChannel(hostname, port, 10, usecs->server_protocol,
+                                             usecs->server_features);
+        }
 
         if (!cserver) {
             log_error() << "no server found behind given hostname " << hostname << ":"
@@ -417,13 +1317,22 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 throw client_error(6, "Error 6 - send environment to remove failed");
             }
 
-            int env_fd = open(version_file.c_str(), O_RDONLY);
+            /* The host may have most of the files in other environments
+               already, then only the rest is sent.  */
+            EnvManifestMsg manifest;
 
-            if (env_fd < 0) {
-                throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
-            }
+            if (IS_PROTOCOL_44(cserver) && env_manifest(version_file, manifest)) {
+                manifest.peers = usecs->env_peers;
+                transfer_env_files(version_file, manifest, cserver);
+            } else {
+                int env_fd = open(version_file.c_str(), O_RDONLY);
 
-            write_server_cpp(env_fd, cserver);
+                if (env_fd < 0) {
+                    throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
+                }
+
+                write_server_cpp(env_fd, cserver, Payload_Environment);
+            }
 
             if (!cserver->send_msg(EndMsg())) {
                 log_error() << "write of environment failed" << endl;
@@ -437,26 +1346,10 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                     throw client_error(22, "Error 22 - error sending environment");
                 }
 
-                Msg *verify_msg = cserver->get_msg(60);
-
-                if (verify_msg && verify_msg->type == M_VERIFY_ENV_RESULT) {
-                    if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
-                        // The remote can't handle the environment at all (e.g. kernel too old),
-                        // mark it as never to be used again for this environment.
-                        log_info() << "Host " << hostname
-                                   << " did not successfully verify environment."
-                                   << endl;
-                        BlacklistHostEnvMsg blacklist(job.targetPlatform(),
-                                                      job.environmentVersion(), hostname);
-                        local_daemon->send_msg(blacklist);
-                        throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
-                    } else
-                        trace() << "Verified host " << hostname << " for environment "
-                                << job.environmentVersion() << " (" << job.targetPlatform() << ")"
-                                << endl;
-                } else {
-                    throw client_error(25, "Error 25 - other error verifying enviornment on remote");
-                }
+                /* The server handles the messages in order, so the compile
+                   job can follow right away. The result is checked once it
+                   is sent.  */
+                verify_pending = true;
             }
         }
 
@@ -465,128 +1358,31 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw client_error(26, "Error 26 - environment on " + hostname + " cannot be verified");
         }
 
-        CompileFileMsg compile_file(&job);
-        {
-            log_block b("send compile_file");
-
-            if (!cserver->send_msg(compile_file)) {
-                log_info() << "write of job failed" << endl;
-                throw client_error(9, "Error 9 - error sending file to remote");
-            }
-        }
-
-        if (!preproc_file) {
-            int sockets[2];
-
-            if (pipe(sockets)) {
-                /* for all possible cases, this is something severe */
-                exit(errno);
-            }
-
-            /* This will fork, and return the pid of the child.  It will not
-               return for the child itself.  If it returns normally it will have
-               closed the write fd, i.e. sockets[1].  */
-            pid_t cpp_pid = call_cpp(job, sockets[1], sockets[0]);
-
-            if (cpp_pid == -1) {
-                throw client_error(18, "Error 18 - (fork error?)");
-            }
-
-            try {
-                log_block bl2("write_server_cpp from cpp");
-                write_server_cpp(sockets[0], cserver);
-            } catch (...) {
-                kill(cpp_pid, SIGTERM);
-                throw;
-            }
-
-            log_block wait_cpp("wait for cpp");
-
-            while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
-
-            if (shell_exit_status(status) != 0) {   // failure
-                delete cserver;
-                cserver = 0;
-                return shell_exit_status(status);
-            }
-        } else {
-            int cpp_fd = open(preproc_file, O_RDONLY);
-
-            if (cpp_fd < 0) {
-                throw client_error(11, "Error 11 - unable to open preprocessed file");
-            }
-
-            log_block cpp_block("write_server_cpp");
-            write_server_cpp(cpp_fd, cserver);
-        }
-
-        if (!cserver->send_msg(EndMsg())) {
-            log_info() << "write of end failed" << endl;
-            throw client_error(12, "Error 12 - failed to send file to remote");
-        }
-
-        Msg *msg;
-        {
-            log_block wait_cs("wait for cs");
-            msg = cserver->get_msg(12 * 60);
-
-            if (!msg) {
-                throw client_error(14, "Error 14 - error reading message from remote");
-            }
-        }
-
-        check_for_failure(msg, cserver);
-
-        if (msg->type != M_COMPILE_RESULT) {
-            log_warning() << "waited for compile result, but got " << (char)msg->type << endl;
-            delete msg;
-            throw client_error(13, "Error 13 - did not get compile response message");
-        }
-
-        CompileResultMsg *crmsg = dynamic_cast<CompileResultMsg*>(msg);
-        assert(crmsg);
-
-        status = crmsg->status;
-
-        if (status && crmsg->was_out_of_memory) {
-            delete crmsg;
-            log_info() << "the server ran out of memory, recompiling locally" << endl;
-            throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
-        }
-
-        if (output) {
-            if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
-                delete crmsg;
-                log_info() << "command needs stdout/stderr workaround, recompiling locally" << endl;
-                throw remote_error(102, "Error 102 - command needs stdout/stderr workaround, recompiling locally");
-            }
-
-            ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
-
-            if (colorify_wanted(job)) {
-                colorify_output(crmsg->err);
-            } else {
-                ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
-            }
+        // only servers that keep chunks are asked which ones they have
+        bool chunk_store = usecs->server_caches & DaemonCache_Chunks;
+        status = compile_on_server(job, cserver, hostname, local_daemon, preproc_file, output,
+                                   cache, verify_pending, chunk_store,
+                                   batch && batch->size() > 1);
 
-            if (status && (crmsg->err.length() || crmsg->out.length())) {
-                log_error() << "Compiled on " << hostname << endl;
-            }
+        if (batch) {
+            batch->pop_front();
         }
 
-        bool have_dwo_file = crmsg->have_dwo_file;
-        delete crmsg;
-
-        assert(!job.outputFile().empty());
-
-        if (status == 0) {
-            receive_file(job.outputFile(), cserver);
-            if (have_dwo_file) {
-                string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
-                receive_file(dwo_output, cserver);
+        /* The other jobs of a batch follow on the same connection, the
+           server is inside the environment already.  */
+        while (batch && !batch->empty() && cserver && IS_PROTOCOL_42(cserver)) {
+            CompileJob &next = batch->front();
+            next.setJobID(job_id);
+            next.setEnvironmentVersion(environment);
+            int next_status = compile_on_server(next, cserver, hostname, local_daemon, 0, output,
+                                                0, verify_pending, chunk_store,
+                                                batch->size() > 1);
+            batch->pop_front();
+
+            if (next_status != 0) {
+                status = next_status;
             }
         }
-
     } catch (...) {
         // Handle pending status messages, if any.
         if(cserver) {
@@ -634,18 +1430,7 @@ md5_for_file(const string & file)
 
     fclose(f);
 
-    md5_byte_t digest[16];
-    md5_finish(&state, digest);
-
-    char digest_cache[33];
-
-    for (int di = 0; di < 16; ++di) {
-        sprintf(digest_cache + di * 2, "%02x", digest[di]);
-    }
-
-    digest_cache[32] = 0;
-    result = digest_cache;
-    return result;
+    return md5_hex(&state);
 }
 
 static bool
@@ -719,7 +1504,33 @@ static int minimalRemoteVersion( const CompileJob& )
     return version;
 }
 
-int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
+/* Runs the preprocessor into a new temporary file PREPROC, returns its
+   exit status.  */
+static int preprocess_to_file(CompileJob &job, char *&preproc)
+{
+    dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
+    int cpp_fd = open(preproc, O_WRONLY);
+    /* When call_cpp returns normally (for the parent) it will have closed
+       the write fd, i.e. cpp_fd.  */
+    pid_t cpp_pid = call_cpp(job, cpp_fd);
+
+    if (cpp_pid == -1) {
+        ::unlink(preproc);
+        throw client_error(10, "Error 10 - (unable to fork process?)");
+    }
+
+    int status = 255;
+    waitpid(cpp_pid, &status, 0);
+
+    if (shell_exit_status(status)) {   // failure
+        ::unlink(preproc);
+    }
+
+    return shell_exit_status(status);
+}
+
+int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill,
+                 ResultCache *cache)
 {
     srand(time(0) + getpid());
 
@@ -751,6 +1562,26 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
 
     if (torepeat == 1) {
+        /* The cache needs the preprocessed source before there is a
+           server to stream it to.  */
+        char *preproc = 0;
+
+        if (cache) {
+            int cpp_status = preprocess_to_file(job, preproc);
+
+            if (cpp_status) {
+                free(preproc);
+                return cpp_status;
+            }
+        }
+
+        const CharBufferDeleter preproc_holder(preproc);
+
+        if (cache && cache->lookupPreprocessed(preproc)) {
+            ::unlink(preproc);
+            return 0;
+        }
+
         string fake_filename;
         list<string> args = job.remoteFlags();
 
@@ -779,34 +1610,38 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         UseCSMsg *usecs = get_server(local_daemon);
         int ret;
 
-        if (!maybe_build_local(local_daemon, usecs, job, ret))
-            ret = build_remote_int(job, usecs, local_daemon,
-                                   version_map[usecs->host_platform],
-                                   versionfile_map[usecs->host_platform],
-                                   0, true);
+        try {
+            if (!maybe_build_local(local_daemon, usecs, job, ret))
+                ret = build_remote_int(job, usecs, local_daemon,
+                                       version_map[usecs->host_platform],
+                                       versionfile_map[usecs->host_platform],
+                                       preproc, true, cache);
+        } catch (...) {
+            if (preproc) {
+                ::unlink(preproc);
+            }
+
+            delete usecs;
+            throw;
+        }
+
+        if (preproc) {
+            if (ret == 0) {
+                cache->store();
+            }
+
+            ::unlink(preproc);
+        }
 
         delete usecs;
         return ret;
     } else {
         char *preproc = 0;
-        dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
+        int status = preprocess_to_file(job, preproc);
         const CharBufferDeleter preproc_holder(preproc);
-        int cpp_fd = open(preproc, O_WRONLY);
-        /* When call_cpp returns normally (for the parent) it will have closed
-           the write fd, i.e. cpp_fd.  */
-        pid_t cpp_pid = call_cpp(job, cpp_fd);
-
-        if (cpp_pid == -1) {
-            ::unlink(preproc);
-            throw client_error(10, "Error 10 - (unable to fork process?)");
-        }
 
-        int status = 255;
-        waitpid(cpp_pid, &status, 0);
-
-        if (shell_exit_status(status)) {   // failure
-            ::unlink(preproc);
-            return shell_exit_status(status);
+        if (status) {
+            return status;
         }
 
         char rand_seed[400]; // "designed to be oversized" (Levi's)
@@ -985,3 +1820,49 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
 
     return 0;
 }
+
+int build_remote_batch(list<CompileJob> &jobs, MsgChannel *local_daemon, const Environments &_envs)
+{
+    map<string, string> versionfile_map, version_map;
+    Environments envs = rip_out_paths(_envs, version_map, versionfile_map);
+
+    if (!envs.size()) {
+        log_error() << "$ICECC_VERSION needs to point to .tar files" << endl;
+        throw client_error(22, "Error 22 - $ICECC_VERSION needs to point to .tar files");
+    }
+
+    const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
+    CompileJob job = jobs.front();
+
+    trace() << "batch of " << jobs.size() << " jobs for " << job.targetPlatform() << endl;
+
+    GetCSMsg getcs(envs, get_absfilename(job.inputFile()), job.language(), 1,
+                   job.targetPlatform(), job.argumentFlags(),
+                   preferred_host ? preferred_host : string(),
+                   minimalRemoteVersion(job));
+
+    if (!local_daemon->send_msg(getcs)) {
+        log_warning() << "asked for CS" << endl;
+        throw client_error(24, "Error 24 - asked for CS");
+    }
+
+    UseCSMsg *usecs = get_server(local_daemon);
+    int ret;
+
+    try {
+        if (maybe_build_local(local_daemon, usecs, job, ret)) {
+            jobs.pop_front();
+        } else {
+            ret = build_remote_int(job, usecs, local_daemon,
+                                   version_map[usecs->host_platform],
+                                   versionfile_map[usecs->host_platform],
+                                   0, true, 0, &jobs);
+        }
+    } catch (...) {
+        delete usecs;
+        throw;
+    }
+
+    delete usecs;
+    return ret;
+}
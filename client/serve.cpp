@@ -0,0 +1,680 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+// Required by struct ucred on some systems.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <comm.h>
+
+#include "client.h"
+#include "serve.h"
+#include "services/util.h"
+
+using namespace std;
+
+extern char **environ;
+
+/* how long the service trusts what a compile found out, in seconds  */
+#define SERVE_CACHE_TIMEOUT 60
+
+/* the largest command line and environment of a compile request  */
+#define SERVE_REQUEST_MAX (16 * 1024 * 1024)
+
+// the values remembered by the service, with the time they were found out
+static map<string, pair<time_t, string> > remembered;
+
+// in a child of the service: where remembered values go to the parent
+static int remember_fd = -1;
+
+// in a child of the service: the connection to the local daemon that was
+// opened ahead of time
+static MsgChannel *spare_daemon = 0;
+
+static int child_exited_fd = -1;
+
+struct ServeRequest {
+    // the fields of the request, each terminated by a NUL
+    string data;
+    int fds[3];
+    const char *cwd;
+    mode_t mask;
+    vector<char *> argv;
+    vector<char *> env;
+};
+
+// a child of the service, which reads the request and compiles
+struct ServeChild {
+    pid_t pid;
+    // the child writes a byte once it has read the request, until then
+    // the caller is still sending and its connection isn't watched
+    int started_fd;
+    bool started;
+};
+
+static bool make_address(const string &path, struct sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+static void append_field(string &data, const char *field)
+{
+    data.append(field, strlen(field) + 1);
+}
+
+/* Reads the length of the request with the passed stdin, stdout and stderr,
+   and then the request, and splits it into its fields.  */
+static bool read_request(int conn, ServeRequest &req)
+{
+    uint32_t len;
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t ret;
+
+    while ((ret = recvmsg(conn, &msg, 0)) < 0 && errno == EINTR) {}
+
+    req.fds[0] = req.fds[1] = req.fds[2] = -1;
+    int count = 0;
+
+    if (ret > 0) {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+
+            int passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (int i = 0; i < passed; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+                if (count < 3) {
+                    req.fds[count++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    if (ret <= 0 || count != 3
+            || !read_fully(conn, reinterpret_cast<char *>(&len) + ret, sizeof(len) - ret)) {
+        return false;
+    }
+
+    len = ntohl(len);
+
+    if (len == 0 || len > SERVE_REQUEST_MAX) {
+        return false;
+    }
+
+    req.data.resize(len);
+
+    if (!read_fully(conn, &req.data[0], len) || req.data[len - 1] != '\0') {
+        return false;
+    }
+
+    vector<char *> fields;
+
+    for (size_t pos = 0; pos < len; pos = req.data.find('\0', pos) + 1) {
+        fields.push_back(&req.data[pos]);
+    }
+
+    if (fields.size() < 4) {
+        return false;
+    }
+
+    req.cwd = fields[0];
+    req.mask = strtoul(fields[1], 0, 8);
+    size_t argc = strtoul(fields[2], 0, 10);
+
+    if (argc == 0 || argc > fields.size() - 3) {
+        return false;
+    }
+
+    req.argv.assign(fields.begin() + 3, fields.begin() + 3 + argc);
+    req.argv.push_back(0);
+    req.env.assign(fields.begin() + 3 + argc, fields.end());
+    req.env.push_back(0);
+    return true;
+}
+
+static void close_request(ServeRequest &req)
+{
+    for (int i = 0; i < 3; ++i) {
+        if (req.fds[i] >= 0) {
+            close(req.fds[i]);
+        }
+    }
+}
+
+/* In the child: takes over the caller's terminal, directory and
+   environment, and compiles.  */
+static int run_request(ServeRequest &req, int (*run)(int argc, char **argv))
+{
+    // the passed descriptors may be 0 to 2 already if we run without them
+    for (int i = 0; i < 3; ++i) {
+        int fd = fcntl(req.fds[i], F_DUPFD, 3);
+        close(req.fds[i]);
+        req.fds[i] = fd;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        dup2(req.fds[i], i);
+
+        if (req.fds[i] > 2) {
+            close(req.fds[i]);
+        }
+    }
+
+    umask(req.mask);
+    environ = &req.env[0];
+    // the compile must not be forwarded to us again
+    unsetenv("ICECC_SERVE_SOCKET");
+
+    if (chdir(req.cwd) < 0) {
+        log_perror("chdir to the caller's directory failed");
+        return EXIT_DISTCC_FAILED;
+    }
+
+    return run(req.argv.size() - 1, &req.argv[0]);
+}
+
+static void remember_value(const string &line)
+{
+    string::size_type tab = line.find('\t');
+
+    if (tab != string::npos) {
+        remembered[line.substr(0, tab)] = make_pair(time(0), line.substr(tab + 1));
+    }
+}
+
+/* Reads what the child wrote to STARTED_FD, if it read the request.  */
+static void take_started(ServeChild &child)
+{
+    char c;
+    ssize_t ret;
+
+    while ((ret = read(child.started_fd, &c, 1)) < 0 && errno == EINTR) {}
+
+    close(child.started_fd);
+    child.started_fd = -1;
+    child.started = ret == 1;
+}
+
+static void child_exited(int)
+{
+    int saved_errno = errno;
+    ignore_result(write(child_exited_fd, "", 1));
+    errno = saved_errno;
+}
+
+int serve_clients(const string &path, int (*run)(int argc, char **argv))
+{
+    struct sockaddr_un addr;
+
+    if (!make_address(path, addr)) {
+        log_error() << "socket path too long: " << path << endl;
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listen_fd < 0) {
+        log_perror("socket()");
+        return 1;
+    }
+
+    // don't take the socket away from a running service
+    if (connect(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        log_error() << "icecc is serving on " << path << " already" << endl;
+        close(listen_fd);
+        return 1;
+    }
+
+    close(listen_fd);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+
+    // only the user may connect, the compiles run as the user
+    mode_t old_umask = umask(0077);
+
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(listen_fd, SOMAXCONN) < 0) {
+        log_perror("can't listen on the serve socket");
+        umask(old_umask);
+        return 1;
+    }
+
+    umask(old_umask);
+    set_cloexec_flag(listen_fd, 1);
+
+    int exited_pipe[2];
+    int remember_pipe[2];
+
+    if (pipe(exited_pipe) || pipe(remember_pipe)) {
+        log_perror("pipe()");
+        return 1;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        fcntl(exited_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(remember_pipe[i], F_SETFL, O_NONBLOCK);
+        set_cloexec_flag(exited_pipe[i], 1);
+        set_cloexec_flag(remember_pipe[i], 1);
+    }
+
+    child_exited_fd = exited_pipe[1];
+    signal(SIGCHLD, child_exited);
+    dcc_ignore_sigpipe(1);
+
+    spare_daemon = connect_local_daemon();
+
+    // the connection of each running compile, with its child
+    map<int, ServeChild> requests;
+    string remember_buf;
+
+    log_info() << "serving compiles on " << path << endl;
+
+    for (;;) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        int max_fd = max(listen_fd, max(exited_pipe[0], remember_pipe[0]));
+        FD_SET(listen_fd, &rfds);
+        FD_SET(exited_pipe[0], &rfds);
+        FD_SET(remember_pipe[0], &rfds);
+
+        // the daemon doesn't say anything on an idle connection, unless it
+        // goes away
+        if (spare_daemon) {
+            FD_SET(spare_daemon->fd, &rfds);
+            max_fd = max(max_fd, spare_daemon->fd);
+        }
+
+        // the callers don't say anything while they wait, unless they die
+        for (map<int, ServeChild>::const_iterator it = requests.begin(); it != requests.end();
+                ++it) {
+            int fd = it->second.started_fd >= 0 ? it->second.started_fd : it->first;
+            FD_SET(fd, &rfds);
+            max_fd = max(max_fd, fd);
+        }
+
+        if (select(max_fd + 1, &rfds, 0, 0, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("select()");
+            return 1;
+        }
+
+        char buf[4096];
+        ssize_t len;
+
+        if (FD_ISSET(exited_pipe[0], &rfds)) {
+            while (read(exited_pipe[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        int status;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (map<int, ServeChild>::iterator it = requests.begin(); it != requests.end(); ++it) {
+                if (it->second.pid == pid) {
+                    if (it->second.started_fd >= 0) {
+                        take_started(it->second);
+                    }
+
+                    // nothing ran for a broken request
+                    if (it->second.started) {
+                        uint32_t exit_status = htonl(shell_exit_status(status));
+                        write_fully(it->first, &exit_status, sizeof(exit_status));
+                    }
+
+                    close(it->first);
+                    requests.erase(it);
+                    break;
+                }
+            }
+        }
+
+        if (FD_ISSET(remember_pipe[0], &rfds)) {
+            while ((len = read(remember_pipe[0], buf, sizeof(buf))) > 0) {
+                remember_buf.append(buf, len);
+            }
+
+            string::size_type end;
+
+            while ((end = remember_buf.find('\n')) != string::npos) {
+                remember_value(remember_buf.substr(0, end));
+                remember_buf.erase(0, end + 1);
+            }
+        }
+
+        if (spare_daemon && FD_ISSET(spare_daemon->fd, &rfds)) {
+            delete spare_daemon;
+            spare_daemon = 0;
+        }
+
+        for (map<int, ServeChild>::iterator it = requests.begin(); it != requests.end();) {
+            if (it->second.started_fd >= 0) {
+                if (FD_ISSET(it->second.started_fd, &rfds)) {
+                    take_started(it->second);
+                }
+
+                ++it;
+            } else if (it->second.started && FD_ISSET(it->first, &rfds)) {
+                trace() << "caller of " << it->second.pid << " went away" << endl;
+                kill(it->second.pid, SIGTERM);
+                close(it->first);
+                requests.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+
+        if (!FD_ISSET(listen_fd, &rfds)) {
+            continue;
+        }
+
+        int conn = accept(listen_fd, 0, 0);
+
+        if (conn < 0) {
+            continue;
+        }
+
+        set_cloexec_flag(conn, 1);
+
+#ifdef SO_PEERCRED
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) || cred.uid != getuid()) {
+            log_warning() << "refusing compile of another user" << endl;
+            close(conn);
+            continue;
+        }
+#endif
+
+        int started_pipe[2];
+
+        if (pipe(started_pipe)) {
+            log_perror("pipe()");
+            close(conn);
+            continue;
+        }
+
+        set_cloexec_flag(started_pipe[0], 1);
+        set_cloexec_flag(started_pipe[1], 1);
+        flush_debug();
+        pid = fork();
+
+        if (pid < 0) {
+            log_perror("fork()");
+            close(started_pipe[0]);
+            close(started_pipe[1]);
+            close(conn);
+            continue;
+        }
+
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(listen_fd);
+            close(exited_pipe[0]);
+            close(exited_pipe[1]);
+            close(remember_pipe[0]);
+            close(started_pipe[0]);
+
+            for (map<int, ServeChild>::const_iterator it = requests.begin();
+                    it != requests.end(); ++it) {
+                close(it->first);
+
+                if (it->second.started_fd >= 0) {
+                    close(it->second.started_fd);
+                }
+            }
+
+            // the request is read here, a caller that is slow to send it only
+            // holds up its own compile
+            struct timeval tv;
+            tv.tv_sec = 5;
+            tv.tv_usec = 0;
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            ServeRequest req;
+
+            if (!read_request(conn, req)) {
+                log_warning() << "broken compile request" << endl;
+                close_request(req);
+                _exit(EXIT_PROTOCOL_ERROR);
+            }
+
+            close(conn);
+            ignore_result(write(started_pipe[1], "", 1));
+            close(started_pipe[1]);
+            remember_fd = remember_pipe[1];
+            _exit(run_request(req, run));
+        }
+
+        close(started_pipe[1]);
+        ServeChild &child = requests[conn];
+        child.pid = pid;
+        child.started_fd = started_pipe[0];
+        child.started = false;
+
+        // the child took the connection, open one for the next compile
+        delete spare_daemon;
+        spare_daemon = connect_local_daemon();
+    }
+}
+
+int serve_forward(const string &path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+
+    if (!make_address(path, addr)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || !getcwd(cwd, sizeof(cwd))) {
+        close(fd);
+        return -1;
+    }
+
+    mode_t mask = umask(0);
+    umask(mask);
+
+    string data;
+    char number[32];
+    append_field(data, cwd);
+    sprintf(number, "%o", (unsigned int) mask);
+    append_field(data, number);
+    sprintf(number, "%d", argc);
+    append_field(data, number);
+
+    for (int i = 0; i < argc; ++i) {
+        append_field(data, argv[i]);
+    }
+
+    for (char **env = environ; *env; ++env) {
+        append_field(data, *env);
+    }
+
+    // the compile writes to our terminal
+    int fds[3];
+
+    for (int i = 0; i < 3; ++i) {
+        fds[i] = fcntl(i, F_GETFD) < 0 ? open("/dev/null", O_RDWR) : i;
+    }
+
+    uint32_t len = htonl(data.size());
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    dcc_ignore_sigpipe(1);
+    ssize_t ret;
+
+    while ((ret = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR) {}
+
+    // nothing was started if the request didn't get there
+    if (ret != sizeof(len) || !write_fully(fd, data.data(), data.size())) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t status;
+
+    if (!read_fully(fd, &status, sizeof(status))) {
+        close(fd);
+        log_error() << "lost the connection to icecc --serve" << endl;
+        return EXIT_DISTCC_FAILED;
+    }
+
+    close(fd);
+    return ntohl(status);
+}
+
+bool serve_lookup(const string &key, string &value)
+{
+    map<string, pair<time_t, string> >::const_iterator it = remembered.find(key);
+
+    if (it == remembered.end() || time(0) - it->second.first >= SERVE_CACHE_TIMEOUT) {
+        return false;
+    }
+
+    value = it->second.second;
+    return true;
+}
+
+void serve_remember(const string &key, const string &value)
+{
+    if (remember_fd < 0 || key.find_first_of("\t\n") != string::npos
+            || value.find('\n') != string::npos) {
+        return;
+    }
+
+    string line = key + '\t' + value + '\n';
+
+    // the children write to the same pipe, only small writes are atomic
+    if (line.size() <= PIPE_BUF) {
+        ignore_result(write(remember_fd, line.data(), line.size()));
+    }
+}
+
+MsgChannel *connect_local_daemon()
+{
+    if (spare_daemon) {
+        MsgChannel *local_daemon = spare_daemon;
+        spare_daemon = 0;
+        return local_daemon;
+    }
+
+    if (getenv("ICECC_TEST_SOCKET")) {
+        return Service::createChannel(getenv("ICECC_TEST_SOCKET"));
+    }
+
+    /* try several options to reach the local daemon - 3 sockets, one TCP */
+    MsgChannel *local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
+
+    if (!local_daemon) {
+        local_daemon = Service::createChannel("/var/run/iceccd.socket");
+    }
+
+    if (!local_daemon && getenv("HOME")) {
+        string path = getenv("HOME");
+        path += "/.iceccd.socket";
+        local_daemon = Service::createChannel(path);
+    }
+
+    if (!local_daemon) {
+        local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
+    }
+
+    return local_daemon;
+}
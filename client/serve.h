@@ -0,0 +1,50 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CLIENT_SERVE_H
+#define ICECREAM_CLIENT_SERVE_H
+
+#include <string>
+
+class MsgChannel;
+
+// Client service, "icecc --serve": a long running icecc takes the compile
+// commands of icecc processes that find $ICECC_SERVE_SOCKET set, and runs
+// each in a child that starts with what earlier compiles found out.
+
+// Accepts compile commands on the unix socket PATH until killed, and runs
+// each with RUN in a child in the caller's directory and environment.
+int serve_clients(const std::string &path, int (*run)(int argc, char **argv));
+
+// Hands the command line to the service listening at PATH and returns the
+// exit status of the compile, or -1 if there is no service.
+int serve_forward(const std::string &path, int argc, char **argv);
+
+// Values that are expensive to find out, like the path of a compiler, are
+// remembered by the service for a minute, for the compiles that follow.
+// Outside of the service these do nothing.
+bool serve_lookup(const std::string &key, std::string &value);
+void serve_remember(const std::string &key, const std::string &value);
+
+// Connects to the local daemon - or takes the connection the service opened
+// ahead of time. 0 if there is no daemon.
+MsgChannel *connect_local_daemon();
+
+#endif
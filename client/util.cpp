@@ -203,7 +203,11 @@ bool dcc_lock_host(int &lock_fd)
     }
 
     fname += "/local_lock";
+    return dcc_lock_file(fname, lock_fd);
+}
 
+bool dcc_lock_file(const string &fname, int &lock_fd)
+{
     lock_fd = 0;
 
     if (!dcc_open_lockfile(fname, lock_fd)) {
@@ -349,3 +353,65 @@ int resolve_link(const std::string &file, std::string &resolved)
     resolved = std::string(buf);
     return 0;
 }
+
+bool split_command_line(const std::string &line, std::list<std::string> &words)
+{
+    std::string word;
+    bool in_word = false;
+    size_t i = 0;
+
+    while (i < line.size()) {
+        char c = line[i++];
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            if (in_word) {
+                words.push_back(word);
+                word.clear();
+                in_word = false;
+            }
+        } else if (c == '\\') {
+            if (i == line.size()) {
+                return false;
+            }
+
+            word += line[i++];
+            in_word = true;
+        } else if (c == '\'') {
+            std::string::size_type end = line.find('\'', i);
+
+            if (end == std::string::npos) {
+                return false;
+            }
+
+            word.append(line, i, end - i);
+            i = end + 1;
+            in_word = true;
+        } else if (c == '"') {
+            while (i < line.size() && line[i] != '"') {
+                // only these keep their meaning inside double quotes
+                if (line[i] == '\\' && i + 1 < line.size() && line[i + 1] != '\0'
+                        && strchr("$`\"\\\n", line[i + 1])) {
+                    ++i;
+                }
+
+                word += line[i++];
+            }
+
+            if (i == line.size()) {
+                return false;
+            }
+
+            ++i;
+            in_word = true;
+        } else {
+            word += c;
+            in_word = true;
+        }
+    }
+
+    if (in_word) {
+        words.push_back(word);
+    }
+
+    return true;
+}
@@ -20,6 +20,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <list>
 #include <string>
 
 class CompileJob;
@@ -36,6 +37,11 @@ extern bool compiler_has_color_output(const CompileJob &job);
 extern bool output_needs_workaround(const CompileJob &job);
 extern bool ignore_unverified();
 extern int resolve_link(const std::string &file, std::string &resolved);
+/* Splits LINE into words like a POSIX shell, with quotes and backslashes
+   but no expansions. False if a quote is not closed or the line ends in a
+   backslash. */
+extern bool split_command_line(const std::string &line, std::list<std::string> &words);
 
 extern bool dcc_unlock(int lock_fd);
 extern bool dcc_lock_host(int &lock_fd);
+extern bool dcc_lock_file(const std::string &fname, int &lock_fd);
@@ -0,0 +1,187 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "connections.h"
+#include <unistd.h>
+#include <logging.h>
+
+using namespace std;
+
+// idle connections kept per compile server
+#define CONNECTIONS_PER_HOST 2
+#define MAX_CONNECTIONS 32
+// servers that didn't get a job for this long get no connections, and
+// connections idle for this long are closed
+#define CONNECTION_IDLE_TIMEOUT 60
+#define CONNECT_TIMEOUT 10
+
+ConnectionPool::ConnectionPool()
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    clear();
+}
+
+void ConnectionPool::close_connection(list<Connection>::iterator it)
+{
+    if (it->channel) {
+        delete it->channel;
+    } else if (it->fd >= 0) {
+        close(it->fd);
+    }
+
+    connections.erase(it);
+}
+
+void ConnectionPool::clear()
+{
+    while (!connections.empty()) {
+        close_connection(connections.begin());
+    }
+
+    last_use.clear();
+}
+
+MsgChannel *ConnectionPool::take(const string &host, unsigned short port)
+{
+    for (list<Connection>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        if (it->host == Host(host, port) && it->channel && it->channel->protocolEstablished()) {
+            MsgChannel *c = it->channel;
+            connections.erase(it);
+            trace() << "passing connection to " << host << ":" << port << endl;
+            return c;
+        }
+    }
+
+    return 0;
+}
+
+void ConnectionPool::used(const string &host, unsigned short port)
+{
+    last_use[Host(host, port)] = time(0);
+}
+
+void ConnectionPool::maintain()
+{
+    time_t now = time(0);
+    map<Host, int> count;
+
+    for (list<Connection>::iterator it = connections.begin(); it != connections.end();) {
+        time_t timeout = it->channel && it->channel->protocolEstablished()
+                         ? CONNECTION_IDLE_TIMEOUT : CONNECT_TIMEOUT;
+
+        if (now - it->started >= timeout) {
+            close_connection(it++);
+            continue;
+        }
+
+        count[it->host]++;
+        ++it;
+    }
+
+    for (map<Host, time_t>::iterator it = last_use.begin(); it != last_use.end();) {
+        if (now - it->second >= CONNECTION_IDLE_TIMEOUT) {
+            last_use.erase(it++);
+            continue;
+        }
+
+        while (count[it->first] < CONNECTIONS_PER_HOST && connections.size() < MAX_CONNECTIONS) {
+            Connection c;
+            c.host = it->first;
+            c.fd = Service::startConnect(c.host.first, c.host.second);
+            c.channel = 0;
+            c.started = now;
+
+            if (c.fd < 0) {
+                // don't retry all the time
+                break;
+            }
+
+            connections.push_back(c);
+            count[it->first]++;
+        }
+
+        ++it;
+    }
+}
+
+void ConnectionPool::fill_fd_sets(fd_set *read_set, fd_set *write_set, int &max_fd) const
+{
+    for (list<Connection>::const_iterator it = connections.begin(); it != connections.end(); ++it) {
+        if (it->channel) {
+            FD_SET(it->channel->fd, read_set);
+            max_fd = max(max_fd, it->channel->fd);
+        } else {
+            FD_SET(it->fd, write_set);
+            max_fd = max(max_fd, it->fd);
+        }
+    }
+}
+
+void ConnectionPool::handle_fd_sets(fd_set *read_set, fd_set *write_set)
+{
+    for (list<Connection>::iterator it = connections.begin(); it != connections.end();) {
+        if (!it->channel) {
+            if (FD_ISSET(it->fd, write_set)) {
+                it->channel = Service::createChannelAsync(it->fd);
+                it->fd = -1;
+
+                if (!it->channel) {
+                    trace() << "connecting to " << it->host.first << " failed" << endl;
+                    connections.erase(it++);
+                    continue;
+                }
+            }
+        } else if (FD_ISSET(it->channel->fd, read_set)) {
+            // the server is not supposed to send anything but the version
+            // exchange, anything else means the connection is unusable
+            if (!it->channel->read_a_bit() || it->channel->has_msg()) {
+                close_connection(it++);
+                continue;
+            }
+
+            if (it->channel->protocolEstablished()) {
+                it->started = time(0);
+            }
+        }
+
+        ++it;
+    }
+}
+
+string ConnectionPool::dump() const
+{
+    string result;
+
+    for (list<Connection>::const_iterator it = connections.begin(); it != connections.end(); ++it) {
+        result += "  connection to " + it->host.first + ":" + toString(it->host.second) + " ";
+
+        if (!it->channel) {
+            result += "connecting\n";
+        } else {
+            result += it->channel->dump() + "\n";
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,70 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CONNECTIONS_H
+#define ICECREAM_CONNECTIONS_H
+
+#include <comm.h>
+#include <sys/select.h>
+#include <list>
+#include <map>
+#include <string>
+
+// Keeps connections to the compile servers used recently open, with the
+// protocol setup already done. A local client gets one passed along with
+// its UseCSMsg, so it doesn't have to connect and exchange versions itself.
+class ConnectionPool
+{
+public:
+    ConnectionPool();
+    ~ConnectionPool();
+
+    // an idle connection to HOST:PORT, or 0, the caller owns it
+    MsgChannel *take(const std::string &host, unsigned short port);
+    // HOST:PORT got a job, keep connections to it for a while
+    void used(const std::string &host, unsigned short port);
+
+    // drop old connections and start new ones where needed
+    void maintain();
+    void fill_fd_sets(fd_set *read_set, fd_set *write_set, int &max_fd) const;
+    // handle connects and version exchanges that progressed
+    void handle_fd_sets(fd_set *read_set, fd_set *write_set);
+    void clear();
+
+    std::string dump() const;
+
+private:
+    typedef std::pair<std::string, unsigned short> Host;
+
+    struct Connection {
+        Host host;
+        // the connecting socket, until the channel is created
+        int fd;
+        MsgChannel *channel;
+        time_t started;
+    };
+
+    void close_connection(std::list<Connection>::iterator it);
+
+    std::list<Connection> connections;
+    std::map<Host, time_t> last_use;
+};
+
+#endif
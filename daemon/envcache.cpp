@@ -0,0 +1,170 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "envcache.h"
+
+#include <algorithm>
+
+#include "logging.h"
+
+using namespace std;
+
+EnvCache::EnvCache()
+    : total(0)
+    , high(0)
+    , low(0)
+{
+}
+
+void EnvCache::setLimit(size_t limit, unsigned int low_percent)
+{
+    high = limit;
+    low = limit / 100 * min(low_percent, 100u);
+}
+
+void EnvCache::add(const string &env, size_t size, bool pinned)
+{
+    map<string, Entry>::iterator it = entries.find(env);
+
+    if (it == entries.end()) {
+        Entry entry;
+        entry.size = 0;
+        entry.refs = 0;
+        entry.pinned = false;
+        entry.lru_pos = lru.insert(lru.end(), env);
+        it = entries.insert(make_pair(env, entry)).first;
+    }
+
+    it->second.size += size;
+    it->second.pinned = it->second.pinned || pinned;
+    total += size;
+    touch(env);
+}
+
+void EnvCache::remove(const string &env, size_t freed)
+{
+    map<string, Entry>::iterator it = entries.find(env);
+
+    if (it == entries.end()) {
+        return;
+    }
+
+    if (it->second.refs) {
+        log_warning() << "removing environment " << env << " in use by "
+                      << it->second.refs << " jobs" << endl;
+    }
+
+    lru.erase(it->second.lru_pos);
+    entries.erase(it);
+    total -= min(freed, total);
+}
+
+bool EnvCache::contains(const string &env) const
+{
+    return entries.count(env) != 0;
+}
+
+void EnvCache::touch(const string &env)
+{
+    map<string, Entry>::iterator it = entries.find(env);
+
+    if (it == entries.end()) {
+        return;
+    }
+
+    lru.splice(lru.end(), lru, it->second.lru_pos);
+    it->second.last_use = time(NULL);
+}
+
+void EnvCache::acquire(const string &env)
+{
+    map<string, Entry>::iterator it = entries.find(env);
+
+    if (it != entries.end()) {
+        it->second.refs++;
+        touch(env);
+    }
+}
+
+void EnvCache::release(const string &env)
+{
+    map<string, Entry>::iterator it = entries.find(env);
+
+    if (it != entries.end() && it->second.refs > 0) {
+        it->second.refs--;
+        touch(env);
+    }
+}
+
+void EnvCache::setPinned(const string &env, bool pinned)
+{
+    map<string, Entry>::iterator it = entries.find(env);
+
+    if (it != entries.end()) {
+        it->second.pinned = pinned;
+    }
+}
+
+string EnvCache::victim(const string &keep) const
+{
+    for (list<string>::const_iterator it = lru.begin(); it != lru.end(); ++it) {
+        const Entry &entry = entries.find(*it)->second;
+
+        if (!entry.refs && !entry.pinned && *it != keep) {
+            return *it;
+        }
+    }
+
+    return string();
+}
+
+void EnvCache::evict(const string &keep, Remover &remover)
+{
+    if (!overLimit()) {
+        return;
+    }
+
+    while (overLowWatermark()) {
+        string oldest = victim(keep);
+
+        if (oldest.empty()) {
+            trace() << "cache over its limit, but nothing can be removed" << endl;
+            break;
+        }
+
+        remove(oldest, remover.remove(oldest));
+    }
+}
+
+string EnvCache::dump() const
+{
+    string result = "  Environments: " + toString(total) + " of " + toString(high)
+                    + " bytes, " + toString(time(NULL)) + " now\n";
+
+    for (list<string>::const_iterator it = lru.begin(); it != lru.end(); ++it) {
+        const Entry &entry = entries.find(*it)->second;
+        result += "  env " + *it + ": last use " + toString(entry.last_use) + ", "
+                  + toString(entry.size) + " bytes, " + toString(entry.refs) + " jobs"
+                  + (entry.pinned ? ", pinned" : "") + "\n";
+    }
+
+    return result;
+}
@@ -0,0 +1,107 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_ENVCACHE_H
+#define ICECREAM_ENVCACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <list>
+#include <map>
+#include <string>
+
+// The environments on disk and the space they take: the installed ones as
+// TARGET/NAME, and the native ones by the path of their tarball. They are
+// kept in the order of their last use. Once the cache grows over its limit,
+// the least recently used ones are removed until it is down to the low
+// watermark, a bit below the limit, so that not every install has to remove
+// one. Environments that running jobs hold and pinned ones stay.
+class EnvCache
+{
+public:
+    EnvCache();
+
+    // the limit, and the percentage of it eviction goes down to
+    void setLimit(size_t limit, unsigned int low_percent = 80);
+    size_t limit() const {
+        return high;
+    }
+    size_t size() const {
+        return total;
+    }
+
+    // Installed environments take SIZE bytes more than before: those of
+    // their files no other environment has.
+    void add(const std::string &env, size_t size, bool pinned = false);
+    // The environment is removed, which freed FREED bytes. Files it shared
+    // with others are theirs now.
+    void remove(const std::string &env, size_t freed);
+    bool contains(const std::string &env) const;
+
+    // makes it the most recently used one
+    void touch(const std::string &env);
+    // jobs that use the environment hold it
+    void acquire(const std::string &env);
+    void release(const std::string &env);
+    void setPinned(const std::string &env, bool pinned);
+
+    bool overLimit() const {
+        return total > high;
+    }
+    bool overLowWatermark() const {
+        return total > low;
+    }
+    // The least recently used environment that can be removed, other than
+    // KEEP, or an empty string if there is none.
+    std::string victim(const std::string &keep) const;
+
+    // removes the environments evict() chose from the disk
+    class Remover
+    {
+    public:
+        virtual ~Remover() {}
+        // returns the bytes that were freed
+        virtual size_t remove(const std::string &env) = 0;
+    };
+
+    // Once over the limit, removes victims other than KEEP with REMOVER
+    // until the cache is down to the low watermark, or nothing else can go.
+    void evict(const std::string &keep, Remover &remover);
+
+    std::string dump() const;
+
+private:
+    struct Entry {
+        size_t size;
+        unsigned int refs;
+        bool pinned;
+        time_t last_use;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::map<std::string, Entry> entries;
+    // least recently used first
+    std::list<std::string> lru;
+    size_t total;
+    size_t high;
+    size_t low;
+};
+
+#endif
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -38,8 +39,12 @@
 
 #include "comm.h"
 #include "exitcode.h"
+#include "md5.h"
 #include "util.h"
 
+#include <map>
+#include <set>
+
 using namespace std;
 
 #if 0
@@ -86,6 +91,9 @@ static bool extract_version(string &version)
 }
 #endif
 
+/* The disk space of the files in DIR that no other environment shares.
+   A file in the store has one link there and one in each environment
+   that has it.  */
 size_t sumup_dir(const string &dir)
 {
     size_t res = 0;
@@ -111,7 +119,7 @@ size_t sumup_dir(const string &dir)
 
         if (S_ISDIR(st.st_mode)) {
             res += sumup_dir(tdir + ent->d_name);
-        } else if (S_ISREG(st.st_mode)) {
+        } else if (S_ISREG(st.st_mode) && st.st_nlink <= 2) {
             res += st.st_size;
         }
 
@@ -122,6 +130,96 @@ size_t sumup_dir(const string &dir)
     return res;
 }
 
+/* Environments keep their files in a content addressed store: every file
+   is a hardlink to store/MD5-MODE, so the files environments have in
+   common, like those of glibc or binutils, use the disk only once.  */
+static string store_dir(const string &basedir)
+{
+    return basedir + "/store";
+}
+
+static bool hash_file(const string &path, string &hex)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        md5_append(&state, reinterpret_cast<const md5_byte_t *>(buf), n);
+    }
+
+    close(fd);
+
+    if (n < 0) {
+        return false;
+    }
+
+    hex = md5_hex(&state);
+    return true;
+}
+
+static string store_name(const string &store, const string &hex, mode_t mode)
+{
+    char suffix[16];
+    sprintf(suffix, "-%o", (unsigned int)(mode & 07555));
+    return store + "/" + hex + suffix;
+}
+
+/* Adds the regular file PATH with the md5 sum HEX to the store, or if the
+   store has it already, replaces it by a link to that one. The file becomes
+   read-only, compile jobs of one environment must not change those of
+   another.  */
+static void store_file(const string &path, const struct stat &st, const string &hex,
+                       const string &store)
+{
+    mode_t mode = st.st_mode & 07555;
+    string stored = store_name(store, hex, mode);
+
+    if (chmod(path.c_str(), mode) == 0 && link(path.c_str(), stored.c_str()) == 0) {
+        return;
+    }
+
+    // the store has it already, share that one
+    struct stat stored_st;
+    string tmp = path + ".icecc-link";
+
+    if (lstat(stored.c_str(), &stored_st) == 0 && stored_st.st_size == st.st_size
+            && link(stored.c_str(), tmp.c_str()) == 0
+            && rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+    }
+}
+
+/* Removes the files of the store no environment links to any more.  */
+static void prune_store(const string &basedir)
+{
+    string store = store_dir(basedir);
+    DIR *dir = opendir(store.c_str());
+
+    if (!dir) {
+        return;
+    }
+
+    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
+        string path = store + "/" + ent->d_name;
+        struct stat st;
+
+        if (ent->d_name[0] != '.' && lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+                && st.st_nlink == 1) {
+            unlink(path.c_str());
+        }
+    }
+
+    closedir(dir);
+}
+
 static void list_target_dirs(const string &current_target, const string &targetdir, Environments &envs)
 {
     DIR *envdir = opendir(targetdir.c_str());
@@ -441,157 +539,1281 @@ size_t finish_create_env(int pipe, const string &basedir, string &native_environ
 }
 
 
-pid_t start_install_environment(const std::string &basename, const std::string &target,
-                                const std::string &name, MsgChannel *c,
-                                int &pipe_to_stdin, FileChunkMsg *&fmsg,
-                                uid_t user_uid, gid_t user_gid)
+/* A path in the environment from a manifest: relative, and never leaving
+   the environment's directory.  */
+static bool valid_manifest_path(string &path)
 {
-    if (!name.size()) {
-        log_error() << "illegal name for environment " << name << endl;
-        return 0;
+    while (path.compare(0, 2, "./") == 0) {
+        path.erase(0, 2);
     }
 
-    for (string::size_type i = 0; i < name.size(); ++i) {
-        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
-            continue;
+    if (path.empty() || path[0] == '/') {
+        return false;
+    }
+
+    string::size_type start = 0;
+
+    while (start <= path.size()) {
+        string::size_type end = path.find('/', start);
+
+        if (end == string::npos) {
+            end = path.size();
         }
 
-        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
-        return 0;
-    }
+        string part = path.substr(start, end - start);
 
-    string dirname = basename + "/target=" + target;
-    Msg *msg = c->get_msg(30);
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
 
-    if (!msg || msg->type != M_FILE_CHUNK) {
-        trace() << "Expected first file chunk\n";
-        return 0;
+        start = end + 1;
     }
 
-    fmsg = dynamic_cast<FileChunkMsg*>(msg);
-    enum { BZip2, Gzip, None} compression = None;
+    return true;
+}
+
+static bool make_parent_dirs(const string &dir, const string &path)
+{
+    for (string::size_type slash = path.find('/'); slash != string::npos;
+            slash = path.find('/', slash + 1)) {
+        string parent = dir + "/" + path.substr(0, slash);
 
-    if (fmsg->len > 2) {
-        if (fmsg->buffer[0] == 037 && fmsg->buffer[1] == 0213) {
-            compression = Gzip;
-        } else if (fmsg->buffer[0] == 'B' && fmsg->buffer[1] == 'Z') {
-            compression = BZip2;
+        if (mkdir(parent.c_str(), 0755) && errno != EEXIST) {
+            return false;
         }
     }
 
-    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
-        log_perror("mkdir target");
-        return 0;
+    return true;
+}
+
+// where the install of a file of a manifest gets it from
+enum { InStore, FromClient, Written };
+
+// a file of a manifest being written
+struct ManifestFile {
+    int fd;
+    string path;
+    md5_state_t state;
+    uint32_t done;
+};
+
+static bool begin_manifest_file(const string &dirname, const string &name, ManifestFile &file)
+{
+    file.path = dirname + "/" + name;
+    file.done = 0;
+    md5_init(&file.state);
+
+    if (!make_parent_dirs(dirname, name)) {
+        log_perror(("mkdir " + file.path).c_str());
+        return false;
     }
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod target");
-        return 0;
+    file.fd = open(file.path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (file.fd < 0) {
+        log_perror(("open " + file.path).c_str());
+        return false;
     }
 
-    dirname = dirname + "/" + name;
+    return true;
+}
 
-    if (mkdir(dirname.c_str(), 0770)) {
-        log_perror("mkdir name");
-        return 0;
+static bool append_manifest_file(ManifestFile &file, const char *buf, size_t len)
+{
+    if (!write_fully(file.fd, buf, len)) {
+        log_perror(("write " + file.path).c_str());
+        return false;
     }
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod name");
-        return 0;
+    md5_append(&file.state, reinterpret_cast<const md5_byte_t *>(buf), len);
+    file.done += len;
+    return true;
+}
+
+/* Checks the written file against its md5 sum, and adds it to the store.
+   A file that doesn't match is removed.  */
+static bool end_manifest_file(ManifestFile &file, const ChunkRef &ref, uint32_t mode,
+                              const string &store)
+{
+    close(file.fd);
+    file.fd = -1;
+    md5_byte_t digest[16];
+    md5_finish(&file.state, digest);
+
+    if (memcmp(digest, ref.digest, 16) != 0) {
+        log_error() << "environment file " << file.path << " does not match its md5 sum" << endl;
+        unlink(file.path.c_str());
+        return false;
     }
 
-    int fds[2];
+    struct stat st;
 
-    if (pipe(fds)) {
-        return 0;
+    if (chmod(file.path.c_str(), mode & 07555) || lstat(file.path.c_str(), &st)) {
+        log_perror(("chmod " + file.path).c_str());
+        return false;
     }
 
-    flush_debug();
-    pid_t pid = fork();
+    store_file(file.path, st, md5_hex(ref.digest), store);
+    return true;
+}
 
-    if (pid) {
-        trace() << "pid " << pid << endl;
-        close(fds[0]);
-        pipe_to_stdin = fds[1];
+/* Gets the files the client would have to send from the compile servers
+   PEERS instead. A transfer that breaks off goes on with the next peer
+   where it stopped, and a file that doesn't match its md5 sum is asked
+   for again. What none of the peers sends is left to the client.  */
+static void fetch_from_peers(const string &dirname, const string &store,
+                             const vector<string> &files, const vector<uint32_t> &modes,
+                             const vector<ChunkRef> &refs, vector<char> &state,
+                             const list<string> &peers)
+{
+    ManifestFile file;
+    file.fd = -1;
+    size_t current = files.size();
+
+    for (list<string>::const_iterator it = peers.begin(); it != peers.end(); ++it) {
+        GetEnvFilesMsg request;
+        vector<size_t> wanted;
+
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (state[i] == FromClient) {
+                wanted.push_back(i);
+                request.refs.push_back(refs[i]);
+                request.modes.push_back(modes[i]);
+            }
+        }
 
-        return pid;
+        if (wanted.empty()) {
+            break;
+        }
+
+        string::size_type colon = it->rfind(':');
+        unsigned short port = colon == string::npos ? 0 : atoi(it->c_str() + colon + 1);
+
+        if (!port) {
+            continue;
+        }
+
+        // the file that broke off is the first one that is still wanted
+        request.offset = current == wanted[0] ? file.done : 0;
+        MsgChannel *peer = Service::createChannel(it->substr(0, colon), port, 10);
+
+        if (!peer) {
+            log_warning() << "can't reach " << *it << " for environment files" << endl;
+            continue;
+        }
+
+        trace() << "getting " << wanted.size() << " environment files from " << *it << endl;
+        size_t next = 0;
+        bool ok = peer->send_msg(request);
+
+        while (ok) {
+            Msg *msg = peer->get_msg(60);
+
+            if (!msg || msg->type != M_FILE_CHUNK) {
+                delete msg;
+                break;
+            }
+
+            FileChunkMsg *chunk = static_cast<FileChunkMsg*>(msg);
+            const char *data = reinterpret_cast<const char *>(chunk->buffer);
+            size_t len = chunk->len;
+
+            while (ok && len > 0) {
+                if (next >= wanted.size()) {
+                    ok = false;
+                    break;
+                }
+
+                size_t i = wanted[next];
+
+                if (current != i) {
+                    current = i;
+
+                    if (!begin_manifest_file(dirname, files[i], file)) {
+                        ok = false;
+                        break;
+                    }
+                }
+
+                size_t n = min(len, (size_t)(refs[i].len - file.done));
+                ok = append_manifest_file(file, data, n);
+                data += n;
+                len -= n;
+
+                if (ok && file.done == refs[i].len) {
+                    ok = end_manifest_file(file, refs[i], modes[i], store);
+                    current = files.size();
+
+                    if (ok) {
+                        state[i] = Written;
+                        ++next;
+                    }
+                }
+            }
+
+            delete msg;
+        }
+
+        delete peer;
     }
 
-    // else
-#ifndef HAVE_LIBCAP_NG
+    // the client sends the file that broke off from its start
+    if (file.fd >= 0) {
+        close(file.fd);
+        unlink(file.path.c_str());
+    }
+}
 
-    if (setgroups(0, NULL) < 0) {
-        log_perror("setgroups fails");
-        _exit(143);
+/* The child's part of an install from a manifest: the files come from the
+   peers, or if none is given or they fail, one after the other from the
+   client on stdin. The parent learns on RESULT_FD, if any, which files the
+   client has to send. The rest of the files are links to the store.  */
+static int install_from_manifest(const string &dirname, const string &store,
+                                 const vector<string> &files, const vector<uint32_t> &modes,
+                                 const vector<ChunkRef> &refs, vector<char> &state,
+                                 const list<string> &peers, int result_fd)
+{
+    if (!peers.empty()) {
+        for (size_t i = 0; i < files.size(); ++i) {
+            ManifestFile file;
+
+            // empty files need nobody to send them
+            if (state[i] == FromClient && refs[i].len == 0) {
+                if (!begin_manifest_file(dirname, files[i], file)
+                        || !end_manifest_file(file, refs[i], modes[i], store)) {
+                    return 1;
+                }
+
+                state[i] = Written;
+            }
+        }
+
+        fetch_from_peers(dirname, store, files, modes, refs, state, peers);
     }
 
-    if (setgid(user_gid) < 0) {
-        log_perror("setgid fails");
-        _exit(143);
+    if (result_fd >= 0) {
+        vector<uint32_t> left;
+
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (state[i] == FromClient) {
+                left.push_back(i);
+            }
+        }
+
+        uint32_t count = left.size();
+        bool ok = write_fully(result_fd, (const char *) &count, sizeof(count))
+                  && (left.empty()
+                      || write_fully(result_fd, (const char *) &left[0], count * sizeof(uint32_t)));
+        close(result_fd);
+
+        if (!ok) {
+            return 1;
+        }
     }
 
-    if (!geteuid() && setuid(user_uid) < 0) {
-        log_perror("setuid fails");
-        _exit(142);
+    char buf[65536];
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (state[i] != FromClient) {
+            continue;
+        }
+
+        ManifestFile file;
+
+        if (!begin_manifest_file(dirname, files[i], file)) {
+            return 1;
+        }
+
+        while (file.done < refs[i].len) {
+            uint32_t left = refs[i].len - file.done;
+            ssize_t n = read(0, buf, left < sizeof(buf) ? left : sizeof(buf));
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                log_error() << "short environment file " << file.path << endl;
+                close(file.fd);
+                return 1;
+            }
+
+            if (!append_manifest_file(file, buf, n)) {
+                close(file.fd);
+                return 1;
+            }
+        }
+
+        if (!end_manifest_file(file, refs[i], modes[i], store)) {
+            return 1;
+        }
     }
 
-#endif
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (state[i] != InStore) {
+            continue;
+        }
 
-    // reset SIGPIPE and SIGCHILD handler so that tar
-    // isn't confused when gzip/bzip2 aborts
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGPIPE, SIG_DFL);
+        string path = dirname + "/" + files[i];
+        string stored = store_name(store, md5_hex(refs[i].digest), modes[i]);
 
-    close(0);
-    close(fds[1]);
-    dup2(fds[0], 0);
+        if (!make_parent_dirs(dirname, files[i]) || link(stored.c_str(), path.c_str())) {
+            log_perror(("link " + path).c_str());
+            return 1;
+        }
+    }
 
-    char **argv;
-    argv = new char*[6];
-    argv[0] = strdup(TAR);
-    argv[1] = strdup("-C");
-    argv[2] = strdup(dirname.c_str());
+    return 0;
+}
+
+/* The files of GMSG from the store, for a compile server that installs an
+   environment. Runs in a child that has the connection to itself.  */
+void serve_env_files(const string &basename, MsgChannel *c, const GetEnvFilesMsg *gmsg)
+{
+    string store = store_dir(basename);
+    vector<unsigned char> buf(100000);
+
+    for (size_t i = 0; i < gmsg->refs.size() && i < gmsg->modes.size(); ++i) {
+        string stored = store_name(store, md5_hex(gmsg->refs[i].digest), gmsg->modes[i]);
+        int fd = open(stored.c_str(), O_RDONLY);
+        struct stat st;
+        off_t offset = i == 0 ? gmsg->offset : 0;
+
+        if (fd < 0 || fstat(fd, &st) || st.st_size != (off_t) gmsg->refs[i].len
+                || lseek(fd, offset, SEEK_SET) != offset) {
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            trace() << "no " << stored << " to serve" << endl;
+            break;
+        }
+
+        ssize_t n;
+
+        while ((n = read(fd, &buf[0], buf.size())) > 0) {
+            FileChunkMsg chunk(&buf[0], n, Payload_Environment);
+
+            if (!c->send_msg(chunk)) {
+                close(fd);
+                return;
+            }
+        }
 
-    if (compression == BZip2) {
-        argv[3] = strdup("-xjf");
-    } else if (compression == Gzip) {
-        argv[3] = strdup("-xzf");
-    } else if (compression == None) {
-        argv[3] = strdup("-xf");
+        close(fd);
+
+        // what was sent of the file is all the peer gets
+        if (n < 0) {
+            break;
+        }
     }
 
-    argv[4] = strdup("-");
-    argv[5] = 0;
-    _exit(execv(argv[0], argv));
+    c->send_msg(EndMsg());
 }
 
+#define TAR_BLOCK 512
 
-size_t finalize_install_environment(const std::string &basename, const std::string &target,
-                                    pid_t pid, uid_t user_uid, gid_t user_gid)
+static unsigned long long tar_number(const char *field, size_t size)
 {
-    int status = 1;
+    unsigned long long value = 0;
 
-    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    // base-256, for what doesn't fit the octal digits
+    if ((unsigned char) field[0] & 0x80) {
+        value = (unsigned char) field[0] & 0x7f;
 
-    if (shell_exit_status(status) != 0) {
-        log_error() << "exit code: " << shell_exit_status(status) << endl;
-        remove_environment(basename, target);
-        return 0;
+        for (size_t i = 1; i < size; ++i) {
+            value = (value << 8) | (unsigned char) field[i];
+        }
+
+        return value;
     }
 
-    string dirname = basename + "/target=" + target;
+    for (size_t i = 0; i < size && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + field[i] - '0';
+        }
+    }
 
-    errno = 0;
-    mkdir((dirname + "/tmp").c_str(), 01775);
-    ignore_result(chown((dirname + "/tmp").c_str(), user_uid, user_gid));
-    chmod((dirname + "/tmp").c_str(), 01775);
-    if (errno == -1) {
-        log_error() << "failed to setup " << dirname << "/tmp :"
-                    << strerror(errno) << endl;
+    return value;
+}
+
+// The header's checksum field, that counts as spaces, covers the header.
+static bool tar_checksum_ok(const char *header)
+{
+    unsigned long sum = 0;
+
+    for (int i = 0; i < TAR_BLOCK; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
     }
 
-    return sumup_dir(dirname);
+    return sum == tar_number(header + 148, 8);
+}
+
+// The path, link target and size of a pax extended header, "LEN KEY=VALUE\n" records.
+static void pax_header(const string &data, string &path, string &link, unsigned long long &size)
+{
+    string::size_type pos = 0;
+
+    while (pos < data.size()) {
+        unsigned long len = strtoul(data.c_str() + pos, NULL, 10);
+        string::size_type space = data.find(' ', pos);
+
+        if (!len || space == string::npos || pos + len > data.size() || space >= pos + len) {
+            return;
+        }
+
+        string record = data.substr(space + 1, pos + len - space - 2);
+        string::size_type eq = record.find('=');
+
+        if (eq != string::npos && record.compare(0, eq, "path") == 0) {
+            path = record.substr(eq + 1);
+        } else if (eq != string::npos && record.compare(0, eq, "linkpath") == 0) {
+            link = record.substr(eq + 1);
+        } else if (eq != string::npos && record.compare(0, eq, "size") == 0) {
+            size = strtoull(record.c_str() + eq + 1, NULL, 10);
+        }
+
+        pos += len;
+    }
+}
+
+static bool read_tar_data(int fd, unsigned long long size, string &data)
+{
+    if (size > 1024 * 1024) {
+        return false;
+    }
+
+    vector<char> buf((size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK);
+
+    if (!buf.empty() && !read_fully(fd, &buf[0], buf.size())) {
+        return false;
+    }
+
+    data.assign(buf.begin(), buf.begin() + size);
+    return true;
+}
+
+/* A path of the tarball in the environment, without the leading slashes
+   tar takes off too. Its directories must not lead out of ROOT, the real
+   path of the environment, by symbolic links of the tarball.  */
+static bool env_tar_path(const string &dirname, const string &root, string &path)
+{
+    while (!path.empty() && path[0] == '/') {
+        path.erase(0, 1);
+    }
+
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+
+    if (!valid_manifest_path(path) || !make_parent_dirs(dirname, path)) {
+        return false;
+    }
+
+    string::size_type slash = path.rfind('/');
+
+    if (slash == string::npos) {
+        return true;
+    }
+
+    char *parent = realpath((dirname + "/" + path.substr(0, slash)).c_str(), NULL);
+    bool inside = parent && (parent == root || !strncmp(parent, (root + "/").c_str(),
+                                                        root.size() + 1));
+    free(parent);
+    return inside;
+}
+
+/* Extracts the tar stream on FD into DIRNAME, as tar would, and adds the
+   regular files to the store as they are written. HASH is the md5 sum of
+   the md5 sums of the regular files in the order of the tarball, that is
+   how icecc-create-env names the environments. PLAIN is false if the
+   tarball has more than regular files, which icecc-create-env doesn't
+   write.  */
+bool extract_env_tar(int fd, const string &dirname, const string &store,
+                     string &hash, bool &plain)
+{
+    char *real = realpath(dirname.c_str(), NULL);
+
+    if (!real) {
+        return false;
+    }
+
+    string root = real;
+    free(real);
+    md5_state_t env_state;
+    md5_init(&env_state);
+    map<string, string> hexes;
+    string long_path, long_link;
+    char header[TAR_BLOCK];
+    vector<char> buf(65536);
+    plain = true;
+
+    while (true) {
+        if (!read_fully(fd, header, TAR_BLOCK)) {
+            log_error() << "environment tarball ends early" << endl;
+            return false;
+        }
+
+        // two zero blocks end the archive, the first is enough for us
+        if (header[0] == 0) {
+            break;
+        }
+
+        if (!tar_checksum_ok(header)) {
+            log_error() << "environment tarball is corrupt" << endl;
+            return false;
+        }
+
+        char type = header[156];
+        unsigned long long size = tar_number(header + 124, 12);
+        string path(header, strnlen(header, 100));
+        string link(header + 157, strnlen(header + 157, 100));
+
+        if (!memcmp(header + 257, "ustar", 5) && header[345]) {
+            path = string(header + 345, strnlen(header + 345, 155)) + "/" + path;
+        }
+
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            string data;
+
+            if (!read_tar_data(fd, size, data)) {
+                log_error() << "bad extended header in environment tarball" << endl;
+                return false;
+            }
+
+            if (type == 'L') {
+                long_path = data.c_str();
+            } else if (type == 'K') {
+                long_link = data.c_str();
+            } else if (type == 'x') {
+                pax_header(data, long_path, long_link, size);
+            }
+
+            continue;
+        }
+
+        if (!long_path.empty()) {
+            path = long_path;
+        }
+
+        if (!long_link.empty()) {
+            link = long_link;
+        }
+
+        long_path.clear();
+        long_link.clear();
+        mode_t mode = tar_number(header + 100, 8) & 07777;
+
+        if (path == "." || path == "./") {
+            continue;
+        }
+
+        if (!env_tar_path(dirname, root, path)) {
+            log_error() << "illegal path " << path << " in environment tarball" << endl;
+            return false;
+        }
+
+        string target = dirname + "/" + path;
+
+        if (type == '5') {
+            plain = false;
+
+            if ((mkdir(target.c_str(), 0755) && errno != EEXIST)
+                    || chmod(target.c_str(), mode | 0700)) {
+                log_perror(("mkdir " + target).c_str());
+                return false;
+            }
+
+            continue;
+        }
+
+        unlink(target.c_str());
+
+        if (type == '2') {
+            plain = false;
+
+            if (symlink(link.c_str(), target.c_str())) {
+                log_perror(("symlink " + target).c_str());
+                return false;
+            }
+
+            continue;
+        }
+
+        // a file with more names, as tar -h writes them
+        if (type == '1') {
+            map<string, string>::const_iterator it;
+
+            if (!valid_manifest_path(link) || (it = hexes.find(link)) == hexes.end()
+                    || ::link((dirname + "/" + link).c_str(), target.c_str())) {
+                log_error() << "bad link " << path << " in environment tarball" << endl;
+                return false;
+            }
+
+            string line = it->second + "\n";
+            md5_append(&env_state, reinterpret_cast<const md5_byte_t *>(line.data()),
+                       line.size());
+            continue;
+        }
+
+        if (type != '0' && type != '\0' && type != '7') {
+            log_error() << "unsupported file " << path << " in environment tarball" << endl;
+            return false;
+        }
+
+        ManifestFile file;
+        file.path = target;
+        file.done = 0;
+        md5_init(&file.state);
+        file.fd = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+
+        if (file.fd < 0) {
+            log_perror(("open " + target).c_str());
+            return false;
+        }
+
+        unsigned long long left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+        while (left > 0) {
+            size_t n = min<unsigned long long>(left, buf.size());
+
+            if (!read_fully(fd, &buf[0], n)) {
+                log_error() << "environment tarball ends in " << path << endl;
+                close(file.fd);
+                return false;
+            }
+
+            size_t data = min<unsigned long long>(n, size - file.done);
+
+            if (data && !append_manifest_file(file, &buf[0], data)) {
+                close(file.fd);
+                return false;
+            }
+
+            left -= n;
+        }
+
+        close(file.fd);
+        md5_byte_t digest[16];
+        md5_finish(&file.state, digest);
+        string hex = md5_hex(digest);
+        struct stat st;
+
+        if (chmod(target.c_str(), mode) || lstat(target.c_str(), &st)) {
+            log_perror(("chmod " + target).c_str());
+            return false;
+        }
+
+        store_file(target, st, hex, store);
+        hexes[path] = hex;
+        string line = hex + "\n";
+        md5_append(&env_state, reinterpret_cast<const md5_byte_t *>(line.data()), line.size());
+    }
+
+    // the rest is padding, the decompressor must get to its end
+    while (read(fd, &buf[0], buf.size()) > 0) {}
+
+    md5_byte_t digest[16];
+    md5_finish(&env_state, digest);
+    hash = md5_hex(digest);
+    return true;
+}
+
+/* The child's part of the install of a tarball: the stream on stdin goes
+   through the decompressor FILTER, if there is one, and is extracted on
+   the fly. Corrupt streams fail in the decompressor or the checksums of
+   the tar headers, and an environment named by the hash of its files, as
+   those of icecc-create-env are, must have those files.  */
+int install_from_tar(const string &name, const string &dirname, const string &store,
+                     const char *filter)
+{
+    int in = 0;
+    pid_t filter_pid = 0;
+
+    if (filter) {
+        int fds[2];
+
+        if (pipe(fds)) {
+            return 1;
+        }
+
+        filter_pid = fork();
+
+        if (filter_pid == 0) {
+            dup2(fds[1], 1);
+            close(fds[0]);
+            close(fds[1]);
+            execlp(filter, filter, "-dc", (char *) NULL);
+            _exit(127);
+        }
+
+        close(fds[1]);
+        close(0);
+
+        if (filter_pid < 0) {
+            close(fds[0]);
+            return 1;
+        }
+
+        in = fds[0];
+    }
+
+    string hash;
+    bool plain;
+    bool ok = extract_env_tar(in, dirname, store, hash, plain);
+    close(in);
+
+    if (filter_pid > 0) {
+        int status = 1;
+
+        while (waitpid(filter_pid, &status, 0) < 0 && errno == EINTR) {}
+
+        if (shell_exit_status(status) != 0) {
+            log_error() << filter << " failed on environment " << name << endl;
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        return 1;
+    }
+
+    bool hashed = name.size() > 36 && name.compare(32, 4, ".tar") == 0
+                  && name.find_first_not_of("0123456789abcdef") == 32;
+
+    if (hashed && plain && name.compare(0, 32, hash) != 0) {
+        log_error() << "environment " << name << " has the files of " << hash << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+static bool valid_env_name(const string &name)
+{
+    if (!name.size()) {
+        log_error() << "illegal name for environment " << name << endl;
+        return false;
+    }
+
+    for (string::size_type i = 0; i < name.size(); ++i) {
+        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
+            continue;
+        }
+
+        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Creates the directory of the environment TARGET/NAME, and the store,
+   for the user that installs it.  */
+static bool make_install_dirs(const string &basename, const string &target, const string &name,
+                              uid_t user_uid, gid_t user_gid, string &dirname)
+{
+    dirname = basename + "/target=" + target;
+
+    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
+        log_perror("mkdir target");
+        return false;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod target");
+        return false;
+    }
+
+    string store = store_dir(basename);
+
+    if ((mkdir(store.c_str(), 0770) && errno != EEXIST)
+            || chown(store.c_str(), user_uid, user_gid) || chmod(store.c_str(), 0770)) {
+        log_perror("mkdir,chown,chmod store");
+        return false;
+    }
+
+    dirname = dirname + "/" + name;
+
+    if (mkdir(dirname.c_str(), 0770)) {
+        log_perror("mkdir name");
+        return false;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod name");
+        return false;
+    }
+
+    return true;
+}
+
+// the install child runs as the user, it exits if it can't
+static void become_user(uid_t user_uid, gid_t user_gid)
+{
+#ifndef HAVE_LIBCAP_NG
+
+    if (setgroups(0, NULL) < 0) {
+        log_perror("setgroups fails");
+        _exit(143);
+    }
+
+    if (setgid(user_gid) < 0) {
+        log_perror("setgid fails");
+        _exit(143);
+    }
+
+    if (!geteuid() && setuid(user_uid) < 0) {
+        log_perror("setuid fails");
+        _exit(142);
+    }
+
+#else
+    (void) user_uid;
+    (void) user_gid;
+#endif
+}
+
+/* Takes the files of MMSG, which is deleted, if all of their paths are
+   within the environment NAME.  */
+static bool take_manifest(EnvManifestMsg *mmsg, const string &name, vector<string> &files,
+                          vector<uint32_t> &modes, vector<ChunkRef> &refs)
+{
+    files.assign(mmsg->files.begin(), mmsg->files.end());
+    modes.swap(mmsg->modes);
+    refs.swap(mmsg->refs);
+    delete mmsg;
+
+    if (files.size() != modes.size() || files.size() != refs.size()) {
+        log_error() << "protocol error while reading environment manifest" << endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!valid_manifest_path(files[i])) {
+            log_error() << "illegal path " << files[i] << " - rejecting environment "
+                        << name << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* The files of a manifest that are in the store are not sent again, and
+   of those that are in it more than once, only the first one. MISSING
+   are the indexes of those that are sent.  */
+static void plan_manifest(const string &store, const vector<uint32_t> &modes,
+                          const vector<ChunkRef> &refs, vector<char> &state,
+                          vector<uint32_t> &missing)
+{
+    set<string> requested;
+    state.assign(refs.size(), InStore);
+
+    for (size_t i = 0; i < refs.size(); ++i) {
+        string stored = store_name(store, md5_hex(refs[i].digest), modes[i]);
+        struct stat st;
+
+        if (lstat(stored.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+                && st.st_size == (off_t) refs[i].len) {
+            continue;
+        }
+
+        if (requested.insert(stored).second) {
+            state[i] = FromClient;
+            missing.push_back(i);
+        }
+    }
+}
+
+/* The install child is done. The exit code goes through DONE_PIPE too, as
+   the daemon may reap the child before it gets to the result.  */
+static int install_done(int done_pipe, int exit_code)
+{
+    unsigned char code = exit_code;
+    ignore_result(write(done_pipe, &code, 1));
+    return exit_code;
+}
+
+pid_t start_install_environment(const std::string &basename, const std::string &target,
+                                const std::string &name, MsgChannel *c,
+                                int &pipe_to_stdin, int &pipe_from_child, int &done_pipe,
+                                FileChunkMsg *&fmsg, uid_t user_uid, gid_t user_gid)
+{
+    pipe_from_child = -1;
+    done_pipe = -1;
+
+    if (!valid_env_name(name)) {
+        return 0;
+    }
+
+    Msg *msg = c->get_msg(30);
+    vector<string> files;
+    vector<uint32_t> modes;
+    vector<ChunkRef> refs;
+    list<string> peers;
+    bool manifest = msg && msg->type == M_ENV_MANIFEST;
+
+    if (manifest) {
+        EnvManifestMsg *mmsg = static_cast<EnvManifestMsg*>(msg);
+        peers.swap(mmsg->peers);
+
+        if (!take_manifest(mmsg, name, files, modes, refs)) {
+            return 0;
+        }
+    } else if (!msg || msg->type != M_FILE_CHUNK) {
+        trace() << "Expected first file chunk\n";
+        delete msg;
+        return 0;
+    } else {
+        fmsg = dynamic_cast<FileChunkMsg*>(msg);
+    }
+
+    const char *filter = NULL;
+
+    if (fmsg && fmsg->len > 5) {
+        const unsigned char *magic = fmsg->buffer;
+
+        if (magic[0] == 037 && magic[1] == 0213) {
+            filter = "gzip";
+        } else if (magic[0] == 'B' && magic[1] == 'Z') {
+            filter = "bzip2";
+        } else if (!memcmp(magic, "\xfd" "7zXZ", 6)) {
+            filter = "xz";
+        } else if (!memcmp(magic, "\x28\xb5\x2f\xfd", 4)) {
+            filter = "zstd";
+        }
+    }
+
+    string dirname;
+    string store = store_dir(basename);
+
+    if (!make_install_dirs(basename, target, name, user_uid, user_gid, dirname)) {
+        return 0;
+    }
+
+    vector<char> state;
+    int result_fds[2] = { -1, -1 };
+
+    if (manifest) {
+        ChunkRequestMsg request;
+        plan_manifest(store, modes, refs, state, request.missing);
+        trace() << "environment " << name << ": " << request.missing.size() << " of "
+                << files.size() << " files missing" << endl;
+
+        /* The child tries the peers first, the client is told what is
+           left when it's done with them.  */
+        if (!peers.empty() && !request.missing.empty()) {
+            if (pipe(result_fds)) {
+                return 0;
+            }
+        } else if (!c->send_msg(request)) {
+            return 0;
+        }
+    }
+
+    int fds[2] = { -1, -1 };
+    int done_fds[2] = { -1, -1 };
+
+    if (pipe(fds) || pipe(done_fds)) {
+        if (result_fds[0] >= 0) {
+            close(result_fds[0]);
+            close(result_fds[1]);
+        }
+
+        if (done_fds[0] >= 0) {
+            close(done_fds[0]);
+            close(done_fds[1]);
+        } else if (fds[0] >= 0) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid) {
+        trace() << "pid " << pid << endl;
+        close(fds[0]);
+        pipe_to_stdin = fds[1];
+        close(done_fds[1]);
+
+        if (pid > 0) {
+            done_pipe = done_fds[0];
+        } else {
+            close(done_fds[0]);
+        }
+
+        if (result_fds[0] >= 0) {
+            close(result_fds[1]);
+
+            if (pid > 0) {
+                pipe_from_child = result_fds[0];
+            } else {
+                close(result_fds[0]);
+            }
+        }
+
+        return pid;
+    }
+
+    // else
+    become_user(user_uid, user_gid);
+
+    // reset SIGPIPE and SIGCHILD handler so that tar
+    // isn't confused when gzip/bzip2 aborts
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    close(0);
+    close(fds[1]);
+    dup2(fds[0], 0);
+    close(fds[0]);
+    close(done_fds[0]);
+
+    if (manifest) {
+        if (result_fds[0] >= 0) {
+            close(result_fds[0]);
+        }
+
+        _exit(install_done(done_fds[1], install_from_manifest(dirname, store, files, modes,
+                                                              refs, state, peers,
+                                                              result_fds[1])));
+    }
+
+    _exit(install_done(done_fds[1], install_from_tar(name, dirname, store, filter)));
+}
+
+
+size_t finish_install_environment(int done_pipe, const std::string &basename,
+                                  const std::string &target, pid_t pid,
+                                  uid_t user_uid, gid_t user_gid)
+{
+    unsigned char exit_code = 1;
+
+    // EOF if the child didn't get to the end
+    if (done_pipe < 0 || read(done_pipe, &exit_code, 1) != 1) {
+        exit_code = 1;
+    }
+
+    if (done_pipe >= 0) {
+        close(done_pipe);
+    }
+
+    // the main loop may have reaped it already
+    if (pid > 0) {
+        waitpid(pid, NULL, WNOHANG);
+    }
+
+    if (exit_code != 0) {
+        log_error() << "exit code: " << (int) exit_code << endl;
+        remove_environment(basename, target);
+        return 0;
+    }
+
+    string dirname = basename + "/target=" + target;
+
+    errno = 0;
+    mkdir((dirname + "/tmp").c_str(), 01775);
+    ignore_result(chown((dirname + "/tmp").c_str(), user_uid, user_gid));
+    chmod((dirname + "/tmp").c_str(), 01775);
+    if (errno == -1) {
+        log_error() << "failed to setup " << dirname << "/tmp :"
+                    << strerror(errno) << endl;
+    }
+
+    return sumup_dir(dirname);
+}
+
+/* The prestage child: the manifest comes from the first of PEERS that has
+   the environment, and then the files from all of them.  */
+static int prestage_from_peers(const string &dirname, const string &store, const string &target,
+                               const string &name, const list<string> &peers)
+{
+    EnvManifestMsg *mmsg = 0;
+
+    for (list<string>::const_iterator it = peers.begin(); it != peers.end() && !mmsg; ++it) {
+        string::size_type colon = it->rfind(':');
+        unsigned short port = colon == string::npos ? 0 : atoi(it->c_str() + colon + 1);
+        MsgChannel *peer = port ? Service::createChannel(it->substr(0, colon), port, 10) : 0;
+
+        if (!peer) {
+            continue;
+        }
+
+        GetEnvManifestMsg request;
+        request.target = target;
+        request.name = name;
+        Msg *msg = peer->send_msg(request) ? peer->get_msg(60) : 0;
+
+        if (msg && msg->type == M_ENV_MANIFEST) {
+            mmsg = static_cast<EnvManifestMsg*>(msg);
+        } else {
+            delete msg;
+        }
+
+        delete peer;
+    }
+
+    vector<string> files;
+    vector<uint32_t> modes;
+    vector<ChunkRef> refs;
+
+    if (!mmsg || !take_manifest(mmsg, name, files, modes, refs)) {
+        log_error() << "no peer sent the files of " << target << "/" << name << endl;
+        return 1;
+    }
+
+    vector<char> state;
+    vector<uint32_t> missing;
+    plan_manifest(store, modes, refs, state, missing);
+    trace() << "prestaging " << target << "/" << name << ": " << missing.size() << " of "
+            << files.size() << " files missing" << endl;
+
+    // there is no client to send what the peers don't
+    int null_fd = open("/dev/null", O_RDONLY);
+
+    if (null_fd < 0 || dup2(null_fd, 0) < 0) {
+        return 1;
+    }
+
+    close(null_fd);
+    return install_from_manifest(dirname, store, files, modes, refs, state, peers, -1);
+}
+
+pid_t start_prestage_environment(const std::string &basename, const std::string &target,
+                                 const std::string &name, const std::list<std::string> &peers,
+                                 int &done_pipe, uid_t user_uid, gid_t user_gid)
+{
+    string dirname;
+
+    if (!valid_env_name(name) || target.empty() || target.find('/') != string::npos
+            || peers.empty()
+            || !make_install_dirs(basename, target, name, user_uid, user_gid, dirname)) {
+        return 0;
+    }
+
+    int fds[2];
+
+    if (pipe(fds)) {
+        remove_environment(basename, target + "/" + name);
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid) {
+        close(fds[1]);
+
+        if (pid < 0) {
+            close(fds[0]);
+            remove_environment(basename, target + "/" + name);
+            return 0;
+        }
+
+        done_pipe = fds[0];
+        return pid;
+    }
+
+    close(fds[0]);
+    become_user(user_uid, user_gid);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    _exit(install_done(fds[1], prestage_from_peers(dirname, store_dir(basename), target, name,
+                                                   peers)));
+}
+
+/* The manifest of an installed environment: the files are links to the
+   store, whose names have their md5 sums.  */
+static bool env_manifest_from_dir(const string &dir, const string &prefix,
+                                  const map<ino_t, string> &stored, EnvManifestMsg &manifest)
+{
+    DIR *envdir = opendir(dir.c_str());
+
+    if (!envdir) {
+        return false;
+    }
+
+    bool ok = true;
+
+    for (struct dirent *ent = readdir(envdir); ok && ent; ent = readdir(envdir)) {
+        string name = ent->d_name;
+
+        // the jobs' tmp is not part of the environment
+        if (name == "." || name == ".." || (prefix.empty() && name == "tmp")) {
+            continue;
+        }
+
+        string path = dir + "/" + name;
+        struct stat st;
+
+        if (lstat(path.c_str(), &st)) {
+            ok = false;
+        } else if (S_ISDIR(st.st_mode)) {
+            ok = env_manifest_from_dir(path, prefix + name + "/", stored, manifest);
+        } else if (!S_ISREG(st.st_mode) || st.st_size > 0xffffffffLL) {
+            ok = false;
+        } else {
+            map<ino_t, string>::const_iterator it = stored.find(st.st_ino);
+            string hex;
+
+            if (it != stored.end()) {
+                hex = it->second;
+            } else if (!hash_file(path, hex)) {
+                ok = false;
+                break;
+            }
+
+            ChunkRef ref;
+
+            for (int i = 0; i < 16; ++i) {
+                ref.digest[i] = strtoul(hex.substr(2 * i, 2).c_str(), NULL, 16);
+            }
+
+            ref.len = st.st_size;
+            manifest.files.push_back(prefix + name);
+            manifest.modes.push_back(st.st_mode & 07777);
+            manifest.refs.push_back(ref);
+        }
+    }
+
+    closedir(envdir);
+    return ok;
+}
+
+void serve_env_manifest(const string &basename, MsgChannel *c, const GetEnvManifestMsg *gmsg)
+{
+    string store = store_dir(basename);
+    map<ino_t, string> stored;
+    DIR *dir = opendir(store.c_str());
+
+    for (struct dirent *ent = dir ? readdir(dir) : 0; ent; ent = readdir(dir)) {
+        struct stat st;
+
+        if (strlen(ent->d_name) > 32 && ent->d_name[32] == '-'
+                && lstat((store + "/" + ent->d_name).c_str(), &st) == 0) {
+            stored[st.st_ino] = string(ent->d_name, 32);
+        }
+    }
+
+    if (dir) {
+        closedir(dir);
+    }
+
+    EnvManifestMsg manifest;
+    string envdir = basename + "/target=" + gmsg->target + "/" + gmsg->name;
+
+    if (gmsg->target.find('/') == string::npos && valid_env_name(gmsg->name)
+            && env_manifest_from_dir(envdir, "", stored, manifest)
+            && manifest.refs.size() <= MAX_CHUNK_REFS) {
+        c->send_msg(manifest);
+    } else {
+        c->send_msg(EndMsg());
+    }
 }
 
 size_t remove_environment(const string &basename, const string &env)
@@ -609,6 +1831,7 @@ size_t remove_environment(const string &basename, const string &env)
         while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
 
         if (WIFEXITED(status)) {
+            prune_store(basename);
             return res;
         }
 
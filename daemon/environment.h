@@ -41,14 +41,35 @@ extern pid_t start_install_environment(const std::string &basename,
                                        const std::string &target,
                                        const std::string &name,
                                        MsgChannel *c, int& pipe_to_child,
-                                       FileChunkMsg*& fmsg,
-                                       uid_t user_uid, gid_t user_gid);
-extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
-        pid_t pid, uid_t user_uid, gid_t user_gid);
+                                       int& pipe_from_child, int& done_pipe,
+                                       FileChunkMsg*& fmsg, uid_t user_uid, gid_t user_gid);
+// Reads the exit code of the install child PID from DONE_PIPE, and returns
+// the size of the environment TARGET/NAME, or 0 if the install failed and
+// it is removed again.
+extern size_t finish_install_environment(int done_pipe, const std::string &basename,
+                                         const std::string &target, pid_t pid,
+                                         uid_t user_uid, gid_t user_gid);
+// Installs TARGET/NAME in the background from PEERS, that have it. The
+// child reports on DONE_PIPE like the one of start_install_environment.
+extern pid_t start_prestage_environment(const std::string &basename, const std::string &target,
+                                        const std::string &name,
+                                        const std::list<std::string> &peers,
+                                        int &done_pipe, uid_t user_uid, gid_t user_gid);
 extern size_t remove_environment(const std::string &basedir, const std::string &env);
 extern size_t remove_native_environment(const std::string &env);
 extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
+extern void serve_env_files(const std::string &basename, MsgChannel *c,
+                            const GetEnvFilesMsg *gmsg);
+extern void serve_env_manifest(const std::string &basename, MsgChannel *c,
+                               const GetEnvManifestMsg *gmsg);
 extern bool verify_env(MsgChannel *c, const std::string &basedir, const std::string &target,
                        const std::string &env, uid_t user_uid, gid_t user_gid);
 
+// The child's part of an install from a tarball on stdin, and the tar
+// extraction it does, exposed for the tests.
+extern int install_from_tar(const std::string &name, const std::string &dirname,
+                            const std::string &store, const char *filter);
+extern bool extract_env_tar(int fd, const std::string &dirname, const std::string &store,
+                            std::string &hash, bool &plain);
+
 #endif
@@ -48,6 +48,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/ioctl.h>
 #include <pwd.h>
 
 #include <netinet/in.h>
@@ -99,6 +100,9 @@
 #include <comm.h>
 #include "load.h"
 #include "environment.h"
+#include "connections.h"
+#include "objcache.h"
+#include "envcache.h"
 #include "platform.h"
 #include "util.h"
 
@@ -122,6 +126,7 @@ public:
      * LINKJOB: This is a local job (aka link job) by a local client we told the scheduler about
      *          and await the finish of it
      * TOINSTALL: We're receiving an environment transfer and wait for it to complete.
+     * WAITINSTALL: The environment is transferred, the child still installs it.
      * TOCOMPILE: We're supposed to compile it ourselves
      * WAITFORCS: Client asked for a CS and we asked the scheduler - waiting for its answer
      * WAITCOMPILE: Client got a CS and will ask him now (it's not me)
@@ -130,8 +135,8 @@ public:
      * WAITCREATEENV: We're waiting for icecc-create-env to finish.
      */
     enum Status { UNKNOWN, GOTNATIVE, PENDING_USE_CS, JOBDONE, LINKJOB, TOINSTALL, TOCOMPILE,
-                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV,
-                  LASTSTATE = WAITCREATEENV
+                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV, WAITINSTALL,
+                  LASTSTATE = WAITINSTALL
                 } status;
     Client() {
         job_id = 0;
@@ -141,7 +146,13 @@ public:
         client_id = 0;
         status = UNKNOWN;
         pipe_to_child = -1;
+        pipe_from_child = -1;
+        done_pipe = -1;
         child_pid = -1;
+        input_inline = false;
+        inline_compressed = 0;
+        pump = false;
+        batch_more = false;
     }
 
     static string status_str(Status status) {
@@ -170,6 +181,8 @@ public:
             return "waitforchild";
         case WAITCREATEENV:
             return "waitcreateenv";
+        case WAITINSTALL:
+            return "waitinstall";
         }
 
         assert(false);
@@ -189,6 +202,13 @@ public:
             close(pipe_to_child);
         }
 
+        if (pipe_from_child >= 0) {
+            close(pipe_from_child);
+        }
+
+        if (done_pipe >= 0) {
+            close(done_pipe);
+        }
     }
     uint32_t job_id;
     string outfile; // only useful for LINKJOB or TOINSTALL
@@ -197,8 +217,16 @@ public:
     CompileJob *job;
     int client_id;
     int pipe_to_child; // pipe to child process, only valid if WAITFORCHILD or TOINSTALL
+    int pipe_from_child; // TOINSTALL only, while the child gets files from peers
+    int done_pipe; // TOINSTALL and WAITINSTALL, the install child's exit code comes on it
     pid_t child_pid;
     string pending_create_env; // only for WAITCREATEENV
+    string held_env; // the environment the client holds in the cache until it ends
+    bool input_inline; // the preprocessed input came with the job
+    string inline_input;
+    size_t inline_compressed; // the size of the input on the wire
+    bool pump; // the source and headers follow the job
+    bool batch_more; // more jobs follow on the connection
 
     string dump() const {
         string ret = status_str(status) + " " + channel->dump();
@@ -207,6 +235,7 @@ public:
         case LINKJOB:
             return ret + " CID: " + toString(client_id) + " " + outfile;
         case TOINSTALL:
+        case WAITINSTALL:
             return ret + " " + toString(client_id) + " " + outfile;
         case WAITFORCHILD:
             return ret + " CID: " + toString(client_id) + " PID: " + toString(child_pid) + " PFD: " + toString(pipe_to_child);
@@ -403,7 +432,10 @@ void usage(const char *reason = 0)
     }
 
     cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-w] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]" << endl;
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]"
+        " [--compression <codec[:level]>] [--zstd-dictionaries <dir>]"
+        " [--object-cache <MB>] [--object-cache-dir <dir>]"
+        " [--chunk-cache <MB>] [--chunk-cache-dir <dir>] [--jobserver <fifo>]" << endl;
     exit(1);
 }
 
@@ -412,6 +444,18 @@ int mem_limit = 100;
 unsigned int max_kids = 0;
 
 size_t cache_size_limit = 100 * 1024 * 1024;
+// compile results are only cached if this is set
+size_t object_cache_limit = 0;
+// chunks of preprocessed input are only kept if this is set
+size_t chunk_cache_limit = 0;
+
+// how old the scheduler's numbers of free job slots may get, in seconds
+#define CAPACITY_MAX_AGE 2
+// jobserver tokens that aren't back once the local clients were idle
+// this long, in seconds, are lost
+#define JOBSERVER_RESET 60
+// how many compile servers may get environment files from us at a time
+#define MAX_ENV_SERVERS 4
 
 struct NativeEnvironment {
     string name; // the hash
@@ -424,9 +468,21 @@ struct NativeEnvironment {
     int create_env_pipe; // if in progress of creating the environment
 };
 
-struct Daemon {
+// an environment that is installed without a client waiting for it: one the
+// scheduler had us get from other daemons ahead of time, or one whose client
+// went away after sending it
+struct BackgroundInstall {
+    string env; // target/name
+    pid_t pid;
+};
+
+struct Daemon : public EnvCache::Remover {
     Clients clients;
-    map<string, time_t> envs_last_use;
+    EnvCache envcache;
+    // Environments that were verified to run on this host, that doesn't
+    // change when they are removed and installed again. Failures are not
+    // kept, the client has the scheduler blacklist us for them.
+    set<string> envs_verified;
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
@@ -442,8 +498,12 @@ struct Daemon {
     string nodename;
     bool noremote;
     bool custom_nodename;
-    size_t cache_size;
     map<int, MsgChannel *> fd2chan;
+    ConnectionPool connections;
+    ObjectCache objcache;
+    string objcachedir;
+    ObjectCache chunkcache;
+    string chunkcachedir;
     int new_client_id;
     string remote_name;
     time_t next_scheduler_connect;
@@ -462,6 +522,26 @@ struct Daemon {
     int max_scheduler_ping;
     unsigned int current_kids;
 
+    // what the scheduler said about the free job slots last, and when
+    CapacityMsg capacity;
+    time_t capacity_time;
+    bool capacity_asked;
+    // the clients that wait for the scheduler's numbers
+    list<int> capacity_waiters;
+
+    // the GNU make jobserver fifo that we keep filled with tokens
+    string jobserver_path;
+    int jobserver_fd;
+    unsigned int jobserver_tokens;
+    time_t jobserver_busy_time;
+
+    // the children that send environment files to other compile servers
+    set<pid_t> env_servers;
+
+    // the environments installed in the background, by the pipe their child
+    // reports on
+    map<int, BackgroundInstall> background_installs;
+
     Daemon() {
         warn_icecc_user_errno = 0;
         if (getuid() == 0) {
@@ -481,11 +561,12 @@ struct Daemon {
         }
 
         envbasedir = "/tmp/icecc-envs";
+        objcachedir = "/tmp/icecc-objects";
+        chunkcachedir = "/tmp/icecc-chunks";
         tcp_listen_fd = -1;
         unix_listen_fd = -1;
         new_client_id = 0;
         next_scheduler_connect = 0;
-        cache_size = 0;
         noremote = false;
         custom_nodename = false;
         icecream_load = 0;
@@ -499,12 +580,19 @@ struct Daemon {
         max_scheduler_pong = MAX_SCHEDULER_PONG;
         max_scheduler_ping = MAX_SCHEDULER_PING;
         current_kids = 0;
+        capacity_time = 0;
+        capacity_asked = false;
+        jobserver_fd = -1;
+        jobserver_tokens = 0;
+        jobserver_busy_time = 0;
     }
 
     bool reannounce_environments() __attribute_warn_unused_result__;
     int answer_client_requests();
     bool handle_transfer_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_transfer_env_done(Client *client);
+    bool handle_env_peers_done(Client *client);
+    bool handle_get_env_files(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
     void handle_old_request();
@@ -522,6 +610,16 @@ struct Daemon {
     bool handle_verify_env(Client *client, VerifyEnvMsg *msg) __attribute_warn_unused_result__;
     bool handle_blacklist_host_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     int handle_cs_conf(ConfCSMsg *msg);
+    void fill_capacity(CapacityMsg &msg) const;
+    bool ask_capacity() __attribute_warn_unused_result__;
+    bool handle_get_capacity(Client *client) __attribute_warn_unused_result__;
+    int scheduler_capacity(CapacityMsg *msg);
+    int scheduler_prestage_env(PrestageEnvMsg *msg);
+    bool background_install_finished(int pipe) __attribute_warn_unused_result__;
+    void cancel_background_install(const string &env);
+    void answer_capacity_waiters();
+    bool setup_jobserver();
+    void size_jobserver();
     string dump_internals() const;
     string determine_nodename();
     void determine_system();
@@ -532,6 +630,9 @@ struct Daemon {
     int working_loop();
     bool setup_listen_fds();
     void check_cache_size(const string &new_env);
+    virtual size_t remove(const string &env);
+    void hold_environment(Client *client);
+    void hold_environment(Client *client, const string &env);
     bool create_env_finished(string env_key);
 };
 
@@ -580,6 +681,15 @@ bool Daemon::setup_listen_fds()
             return false;
         }
 
+#ifdef TCP_FASTOPEN
+        /* Clients that know our protocol version send it with the SYN.  */
+        int queue_len = 20;
+
+        if (setsockopt(tcp_listen_fd, IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len)) < 0) {
+            trace() << "TCP fast open not available: " << strerror(errno) << endl;
+        }
+#endif
+
         fcntl(tcp_listen_fd, F_SETFD, FD_CLOEXEC);
     }
 
@@ -701,7 +811,29 @@ bool Daemon::reannounce_environments()
 {
     log_error() << "reannounce_environments " << endl;
     LoginMsg lmsg(0, nodename, "");
-    lmsg.envs = available_environmnents(envbasedir);
+    Environments envs = available_environmnents(envbasedir);
+
+    set<string> installing;
+
+    for (map<int, BackgroundInstall>::const_iterator it = background_installs.begin();
+            it != background_installs.end(); ++it) {
+        installing.insert(it->second.env);
+    }
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->status == Client::TOINSTALL
+                || it->second->status == Client::WAITINSTALL) {
+            installing.insert(it->second->outfile);
+        }
+    }
+
+    // the ones that are still installed are not there yet
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        if (!installing.count(it->first + "/" + it->second)) {
+            lmsg.envs.push_back(*it);
+        }
+    }
+
     return send_scheduler(lmsg);
 }
 
@@ -716,6 +848,10 @@ void Daemon::close_scheduler()
     delete discover;
     discover = 0;
     next_scheduler_connect = time(0) + 20 + (rand() & 31);
+
+    // there is no answer coming
+    capacity_asked = false;
+    answer_capacity_waiters();
 }
 
 bool Daemon::maybe_stats(bool send_ping)
@@ -821,9 +957,7 @@ string Daemon::dump_internals() const
         result += "  client " + toString(it->second->client_id) + ": " + it->second->dump() + "\n";
     }
 
-    if (cache_size) {
-        result += "  Cache Size: " + toString(cache_size) + "\n";
-    }
+    result += connections.dump();
 
     result += "  Architecture: " + machine_name + "\n";
 
@@ -833,14 +967,7 @@ string Daemon::dump_internals() const
             + (it->second.create_env_pipe ? " (creating)" : "" ) + "\n";
     }
 
-    if (!envs_last_use.empty()) {
-        result += "  Now: " + toString(time(0)) + "\n";
-    }
-
-    for (map<string, time_t>::const_iterator it = envs_last_use.begin();
-            it != envs_last_use.end(); ++it)  {
-        result += "  envs_last_use[" + it->first  + "] = " + toString(it->second) + "\n";
-    }
+    result += envcache.dump();
 
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
 
@@ -893,7 +1020,28 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
 
-        if (!c->channel->send_msg(*msg)) {
+        /* Hand the client a connection to the compile server that is
+           already set up, if we have one.  */
+        MsgChannel *server = 0;
+        connections.used(msg->hostname, msg->port);
+
+        if (IS_PROTOCOL_37(c->channel) && c->channel->canPassFds()) {
+            server = connections.take(msg->hostname, msg->port);
+        }
+
+        if (server) {
+            msg->connection_protocol = server->protocol;
+            msg->connection_codecs = server->peer_codecs;
+            msg->connection_dictionaries = server->peer_dictionaries;
+            c->channel->attachFd(server->fd);
+        }
+
+        bool sent = c->channel->send_msg(*msg);
+        c->channel->attachFd(-1);
+        // the client has its own copy of the socket now
+        delete server;
+
+        if (!sent) {
             handle_end(c, 143);
             return 0;
         }
@@ -923,21 +1071,29 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
     }
 
     int sock_to_stdin = -1;
+    int sock_from_child = -1;
     FileChunkMsg *fmsg = 0;
 
+    // the client is quicker than a background install of the same environment
+    cancel_background_install(target + "/" + emsg->name);
+
+    int done_pipe = -1;
     pid_t pid = start_install_environment(envbasedir, target, emsg->name, client->channel,
-                                          sock_to_stdin, fmsg, user_uid, user_gid);
+                                          sock_to_stdin, sock_from_child, done_pipe, fmsg,
+                                          user_uid, user_gid);
 
     client->status = Client::TOINSTALL;
-    client->outfile = emsg->target + "/" + emsg->name;
+    client->outfile = target + "/" + emsg->name;
     current_kids++;
 
     if (pid > 0) {
         log_error() << "got pid " << pid << endl;
         client->pipe_to_child = sock_to_stdin;
+        client->pipe_from_child = sock_from_child;
+        client->done_pipe = done_pipe;
         client->child_pid = pid;
 
-        if (!handle_file_chunk_env(client, fmsg)) {
+        if (fmsg && !handle_file_chunk_env(client, fmsg)) {
             pid = 0;
         }
     }
@@ -950,22 +1106,107 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
     return pid > 0;
 }
 
+/* The install child got what it could from the peers, and tells which
+   files the client has to send itself. False if the client is gone.  */
+bool Daemon::handle_env_peers_done(Client *client)
+{
+    ChunkRequestMsg request;
+    uint32_t count = 0;
+    bool ok = read(client->pipe_from_child, &count, sizeof(count)) == sizeof(count)
+              && count <= MAX_CHUNK_REFS;
+
+    if (ok && count) {
+        request.missing.resize(count);
+        size_t len = count * sizeof(uint32_t);
+        char *buf = reinterpret_cast<char *>(&request.missing[0]);
+
+        while (ok && len) {
+            ssize_t n = read(client->pipe_from_child, buf, len);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            ok = n > 0;
+            buf += ok ? n : 0;
+            len -= ok ? n : 0;
+        }
+    }
+
+    close(client->pipe_from_child);
+    client->pipe_from_child = -1;
+
+    if (!ok || !client->channel->send_msg(request)) {
+        handle_end(client, 140);
+        return false;
+    }
+
+    return true;
+}
+
+/* Another compile server installs an environment we have files of, or
+   wants to know which files one of ours has. A child answers, the
+   connection is its then.  */
+bool Daemon::handle_get_env_files(Client *client, Msg *msg)
+{
+    for (set<pid_t>::iterator it = env_servers.begin(); it != env_servers.end();) {
+        if (kill(*it, 0) != 0 && errno == ESRCH) {
+            env_servers.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    if (env_servers.size() >= MAX_ENV_SERVERS) {
+        trace() << "too busy to send environment files to " << client->channel->name << endl;
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 141);
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (msg->type == M_GET_ENV_MANIFEST) {
+            serve_env_manifest(envbasedir, client->channel,
+                               static_cast<GetEnvManifestMsg *>(msg));
+        } else {
+            serve_env_files(envbasedir, client->channel, static_cast<GetEnvFilesMsg *>(msg));
+        }
+
+        _exit(0);
+    }
+
+    if (pid > 0) {
+        env_servers.insert(pid);
+    }
+
+    handle_end(client, 141);
+    return false;
+}
+
 bool Daemon::handle_transfer_env_done(Client *client)
 {
     log_error() << "handle_transfer_env_done" << endl;
 
     assert(client->outfile.size());
-    assert(client->status == Client::TOINSTALL);
-
-    size_t installed_size = finalize_install_environment(envbasedir, client->outfile,
-                            client->child_pid, user_uid, user_gid);
+    assert(client->status == Client::TOINSTALL || client->status == Client::WAITINSTALL);
 
+    // the transfer broke off, the install can't complete
     if (client->pipe_to_child >= 0) {
-        installed_size = 0;
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
+
+        if (client->child_pid > 0) {
+            kill(client->child_pid, SIGTERM);
+        }
     }
 
+    size_t installed_size = finish_install_environment(client->done_pipe, envbasedir,
+                            client->outfile, client->child_pid, user_uid, user_gid);
+    client->done_pipe = -1;
+
     client->status = Client::UNKNOWN;
     string current = client->outfile;
     client->outfile.clear();
@@ -976,10 +1217,11 @@ bool Daemon::handle_transfer_env_done(Client *client)
     log_error() << "installed_size: " << installed_size << endl;
 
     if (installed_size) {
-        cache_size += installed_size;
-        envs_last_use[current] = time(NULL);
+        envcache.add(current, installed_size);
         log_error() << "installed " << current << " size: " << installed_size
-                    << " all: " << cache_size << endl;
+                    << " all: " << envcache.size() << endl;
+        // until its compile file comes, others' installs mustn't remove it
+        hold_environment(client, current);
     }
 
     check_cache_size(current);
@@ -994,85 +1236,128 @@ bool Daemon::handle_transfer_env_done(Client *client)
     return r;
 }
 
-void Daemon::check_cache_size(const string &new_env)
+/* The scheduler found us idle, and has us get a popular environment
+   from the daemons that have it, so that we can take its jobs without
+   an install first. Nothing if we are short of cache space for it.  */
+int Daemon::scheduler_prestage_env(PrestageEnvMsg *msg)
 {
-    time_t now = time(NULL);
-
-    while (cache_size > cache_size_limit) {
-        string oldest;
-        // I don't dare to use (time_t)-1
-        time_t oldest_time = time(NULL) + 90000;
-        string oldest_native_env_key;
-
-        for (map<string, time_t>::const_iterator it = envs_last_use.begin();
-                it != envs_last_use.end(); ++it) {
-            trace() << "das ist jetzt so: " << it->first << " " << it->second << " " << oldest_time << endl;
-            // ignore recently used envs (they might be in use _right_ now)
-            int keep_timeout = 200;
-            string native_env_key;
-
-            // If it is a native environment, allow removing it only after a longer period,
-            // unless there are many native environments.
-            for (map<string, NativeEnvironment>::const_iterator it2 = native_environments.begin();
-                    it2 != native_environments.end(); ++it2) {
-                if (it2->second.name == it->first) {
-                    native_env_key = it2->first;
-
-                    if (native_environments.size() < 5) {
-                        keep_timeout = 24 * 60 * 60;    // 1 day
-                    }
+    string env = msg->target + "/" + msg->name;
+    struct stat st;
 
-                    if (it2->second.create_env_pipe) {
-                        keep_timeout = 365 * 24 * 60 * 60; // do not remove if it's still being created
-                    }
-                    break;
-                }
-            }
+    if (envcache.size() >= envcache.limit() / 2
+            || stat((envbasedir + "/target=" + env).c_str(), &st) == 0) {
+        trace() << "not prestaging " << env << endl;
+        return 0;
+    }
 
-            if (it->second < oldest_time && now - it->second > keep_timeout) {
-                bool env_currently_in_use = false;
+    for (map<int, BackgroundInstall>::const_iterator it = background_installs.begin();
+            it != background_installs.end(); ++it) {
+        if (it->second.env == env) {
+            return 0;
+        }
+    }
 
-                for (Clients::const_iterator it2 = clients.begin(); it2 != clients.end(); ++it2)  {
-                    if (it2->second->status == Client::TOCOMPILE
-                            || it2->second->status == Client::TOINSTALL
-                            || it2->second->status == Client::WAITFORCHILD) {
+    int done_pipe = -1;
+    pid_t pid = start_prestage_environment(envbasedir, msg->target, msg->name, msg->peers,
+                                           done_pipe, user_uid, user_gid);
 
-                        assert(it2->second->job);
-                        string envforjob = it2->second->job->targetPlatform() + "/"
-                                           + it2->second->job->environmentVersion();
+    if (pid > 0) {
+        trace() << "prestaging " << env << " in " << pid << endl;
+        background_installs[done_pipe].env = env;
+        background_installs[done_pipe].pid = pid;
+    }
 
-                        if (envforjob == it->first) {
-                            env_currently_in_use = true;
-                        }
-                    }
-                }
+    return 0;
+}
 
-                if (!env_currently_in_use) {
-                    oldest_time = it->second;
-                    oldest = it->first;
-                    oldest_native_env_key = native_env_key;
-                }
+bool Daemon::background_install_finished(int pipe)
+{
+    BackgroundInstall install = background_installs[pipe];
+    background_installs.erase(pipe);
+    size_t installed_size = finish_install_environment(pipe, envbasedir, install.env,
+                                                       install.pid, user_uid, user_gid);
+
+    log_info() << "installed " << install.env << " in the background, size: "
+               << installed_size << endl;
+
+    if (!installed_size) {
+        return true;
+    }
+
+    envcache.add(install.env, installed_size);
+    check_cache_size(install.env);
+    return reannounce_environments();
+}
+
+void Daemon::cancel_background_install(const string &env)
+{
+    for (map<int, BackgroundInstall>::iterator it = background_installs.begin();
+            it != background_installs.end(); ++it) {
+        if (env.empty() || it->second.env == env) {
+            kill(it->second.pid, SIGTERM);
+            while (waitpid(it->second.pid, NULL, 0) < 0 && errno == EINTR) {}
+            close(it->first);
+            remove_environment(envbasedir, it->second.env);
+            trace() << "cancelled install of " << it->second.env << endl;
+
+            if (!env.empty()) {
+                background_installs.erase(it);
+                return;
             }
         }
+    }
 
-        if (oldest.empty() || oldest == new_env) {
+    background_installs.clear();
+}
+
+/* Once the environments take more than the cache limit, remove the least
+   recently used ones that no job holds, down to the low watermark. The
+   one just installed stays, and so do the pinned native environments.  */
+void Daemon::check_cache_size(const string &new_env)
+{
+    envcache.evict(new_env, *this);
+}
+
+/* Removes the environment ENV that the cache evicts from the disk.  */
+size_t Daemon::remove(const string &env)
+{
+    size_t removed;
+    string native_env_key;
+
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        if (it->second.name == env) {
+            native_env_key = it->first;
             break;
         }
+    }
 
-        size_t removed;
+    if (!native_env_key.empty()) {
+        removed = remove_native_environment(env);
+        native_environments.erase(native_env_key);
+        trace() << "removing " << env << " " << removed << endl;
+    } else {
+        removed = remove_environment(envbasedir, env);
+        trace() << "removing " << envbasedir << "/" << env << " " << removed << endl;
+    }
 
-        if (!oldest_native_env_key.empty()) {
-            removed = remove_native_environment(oldest);
-            native_environments.erase(oldest_native_env_key);
-            trace() << "removing " << oldest << " " << oldest_time << " " << removed << endl;
-        } else {
-            removed = remove_environment(envbasedir, oldest);
-            trace() << "removing " << envbasedir << "/" << oldest << " " << oldest_time
-                    << " " << removed << endl;
-        }
+    return removed;
+}
+
+/* The job of CLIENT keeps its environment in the cache until it ends.  */
+void Daemon::hold_environment(Client *client)
+{
+    hold_environment(client, client->job->targetPlatform() + "/" + client->job->environmentVersion());
+}
 
-        cache_size -= min(removed, cache_size);
-        envs_last_use.erase(oldest);
+/* CLIENT keeps ENV in the cache until it ends, it holds one at most.  */
+void Daemon::hold_environment(Client *client, const string &env)
+{
+    if (client->held_env.empty() && envcache.contains(env)) {
+        envcache.acquire(env);
+        client->held_env = env;
+    } else {
+        envcache.touch(env);
     }
 }
 
@@ -1105,8 +1390,7 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
                 || env.extrafilestimes != extrafilestimes
                 || access(env.name.c_str(), R_OK) != 0) {
             trace() << "native_env needs rebuild" << endl;
-            cache_size -= remove_native_environment(env.name);
-            envs_last_use.erase(env.name);
+            envcache.remove(env.name, remove_native_environment(env.name));
             if (env.create_env_pipe) {
                 close(env.create_env_pipe);
                 // TODO kill the still running icecc-create-env process?
@@ -1147,7 +1431,8 @@ bool Daemon::finish_get_native_env(Client *client, string env_key)
         return false;
     }
 
-    envs_last_use[native_environments[env_key].name] = time(NULL);
+    // the client reads the tarball after this, it must not go before
+    hold_environment(client, native_environments[env_key].name);
     client->status = Client::GOTNATIVE;
     client->pending_create_env.clear();
     return true;
@@ -1163,10 +1448,6 @@ bool Daemon::create_env_finished(string env_key)
     size_t installed_size = finish_create_env(env.create_env_pipe, envbasedir, env.name);
     env.create_env_pipe = 0;
 
-    // we only clean out cache on next target install
-    cache_size += installed_size;
-    trace() << "cache_size = " << cache_size << endl;
-
     if (!installed_size) {
         for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it)  {
             if (it->second->pending_create_env == env_key) {
@@ -1178,7 +1459,9 @@ bool Daemon::create_env_finished(string env_key)
     }
 
     save_compiler_timestamps(env.gcc_bin_timestamp, env.gpp_bin_timestamp, env.clang_bin_timestamp);
-    envs_last_use[env.name] = time(NULL);
+    // the plain compiler is what most local builds send, that one stays
+    envcache.add(env.name, installed_size, env_key.find(':') == string::npos);
+    trace() << "cache_size = " << envcache.size() << endl;
     check_cache_size(env.name);
 
     for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
@@ -1266,9 +1549,11 @@ void Daemon::handle_old_request()
 
             trace() << "requests--" << job->jobID() << endl;
 
-            string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
-            envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            hold_environment(client);
+            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid,
+                                    client->input_inline ? &client->inline_input : 0,
+                                    client->inline_compressed, objcache.dirFd(),
+                                    chunkcache.dirFd(), client->pump, client->batch_more);
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
@@ -1319,8 +1604,6 @@ bool Daemon::handle_compile_done(Client *client)
 
     close(client->pipe_to_child);
     client->pipe_to_child = -1;
-    string envforjob = client->job->targetPlatform() + "/" + client->job->environmentVersion();
-    envs_last_use[envforjob] = time(NULL);
 
     bool r = send_scheduler(*msg);
     handle_end(client, end_status);
@@ -1330,10 +1613,16 @@ bool Daemon::handle_compile_done(Client *client)
 
 bool Daemon::handle_compile_file(Client *client, Msg *msg)
 {
-    CompileJob *job = dynamic_cast<CompileFileMsg *>(msg)->takeJob();
+    CompileFileMsg *cmsg = dynamic_cast<CompileFileMsg *>(msg);
+    CompileJob *job = cmsg->takeJob();
     assert(client);
     assert(job);
     client->job = job;
+    client->input_inline = cmsg->input_inline;
+    client->inline_input.swap(cmsg->input);
+    client->inline_compressed = cmsg->input_compressed;
+    client->pump = cmsg->pump;
+    client->batch_more = cmsg->batch_more;
 
     if (client->status == Client::CLIENTWORK) {
         assert(job->environmentVersion() == "__client");
@@ -1347,6 +1636,7 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
         // no scheduler is not an error case!
     } else {
         client->status = Client::TOCOMPILE;
+        hold_environment(client);
     }
 
     return true;
@@ -1355,7 +1645,19 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
 bool Daemon::handle_verify_env(Client *client, VerifyEnvMsg *msg)
 {
     assert(msg);
-    bool ok = verify_env(client->channel, envbasedir, msg->target, msg->environment, user_uid, user_gid);
+    string env_key = msg->target + "/" + msg->environment;
+    // it still has to be installed
+    bool ok = envs_verified.count(env_key) != 0
+              && ::access((envbasedir + "/target=" + env_key + "/bin/true").c_str(), X_OK) == 0;
+
+    if (!ok) {
+        ok = verify_env(client->channel, envbasedir, msg->target, msg->environment, user_uid, user_gid);
+
+        if (ok) {
+            envs_verified.insert(env_key);
+        }
+    }
+
     trace() << "Verify environment done, " << (ok ? "success" : "failure") << ", environment " << msg->environment
             << " (" << msg->target << ")" << endl;
     VerifyEnvResultMsg resultmsg(ok);
@@ -1395,6 +1697,28 @@ void Daemon::handle_end(Client *client, int exitcode)
         handle_transfer_env_done(client);
     }
 
+    // the install goes on without the client
+    if (client->status == Client::WAITINSTALL) {
+        if (client->done_pipe >= 0) {
+            background_installs[client->done_pipe].env = client->outfile;
+            background_installs[client->done_pipe].pid = client->child_pid;
+            client->done_pipe = -1;
+        }
+
+        assert(current_kids > 0);
+        current_kids--;
+    }
+
+    if (client->pipe_from_child >= 0) {
+        close(client->pipe_from_child);
+        client->pipe_from_child = -1;
+    }
+
+    if (!client->held_env.empty()) {
+        envcache.release(client->held_env);
+        client->held_env.clear();
+    }
+
     if (client->status == Client::CLIENTWORK) {
         clients.active_processes--;
     }
@@ -1439,6 +1763,7 @@ void Daemon::handle_end(Client *client, int exitcode)
             case Client::WAITFORCHILD:
             case Client::LINKJOB:
             case Client::TOINSTALL:
+            case Client::WAITINSTALL:
             case Client::WAITCREATEENV:
                 assert(false);   // should not have a job_id
                 break;
@@ -1484,6 +1809,8 @@ void Daemon::clear_children()
         current_kids--;
     }
 
+    cancel_background_install(string());
+
     // they should be all in clients too
     assert(fd2chan.empty());
 
@@ -1521,6 +1848,183 @@ int Daemon::handle_cs_conf(ConfCSMsg *msg)
     return 0;
 }
 
+void Daemon::fill_capacity(CapacityMsg &msg) const
+{
+    if (scheduler) {
+        msg.total_remote = capacity.total_remote;
+        msg.free_remote = capacity.free_remote;
+        msg.waiting = capacity.waiting;
+    }
+
+    msg.local_slots = num_cpus;
+    msg.busy = 0;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        switch (it->second->status) {
+        case Client::PENDING_USE_CS:
+        case Client::LINKJOB:
+        case Client::WAITFORCS:
+        case Client::WAITCOMPILE:
+        case Client::CLIENTWORK:
+            msg.busy++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    msg.jobserver = jobserver_fd >= 0 ? jobserver_path : string();
+}
+
+bool Daemon::ask_capacity()
+{
+    if (capacity_asked) {
+        return true;
+    }
+
+    capacity_asked = send_scheduler(GetCapacityMsg());
+    return capacity_asked;
+}
+
+bool Daemon::handle_get_capacity(Client *client)
+{
+    if (scheduler && IS_PROTOCOL_43(scheduler) && time(0) - capacity_time >= CAPACITY_MAX_AGE) {
+        capacity_waiters.push_back(client->client_id);
+        return ask_capacity();
+    }
+
+    CapacityMsg msg;
+    fill_capacity(msg);
+    return client->channel->send_msg(msg);
+}
+
+int Daemon::scheduler_capacity(CapacityMsg *msg)
+{
+    capacity.total_remote = msg->total_remote;
+    capacity.free_remote = msg->free_remote;
+    capacity.waiting = msg->waiting;
+    capacity_time = time(0);
+    capacity_asked = false;
+    answer_capacity_waiters();
+    size_jobserver();
+    return 0;
+}
+
+void Daemon::answer_capacity_waiters()
+{
+    if (capacity_waiters.empty()) {
+        return;
+    }
+
+    CapacityMsg msg;
+    fill_capacity(msg);
+
+    for (list<int>::const_iterator it = capacity_waiters.begin(); it != capacity_waiters.end(); ++it) {
+        // the client may have gone away in the meantime
+        if (Client *client = clients.find_by_client_id(*it)) {
+            client->channel->send_msg(msg);
+        }
+    }
+
+    capacity_waiters.clear();
+}
+
+bool Daemon::setup_jobserver()
+{
+    if (jobserver_path.empty()) {
+        return true;
+    }
+
+    if (mkfifo(jobserver_path.c_str(), 0666) < 0 && errno != EEXIST) {
+        log_perror("mkfifo()");
+        return false;
+    }
+
+    struct stat st;
+
+    if (lstat(jobserver_path.c_str(), &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        log_error() << jobserver_path << " is not a fifo" << endl;
+        return false;
+    }
+
+    // every user's make takes tokens from it
+    chmod(jobserver_path.c_str(), 0666);
+
+    // with both ends open the readers never see the end of the file
+    jobserver_fd = open(jobserver_path.c_str(), O_RDWR | O_NONBLOCK);
+
+    if (jobserver_fd < 0) {
+        log_perror("open jobserver fifo");
+        return false;
+    }
+
+    fcntl(jobserver_fd, F_SETFD, FD_CLOEXEC);
+
+    // the tokens of an earlier run
+    char buf[256];
+
+    while (read(jobserver_fd, buf, sizeof(buf)) > 0) {}
+
+    log_info() << "jobserver on " << jobserver_path << endl;
+    size_jobserver();
+    return true;
+}
+
+/* Puts tokens into the jobserver fifo or takes them out, so that there is
+   one for each job the cluster can take for our clients.  */
+void Daemon::size_jobserver()
+{
+    if (jobserver_fd < 0) {
+        return;
+    }
+
+    CapacityMsg msg;
+    fill_capacity(msg);
+    time_t now = time(0);
+    int queued = 0;
+    bool counted = !ioctl(jobserver_fd, FIONREAD, &queued);
+
+    /* make gives the tokens back when its jobs are done, a killed make
+       doesn't. Those not in the fifo once everything was quiet for a
+       while are lost. Make may hold tokens longer for recipes that don't
+       go through icecc, and those that come back after all are counted
+       again, so that they are taken out if there are too many.  */
+    if (counted && (unsigned int) queued > jobserver_tokens) {
+        trace() << "jobserver got " << queued - jobserver_tokens << " tokens back" << endl;
+        jobserver_tokens = queued;
+    }
+
+    if (msg.busy) {
+        jobserver_busy_time = now;
+    } else if (now - jobserver_busy_time >= JOBSERVER_RESET) {
+        if (counted && (unsigned int) queued < jobserver_tokens) {
+            trace() << "jobserver lost " << jobserver_tokens - queued << " tokens" << endl;
+            jobserver_tokens = queued;
+        }
+
+        jobserver_busy_time = now;
+    }
+
+    // each make runs one job without a token
+    unsigned int target = max(msg.local_slots, msg.busy + msg.free_remote);
+    target = target ? target - 1 : 0;
+
+    if (jobserver_tokens < target) {
+        string tokens(target - jobserver_tokens, '+');
+        ssize_t ret = write(jobserver_fd, tokens.data(), tokens.size());
+
+        if (ret > 0) {
+            jobserver_tokens += ret;
+        }
+    }
+
+    char token;
+
+    while (jobserver_tokens > target && read(jobserver_fd, &token, 1) == 1) {
+        jobserver_tokens--;
+    }
+}
+
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
     client->status = Client::LINKJOB;
@@ -1569,7 +2073,11 @@ bool Daemon::handle_file_chunk_env(Client *client, Msg *msg)
     if (msg->type == M_END) {
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
-        return handle_transfer_env_done(client);
+
+        /* The child extracts on its own, while we go on with other
+           jobs. The client's job waits for the environment.  */
+        client->status = Client::WAITINSTALL;
+        return true;
     }
 
     if (client->pipe_to_child >= 0) {
@@ -1630,6 +2138,13 @@ bool Daemon::handle_activity(Client *client)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case M_GET_CAPACITY:
+        ret = handle_get_capacity(client);
+        break;
+    case M_GET_ENV_FILES:
+    case M_GET_ENV_MANIFEST:
+        ret = handle_get_env_files(client, msg);
+        break;
     default:
         log_error() << "not compile: " << (char)msg->type << "protocol error on client "
                     << client->dump() << endl;
@@ -1668,9 +2183,11 @@ int Daemon::answer_client_requests()
     }
 
     fd_set listen_set;
+    fd_set write_set;
     struct timeval tv;
 
     FD_ZERO(&listen_set);
+    FD_ZERO(&write_set);
     int max_fd = 0;
 
     if (tcp_listen_fd != -1) {
@@ -1695,7 +2212,8 @@ int Daemon::answer_client_requests()
         assert(client);
         int current_status = client->status;
         bool ignore_channel = current_status == Client::TOCOMPILE
-                              || current_status == Client::WAITFORCHILD;
+                              || current_status == Client::WAITFORCHILD
+                              || current_status == Client::WAITINSTALL;
 
         if (!ignore_channel && (!c->has_msg() || handle_activity(client))) {
             if (i > max_fd) {
@@ -1713,6 +2231,22 @@ int Daemon::answer_client_requests()
 
             FD_SET(client->pipe_to_child, &listen_set);
         }
+
+        if (current_status == Client::TOINSTALL && client->pipe_from_child != -1) {
+            if (client->pipe_from_child > max_fd) {
+                max_fd = client->pipe_from_child;
+            }
+
+            FD_SET(client->pipe_from_child, &listen_set);
+        }
+
+        if (current_status == Client::WAITINSTALL && client->done_pipe != -1) {
+            if (client->done_pipe > max_fd) {
+                max_fd = client->done_pipe;
+            }
+
+            FD_SET(client->done_pipe, &listen_set);
+        }
     }
 
     if (scheduler) {
@@ -1741,10 +2275,35 @@ int Daemon::answer_client_requests()
         }
     }
 
+    for (map<int, BackgroundInstall>::const_iterator it = background_installs.begin();
+            it != background_installs.end(); ++it) {
+        FD_SET(it->first, &listen_set);
+
+        if (max_fd < it->first) {
+            max_fd = it->first;
+        }
+    }
+
+    connections.maintain();
+    objcache.maintain();
+    chunkcache.maintain();
+    connections.fill_fd_sets(&listen_set, &write_set, max_fd);
+
     tv.tv_sec = max_scheduler_pong;
     tv.tv_usec = 0;
 
-    int ret = select(max_fd + 1, &listen_set, NULL, NULL, &tv);
+    /* Keep the jobserver in line with the free job slots.  */
+    if (jobserver_fd >= 0) {
+        if (!scheduler || !IS_PROTOCOL_43(scheduler)) {
+            size_jobserver();
+        } else if (time(0) - capacity_time >= CAPACITY_MAX_AGE && !ask_capacity()) {
+            return 1;
+        }
+
+        tv.tv_sec = min(tv.tv_sec, (time_t) CAPACITY_MAX_AGE);
+    }
+
+    int ret = select(max_fd + 1, &listen_set, &write_set, NULL, &tv);
 
     if (ret < 0 && errno != EINTR) {
         log_perror("select");
@@ -1754,6 +2313,8 @@ int Daemon::answer_client_requests()
     if (ret > 0) {
         bool had_scheduler = scheduler;
 
+        connections.handle_fd_sets(&listen_set, &write_set);
+
         if (scheduler && FD_ISSET(scheduler->fd, &listen_set)) {
             while (!scheduler->read_a_bit() || scheduler->has_msg()) {
                 Msg *msg = scheduler->get_msg();
@@ -1784,6 +2345,12 @@ int Daemon::answer_client_requests()
                 case M_CS_CONF:
                     ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
                     break;
+                case M_CAPACITY:
+                    ret = scheduler_capacity(static_cast<CapacityMsg *>(msg));
+                    break;
+                case M_PRESTAGE_ENV:
+                    ret = scheduler_prestage_env(static_cast<PrestageEnvMsg *>(msg));
+                    break;
                 default:
                     log_error() << "unknown scheduler type " << (char)msg->type << endl;
                     ret = 1;
@@ -1842,7 +2409,8 @@ int Daemon::answer_client_requests()
                 }
 
                 if (client->status == Client::TOCOMPILE
-                        || client->status == Client::WAITFORCHILD) {
+                        || client->status == Client::WAITFORCHILD
+                        || client->status == Client::WAITINSTALL) {
                     break;
                 }
             }
@@ -1865,6 +2433,26 @@ int Daemon::answer_client_requests()
                     }
                 }
 
+                if (client->status == Client::TOINSTALL
+                        && client->pipe_from_child >= 0
+                        && FD_ISSET(client->pipe_from_child, &listen_set)) {
+                    max_fd--;
+
+                    if (!handle_env_peers_done(client)) {
+                        continue;
+                    }
+                }
+
+                if (client->status == Client::WAITINSTALL
+                        && client->done_pipe >= 0
+                        && FD_ISSET(client->done_pipe, &listen_set)) {
+                    max_fd--;
+
+                    if (!handle_transfer_env_done(client)) {
+                        return 1;
+                    }
+                }
+
                 if (FD_ISSET(i, &listen_set)) {
                     assert(client->status != Client::TOCOMPILE);
 
@@ -1874,7 +2462,8 @@ int Daemon::answer_client_requests()
                         }
 
                         if (client->status == Client::TOCOMPILE
-                                || client->status == Client::WAITFORCHILD) {
+                                || client->status == Client::WAITFORCHILD
+                                || client->status == Client::WAITINSTALL) {
                             break;
                         }
                     }
@@ -1895,6 +2484,15 @@ int Daemon::answer_client_requests()
                 ++it;
             }
 
+            for (map<int, BackgroundInstall>::iterator it = background_installs.begin();
+                    it != background_installs.end(); ) {
+                int pipe = it->first;
+                ++it;
+
+                if (FD_ISSET(pipe, &listen_set) && !background_install_finished(pipe)) {
+                    return 1;
+                }
+            }
         }
 
         if (had_scheduler && !scheduler) {
@@ -1953,6 +2551,15 @@ bool Daemon::reconnect()
     lmsg.envs = available_environmnents(envbasedir);
     lmsg.max_kids = max_kids;
     lmsg.noremote = noremote;
+
+    if (objcache.enabled()) {
+        lmsg.caches |= DaemonCache_Objects;
+    }
+
+    if (chunkcache.enabled()) {
+        lmsg.caches |= DaemonCache_Chunks;
+    }
+
     return send_scheduler(lmsg);
 }
 
@@ -2002,6 +2609,13 @@ int main(int argc, char **argv)
             { "cache-limit", 1, NULL, 0},
             { "no-remote", 0, NULL, 0},
             { "port", 1, NULL, 'p'},
+            { "compression", 1, NULL, 0},
+            { "zstd-dictionaries", 1, NULL, 0},
+            { "object-cache", 1, NULL, 0},
+            { "object-cache-dir", 1, NULL, 0},
+            { "chunk-cache", 1, NULL, 0},
+            { "chunk-cache-dir", 1, NULL, 0},
+            { "jobserver", 1, NULL, 0},
             { 0, 0, 0, 0 }
         };
 
@@ -2038,13 +2652,55 @@ int main(int argc, char **argv)
                     int mb = atoi(optarg);
 
                     if (!errno) {
-                        cache_size_limit = mb * 1024 * 1024;
+                        cache_size_limit = size_t(mb) * 1024 * 1024;
                     }
                 } else {
                     usage("Error: --cache-limit requires argument");
                 }
             } else if (optname == "no-remote") {
                 d.noremote = true;
+            } else if (optname == "compression") {
+                if (!optarg || !*optarg) {
+                    usage("Error: --compression requires argument");
+                } else if (!set_default_compression(optarg)) {
+                    usage("Error: invalid --compression setting");
+                }
+            } else if (optname == "zstd-dictionaries") {
+                if (optarg && *optarg) {
+                    load_compression_dictionaries(optarg);
+                } else {
+                    usage("Error: --zstd-dictionaries requires argument");
+                }
+            } else if (optname == "object-cache") {
+                if (optarg && *optarg) {
+                    object_cache_limit = size_t(atoi(optarg)) * 1024 * 1024;
+                } else {
+                    usage("Error: --object-cache requires argument");
+                }
+            } else if (optname == "object-cache-dir") {
+                if (optarg && *optarg) {
+                    d.objcachedir = optarg;
+                } else {
+                    usage("Error: --object-cache-dir requires argument");
+                }
+            } else if (optname == "chunk-cache") {
+                if (optarg && *optarg) {
+                    chunk_cache_limit = size_t(atoi(optarg)) * 1024 * 1024;
+                } else {
+                    usage("Error: --chunk-cache requires argument");
+                }
+            } else if (optname == "chunk-cache-dir") {
+                if (optarg && *optarg) {
+                    d.chunkcachedir = optarg;
+                } else {
+                    usage("Error: --chunk-cache-dir requires argument");
+                }
+            } else if (optname == "jobserver") {
+                if (optarg && *optarg) {
+                    d.jobserver_path = optarg;
+                } else {
+                    usage("Error: --jobserver requires argument");
+                }
             }
 
         }
@@ -2280,6 +2936,18 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    d.envcache.setLimit(cache_size_limit);
+
+    if (object_cache_limit && !d.noremote
+            && !d.objcache.init(d.objcachedir, object_cache_limit, d.user_uid, d.user_gid)) {
+        return 1;
+    }
+
+    if (chunk_cache_limit && !d.noremote
+            && !d.chunkcache.init(d.chunkcachedir, chunk_cache_limit, d.user_uid, d.user_gid)) {
+        return 1;
+    }
+
     list<string> nl = get_netnames(200, d.scheduler_port);
     trace() << "Netnames:" << endl;
 
@@ -2291,6 +2959,10 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (!d.setup_jobserver()) {
+        return 1;
+    }
+
     return d.working_loop();
 }
 
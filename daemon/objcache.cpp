@@ -0,0 +1,382 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "objcache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "comm.h"
+#include "job.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+#define OBJCACHE_MAGIC 0x3143494f // "OIC1"
+// results bigger than this are not worth keeping
+#define MAX_ENTRY_SIZE (64 * 1024 * 1024)
+#define MAINTAIN_INTERVAL 60
+// a store that didn't finish in this time won't finish anymore
+#define STALE_TMP_AGE 3600
+
+namespace
+{
+
+struct EntryHeader {
+    uint32_t magic;
+    uint32_t out_len;
+    uint32_t err_len;
+    uint32_t obj_len;
+    uint32_t dwo_len;
+};
+
+struct CachedFile {
+    string name;
+    time_t mtime;
+    size_t size;
+
+    bool operator<(const CachedFile &other) const {
+        return mtime < other.mtime;
+    }
+};
+
+}
+
+static bool read_all(int fd, string &data, size_t size)
+{
+    data.resize(size);
+    return size == 0 || read_fully(fd, &data[0], size);
+}
+
+ObjectCache::ObjectCache()
+    : dir_fd(-1)
+    , size_limit(0)
+    , next_check(0)
+{
+}
+
+ObjectCache::~ObjectCache()
+{
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+}
+
+bool ObjectCache::init(const string &_dir, size_t _size_limit, uid_t user_uid, gid_t user_gid)
+{
+    dir = _dir;
+    size_limit = _size_limit;
+
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        log_perror(("mkdir " + dir).c_str());
+        return false;
+    }
+
+    // the compile children run as the user and store the entries
+    if (chown(dir.c_str(), user_uid, user_gid) || chmod(dir.c_str(), 0700)) {
+        log_perror(("chown/chmod " + dir).c_str());
+        return false;
+    }
+
+    dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd < 0) {
+        log_perror(("open " + dir).c_str());
+        return false;
+    }
+
+    log_info() << "caching up to " << (size_limit >> 20) << " MB in " << dir << endl;
+    return true;
+}
+
+void ObjectCache::maintain()
+{
+    time_t now = time(0);
+
+    if (dir_fd < 0 || now < next_check) {
+        return;
+    }
+
+    next_check = now + MAINTAIN_INTERVAL;
+
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        log_perror(("opendir " + dir).c_str());
+        return;
+    }
+
+    vector<CachedFile> files;
+    size_t total = 0;
+
+    for (struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        struct stat st;
+
+        if (ent->d_name[0] == '.' || fstatat(dir_fd, ent->d_name, &st, 0) != 0) {
+            continue;
+        }
+
+        if (strchr(ent->d_name, '.')) {
+            if (now - st.st_mtime > STALE_TMP_AGE) {
+                unlinkat(dir_fd, ent->d_name, 0);
+            }
+
+            continue;
+        }
+
+        CachedFile file;
+        file.name = ent->d_name;
+        file.mtime = st.st_mtime;
+        file.size = st.st_size;
+        files.push_back(file);
+        total += file.size;
+    }
+
+    closedir(d);
+
+    if (total <= size_limit) {
+        return;
+    }
+
+    // make some room, so this doesn't happen again for the next store
+    sort(files.begin(), files.end());
+    size_t removed = 0;
+
+    for (vector<CachedFile>::const_iterator it = files.begin();
+            it != files.end() && total > size_limit / 10 * 9; ++it) {
+        if (unlinkat(dir_fd, it->name.c_str(), 0) == 0) {
+            total -= it->size;
+            ++removed;
+        }
+    }
+
+    trace() << "removed " << removed << " files from " << dir << ", " << (total >> 20)
+            << " MB left" << endl;
+}
+
+ObjectCacheEntry::ObjectCacheEntry(int _dir_fd, const CompileJob &job,
+                                   const string &_obj_file, const string &_dwo_file)
+    : dir_fd(_dir_fd)
+    , obj_file(_obj_file)
+    , dwo_file(_dwo_file)
+    , have_dwo_file(job.dwarfFissionEnabled())
+{
+    md5_init(&state);
+
+    list<string> fields;
+    fields.push_back(job.targetPlatform());
+    fields.push_back(job.environmentVersion());
+    fields.push_back(job.compilerName());
+    fields.push_back(toString(job.language()));
+    appendList(fields, job.remoteFlags());
+    fields.push_back("--");
+    appendList(fields, job.restFlags());
+
+    // clang gets the file names as arguments, and with split dwarf the
+    // path of the .dwo file ends up in the object
+    if (job.compilerName().find("clang") != string::npos || have_dwo_file) {
+        fields.push_back(job.inputFile());
+        fields.push_back(job.workingDirectory());
+        fields.push_back(job.outputFile());
+    }
+
+    for (list<string>::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+        update(it->c_str(), it->size() + 1);
+    }
+}
+
+void ObjectCacheEntry::update(const void *data, size_t len)
+{
+    md5_append(&state, static_cast<const md5_byte_t *>(data), len);
+}
+
+string ObjectCacheEntry::key()
+{
+    if (hash.empty()) {
+        md5_byte_t digest[16];
+        md5_finish(&state, digest);
+        hash = md5_hex(digest);
+    }
+
+    return hash;
+}
+
+bool ObjectCacheEntry::find()
+{
+    int fd = openat(dir_fd, key().c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(EntryHeader)
+              && st.st_size <= 2 * MAX_ENTRY_SIZE && read_all(fd, found, st.st_size);
+
+    if (ok) {
+        const EntryHeader *header = reinterpret_cast<const EntryHeader *>(found.data());
+        ok = header->magic == OBJCACHE_MAGIC
+             && sizeof(EntryHeader) + size_t(header->out_len) + header->err_len
+                + header->obj_len + header->dwo_len == found.size();
+    }
+
+    if (ok) {
+        // the modification time is the last use
+        futimens(fd, 0);
+        trace() << "object cache hit " << key() << endl;
+    } else {
+        found.clear();
+    }
+
+    close(fd);
+    return ok;
+}
+
+bool ObjectCacheEntry::restore(CompileResultMsg &rmsg)
+{
+    if (found.empty()) {
+        return false;
+    }
+
+    EntryHeader header;
+    memcpy(&header, found.data(), sizeof(header));
+    const char *data = found.data() + sizeof(header);
+
+    rmsg.out.assign(data, header.out_len);
+    data += header.out_len;
+    rmsg.err.assign(data, header.err_len);
+    data += header.err_len;
+
+    if (!write_file(obj_file, data, header.obj_len)) {
+        return false;
+    }
+
+    data += header.obj_len;
+
+    if (have_dwo_file && !write_file(dwo_file, data, header.dwo_len)) {
+        return false;
+    }
+
+    rmsg.status = 0;
+    rmsg.have_dwo_file = have_dwo_file;
+    return true;
+}
+
+void ObjectCacheEntry::store(const CompileResultMsg &rmsg)
+{
+    string obj, dwo;
+
+    if (!read_file(obj_file, obj, MAX_ENTRY_SIZE)
+            || (have_dwo_file && !read_file(dwo_file, dwo, MAX_ENTRY_SIZE))) {
+        return;
+    }
+
+    EntryHeader header;
+    header.magic = OBJCACHE_MAGIC;
+    header.out_len = rmsg.out.size();
+    header.err_len = rmsg.err.size();
+    header.obj_len = obj.size();
+    header.dwo_len = dwo.size();
+
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", key().c_str(), int(getpid()));
+    int fd = openat(dir_fd, tmp_name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        log_perror("creating object cache entry");
+        return;
+    }
+
+    bool ok = write_fully(fd, reinterpret_cast<const char *>(&header), sizeof(header))
+              && write_fully(fd, rmsg.out.data(), rmsg.out.size())
+              && write_fully(fd, rmsg.err.data(), rmsg.err.size())
+              && write_fully(fd, obj.data(), obj.size())
+              && write_fully(fd, dwo.data(), dwo.size());
+
+    if (close(fd) != 0 || !ok || renameat(dir_fd, tmp_name, dir_fd, key().c_str()) != 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+    }
+}
+
+bool chunk_matches(const ChunkRef &ref, const unsigned char *data, size_t len)
+{
+    if (len != ref.len) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_byte_t digest[16];
+    md5_init(&state);
+    md5_append(&state, data, len);
+    md5_finish(&state, digest);
+    return memcmp(digest, ref.digest, sizeof(digest)) == 0;
+}
+
+bool read_chunk(int dir_fd, const ChunkRef &ref, string &data)
+{
+    string name = md5_hex(ref.digest);
+    int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = read_all(fd, data, ref.len)
+              && chunk_matches(ref, reinterpret_cast<const unsigned char *>(data.data()),
+                               data.size());
+
+    if (ok) {
+        futimens(fd, 0);
+    } else {
+        // a broken chunk would be requested again and again
+        unlinkat(dir_fd, name.c_str(), 0);
+    }
+
+    close(fd);
+    return ok;
+}
+
+void store_chunk(int dir_fd, const ChunkRef &ref, const unsigned char *data)
+{
+    string name = md5_hex(ref.digest);
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", name.c_str(), int(getpid()));
+    int fd = openat(dir_fd, tmp_name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        return;
+    }
+
+    bool ok = write_fully(fd, reinterpret_cast<const char *>(data), ref.len);
+
+    if (close(fd) != 0 || !ok || renameat(dir_fd, tmp_name, dir_fd, name.c_str()) != 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+    }
+}
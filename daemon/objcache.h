@@ -0,0 +1,100 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_OBJCACHE_H
+#define ICECREAM_OBJCACHE_H
+
+#include <sys/types.h>
+#include <string>
+
+#include "md5.h"
+
+class CompileJob;
+class CompileResultMsg;
+struct ChunkRef;
+
+// Results of remote compiles, keyed by everything that goes into them:
+// the environment, the flags and the preprocessed input. The daemon only
+// creates the directory and evicts the least recently used entries, the
+// compile children look up and store entries through the directory fd,
+// as they run chrooted into the environment. The chunks of preprocessed
+// input (see below) are kept the same way, in a directory of their own.
+class ObjectCache
+{
+public:
+    ObjectCache();
+    ~ObjectCache();
+
+    bool init(const std::string &dir, size_t size_limit, uid_t user_uid, gid_t user_gid);
+    bool enabled() const {
+        return dir_fd >= 0;
+    }
+    int dirFd() const {
+        return dir_fd;
+    }
+
+    // removes entries over the size limit, checks only now and then
+    void maintain();
+
+private:
+    std::string dir;
+    int dir_fd;
+    size_t size_limit;
+    time_t next_check;
+};
+
+// The cache entry for one job, used by the compile child.
+class ObjectCacheEntry
+{
+public:
+    // OBJ_FILE and DWO_FILE are where the compiler writes its output
+    ObjectCacheEntry(int dir_fd, const CompileJob &job,
+                     const std::string &obj_file, const std::string &dwo_file);
+
+    // hashes the preprocessed input
+    void update(const void *data, size_t len);
+    // all input was hashed, is there a result for it
+    bool find();
+    // writes the found result to the output files, the compiler must be
+    // gone by now
+    bool restore(CompileResultMsg &rmsg);
+    // the compiler succeeded, remember its result
+    void store(const CompileResultMsg &rmsg);
+
+private:
+    std::string key();
+
+    int dir_fd;
+    std::string obj_file;
+    std::string dwo_file;
+    bool have_dwo_file;
+    md5_state_t state;
+    std::string hash;
+    std::string found;
+};
+
+// Chunks of preprocessed input, named by their md5 sum. A chunk is only
+// used if its content still matches.
+bool chunk_matches(const ChunkRef &ref, const unsigned char *data, size_t len);
+bool read_chunk(int dir_fd, const ChunkRef &ref, std::string &data);
+// DATA has to match REF
+void store_chunk(int dir_fd, const ChunkRef &ref, const unsigned char *data);
+
+#endif
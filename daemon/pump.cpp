@@ -0,0 +1,428 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "pump.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "comm.h"
+#include "exitcode.h"
+#include "file_util.h"
+#include "job.h"
+#include "logging.h"
+#include "objcache.h"
+#include "tempfile.h"
+#include "util.h"
+
+using namespace std;
+
+// nobody includes a bigger file
+#define MAX_PUMP_FILE (64 * 1024 * 1024)
+
+// in the root of the mirrored tree, where no client file can be
+#define PUMP_OUTPUT "/.icecc-pump.i"
+#define PUMP_ERRORS "/.icecc-pump.err"
+#define PUMP_DEPS "/.icecc-pump.d"
+
+/* The compiler sees the mirrored tree, the client must not.  */
+static void strip_prefix(string &data, const string &prefix)
+{
+    size_t pos = data.find(prefix);
+
+    if (pos == string::npos) {
+        return;
+    }
+
+    string result;
+    result.reserve(data.size());
+    size_t last = 0;
+
+    for (; pos != string::npos; pos = data.find(prefix, last)) {
+        result.append(data, last, pos - last);
+        last = pos + prefix.size();
+    }
+
+    result.append(data, last, string::npos);
+    data.swap(result);
+}
+
+/* Gets the files the preprocessor reads, from the chunk store or from the
+   client.  */
+static int receive_files(MsgChannel *client, int store_fd, list<string> &files,
+                         list<string> &system_dirs, vector<string> &contents)
+{
+    Msg *msg = client->get_msg(60);
+
+    if (!msg || msg->type != M_PUMP_FILES) {
+        log_error() << "protocol error while reading pump files" << endl;
+        delete msg;
+        return EXIT_PROTOCOL_ERROR;
+    }
+
+    PumpFilesMsg *pmsg = static_cast<PumpFilesMsg*>(msg);
+    files.swap(pmsg->files);
+    system_dirs.swap(pmsg->system_dirs);
+    vector<ChunkRef> refs;
+    refs.swap(pmsg->refs);
+    delete pmsg;
+
+    if (files.size() != refs.size()) {
+        log_error() << "protocol error while reading pump files" << endl;
+        return EXIT_PROTOCOL_ERROR;
+    }
+
+    ChunkRequestMsg request;
+    request.enabled = store_fd >= 0;
+    contents.resize(refs.size());
+    size_t i = 0;
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it, ++i) {
+        if (it->empty() || (*it)[0] != '/' || refs[i].len > MAX_PUMP_FILE) {
+            log_error() << "invalid pump file " << *it << endl;
+            return EXIT_PROTOCOL_ERROR;
+        }
+
+        if (store_fd < 0 || !read_chunk(store_fd, refs[i], contents[i])) {
+            request.missing.push_back(i);
+        }
+    }
+
+    if (!client->send_msg(request)) {
+        return EXIT_IO_ERROR;
+    }
+
+    for (i = 0; i < request.missing.size(); ++i) {
+        const ChunkRef &ref = refs[request.missing[i]];
+        msg = client->get_msg(60);
+
+        if (!msg || msg->type != M_FILE_CHUNK) {
+            log_error() << "protocol error while reading pump files" << endl;
+            delete msg;
+            return EXIT_PROTOCOL_ERROR;
+        }
+
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg*>(msg);
+
+        if (!chunk_matches(ref, fcmsg->buffer, fcmsg->len)) {
+            log_error() << "pump file doesn't match its checksum" << endl;
+            delete fcmsg;
+            return EXIT_PROTOCOL_ERROR;
+        }
+
+        if (store_fd >= 0) {
+            store_chunk(store_fd, ref, fcmsg->buffer);
+        }
+
+        contents[request.missing[i]].assign((const char *) fcmsg->buffer, fcmsg->len);
+        delete fcmsg;
+    }
+
+    msg = client->get_msg(60);
+    bool ok = msg && msg->type == M_END;
+    delete msg;
+
+    if (!ok) {
+        log_error() << "protocol error while reading pump files" << endl;
+        return EXIT_PROTOCOL_ERROR;
+    }
+
+    trace() << "pump job with " << files.size() << " files, " << request.missing.size()
+            << " sent" << endl;
+    return 0;
+}
+
+/* The preprocessor flags with absolute paths moved into MIRROR, and the
+   dependency file redirected.  */
+static list<string> mirror_flags(const list<string> &flags, const string &mirror)
+{
+    list<string> result;
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        list<string>::const_iterator next = it;
+        ++next;
+
+        if ((*it == "-I" || *it == "-isystem" || *it == "-iquote" || *it == "-idirafter"
+                || *it == "-include" || *it == "-imacros") && next != flags.end()) {
+            result.push_back(*it);
+            result.push_back((*next)[0] == '/' ? mirror + *next : *next);
+            it = next;
+        } else if (*it == "-MF" && next != flags.end()) {
+            result.push_back(*it);
+            result.push_back(mirror + PUMP_DEPS);
+            it = next;
+        } else if (it->compare(0, 3, "-I/") == 0) {
+            result.push_back("-I" + mirror + it->substr(2));
+        } else {
+            result.push_back(*it);
+        }
+    }
+
+    return result;
+}
+
+/* Walks PATH, absolute or relative to CWD, in MIRROR the way the
+   preprocessor does, and with CREATE makes the directories on the way.
+   Nothing in the mirror is a symbolic link, so ".." takes off the last
+   part. False if the path leads out of the mirror.  */
+static bool walk_mirror_path(const string &mirror, const string &cwd, const string &path,
+                             bool create)
+{
+    string full = path[0] == '/' ? path : cwd + '/' + path;
+    vector<string> parts;
+    string dir = mirror;
+
+    for (size_t start = 0; start < full.size();) {
+        size_t end = full.find('/', start);
+
+        if (end == string::npos) {
+            end = full.size();
+        }
+
+        string part = full.substr(start, end - start);
+        start = end + 1;
+
+        if (part.empty() || part == ".") {
+            continue;
+        }
+
+        if (part == "..") {
+            if (parts.empty()) {
+                return false;
+            }
+
+            dir.erase(dir.size() - parts.back().size() - 1);
+            parts.pop_back();
+            continue;
+        }
+
+        parts.push_back(part);
+        dir += '/' + part;
+
+        if (create) {
+            mkdir(dir.c_str(), 0775);
+        }
+    }
+
+    return true;
+}
+
+/* Creates the include directories in MIRROR, the preprocessor walks
+   through them even if they have no files, as in -I/usr/lib/../include.
+   False if one of them leads out of the mirror.  */
+static bool mirror_include_dirs(const list<string> &flags, const string &mirror,
+                                const string &cwd)
+{
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        list<string>::const_iterator next = it;
+        ++next;
+        string dir;
+
+        if ((*it == "-I" || *it == "-isystem" || *it == "-iquote" || *it == "-idirafter")
+                && next != flags.end()) {
+            dir = *next;
+            it = next;
+        } else if (it->compare(0, 2, "-I") == 0) {
+            dir = it->substr(2);
+        }
+
+        if (!dir.empty() && !walk_mirror_path(mirror, cwd, dir, true)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int run_preprocessor(const CompileJob &job, const string &mirror,
+                            const list<string> &system_dirs, int &status)
+{
+    list<string> flags = job.localFlags();
+    appendList(flags, job.restFlags());
+    flags = mirror_flags(flags, mirror);
+
+    // only the headers of the client
+    flags.push_back("-nostdinc");
+
+    if (job.language() == CompileJob::Lang_CXX) {
+        flags.push_back("-nostdinc++");
+    }
+
+    for (list<string>::const_iterator it = system_dirs.begin(); it != system_dirs.end(); ++it) {
+        flags.push_back("-isystem");
+        flags.push_back(mirror + *it);
+    }
+
+    // -nostdinc also drops the implicit include of glibc
+    bool predef = find(flags.begin(), flags.end(), "-ffreestanding") == flags.end();
+
+    for (list<string>::const_iterator it = system_dirs.begin();
+            predef && it != system_dirs.end(); ++it) {
+        string file = mirror + *it + "/stdc-predef.h";
+
+        if (access(file.c_str(), R_OK) == 0) {
+            flags.push_back("-include");
+            flags.push_back(file);
+            predef = false;
+        }
+    }
+
+    flags.push_back("-E");
+    string input = job.inputFile();
+    flags.push_back(input[0] == '/' ? mirror + input : input);
+
+    vector<char *> argv;
+    argv.push_back(strdup(("/usr/bin/" + job.compilerName()).c_str()));
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        argv.push_back(strdup(it->c_str()));
+    }
+
+    argv.push_back(0);
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork");
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    if (pid == 0) {
+        close_debug();
+
+        int out_fd = open((mirror + PUMP_OUTPUT).c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+        int err_fd = open((mirror + PUMP_ERRORS).c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+
+        if (out_fd < 0 || err_fd < 0 || chdir((mirror + job.workingDirectory()).c_str()) != 0) {
+            _exit(EXIT_IO_ERROR);
+        }
+
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        close(out_fd);
+        close(err_fd);
+
+        execv(argv[0], &argv[0]);
+        _exit(EXIT_COMPILER_MISSING);
+    }
+
+    for (size_t i = 0; argv[i]; ++i) {
+        free(argv[i]);
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            log_perror("waitpid");
+            return EXIT_DISTCC_FAILED;
+        }
+    }
+
+    return 0;
+}
+
+int pump_preprocess(CompileJob &job, MsgChannel *client, int store_fd,
+                    string &output, CompileResultMsg &rmsg)
+{
+    list<string> files;
+    list<string> system_dirs;
+    vector<string> contents;
+    int ret = receive_files(client, store_fd, files, system_dirs, contents);
+
+    if (ret) {
+        return ret;
+    }
+
+    char *tmp_dir = 0;
+
+    if ((ret = dcc_make_tmpdir(&tmp_dir)) != 0) {
+        return ret;
+    }
+
+    string mirror = get_canonicalized_path(tmp_dir);
+    free(tmp_dir);
+
+    size_t i = 0;
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it, ++i) {
+        string file = mirror + get_canonicalized_path(*it);
+
+        if (!mkpath(file.substr(0, file.rfind('/'))) || !write_file(file, contents[i].data(), contents[i].size(), 0644)) {
+            log_error() << "can't write " << file << endl;
+            rmpath(mirror.c_str());
+            return EXIT_IO_ERROR;
+        }
+    }
+
+    contents.clear();
+
+    const string &cwd = job.workingDirectory();
+    bool inside = !cwd.empty() && cwd[0] == '/' && walk_mirror_path(mirror, cwd, cwd, true)
+                  && !job.inputFile().empty()
+                  && walk_mirror_path(mirror, cwd, job.inputFile(), false);
+
+    for (list<string>::const_iterator it = system_dirs.begin();
+            inside && it != system_dirs.end(); ++it) {
+        inside = !it->empty() && (*it)[0] == '/' && walk_mirror_path(mirror, cwd, *it, false);
+    }
+
+    list<string> flags = job.localFlags();
+    appendList(flags, job.restFlags());
+
+    if (!inside || !mirror_include_dirs(flags, mirror, cwd)) {
+        log_error() << "pump job with paths outside of the mirror" << endl;
+        rmpath(mirror.c_str());
+        return EXIT_PROTOCOL_ERROR;
+    }
+
+    int status = 0;
+
+    if ((ret = run_preprocessor(job, mirror, system_dirs, status)) != 0) {
+        rmpath(mirror.c_str());
+        return ret;
+    }
+
+    read_file(mirror + PUMP_ERRORS, rmsg.err);
+    strip_prefix(rmsg.err, mirror);
+
+    if (shell_exit_status(status) != 0) {
+        rmsg.status = shell_exit_status(status);
+    } else if (!read_file(mirror + PUMP_OUTPUT, output)) {
+        ret = EXIT_IO_ERROR;
+    } else {
+        strip_prefix(output, mirror);
+
+        if (read_file(mirror + PUMP_DEPS, rmsg.dep)) {
+            strip_prefix(rmsg.dep, mirror);
+        }
+    }
+
+    rmpath(mirror.c_str());
+    return ret;
+}
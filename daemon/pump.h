@@ -0,0 +1,40 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_PUMP_H
+#define ICECREAM_PUMP_H
+
+#include <string>
+
+class CompileJob;
+class CompileResultMsg;
+class MsgChannel;
+
+// Receives the source and headers of a pump mode job and preprocesses them
+// in a copy of the client's directory tree, in the compile child that runs
+// inside the environment. STORE_FD is the directory of the chunk store,
+// which keeps the headers by their content, or -1.
+// Returns an exit code if the files couldn't be received. Otherwise OUTPUT
+// is the preprocessed source, or RMSG has the status and errors of the
+// failed preprocessor.
+int pump_preprocess(CompileJob &job, MsgChannel *client, int store_fd,
+                    std::string &output, CompileResultMsg &rmsg);
+
+#endif
@@ -49,6 +49,8 @@
 #include "exitcode.h"
 #include "tempfile.h"
 #include "workit.h"
+#include "objcache.h"
+#include "pump.h"
 #include "logging.h"
 #include "serve.h"
 #include "util.h"
@@ -73,6 +75,9 @@ using namespace std;
 
 int nice_level = 5;
 
+/* Objects up to this size are sent inside the CompileResultMsg.  */
+#define MAX_INLINE_OUTPUT (256 * 1024)
+
 static void
 error_client(MsgChannel *client, string error)
 {
@@ -114,7 +119,7 @@ static void write_output_file( const string& file, MsgChannel* client )
                 break;
             }
 
-            FileChunkMsg fcmsg(buffer, bytes);
+            FileChunkMsg fcmsg(buffer, bytes, Payload_Object);
 
             if (!client->send_msg(fcmsg)) {
                 log_info() << "write of obj chunk failed " << bytes << endl;
@@ -129,12 +134,52 @@ static void write_output_file( const string& file, MsgChannel* client )
     }
 }
 
+/* Reads FILE into DATA if it is small enough to be sent inline.  */
+static bool read_inline_output(const string &file, string &data)
+{
+    struct stat st;
+
+    if (stat(file.c_str(), &st) != 0 || st.st_size > MAX_INLINE_OUTPUT) {
+        return false;
+    }
+
+    int fd = open(file.c_str(), O_RDONLY | O_LARGEFILE);
+
+    if (fd == -1) {
+        return false;
+    }
+
+    data.resize(st.st_size);
+    size_t offset = 0;
+
+    while (offset < data.size()) {
+        ssize_t bytes = read(fd, &data[offset], data.size() - offset);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        offset += bytes;
+    }
+
+    close(fd);
+    data.resize(offset);
+    return offset == (size_t) st.st_size;
+}
+
 /**
  * Read a request, run the compiler, and send a response.
  **/
 int handle_connection(const string &basedir, CompileJob *job,
                       MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const string *inline_input, size_t inline_compressed, int objcache_fd,
+                      int chunk_dir_fd, bool pump,
+                      bool batch_more)
 {
     int socket[2];
 
@@ -195,114 +240,213 @@ int handle_connection(const string &basedir, CompileJob *job,
             throw myexception(-1);
         }
 
-        int ret;
-        unsigned int job_stat[8];
-        CompileResultMsg rmsg;
-        job_id = job->jobID();
-
-        memset(job_stat, 0, sizeof(job_stat));
-
-        char *tmp_output = 0;
-        char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
-        sprintf(prefix_output, "icecc-%d", job_id);
-
-        if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
-            tmp_path = tmp_output;
-            free(tmp_output);
-
-            // dwo information is embedded in the final object file, but the compiler
-            // hard codes the path to the dwo file based on the given path to the
-            // object output file. In every case, we must recreate the directory structure of
-            // the client system inside our tmp directory, including both the working
-            // directory the compiler will be run from as well as the relative path from
-            // that directory to the specified output file.
-            //
-            // the work_it() function will rewrite the tmp build directory as root, effectively
-            // letting us set up a "chroot"ed environment inside the build folder and letting
-            // us set up the paths to mimic the client system
-
-            string job_output_file = job->outputFile();
-            string job_working_dir = job->workingDirectory();
-
-            size_t slash_index = job_output_file.find_last_of('/');
-            string file_dir, file_name;
-            if (slash_index != string::npos) {
-                file_dir = job_output_file.substr(0, slash_index);
-                file_name = job_output_file.substr(slash_index+1);
+        unsigned int total_stat[8];
+        memset(total_stat, 0, sizeof(total_stat));
+        int batch_status = 0;
+        string batch_input;
+
+        // the jobs of a batch come one after the other on the connection,
+        // each after the result of the previous one
+        for (;;) {
+            int ret;
+            unsigned int job_stat[8];
+            CompileResultMsg rmsg;
+            job_id = job->jobID();
+
+            memset(job_stat, 0, sizeof(job_stat));
+
+            char *tmp_output = 0;
+            char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
+            sprintf(prefix_output, "icecc-%d", job_id);
+
+            // in pump mode the source and its headers come instead of the
+            // preprocessed source
+            string pumped;
+
+            if (pump) {
+                if ((ret = pump_preprocess(*job, client, chunk_dir_fd, pumped, rmsg)) != 0) {
+                    throw myexception(ret);
+                }
+
+                inline_input = &pumped;
+                inline_compressed = 0;
             }
-            else {
-                file_name = job_output_file;
+
+            if (pump && rmsg.status != 0) {
+                // the preprocessor failed, its errors are the result
+            } else if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
+                tmp_path = tmp_output;
+                free(tmp_output);
+
+                // dwo information is embedded in the final object file, but the compiler
+                // hard codes the path to the dwo file based on the given path to the
+                // object output file. In every case, we must recreate the directory structure of
+                // the client system inside our tmp directory, including both the working
+                // directory the compiler will be run from as well as the relative path from
+                // that directory to the specified output file.
+                //
+                // the work_it() function will rewrite the tmp build directory as root, effectively
+                // letting us set up a "chroot"ed environment inside the build folder and letting
+                // us set up the paths to mimic the client system
+
+                string job_output_file = job->outputFile();
+                string job_working_dir = job->workingDirectory();
+
+                size_t slash_index = job_output_file.find_last_of('/');
+                string file_dir, file_name;
+                if (slash_index != string::npos) {
+                    file_dir = job_output_file.substr(0, slash_index);
+                    file_name = job_output_file.substr(slash_index+1);
+                }
+                else {
+                    file_name = job_output_file;
+                }
+
+                string output_dir, relative_file_path;
+                if (!file_dir.empty() && file_dir[0] == '/') { // output dir is absolute, convert to relative
+                    relative_file_path = get_relative_path(get_canonicalized_path(job_output_file), get_canonicalized_path(job_working_dir));
+                    output_dir = tmp_path + get_canonicalized_path(file_dir);
+                }
+                else { // output file is already relative, canonicalize in relation to working dir
+                    string canonicalized_dir = get_canonicalized_path(job_working_dir + '/' + file_dir);
+                    relative_file_path = get_relative_path(canonicalized_dir + '/' + file_name, get_canonicalized_path(job_working_dir));
+                    output_dir = tmp_path + canonicalized_dir;
+                }
+
+                if (!mkpath(output_dir)) {
+                    error_client(client, "could not create object file location in tmp directory");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+                if (!mkpath(tmp_path + job_working_dir))  {
+                    error_client(client, "could not create compiler working directory in tmp directory");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+
+                obj_file = output_dir + '/' + file_name;
+                dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
+
+                ObjectCacheEntry cache(objcache_fd, *job, obj_file, dwo_file);
+                ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1,
+                              inline_input, inline_compressed, objcache_fd >= 0 ? &cache : 0,
+                              chunk_dir_fd);
+            }
+            else if ((ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
+                obj_file = tmp_output;
+                free(tmp_output);
+                string build_path = obj_file.substr(0, obj_file.find_last_of('/'));
+                string file_name = obj_file.substr(obj_file.find_last_of('/')+1);
+
+                ObjectCacheEntry cache(objcache_fd, *job, obj_file, dwo_file);
+                ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1,
+                              inline_input, inline_compressed, objcache_fd >= 0 ? &cache : 0,
+                              chunk_dir_fd);
             }
 
-            string output_dir, relative_file_path;
-            if (!file_dir.empty() && file_dir[0] == '/') { // output dir is absolute, convert to relative
-                relative_file_path = get_relative_path(get_canonicalized_path(job_output_file), get_canonicalized_path(job_working_dir));
-                output_dir = tmp_path + get_canonicalized_path(file_dir);
+            if (ret) {
+                if (ret == EXIT_OUT_OF_MEMORY) {   // we catch that as special case
+                    rmsg.was_out_of_memory = true;
+                } else {
+                    throw myexception(ret);
+                }
+            }
+
+            /* Small results go out with the result message in one write.  */
+            if (IS_PROTOCOL_39(client) && rmsg.status == 0 && !rmsg.was_out_of_memory) {
+                rmsg.output_inline = read_inline_output(obj_file, rmsg.object)
+                                     && (!rmsg.have_dwo_file || read_inline_output(dwo_file, rmsg.dwo));
+
+                if (!rmsg.output_inline) {
+                    rmsg.object.clear();
+                    rmsg.dwo.clear();
+                }
             }
-            else { // output file is already relative, canonicalize in relation to working dir
-                string canonicalized_dir = get_canonicalized_path(job_working_dir + '/' + file_dir);
-                relative_file_path = get_relative_path(canonicalized_dir + '/' + file_name, get_canonicalized_path(job_working_dir));
-                output_dir = tmp_path + canonicalized_dir;
+
+            if (!client->send_msg(rmsg)) {
+                log_info() << "write of result failed" << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
             }
 
-            if (!mkpath(output_dir)) {
-                error_client(client, "could not create object file location in tmp directory");
-                throw myexception(EXIT_IO_ERROR);
+            struct stat st;
+
+            if (!stat(obj_file.c_str(), &st)) {
+                job_stat[JobStatistics::out_uncompressed] += st.st_size;
             }
-            if (!mkpath(tmp_path + job_working_dir))  {
-                error_client(client, "could not create compiler working directory in tmp directory");
-                throw myexception(EXIT_IO_ERROR);
+            if (!stat(dwo_file.c_str(), &st)) {
+                job_stat[JobStatistics::out_uncompressed] += st.st_size;
             }
 
-            obj_file = output_dir + '/' + file_name;
-            dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
+            for (int i = 0; i < 8; ++i) {
+                total_stat[i] += job_stat[i];
+            }
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1);
-        }
-        else if ((ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
-            obj_file = tmp_output;
-            free(tmp_output);
-            string build_path = obj_file.substr(0, obj_file.find_last_of('/'));
-            string file_name = obj_file.substr(obj_file.find_last_of('/')+1);
+            if (rmsg.status != 0) {
+                batch_status = rmsg.status;
+            }
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1);
-        }
+            total_stat[JobStatistics::exit_code] = batch_status;
 
-        if (ret) {
-            if (ret == EXIT_OUT_OF_MEMORY) {   // we catch that as special case
-                rmsg.was_out_of_memory = true;
-            } else {
-                throw myexception(ret);
+            /* wake up parent and tell him that compile finished */
+            /* if the write failed, well, doesn't matter */
+            if (!batch_more) {
+                ignore_result(write(out_fd, total_stat, sizeof(total_stat)));
+                close(out_fd);
             }
-        }
 
-        if (!client->send_msg(rmsg)) {
-            log_info() << "write of result failed" << endl;
-            throw myexception(EXIT_DISTCC_FAILED);
-        }
+            if (rmsg.status == 0 && !rmsg.output_inline) {
+                write_output_file(obj_file, client);
+                if (rmsg.have_dwo_file) {
+                    write_output_file(dwo_file, client);
+                }
+            }
 
-        struct stat st;
+            if (!batch_more) {
+                break;
+            }
 
-        if (!stat(obj_file.c_str(), &st)) {
-            job_stat[JobStatistics::out_uncompressed] += st.st_size;
-        }
-        if (!stat(dwo_file.c_str(), &st)) {
-            job_stat[JobStatistics::out_uncompressed] += st.st_size;
-        }
+            if (!obj_file.empty()) {
+                unlink(obj_file.c_str());
+                obj_file.clear();
+            }
+            if (!dwo_file.empty()) {
+                unlink(dwo_file.c_str());
+                dwo_file.clear();
+            }
+            if (!tmp_path.empty()) {
+                rmpath(tmp_path.c_str());
+                tmp_path.clear();
+            }
 
-        /* wake up parent and tell him that compile finished */
-        /* if the write failed, well, doesn't matter */
-        ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
-        close(out_fd);
+            msg = client->get_msg(60);
 
-        if (rmsg.status == 0) {
-            write_output_file(obj_file, client);
-            if (rmsg.have_dwo_file) {
-                write_output_file(dwo_file, client);
+            if (!msg || msg->type != M_COMPILE_FILE) {
+                log_error() << "protocol error while reading batch job" << endl;
+                throw myexception(EXIT_PROTOCOL_ERROR);
             }
+
+            CompileFileMsg *cmsg = static_cast<CompileFileMsg*>(msg);
+            CompileJob *next = cmsg->takeJob();
+
+            // we are inside the environment of the first job already
+            if (next->environmentVersion() != job->environmentVersion()
+                    || next->targetPlatform() != job->targetPlatform()) {
+                delete next;
+                error_client(client, "batch jobs need the same environment");
+                throw myexception(EXIT_PROTOCOL_ERROR);
+            }
+
+            next->setJobID(job->jobID());
+            delete job;
+            job = next;
+            pump = cmsg->pump;
+            batch_more = cmsg->batch_more;
+            batch_input.swap(cmsg->input);
+            inline_input = cmsg->input_inline ? &batch_input : 0;
+            inline_compressed = cmsg->input_compressed;
+            delete msg;
+            msg = 0;
         }
 
-        throw myexception(rmsg.status);
+        throw myexception(batch_status);
 
     } catch (myexception e) {
         delete client;
@@ -31,8 +31,16 @@ class MsgChannel;
 
 extern int nice_level;
 
+// INLINE_INPUT is the preprocessed input if it came with the job, and
+// INLINE_COMPRESSED its compressed size on the wire,
+// OBJCACHE_FD and CHUNK_DIR_FD the directories of the object cache and
+// of the chunk store if there are any, PUMP is set if the job has to be
+// preprocessed here, BATCH_MORE if more jobs follow on the connection
 int handle_connection(const std::string &basedir, CompileJob *job,
                       MsgChannel *serv, int & out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid);
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const std::string *inline_input = 0, size_t inline_compressed = 0,
+                      int objcache_fd = -1,
+                      int chunk_dir_fd = -1, bool pump = false, bool batch_more = false);
 
 #endif
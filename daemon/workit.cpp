@@ -23,6 +23,7 @@
 
 #include "config.h"
 #include "workit.h"
+#include "objcache.h"
 #include "tempfile.h"
 #include "assert.h"
 #include "exitcode.h"
@@ -86,6 +87,123 @@ error_client(MsgChannel *client, string error)
     }
 }
 
+// clients cut their chunks much smaller than this
+#define MAX_CHUNK_LEN (1024 * 1024)
+
+/* Input waiting for the compiler, in order. A null entry is a chunk the
+   client still has to send, its reference is in the expected list.  */
+typedef std::list<FileChunkMsg *> ChunkQueue;
+
+static void drop_input(FileChunkMsg *&fcmsg, ChunkQueue &queue)
+{
+    delete fcmsg;
+    fcmsg = 0;
+
+    for (ChunkQueue::iterator it = queue.begin(); it != queue.end(); ++it) {
+        delete *it;
+    }
+
+    queue.clear();
+}
+
+/* Queues the announced chunks the store has and asks the client for the
+   others.  */
+static bool queue_chunk_refs(MsgChannel *client, const ChunkRefsMsg &refs, int chunk_dir_fd,
+                             ChunkQueue &queue, std::list<ChunkRef> &expected,
+                             unsigned int job_stat[])
+{
+    ChunkRequestMsg request;
+    request.enabled = chunk_dir_fd >= 0;
+
+    for (size_t i = 0; i < refs.refs.size(); ++i) {
+        const ChunkRef &ref = refs.refs[i];
+        string data;
+
+        if (!ref.len || ref.len > MAX_CHUNK_LEN) {
+            return false;
+        }
+
+        if (chunk_dir_fd >= 0 && read_chunk(chunk_dir_fd, ref, data)) {
+            FileChunkMsg *fcmsg = new FileChunkMsg;
+            fcmsg->assign((const unsigned char *) data.data(), data.size());
+            queue.push_back(fcmsg);
+            job_stat[JobStatistics::in_uncompressed] += ref.len;
+        } else {
+            queue.push_back(0);
+            expected.push_back(ref);
+            request.missing.push_back(i);
+        }
+    }
+
+    return client->send_msg(request);
+}
+
+/* Puts a chunk the client sent in place of the announced chunks it
+   contains, or at the end if nothing was announced.  */
+static bool queue_chunk(FileChunkMsg *fcmsg, int chunk_dir_fd,
+                        ChunkQueue &queue, std::list<ChunkRef> &expected)
+{
+    if (expected.empty()) {
+        queue.push_back(fcmsg);
+        return true;
+    }
+
+    ChunkQueue::iterator slot = std::find(queue.begin(), queue.end(), (FileChunkMsg *) 0);
+    ChunkQueue::iterator it = slot;
+    size_t offset = 0;
+
+    if (!fcmsg->len) {
+        return false;
+    }
+
+    while (offset < fcmsg->len) {
+        if (expected.empty() || it == queue.end() || *it) {
+            return false;
+        }
+
+        const ChunkRef &ref = expected.front();
+
+        if (ref.len > fcmsg->len - offset
+                || !chunk_matches(ref, fcmsg->buffer + offset, ref.len)) {
+            return false;
+        }
+
+        if (chunk_dir_fd >= 0) {
+            store_chunk(chunk_dir_fd, ref, fcmsg->buffer + offset);
+        }
+
+        offset += ref.len;
+        expected.pop_front();
+
+        if (it == slot) {
+            ++it;
+        } else {
+            it = queue.erase(it);
+        }
+    }
+
+    *slot = fcmsg;
+    return true;
+}
+
+/* Takes the next chunk for the compiler's stdin off the queue, if it is
+   there yet.  */
+static void next_chunk(FileChunkMsg *&fcmsg, size_t &off, ChunkQueue &queue,
+                       ObjectCacheEntry *cache)
+{
+    if (fcmsg || queue.empty() || !queue.front()) {
+        return;
+    }
+
+    fcmsg = queue.front();
+    queue.pop_front();
+    off = 0;
+
+    if (cache) {
+        cache->update(fcmsg->buffer, fcmsg->len);
+    }
+}
+
 /*
  * This is all happening in a forked child.
  * That means that we can block and be lazy about closing fds
@@ -94,11 +212,29 @@ error_client(MsgChannel *client, string error)
 
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/)
+            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/,
+            const std::string *inline_input, size_t inline_compressed, ObjectCacheEntry *cache,
+            int chunk_dir_fd)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
 
+    // pumped input is not known compressed, it counts as it is
+    if (inline_input && !inline_compressed) {
+        inline_compressed = inline_input->size();
+    }
+
+    // with all input at hand, a cached result saves starting the compiler
+    if (cache && inline_input) {
+        cache->update(inline_input->data(), inline_input->size());
+
+        if (cache->find() && cache->restore(rmsg)) {
+            job_stat[JobStatistics::in_uncompressed] += inline_input->size();
+            job_stat[JobStatistics::in_compressed] += inline_compressed;
+            return 0;
+        }
+    }
+
     std::list<string> list = j.remoteFlags();
     appendList(list, j.restFlags());
 
@@ -364,54 +500,91 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
     // Pending data to send to stdin
     FileChunkMsg *fcmsg = 0;
     size_t off = 0;
+    // chunks after FCMSG, and what the client announced but didn't send yet
+    ChunkQueue queue;
+    std::list<ChunkRef> expected;
+    // the result was found in the cache, the compiler got killed
+    bool cache_hit = false;
+
+    if (inline_input) {
+        input_complete = true;
+        job_stat[JobStatistics::in_uncompressed] += inline_input->size();
+        job_stat[JobStatistics::in_compressed] += inline_compressed;
+
+        if (inline_input->empty()) {
+            close(sock_in[1]);
+            sock_in[1] = -1;
+        } else {
+            fcmsg = new FileChunkMsg((unsigned char *) inline_input->data(), inline_input->size());
+        }
+    }
 
     log_block parent_wait("parent, waiting");
 
     for (;;) {
+        next_chunk(fcmsg, off, queue, cache);
+
         if (client_fd >= 0 && !fcmsg) {
             if (Msg *msg = client->get_msg(0)) {
+                bool protocol_error = false;
+
                 if (input_complete) {
                     rmsg.err.append("client cancelled\n");
                     return_value = EXIT_CLIENT_KILLED;
                     client_fd = -1;
                     kill(pid, SIGTERM);
-                    delete fcmsg;
-                    fcmsg = 0;
+                    drop_input(fcmsg, queue);
                     delete msg;
                 } else {
-                    if (msg->type == M_END) {
+                    if (msg->type == M_END && expected.empty()) {
                         input_complete = true;
 
-                        if (!fcmsg) {
+                        if (cache && cache->find()) {
+                            cache_hit = true;
+                            kill(pid, SIGTERM);
+                        }
+
+                        if (!fcmsg && queue.empty()) {
                             close(sock_in[1]);
                             sock_in[1] = -1;
                         }
 
                         delete msg;
                     } else if (msg->type == M_FILE_CHUNK) {
-                        fcmsg = static_cast<FileChunkMsg*>(msg);
-                        off = 0;
+                        FileChunkMsg *chunk = static_cast<FileChunkMsg*>(msg);
+                        job_stat[JobStatistics::in_uncompressed] += chunk->len;
+                        job_stat[JobStatistics::in_compressed] += chunk->compressed;
 
-                        job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
-                        job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
-                    } else {
-                        log_error() << "protocol error while reading preprocessed file" << endl;
-                        return_value = EXIT_IO_ERROR;
-                        client_fd = -1;
-                        kill(pid, SIGTERM);
-                        delete fcmsg;
-                        fcmsg = 0;
+                        if (!queue_chunk(chunk, chunk_dir_fd, queue, expected)) {
+                            protocol_error = true;
+                        }
+                    } else if (msg->type == M_CHUNK_REFS) {
+                        protocol_error = !queue_chunk_refs(client, *static_cast<ChunkRefsMsg*>(msg),
+                                                           chunk_dir_fd, queue, expected, job_stat);
                         delete msg;
+                        msg = 0;
+                    } else {
+                        protocol_error = true;
                     }
                 }
+
+                if (protocol_error) {
+                    log_error() << "protocol error while reading preprocessed file" << endl;
+                    return_value = EXIT_IO_ERROR;
+                    client_fd = -1;
+                    kill(pid, SIGTERM);
+                    drop_input(fcmsg, queue);
+                    delete msg;
+                }
             } else if (client->at_eof()) {
                 log_error() << "unexpected EOF while reading preprocessed file" << endl;
                 return_value = EXIT_IO_ERROR;
                 client_fd = -1;
                 kill(pid, SIGTERM);
-                delete fcmsg;
-                fcmsg = 0;
+                drop_input(fcmsg, queue);
             }
+
+            next_chunk(fcmsg, off, queue, cache);
         }
 
         fd_set rfds;
@@ -473,8 +646,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                 return_value = EXIT_IO_ERROR;
                 client_fd = -1;
                 input_complete = true;
-                delete fcmsg;
-                fcmsg = 0;
+                drop_input(fcmsg, queue);
                 continue;
             }
 
@@ -504,8 +676,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return_value = EXIT_COMPILER_CRASHED;
                     client_fd = -1;
                     input_complete = true;
-                    delete fcmsg;
-                    fcmsg = 0;
+                    drop_input(fcmsg, queue);
                     continue;
                 }
 
@@ -518,7 +689,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     delete fcmsg;
                     fcmsg = 0;
 
-                    if (input_complete) {
+                    if (input_complete && queue.empty()) {
                         close(sock_in[1]);
                         sock_in[1] = -1;
                     }
@@ -563,6 +734,14 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+                if (cache_hit) {
+                    if (!cache->restore(rmsg)) {
+                        return EXIT_IO_ERROR;
+                    }
+
+                    status = 0;
+                }
+
                 if (shell_exit_status(status) != 0) {
                     unsigned long int mem_used = ((ru.ru_minflt + ru.ru_majflt) * getpagesize()) / 1024;
                     rmsg.status = EXIT_OUT_OF_MEMORY;
@@ -591,6 +770,10 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     job_stat[JobStatistics::sys_msec] = (ru.ru_stime.tv_sec * 1000)
                                                         + (ru.ru_stime.tv_usec / 1000);
                     job_stat[JobStatistics::sys_pfaults] = ru.ru_majflt + ru.ru_nswap + ru.ru_minflt;
+
+                    if (cache && !cache_hit && rmsg.status == 0 && return_value == 0) {
+                        cache->store(rmsg);
+                    }
                 }
 
                 return return_value;
@@ -32,6 +32,7 @@
 
 class MsgChannel;
 class CompileResultMsg;
+class ObjectCacheEntry;
 
 // No icecream ;(
 class myexception : public std::exception
@@ -53,6 +54,9 @@ enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_co
 
 extern int work_it(CompileJob &j, unsigned int job_stats[], MsgChannel *client, CompileResultMsg &msg,
                    const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-                   unsigned long int mem_limit, int client_fd, int job_in_fd);
+                   unsigned long int mem_limit, int client_fd, int job_in_fd,
+                   const std::string *inline_input = 0, size_t inline_compressed = 0,
+                   ObjectCacheEntry *cache = 0,
+                   int chunk_dir_fd = -1);
 
 #endif
@@ -44,6 +44,9 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_load(1000)
     , m_maxJobs(0)
     , m_noRemote(false)
+    , m_protocolVersion(0)
+    , m_compressionFeatures(0)
+    , m_caches(0)
     , m_jobList()
     , m_submittedJobsCount(0)
     , m_state(CONNECTED)
@@ -56,6 +59,7 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_cumRequested()
     , m_clientMap()
     , m_blacklist()
+    , m_prestageAsked()
 {
 }
 
@@ -119,26 +123,35 @@ bool CompileServer::platforms_compatible(const string &target) const
    env can be run there, i.e. if the host platforms of the CS and of the
    environment are compatible.  Return an empty string if none can be
    installed, otherwise return the platform of the first found
-   environments which can be installed.  */
+   environments which can be installed.  While the CS installs an
+   environment, that takes one of its job slots, and it only takes the
+   jobs of environments it has already.  */
 string CompileServer::can_install(const Job *job)
 {
     // trace() << "can_install host: '" << cs->host_platform << "' target: '"
     //         << job->target_platform << "'" << endl;
-    if (busyInstalling()) {
-#if DEBUG_SCHEDULER > 0
-        trace() << nodeName() << " is busy installing since " << time(0) - cs->busyInstalling()
-                << " seconds." << endl;
-#endif
-        return string();
-    }
-
     Environments environments = job->environments();
     for (Environments::const_iterator it = environments.begin();
             it != environments.end(); ++it) {
-        if (platforms_compatible(it->first) && !blacklisted(job, *it)) {
-            return it->first;
+        if (!platforms_compatible(it->first) || blacklisted(job, *it)) {
+            continue;
+        }
+
+        if (busyInstalling()
+                && find(m_compilerVersions.begin(), m_compilerVersions.end(),
+                        make_pair(job->targetPlatform(), it->second)) == m_compilerVersions.end()) {
+            continue;
         }
+
+        return it->first;
+    }
+
+#if DEBUG_SCHEDULER > 0
+    if (busyInstalling()) {
+        trace() << nodeName() << " is busy installing since " << time(0) - busyInstalling()
+                << " seconds." << endl;
     }
+#endif
 
     return string();
 }
@@ -241,6 +254,36 @@ void CompileServer::setNoRemote(bool value)
     m_noRemote = value;
 }
 
+unsigned int CompileServer::protocolVersion() const
+{
+    return m_protocolVersion;
+}
+
+void CompileServer::setProtocolVersion(const unsigned int version)
+{
+    m_protocolVersion = version;
+}
+
+unsigned int CompileServer::compressionFeatures() const
+{
+    return m_compressionFeatures;
+}
+
+void CompileServer::setCompressionFeatures(const unsigned int features)
+{
+    m_compressionFeatures = features;
+}
+
+unsigned int CompileServer::caches() const
+{
+    return m_caches;
+}
+
+void CompileServer::setCaches(const unsigned int caches)
+{
+    m_caches = caches;
+}
+
 list<Job *> CompileServer::jobList() const
 {
     return m_jobList;
@@ -396,6 +439,17 @@ void CompileServer::eraseCSFromBlacklist(CompileServer *cs)
     m_blacklist.erase(cs);
 }
 
+time_t CompileServer::prestageAsked(const pair<string, string> &env) const
+{
+    map<pair<string, string>, time_t>::const_iterator it = m_prestageAsked.find(env);
+    return it == m_prestageAsked.end() ? 0 : it->second;
+}
+
+void CompileServer::setPrestageAsked(const pair<string, string> &env, const time_t time)
+{
+    m_prestageAsked[env] = time;
+}
+
 bool CompileServer::blacklisted(const Job *job, const pair<string, string> &environment)
 {
     Environments blacklist = job->submitter()->getEnvsForBlacklistedCS(this);
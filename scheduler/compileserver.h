@@ -86,6 +86,16 @@ public:
     bool noRemote() const;
     void setNoRemote(const bool value);
 
+    unsigned int protocolVersion() const;
+    void setProtocolVersion(const unsigned int version);
+
+    unsigned int compressionFeatures() const;
+    void setCompressionFeatures(const unsigned int features);
+
+    // DaemonCache flags
+    unsigned int caches() const;
+    void setCaches(const unsigned int caches);
+
     list<Job *> jobList() const;
     void appendJob(Job *job);
     void removeJob(Job *job);
@@ -132,6 +142,10 @@ public:
     void blacklistCompileServer(CompileServer *cs, const std::pair<std::string, std::string> &env);
     void eraseCSFromBlacklist(CompileServer *cs);
 
+    // when it was last asked to prestage the environment (target, name)
+    time_t prestageAsked(const pair<string, string> &env) const;
+    void setPrestageAsked(const pair<string, string> &env, const time_t time);
+
 private:
     bool blacklisted(const Job *job, const pair<string, string> &environment);
 
@@ -146,6 +160,9 @@ private:
     unsigned int m_load;
     int m_maxJobs;
     bool m_noRemote;
+    unsigned int m_protocolVersion;
+    unsigned int m_compressionFeatures;
+    unsigned int m_caches;
     list<Job *> m_jobList;
     int m_submittedJobsCount;
     State m_state;
@@ -162,6 +179,7 @@ private:
     static unsigned int s_hostIdCounter;
     map<int, int> m_clientMap; // map client ID for daemon to our IDs
     map<CompileServer *, Environments> m_blacklist;
+    map<pair<string, string>, time_t> m_prestageAsked;
 };
 
 #endif
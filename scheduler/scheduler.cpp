@@ -43,6 +43,7 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <vector>
 #include <algorithm>
 #include <cassert>
 #include <fstream>
@@ -120,6 +121,36 @@ static list<UnansweredList *> toanswer;
 static list<JobStat> all_job_stats;
 static JobStat cum_job_stats;
 
+/* The server that last compiled a file for a given set of environments.
+   Daemons with an object cache answer a recompile of unchanged sources from
+   it, so sending the file there again saves compiling it.  */
+static map<string, unsigned int> file_servers;
+static list<string> file_servers_order;
+#define MAX_FILE_SERVERS 50000
+// how many compile servers an installing one is told to get an environment from
+#define MAX_ENV_PEERS 3
+
+/* How popular the environments are, by target, host platform and name:
+   the jobs of all submitters that asked for them, which decay by a tenth
+   every PRESTAGE_INTERVAL. Idle compile servers are told to get the
+   popular ones from those that have them, before jobs need them.  */
+struct EnvUse {
+    string target;
+    string host_platform;
+    string name;
+    double jobs;
+};
+static map<string, EnvUse> env_uses;
+static time_t next_prestage;
+#define PRESTAGE_INTERVAL 60
+#define PRESTAGE_DECAY 0.9
+// the jobs an environment needs to be prestaged, that is about four a minute
+#define PRESTAGE_MIN_JOBS 30
+// how many compile servers are told to prestage an environment per interval
+#define MAX_PRESTAGES 2
+// a compile server is not asked for the same environment again for that long
+#define PRESTAGE_REASK (10 * 60)
+
 static float server_speed(CompileServer *cs, Job *job = 0);
 static void broadcast_scheduler_version();
 
@@ -375,6 +406,24 @@ static void remove_job_request(void)
 
 static string dump_job(Job *job);
 
+static void count_env_use(const Job *job)
+{
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        EnvUse &use = env_uses[job->targetPlatform() + "/" + it->first + "/" + it->second];
+
+        if (use.name.empty()) {
+            use.target = job->targetPlatform();
+            use.host_platform = it->first;
+            use.name = it->second;
+            use.jobs = 0;
+        }
+
+        use.jobs += 1;
+    }
+}
+
 static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 {
     GetCSMsg *m = dynamic_cast<GetCSMsg *>(_m);
@@ -398,6 +447,7 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setPreferredHost(m->preferred_host);
         job->setMinimalHostVersion(m->minimal_host_version);
         enqueue_job_request(job);
+        count_env_use(job);
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
             << submitter->nodeName() << " versions=[";
@@ -492,6 +542,257 @@ static string envs_match(CompileServer *cs, const Job *job)
     return string();
 }
 
+/* The number of leading bits the IPv4 addresses of two hosts have in
+   common, how near they are to each other in the network.  */
+static int address_closeness(const string &a, const string &b)
+{
+    struct in_addr ia, ib;
+
+    if (!inet_aton(a.c_str(), &ia) || !inet_aton(b.c_str(), &ib)) {
+        return 0;
+    }
+
+    uint32_t diff = ntohl(ia.s_addr) ^ ntohl(ib.s_addr);
+    int bits = 0;
+
+    while (bits < 32 && !(diff & (0x80000000u >> bits))) {
+        ++bits;
+    }
+
+    return bits;
+}
+
+struct EnvPeer {
+    bool installing;
+    int closeness;
+    unsigned int jobs;
+    CompileServer *cs;
+
+    bool operator<(const EnvPeer &other) const {
+        if (installing != other.installing) {
+            return !installing;
+        }
+
+        if (closeness != other.closeness) {
+            return closeness > other.closeness;
+        }
+
+        return jobs < other.jobs;
+    }
+};
+
+/* The compile servers CS can get the environment INSTALLED, the target
+   platform and name, from: those that have it installed except SUBMITTER,
+   the nearest and least busy first.  */
+static list<string> installed_env_peers(CompileServer *cs, const CompileServer *submitter,
+                                        const pair<string, string> &installed)
+{
+    list<string> peers;
+    vector<EnvPeer> candidates;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *peer = *it;
+
+        if (peer == cs || peer == submitter || peer->type() != CompileServer::DAEMON
+                || peer->state() != CompileServer::LOGGEDIN || peer->protocolVersion() < 45
+                || peer->noRemote() || !peer->remotePort()) {
+            continue;
+        }
+
+        Environments versions = peer->compilerVersions();
+
+        if (find(versions.begin(), versions.end(), installed) == versions.end()) {
+            continue;
+        }
+
+        EnvPeer candidate;
+        candidate.installing = peer->busyInstalling();
+        candidate.closeness = address_closeness(cs->name, peer->name);
+        candidate.jobs = peer->jobList().size();
+        candidate.cs = peer;
+        candidates.push_back(candidate);
+    }
+
+    sort(candidates.begin(), candidates.end());
+
+    for (size_t i = 0; i < candidates.size() && i < MAX_ENV_PEERS; ++i) {
+        char port[16];
+        snprintf(port, sizeof(port), ":%u", candidates[i].cs->remotePort());
+        peers.push_back(candidates[i].cs->name + port);
+    }
+
+    return peers;
+}
+
+/* The compile servers CS can get the environment of JOB for HOST_PLATFORM
+   from instead of the submitter.  */
+static list<string> env_peers(CompileServer *cs, const Job *job, const string &host_platform)
+{
+    string env;
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (it->first == host_platform) {
+            env = it->second;
+            break;
+        }
+    }
+
+    if (env.empty() || cs->protocolVersion() < 45) {
+        return list<string>();
+    }
+
+    return installed_env_peers(cs, job->submitter(), make_pair(job->targetPlatform(), env));
+}
+
+/* A compile server that can take the jobs of USE, but is idle and doesn't
+   have its environment yet.  */
+static bool can_prestage(CompileServer *cs, const EnvUse &use, time_t now)
+{
+    pair<string, string> env(use.target, use.name);
+
+    if (cs->type() != CompileServer::DAEMON || cs->state() != CompileServer::LOGGEDIN
+            || cs->protocolVersion() < 46 || cs->noRemote() || !cs->chrootPossible()
+            || !cs->jobList().empty() || cs->load() >= 500 || cs->busyInstalling()
+            || !cs->platforms_compatible(use.host_platform)
+            || now - cs->prestageAsked(env) < PRESTAGE_REASK) {
+        return false;
+    }
+
+    Environments versions = cs->compilerVersions();
+    return find(versions.begin(), versions.end(), env) == versions.end();
+}
+
+/* Tells idle compile servers to get the most popular environments from
+   those that have them, so that the jobs find more servers that have
+   their environment. The servers decide if they have the space.  */
+static void prestage_environments()
+{
+    time_t now = time(0);
+
+    if (now < next_prestage) {
+        return;
+    }
+
+    next_prestage = now + PRESTAGE_INTERVAL;
+    vector<pair<double, string> > popular;
+
+    for (map<string, EnvUse>::iterator it = env_uses.begin(); it != env_uses.end();) {
+        it->second.jobs *= PRESTAGE_DECAY;
+
+        if (it->second.jobs < 1) {
+            env_uses.erase(it++);
+            continue;
+        }
+
+        if (it->second.jobs >= PRESTAGE_MIN_JOBS) {
+            popular.push_back(make_pair(-it->second.jobs, it->first));
+        }
+
+        ++it;
+    }
+
+    sort(popular.begin(), popular.end());
+    int asked = 0;
+
+    for (size_t i = 0; i < popular.size() && asked < MAX_PRESTAGES; ++i) {
+        const EnvUse &use = env_uses[popular[i].second];
+
+        for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+            CompileServer *cs = *it;
+
+            if (!can_prestage(cs, use, now)) {
+                continue;
+            }
+
+            PrestageEnvMsg msg;
+            msg.target = use.target;
+            msg.name = use.name;
+            msg.peers = installed_env_peers(cs, 0, make_pair(use.target, use.name));
+
+            // nobody has it to get it from
+            if (msg.peers.empty()) {
+                break;
+            }
+
+            cs->setPrestageAsked(make_pair(use.target, use.name), now);
+
+            if (cs->send_msg(msg)) {
+                trace() << "prestage " << use.target << "/" << use.name << " on "
+                        << cs->nodeName() << endl;
+                ++asked;
+                break;
+            }
+        }
+    }
+}
+
+static string file_server_key(const Job *job)
+{
+    string key = job->targetPlatform() + ":" + job->language() + ":" + job->fileName();
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        key += ":" + it->second;
+    }
+
+    return key;
+}
+
+static void remember_file_server(const Job *job, const CompileServer *cs)
+{
+    if (job->fileName().empty() || cs == job->submitter()
+            || !(cs->caches() & DaemonCache_Objects)) {
+        return;
+    }
+
+    string key = file_server_key(job);
+    map<string, unsigned int>::iterator it = file_servers.find(key);
+
+    if (it != file_servers.end()) {
+        it->second = cs->hostId();
+        return;
+    }
+
+    file_servers[key] = cs->hostId();
+    file_servers_order.push_back(key);
+
+    if (file_servers_order.size() > MAX_FILE_SERVERS) {
+        file_servers.erase(file_servers_order.front());
+        file_servers_order.pop_front();
+    }
+}
+
+/* The server that compiled the same file before, if it still keeps an
+   object cache, can take the job right now and has the environment.  */
+static CompileServer *file_server(Job *job)
+{
+    if (job->fileName().empty()) {
+        return 0;
+    }
+
+    map<string, unsigned int>::const_iterator it = file_servers.find(file_server_key(job));
+
+    if (it == file_servers.end()) {
+        return 0;
+    }
+
+    for (list<CompileServer *>::iterator cit = css.begin(); cit != css.end(); ++cit) {
+        CompileServer *cs = *cit;
+
+        if (cs->hostId() == it->second) {
+            if (cs != job->submitter() && (cs->caches() & DaemonCache_Objects)
+                    && cs->is_eligible(job) && !envs_match(cs, job).empty()) {
+                return cs;
+            }
+
+            break;
+        }
+    }
+
+    return 0;
+}
+
 static CompileServer *pick_server(Job *job)
 {
 #if DEBUG_SCHEDULER > 1
@@ -671,6 +972,21 @@ static CompileServer *pick_server(Job *job)
         best = 0;
     }
 
+    /* The server that compiled the file before likely has the result in
+       its object cache. Take it if it's nearly as good as the best one.  */
+    CompileServer *cached = best ? file_server(job) : 0;
+
+    if (cached && cached != best && cached->load() < 1000
+            && int(cached->jobList().size()) < cached->maxJobs()
+            && cached->chrootPossible() && cached->check_remote(job)
+            && server_speed(cached, job) * 4 >= server_speed(best, job) * 3) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking " << cached->nodeName() << " which compiled " << job->fileName()
+                << " before " << server_speed(cached, job) << endl;
+#endif
+        return cached;
+    }
+
     if (best) {
 #if DEBUG_SCHEDULER > 1
         trace() << "taking best installed " << best->nodeName() << " " <<  server_speed(best, job) << endl;
@@ -867,6 +1183,13 @@ static bool empty_queue()
 
     UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
+    m2.server_protocol = cs->protocolVersion();
+    m2.server_features = cs->compressionFeatures();
+    m2.server_caches = cs->caches();
+
+    if (!gotit) {
+        m2.env_peers = env_peers(cs, job, host_platform);
+    }
 
     if (!job->submitter()->send_msg(m2)) {
         trace() << "failed to deliver job " << job->id() << endl;
@@ -882,6 +1205,7 @@ static bool empty_queue()
     }
 #endif
     cs->appendJob(job);
+    remember_file_server(job, cs);
 
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
@@ -926,6 +1250,9 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     cs->setCompilerVersions(m->envs);
     cs->setMaxJobs(m->max_kids);
     cs->setNoRemote(m->noremote);
+    cs->setProtocolVersion(m->protocol_version);
+    cs->setCompressionFeatures(m->compression_features);
+    cs->setCaches(m->caches);
 
     if (m->nodename.length()) {
         cs->setNodeName(m->nodename);
@@ -1241,6 +1568,34 @@ static bool handle_blacklist_host_env(CompileServer *cs, Msg *_m)
     return true;
 }
 
+/* Counts the job slots of the daemons that take remote jobs, for
+   the build systems that size their parallelism by it.  */
+static bool handle_get_capacity(CompileServer *cs, Msg *)
+{
+    CapacityMsg msg;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *server = *it;
+
+        if (server->type() != CompileServer::DAEMON || server->state() != CompileServer::LOGGEDIN
+                || server->noRemote() || server->maxJobs() <= 0) {
+            continue;
+        }
+
+        msg.total_remote += server->maxJobs();
+
+        if (server->load() < 1000 && int(server->jobList().size()) < server->maxJobs()) {
+            msg.free_remote += server->maxJobs() - server->jobList().size();
+        }
+    }
+
+    for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        msg.waiting += (*it)->l.size();
+    }
+
+    return cs->send_msg(msg);
+}
+
 static string dump_job(Job *job)
 {
     char buffer[1000];
@@ -1647,6 +2002,9 @@ static bool handle_activity(CompileServer *cs)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(cs, m);
         break;
+    case M_GET_CAPACITY:
+        ret = handle_get_capacity(cs, m);
+        break;
     default:
         log_info() << "Invalid message type arrived " << (char)m->type << endl;
         handle_end(cs, m);
@@ -2017,6 +2375,8 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        prestage_environments();
+
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
            their daemons if we are the preferred scheduler (daemons with version new enough
            should automatically select the best scheduler, but old daemons connect randomly). */
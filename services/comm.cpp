@@ -29,6 +29,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <netinet/in.h>
@@ -47,9 +48,16 @@
 #include <assert.h>
 #include <lzo/lzo1x.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+#include <map>
 #ifdef HAVE_LIBCAP_NG
 #include <cap-ng.h>
 #endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 
 #include "logging.h"
 #include "job.h"
@@ -66,6 +74,181 @@ using namespace std;
 
 #define MAX_MSG_SIZE 1 * 1024 * 1024
 
+/* zstd level 1 is about as fast as LZO1X-1, but compresses preprocessed
+   sources and object files much better.  */
+#define DEFAULT_ZSTD_LEVEL 1
+
+#define DEFAULT_CODEC Codec_Auto
+#define DEFAULT_LEVEL 0
+
+/* Received chunks are decompressed into buffers of this size (bigger chunks
+   get their own), and a few of them are kept for reuse, so the allocator
+   isn't involved for every chunk.  */
+#define CHUNK_BUFFER_SIZE 128 * 1024
+#define CHUNK_POOL_SIZE 8
+
+static unsigned char *chunk_pool[CHUNK_POOL_SIZE];
+static int chunk_pool_count = 0;
+
+static unsigned char *get_chunk_buffer(size_t len)
+{
+    if (len > CHUNK_BUFFER_SIZE) {
+        return new unsigned char[len];
+    }
+
+    if (chunk_pool_count) {
+        return chunk_pool[--chunk_pool_count];
+    }
+
+    return new unsigned char[CHUNK_BUFFER_SIZE];
+}
+
+/* LEN has to be the one passed to get_chunk_buffer().  */
+static void release_chunk_buffer(unsigned char *buf, size_t len)
+{
+    if (buf && len <= CHUNK_BUFFER_SIZE && chunk_pool_count < CHUNK_POOL_SIZE) {
+        chunk_pool[chunk_pool_count++] = buf;
+        return;
+    }
+
+    delete [] buf;
+}
+
+/* Before anything is measured, assume a gigabit link.  */
+#define DEFAULT_BANDWIDTH 100e6
+#define MAX_BANDWIDTH 10e9
+
+static CompressionCodec default_codecs[Payload_Count] = {
+    DEFAULT_CODEC, DEFAULT_CODEC, DEFAULT_CODEC, DEFAULT_CODEC
+};
+static int default_levels[Payload_Count] = {
+    DEFAULT_LEVEL, DEFAULT_LEVEL, DEFAULT_LEVEL, DEFAULT_LEVEL
+};
+
+static const char *const payload_names[Payload_Count] = {
+    "generic", "source", "object", "env"
+};
+
+#ifdef HAVE_LIBZSTD
+struct ZstdDictionary {
+    unsigned int id;
+    string data;
+    ZSTD_DDict *ddict;
+    // created on demand, a CDict is bound to one compression level
+    map<int, ZSTD_CDict *> cdicts;
+};
+
+static ZstdDictionary *zstd_dictionaries[Payload_Count];
+// identifies the loaded set of dictionaries, 0 if there are none
+static uint32_t zstd_dictionaries_fingerprint = 0;
+
+static ZSTD_DDict *find_zstd_ddict(unsigned int id)
+{
+    for (int i = 0; i < Payload_Count; ++i) {
+        if (zstd_dictionaries[i] && zstd_dictionaries[i]->id == id) {
+            return zstd_dictionaries[i]->ddict;
+        }
+    }
+
+    return 0;
+}
+
+static ZSTD_CDict *find_zstd_cdict(FilePayload payload, int level)
+{
+    ZstdDictionary *dict = zstd_dictionaries[payload];
+
+    if (!dict) {
+        return 0;
+    }
+
+    map<int, ZSTD_CDict *>::const_iterator it = dict->cdicts.find(level);
+
+    if (it != dict->cdicts.end()) {
+        return it->second;
+    }
+
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict->data.data(), dict->data.size(), level);
+    dict->cdicts[level] = cdict;
+    return cdict;
+}
+#endif
+
+/* The codecs Codec_Auto chooses from. The speed (bytes per second) and ratio
+   (compressed / uncompressed size) are initial guesses, they get refined per
+   payload type by measuring the compressed chunks.  */
+struct CodecCandidate {
+    CompressionCodec codec;
+    int level;
+    double speed;
+    double ratio;
+};
+
+static const CodecCandidate codec_candidates[] = {
+    { Codec_None, 0, 0, 1.0 },
+    { Codec_LZO, 0, 400e6, 0.45 },
+    { Codec_Zstd, 1, 300e6, 0.30 },
+    { Codec_Zstd, 3, 150e6, 0.27 },
+    { Codec_Zstd, 9, 40e6, 0.24 }
+};
+
+#define CODEC_CANDIDATES (int)(sizeof(codec_candidates) / sizeof(codec_candidates[0]))
+
+struct CodecEstimate {
+    double speed;
+    double ratio;
+};
+
+static CodecEstimate codec_estimates[Payload_Count][CODEC_CANDIDATES];
+static bool codec_estimates_initialized = false;
+
+// the measured bandwidth of all peers we talked to, so that it survives
+// the channel
+static map<string, double> peer_bandwidth;
+
+static double current_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Estimate the entropy in bits per byte from a sample of BUF. Compressed data
+   like gzip or bzip2 environment tarballs is close to 8.  */
+static double sample_entropy(const unsigned char *buf, size_t len)
+{
+    unsigned int counts[256] = { 0 };
+    size_t step = len > 4096 ? len / 4096 : 1;
+    size_t samples = 0;
+
+    for (size_t i = 0; i < len; i += step) {
+        counts[buf[i]]++;
+        samples++;
+    }
+
+    double entropy = 0;
+
+    for (int i = 0; i < 256; ++i) {
+        if (counts[i]) {
+            double p = counts[i] / (double) samples;
+            entropy -= p * log(p) / M_LN2;
+        }
+    }
+
+    return entropy;
+}
+
+/* The codecs we can decode, announced to the peer during the handshake in the
+   lower 16 bits, the upper 16 bits identify the zstd dictionaries.  */
+static uint32_t local_compression_features()
+{
+    uint32_t codecs = (1 << Codec_None) | (1 << Codec_LZO);
+#ifdef HAVE_LIBZSTD
+    codecs |= 1 << Codec_Zstd;
+    codecs |= zstd_dictionaries_fingerprint << 16;
+#endif
+    return codecs;
+}
+
 /* TODO
  * buffered in/output per MsgChannel
     + move read* into MsgChannel, create buffer-fill function
@@ -78,31 +261,79 @@ using namespace std;
     of the whole data packet?)
  */
 
-/* Tries to fill the inbuf completely.  */
+/* Raw payloads at least this big are sent from the caller's buffer with
+   writev() instead of being copied into msgbuf.  */
+#define MIN_ZERO_COPY_SIZE 16384
+
+/* How many file descriptors one read can receive.  */
+#define MAX_PASSED_FDS 8
+
+/* Reads what is available. The data goes to the free space at the end of
+   inbuf and, if there is more, to a buffer on the stack, so that one
+   recvmsg() gets everything no matter how much room was left.  */
 bool MsgChannel::read_a_bit()
 {
     chop_input();
-    size_t count = inbuflen - inofs;
-
-    if (count < 128) {
-        inbuflen = (inbuflen + 128 + 127) & ~(size_t) 127;
-        inbuf = (char *) realloc(inbuf, inbuflen);
-        count = inbuflen - inofs;
-    }
+    reserve_input(4096);
 
-    char *buf = inbuf + inofs;
+    char overflow[65536];
     bool error = false;
 
-    while (count) {
-        if (eof) {
-            break;
-        }
+    while (!eof) {
+        struct iovec iov[2];
+        iov[0].iov_base = inbuf + inofs;
+        iov[0].iov_len = inbuflen - inofs;
+        iov[1].iov_base = overflow;
+        iov[1].iov_len = sizeof(overflow);
+
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t ret = recvmsg(fd, &msg, 0);
+#endif
+        read_calls++;
+
+        if (ret > 0 && msg.msg_controllen) {
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                    continue;
+                }
 
-        ssize_t ret = read(fd, buf, count);
+                int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+                for (int i = 0; i < count; ++i) {
+                    int passed;
+                    memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    fcntl(passed, F_SETFD, FD_CLOEXEC);
+                    received_fds.push_back(passed);
+                }
+            }
+        }
 
         if (ret > 0) {
-            count -= ret;
-            buf += ret;
+            size_t count = ret;
+            bytes_read += count;
+
+            if (count <= iov[0].iov_len) {
+                inofs += count;
+            } else {
+                size_t extra = count - iov[0].iov_len;
+                inofs = inbuflen;
+                reserve_input(extra);
+                memcpy(inbuf + inofs, overflow, extra);
+                inofs += extra;
+            }
         } else if (ret < 0 && errno == EINTR) {
             continue;
         } else if (ret < 0) {
@@ -117,8 +348,6 @@ bool MsgChannel::read_a_bit()
         break;
     }
 
-    inofs = buf - inbuf;
-
     if (!update_state()) {
         error = true;
     }
@@ -146,7 +375,29 @@ bool MsgChannel::update_state(void)
                 remote_prot |= vers[i] << (i * 8);
             }
 
-            if (protocol == -1) {
+            if (assumed_proto_words) {
+                /* We already talk PROTOCOL, the peer's version, echo and
+                   features have to agree.  */
+                int word = (IS_PROTOCOL_36(this) ? 3 : 2) - assumed_proto_words;
+
+                if (word == 0 && min(remote_prot, (uint32_t) PROTOCOL_VERSION) != (uint32_t) protocol) {
+                    log_error() << "peer " << name << " has protocol " << remote_prot
+                                << ", not as assumed " << protocol << endl;
+                    protocol = 0;
+                    return false;
+                } else if (word == 1 && remote_prot != (uint32_t) protocol) {
+                    protocol = 0;
+                    return false;
+                } else if (word == 2) {
+                    peer_codecs = remote_prot & 0xffff;
+                    peer_dictionaries = remote_prot >> 16;
+                }
+
+                if (--assumed_proto_words == 0) {
+                    instate = NEED_LEN;
+                    break;
+                }
+            } else if (protocol == -1) {
                 /* The first time we read the remote protocol.  */
                 protocol = 0;
 
@@ -165,6 +416,18 @@ bool MsgChannel::update_state(void)
 
                 writefull(vers, 4);
 
+                /* Since protocol 36 the echo is followed by the codecs
+                   we can decode, so no extra round trip is needed.  */
+                if (remote_prot >= 36) {
+                    uint32_t features = local_compression_features();
+
+                    for (int i = 0; i < 4; ++i) {
+                        vers[i] = features >> (i * 8);
+                    }
+
+                    writefull(vers, 4);
+                }
+
                 if (!flush_writebuf(true)) {
                     return false;
                 }
@@ -179,9 +442,19 @@ bool MsgChannel::update_state(void)
                     return false;
                 }
 
+                if (IS_PROTOCOL_36(this)) {
+                    /* The compression features follow.  */
+                    continue;
+                }
+
                 instate = NEED_LEN;
                 /* Don't consume bytes from messages.  */
                 break;
+            } else if (IS_PROTOCOL_36(this)) {
+                peer_codecs = remote_prot & 0xffff;
+                peer_dictionaries = remote_prot >> 16;
+                instate = NEED_LEN;
+                break;
             } else {
                 trace() << "NEED_PROTO but protocol > 0" << endl;
             }
@@ -217,10 +490,7 @@ bool MsgChannel::update_state(void)
                 return false;
             }
 
-            if (inbuflen - intogo < inmsglen) {
-                inbuflen = (inmsglen + intogo + 127) & ~(size_t)127;
-                inbuf = (char *) realloc(inbuf, inbuflen);
-            }
+            reserve_input(inmsglen - min((size_t) inmsglen, inofs - intogo));
 
             instate = FILL_BUF;
             /* FALLTHROUGH */
@@ -246,59 +516,139 @@ bool MsgChannel::update_state(void)
     return true;
 }
 
+/* The buffers are used like rings that wrap around as soon as everything
+   in them has been consumed. Data is only moved to the front if there's not
+   enough room left at the end, and the buffers grow geometrically.  */
+static void grow_buffer(char *&buf, size_t &buflen, size_t needed)
+{
+    if (needed <= buflen) {
+        return;
+    }
+
+    size_t newlen = max(buflen * 2, (needed + 127) & ~(size_t) 127);
+    buf = (char *) realloc(buf, newlen);
+    buflen = newlen;
+}
+
 void MsgChannel::chop_input()
 {
-    /* Make buffer smaller, if there's much already read in front
-       of it, or it is cheap to do.  */
-    if (intogo > 8192 || inofs - intogo <= 16) {
-        if (inofs - intogo != 0) {
-            memmove(inbuf, inbuf + intogo, inofs - intogo);
-        }
+    if (intogo == inofs) {
+        intogo = inofs = 0;
+    }
+}
+
+/* Makes room for COUNT more bytes after inofs.  */
+void MsgChannel::reserve_input(size_t count)
+{
+    if (inbuflen - inofs >= count) {
+        return;
+    }
 
+    if (intogo) {
+        memmove(inbuf, inbuf + intogo, inofs - intogo);
         inofs -= intogo;
         intogo = 0;
     }
+
+    grow_buffer(inbuf, inbuflen, inofs + count);
 }
 
 void MsgChannel::chop_output()
 {
-    if (msgofs > 8192 || msgtogo <= 16) {
-        if (msgtogo) {
-            memmove(msgbuf, msgbuf + msgofs, msgtogo);
-        }
+    if (!msgtogo) {
+        msgofs = 0;
+    }
+}
+
+/* Makes room for COUNT more bytes after the pending output.  */
+void MsgChannel::reserve_output(size_t count)
+{
+    if (msgbuflen - msgofs - msgtogo >= count) {
+        return;
+    }
 
+    if (msgofs) {
+        memmove(msgbuf, msgbuf + msgofs, msgtogo);
         msgofs = 0;
     }
+
+    grow_buffer(msgbuf, msgbuflen, msgtogo + count);
 }
 
-void MsgChannel::writefull(const void *_buf, size_t count)
+/* Copies a raw payload that wasn't sent yet into msgbuf, needed before
+   anything else is added or the caller's buffer goes away.  */
+void MsgChannel::materialize_external()
 {
-    if (msgtogo + count >= msgbuflen) {
-        /* Realloc to a multiple of 128.  */
-        msgbuflen = (msgtogo + count + 127) & ~(size_t)127;
-        msgbuf = (char *) realloc(msgbuf, msgbuflen);
+    if (!external_len) {
+        return;
     }
 
-    memcpy(msgbuf + msgtogo, _buf, count);
+    const void *buf = external_buf;
+    size_t len = external_len;
+    external_buf = 0;
+    external_len = 0;
+    writefull(buf, len);
+}
+
+void MsgChannel::writefull(const void *_buf, size_t count)
+{
+    materialize_external();
+    reserve_output(count);
+    memcpy(msgbuf + msgofs + msgtogo, _buf, count);
     msgtogo += count;
 }
 
-bool MsgChannel::flush_writebuf(bool blocking)
+bool MsgChannel::flush_writebuf(bool blocking, bool partial)
 {
     trace() << "进来了：开始传送源文件" << endl;
-    const char *buf = msgbuf + msgofs;
     bool error = false;
+    bool waited = false;
+    size_t total = msgtogo + external_len;
+    double start = current_time();
+
+    while (msgtogo || external_len) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+
+        if (msgtogo) {
+            iov[msg.msg_iovlen].iov_base = msgbuf + msgofs;
+            iov[msg.msg_iovlen].iov_len = msgtogo;
+            msg.msg_iovlen++;
+        }
+
+        if (external_len) {
+            iov[msg.msg_iovlen].iov_base = (void *) external_buf;
+            iov[msg.msg_iovlen].iov_len = external_len;
+            msg.msg_iovlen++;
+        }
+
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        if (fd_to_pass >= 0) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd_to_pass, sizeof(int));
+        }
 
-    while (msgtogo) {
 #ifdef MSG_NOSIGNAL
-        ssize_t ret = send(fd, buf, msgtogo, MSG_NOSIGNAL);
+        ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
 #else
         void (*oldsigpipe)(int);
 
         oldsigpipe = signal(SIGPIPE, SIG_IGN);
-        ssize_t ret = send(fd, buf, msgtogo, 0);
+        ssize_t ret = sendmsg(fd, &msg, 0);
         signal(SIGPIPE, oldsigpipe);
 #endif
+        write_calls++;
 
         if (ret < 0) {
             if (errno == EINTR) {
@@ -306,9 +656,11 @@ bool MsgChannel::flush_writebuf(bool blocking)
             }
 
             /* If we want to write blocking, but couldn't write anything,
-               select on the fd.  */
-            if (blocking && errno == EAGAIN) {
+               select on the fd. A fast open connect that couldn't send
+               data with the SYN gives EINPROGRESS.  */
+            if (blocking && (errno == EAGAIN || errno == EINPROGRESS)) {
                 int ready;
+                waited = true;
 
                 for (;;) {
                     fd_set write_set;
@@ -332,6 +684,8 @@ bool MsgChannel::flush_writebuf(bool blocking)
                 }
 
                 /* Timeout or real error --> error.  */
+            } else if (partial && (errno == EAGAIN || errno == EINPROGRESS)) {
+                break;
             }
 
             log_perror("flush_writebuf() failed");
@@ -343,16 +697,48 @@ bool MsgChannel::flush_writebuf(bool blocking)
             break;
         }
 
-        msgtogo -= ret;
-        buf += ret;
+        size_t sent = ret;
+        bytes_written += sent;
+        fd_to_pass = -1;
+
+        if (sent <= msgtogo) {
+            msgofs += sent;
+            msgtogo -= sent;
+        } else {
+            sent -= msgtogo;
+            msgofs += msgtogo;
+            msgtogo = 0;
+            external_buf = (const char *) external_buf + sent;
+            external_len -= sent;
+        }
     }
 
-    msgofs = buf - msgbuf;
     chop_output();
+
+    /* If we had to wait for the socket the link is the bottleneck and we
+       can measure it. If not, it takes more than we give it, so raise the
+       estimate until it does.  */
+    if (!error && !partial && total >= 16384) {
+        double elapsed = current_time() - start;
+
+        if (waited && elapsed > 0) {
+            bandwidth = 0.75 * bandwidth + 0.25 * (total / elapsed);
+        } else if (!waited) {
+            bandwidth = min(bandwidth * 1.1, MAX_BANDWIDTH);
+        }
+
+        peer_bandwidth[name] = bandwidth;
+    }
+
     trace() << "结束了，出错了没：" << error << endl;
     return !error;
 }
 
+bool MsgChannel::flushPending()
+{
+    return flush_writebuf(false, true);
+}
+
 MsgChannel &MsgChannel::operator>>(uint32_t &buf)
 {
     if (inofs >= intogo + 4) {
@@ -462,11 +848,186 @@ void MsgChannel::read_environments(Environments &envs)
     }
 }
 
-void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen)
+void MsgChannel::setCompression(FilePayload payload, CompressionCodec codec, int level)
+{
+    codecs[payload] = codec;
+    levels[payload] = level;
+}
+
+void MsgChannel::setCompression(CompressionCodec codec, int level)
+{
+    for (int i = 0; i < Payload_Count; ++i) {
+        setCompression((FilePayload) i, codec, level);
+    }
+}
+
+bool MsgChannel::peerSupportsCodec(CompressionCodec codec) const
+{
+    return codec < Codec_Count && (peer_codecs & (1 << codec));
+}
+
+bool MsgChannel::compress_chunk(CompressionCodec codec, int level, FilePayload payload,
+                                const unsigned char *in_buf, size_t in_len,
+                                unsigned char *out_buf, size_t &out_len)
+{
+    switch (codec) {
+    case Codec_None:
+        memcpy(out_buf, in_buf, in_len);
+        out_len = in_len;
+        return true;
+    case Codec_LZO: {
+        lzo_uint lzo_out_len = out_len;
+
+        if (!lzo_wrkmem) {
+            lzo_wrkmem = malloc(LZO1X_MEM_COMPRESS);
+        }
+
+        int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &lzo_out_len, lzo_wrkmem);
+
+        if (ret != LZO_E_OK) {
+            /* this should NEVER happen */
+            log_error() << "internal error - compression failed: " << ret << endl;
+            return false;
+        }
+
+        out_len = lzo_out_len;
+        return true;
+    }
+#ifdef HAVE_LIBZSTD
+    case Codec_Zstd: {
+        if (!zstd_cctx) {
+            zstd_cctx = ZSTD_createCCtx();
+        }
+
+        ZSTD_CCtx *cctx = (ZSTD_CCtx *) zstd_cctx;
+        ZSTD_CDict *cdict = 0;
+
+        if (zstd_dictionaries_fingerprint && peer_dictionaries == zstd_dictionaries_fingerprint) {
+            cdict = find_zstd_cdict(payload, level);
+        }
+
+        size_t ret;
+
+        if (cdict) {
+            ret = ZSTD_compress_usingCDict(cctx, out_buf, out_len, in_buf, in_len, cdict);
+        } else {
+            ret = ZSTD_compressCCtx(cctx, out_buf, out_len, in_buf, in_len, level);
+        }
+
+        if (ZSTD_isError(ret)) {
+            log_error() << "internal error - zstd compression failed: "
+                        << ZSTD_getErrorName(ret) << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#else
+    (void) level;
+    (void) payload;
+#endif
+    default:
+        break;
+    }
+
+    log_error() << "internal error - unsupported compression codec " << codec << endl;
+    return false;
+}
+
+bool MsgChannel::decompress_chunk(CompressionCodec codec,
+                                  const unsigned char *in_buf, size_t in_len,
+                                  unsigned char *out_buf, size_t &out_len)
+{
+    switch (codec) {
+    case Codec_None:
+        if (in_len != out_len) {
+            return false;
+        }
+
+        memcpy(out_buf, in_buf, in_len);
+        return true;
+    case Codec_LZO: {
+        lzo_uint lzo_out_len = out_len;
+        // LZO1X decompression needs no work memory
+        int ret = lzo1x_decompress(in_buf, in_len, out_buf, &lzo_out_len, 0);
+
+        if (ret != LZO_E_OK) {
+            log_error() << "lzo decompression failed: " << ret << endl;
+            return false;
+        }
+
+        out_len = lzo_out_len;
+        return true;
+    }
+#ifdef HAVE_LIBZSTD
+    case Codec_Zstd: {
+        if (!zstd_dctx) {
+            zstd_dctx = ZSTD_createDCtx();
+        }
+
+        ZSTD_DCtx *dctx = (ZSTD_DCtx *) zstd_dctx;
+        unsigned int dict_id = ZSTD_getDictID_fromFrame(in_buf, in_len);
+        size_t ret;
+
+        if (dict_id) {
+            ZSTD_DDict *ddict = find_zstd_ddict(dict_id);
+
+            if (!ddict) {
+                log_error() << "chunk needs unknown zstd dictionary " << dict_id << endl;
+                return false;
+            }
+
+            ret = ZSTD_decompress_usingDDict(dctx, out_buf, out_len, in_buf, in_len, ddict);
+        } else {
+            ret = ZSTD_decompressDCtx(dctx, out_buf, out_len, in_buf, in_len);
+        }
+
+        if (ZSTD_isError(ret) || ret != out_len) {
+            log_error() << "zstd decompression failed: "
+                        << (ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "short output") << endl;
+            return false;
+        }
+
+        return true;
+    }
+#endif
+    default:
+        break;
+    }
+
+    log_error() << "unsupported compression codec " << codec << endl;
+    return false;
+}
+
+/* An upper bound for the compressed size of LEN bytes.  */
+static size_t compress_bound(CompressionCodec codec, size_t len)
 {
-    lzo_uint uncompressed_len;
-    lzo_uint compressed_len;
+    switch (codec) {
+    case Codec_None:
+        return len;
+#ifdef HAVE_LIBZSTD
+    case Codec_Zstd:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        return len + len / 64 + 16 + 3;
+    }
+}
+
+void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen,
+                                bool *in_destination)
+{
+    size_t uncompressed_len;
+    size_t compressed_len;
     uint32_t tmp;
+    CompressionCodec codec = Codec_LZO;
+
+    if (IS_PROTOCOL_36(this)) {
+        *this >> tmp;
+        codec = (CompressionCodec) tmp;
+    }
+
     *this >> tmp;
     uncompressed_len = tmp;
     *this >> tmp;
@@ -487,28 +1048,47 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
         return;
     }
 
-    *uncompressed_buf = new unsigned char[uncompressed_len];
+    bool destination = false;
+
+    if (in_destination && chunk_destination) {
+        *uncompressed_buf = chunk_destination->reserve(uncompressed_len);
+        destination = *uncompressed_buf != 0;
+    }
+
+    if (!destination) {
+        *uncompressed_buf = get_chunk_buffer(uncompressed_len);
+    }
 
     if (uncompressed_len && compressed_len) {
-        const lzo_byte *compressed_buf = (lzo_byte *)(inbuf + intogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-        int ret = lzo1x_decompress(compressed_buf, compressed_len,
-                                   *uncompressed_buf, &uncompressed_len, wrkmem);
-        free(wrkmem);
+        const unsigned char *compressed_buf = (unsigned char *)(inbuf + intogo);
 
-        if (ret != LZO_E_OK) {
+        if (!decompress_chunk(codec, compressed_buf, compressed_len,
+                              *uncompressed_buf, uncompressed_len)) {
             /* This should NEVER happen.
             Remove the buffer, and indicate there is nothing in it,
             but don't reset the compressed_len, so our caller know,
             that there actually was something read in.  */
             log_error() << "internal error - decompression of data from " << dump().c_str()
-                        << " failed: " << ret << endl;
-            delete [] *uncompressed_buf;
+                        << " failed" << endl;
+
+            if (!destination) {
+                release_chunk_buffer(*uncompressed_buf, uncompressed_len);
+            }
+
             *uncompressed_buf = 0;
             uncompressed_len = 0;
+            destination = false;
         }
     }
 
+    if (destination) {
+        chunk_destination->commit(uncompressed_len);
+    }
+
+    if (in_destination) {
+        *in_destination = destination;
+    }
+
     /* Read over everything used, _also_ if there was some error.
        If we couldn't decode it now, it won't get better in the future,
        so just ignore this hunk.  */
@@ -517,34 +1097,139 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     _clen = compressed_len;
 }
 
-void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len)
+/* Returns the index of the chosen codec in codec_candidates, or -1 if the
+   data doesn't compress.  */
+int MsgChannel::choose_codec(FilePayload payload, const unsigned char *buf, size_t len,
+                             CompressionCodec &codec, int &level)
 {
-    lzo_uint in_len = _in_len;
-    lzo_uint out_len = _out_len;
-    out_len = in_len + in_len / 64 + 16 + 3;
-    *this << in_len;
-    size_t msgtogo_old = msgtogo;
-    *this << (uint32_t) 0;
+    codec = Codec_None;
+    level = 0;
+
+    if (len >= 1024 && sample_entropy(buf, len) > 7.5) {
+        return -1;
+    }
+
+    if (!codec_estimates_initialized) {
+        for (int p = 0; p < Payload_Count; ++p) {
+            for (int i = 0; i < CODEC_CANDIDATES; ++i) {
+                codec_estimates[p][i].speed = codec_candidates[i].speed;
+                codec_estimates[p][i].ratio = codec_candidates[i].ratio;
+            }
+        }
+
+        codec_estimates_initialized = true;
+    }
+
+    /* Every 32nd chunk try another codec, so the estimates for the ones
+       not chosen don't get stale.  */
+    int explore = -1;
+
+    if (++chunks_compressed % 32 == 0) {
+        explore = (chunks_compressed / 32) % CODEC_CANDIDATES;
+    }
+
+    int best = -1;
+    double best_cost = 0;
+
+    for (int i = 0; i < CODEC_CANDIDATES; ++i) {
+        const CodecCandidate &candidate = codec_candidates[i];
+
+        if (!peerSupportsCodec(candidate.codec)) {
+            continue;
+        }
+
+#ifndef HAVE_LIBZSTD
+        if (candidate.codec == Codec_Zstd) {
+            continue;
+        }
+#endif
+
+        if (i == explore) {
+            best = i;
+            break;
+        }
+
+        // seconds per input byte to compress and send it
+        const CodecEstimate &estimate = codec_estimates[payload][i];
+        double cost = estimate.ratio / bandwidth;
 
-    if (msgtogo + out_len >= msgbuflen) {
-        /* Realloc to a multiple of 128.  */
-        msgbuflen = (msgtogo + out_len + 127) & ~(size_t)127;
-        msgbuf = (char *) realloc(msgbuf, msgbuflen);
+        if (estimate.speed > 0) {
+            cost += 1 / estimate.speed;
+        }
+
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+
+    if (best < 0) {
+        codec = Codec_LZO;
+        return -1;
+    }
+
+    codec = codec_candidates[best].codec;
+    level = codec_candidates[best].level;
+    return best;
+}
+
+void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len,
+                                 FilePayload payload)
+{
+    CompressionCodec codec = Codec_LZO;
+    int level = 0;
+    int candidate = -1;
+
+    if (IS_PROTOCOL_36(this)) {
+        codec = codecs[payload];
+        level = levels[payload];
+
+        if (codec == Codec_Auto) {
+            candidate = choose_codec(payload, in_buf, _in_len, codec, level);
+        } else if (!peerSupportsCodec(codec)) {
+            /* Every peer can decode LZO.  */
+            codec = Codec_LZO;
+        }
+
+        *this << (uint32_t) codec;
     }
 
-    lzo_byte *out_buf = (lzo_byte *)(msgbuf + msgtogo);
-    lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-    int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, wrkmem);
-    free(wrkmem);
+    size_t out_len = compress_bound(codec, _in_len);
+    *this << (uint32_t) _in_len;
 
-    if (ret != LZO_E_OK) {
-        /* this should NEVER happen */
-        log_error() << "internal error - compression failed: " << ret << endl;
+    /* Big raw payloads are not copied, but sent from IN_BUF by
+       flush_writebuf(). If something else is written after them before
+       that, they get copied after all.  */
+    if (codec == Codec_None && _in_len >= MIN_ZERO_COPY_SIZE) {
+        *this << (uint32_t) _in_len;
+        external_buf = in_buf;
+        external_len = _in_len;
+        _out_len = _in_len;
+        return;
+    }
+
+    size_t msgtogo_old = msgtogo;
+    *this << (uint32_t) 0;
+    reserve_output(out_len);
+
+    unsigned char *out_buf = (unsigned char *)(msgbuf + msgofs + msgtogo);
+    double start = current_time();
+
+    if (!compress_chunk(codec, level, payload, in_buf, _in_len, out_buf, out_len)) {
         out_len = 0;
+    } else if (candidate >= 0 && _in_len >= 4096) {
+        CodecEstimate &estimate = codec_estimates[payload][candidate];
+        double elapsed = current_time() - start;
+
+        if (codec != Codec_None && elapsed > 0) {
+            estimate.speed = 0.8 * estimate.speed + 0.2 * (_in_len / elapsed);
+        }
+
+        estimate.ratio = 0.8 * estimate.ratio + 0.2 * ((double) out_len / _in_len);
     }
 
     uint32_t _olen = htonl(out_len);
-    memcpy(msgbuf + msgtogo_old, &_olen, 4);
+    memcpy(msgbuf + msgofs + msgtogo_old, &_olen, 4);
     msgtogo += out_len;
     _out_len = out_len;
 }
@@ -670,7 +1355,8 @@ static bool connect_async(int remote_fd, struct sockaddr *remote_addr, size_t re
     return true;
 }
 
-MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int timeout)
+MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int timeout,
+                                   int server_protocol, uint32_t server_features)
 {
     int remote_fd;
     struct sockaddr_in remote_addr;
@@ -679,6 +1365,15 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
         return 0;
     }
 
+#ifdef TCP_FASTOPEN_CONNECT
+    /* Our version goes out with the SYN if the server gave us a cookie
+       before.  */
+    if (server_protocol) {
+        int on = 1;
+        setsockopt(remote_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+    }
+#endif
+
     if (timeout) {
         if (!connect_async(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr), timeout)) {
             return 0;    // remote_fd is already closed
@@ -695,6 +1390,20 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
     }
 
     trace() << "connected to " << hostname << endl;
+
+    if (server_protocol) {
+        MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *)&remote_addr,
+                                       sizeof(remote_addr), false);
+        c->assume_protocol(server_protocol, server_features);
+
+        if (c->protocol <= 0) {
+            delete c;
+            c = 0;
+        }
+
+        return c;
+    }
+
     return createChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
 }
 
@@ -755,7 +1464,101 @@ MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
     return c;
 }
 
-MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
+MsgChannel *Service::createChannel(int fd, int protocol, uint32_t peer_codecs,
+                                   uint32_t peer_dictionaries)
+{
+    if (protocol < MIN_PROTOCOL_VERSION || protocol > PROTOCOL_VERSION) {
+        close(fd);
+        return 0;
+    }
+
+    struct sockaddr_storage remote_addr;
+    socklen_t len = sizeof(remote_addr);
+
+    if (getpeername(fd, (struct sockaddr *) &remote_addr, &len) < 0) {
+        log_perror("getpeername()");
+        close(fd);
+        return 0;
+    }
+
+    MsgChannel *c = new MsgChannel(fd, (struct sockaddr *) &remote_addr, len, false, protocol);
+    c->peer_codecs = peer_codecs;
+    c->peer_dictionaries = peer_dictionaries;
+    return c;
+}
+
+int Service::startConnect(const string &hostname, unsigned short p)
+{
+    int remote_fd;
+    struct sockaddr_in remote_addr;
+
+    if ((remote_fd = prepare_connect(hostname, p, remote_addr)) < 0) {
+        return -1;
+    }
+
+    fcntl(remote_fd, F_SETFL, O_NONBLOCK);
+    fcntl(remote_fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr)) < 0
+            && errno != EINPROGRESS) {
+        trace() << "connect failed on " << hostname << endl;
+        close(remote_fd);
+        return -1;
+    }
+
+    return remote_fd;
+}
+
+MsgChannel *Service::createChannelAsync(int fd)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error) {
+        close(fd);
+        return 0;
+    }
+
+    struct sockaddr_storage remote_addr;
+    socklen_t len = sizeof(remote_addr);
+
+    if (getpeername(fd, (struct sockaddr *) &remote_addr, &len) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    MsgChannel *c = new MsgChannel(fd, (struct sockaddr *) &remote_addr, len, false);
+
+    if (c->protocol == 0) {
+        delete c;
+        return 0;
+    }
+
+    return c;
+}
+
+bool MsgChannel::canPassFds() const
+{
+    return addr && addr->sa_family == AF_UNIX;
+}
+
+void MsgChannel::attachFd(int _fd)
+{
+    fd_to_pass = _fd;
+}
+
+int MsgChannel::takeReceivedFd()
+{
+    if (received_fds.empty()) {
+        return -1;
+    }
+
+    int ret = received_fds.front();
+    received_fds.pop_front();
+    return ret;
+}
+
+MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text, int established)
     : fd(_fd)
 {
     addr_len = _l;
@@ -787,6 +1590,29 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     intogo = 0;
     eof = false;
     text_based = text;
+    peer_codecs = 1 << Codec_LZO;
+    peer_dictionaries = 0;
+    chunks_compressed = 0;
+    lzo_wrkmem = 0;
+    chunk_destination = 0;
+    external_buf = 0;
+    external_len = 0;
+    fd_to_pass = -1;
+    assumed_proto_words = 0;
+    read_calls = 0;
+    write_calls = 0;
+    bytes_read = 0;
+    bytes_written = 0;
+
+    map<string, double>::const_iterator bw = peer_bandwidth.find(name);
+    bandwidth = bw != peer_bandwidth.end() ? bw->second : DEFAULT_BANDWIDTH;
+    zstd_cctx = 0;
+    zstd_dctx = 0;
+
+    for (int i = 0; i < Payload_Count; ++i) {
+        codecs[i] = default_codecs[i];
+        levels[i] = default_levels[i];
+    }
 
     int on = 1;
 
@@ -827,6 +1653,9 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     if (text_based) {
         instate = NEED_LEN;
         protocol = PROTOCOL_VERSION;
+    } else if (established) {
+        instate = NEED_LEN;
+        protocol = established;
     } else {
         instate = NEED_PROTO;
         protocol = -1;
@@ -850,6 +1679,10 @@ MsgChannel::~MsgChannel()
 
     fd = -1;
 
+    for (list<int>::const_iterator it = received_fds.begin(); it != received_fds.end(); ++it) {
+        close(*it);
+    }
+
     if (msgbuf) {
         free(msgbuf);
     }
@@ -861,6 +1694,13 @@ MsgChannel::~MsgChannel()
     if (addr) {
         free(addr);
     }
+
+    free(lzo_wrkmem);
+
+#ifdef HAVE_LIBZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx *) zstd_cctx);
+    ZSTD_freeDCtx((ZSTD_DCtx *) zstd_dctx);
+#endif
 }
 
 string MsgChannel::dump() const
@@ -868,6 +1708,41 @@ string MsgChannel::dump() const
     return name + ": (" + char((int)instate + 'A') + " eof: " + char(eof + '0') + ")";
 }
 
+void MsgChannel::assume_protocol(int server_protocol, uint32_t server_features)
+{
+    int prot = min(server_protocol, PROTOCOL_VERSION);
+
+    /* Only right after our version went out.  */
+    if (protocol != -1 || instate != NEED_PROTO || prot < MIN_PROTOCOL_VERSION) {
+        return;
+    }
+
+    unsigned char vers[4];
+
+    for (int i = 0; i < 4; ++i) {
+        vers[i] = prot >> (i * 8);
+    }
+
+    writefull(vers, 4);
+    protocol = prot;
+    assumed_proto_words = 2;
+
+    if (IS_PROTOCOL_36(this)) {
+        uint32_t features = local_compression_features();
+
+        for (int i = 0; i < 4; ++i) {
+            vers[i] = features >> (i * 8);
+        }
+
+        writefull(vers, 4);
+        peer_codecs = server_features & 0xffff;
+        peer_dictionaries = server_features >> 16;
+        assumed_proto_words = 3;
+    }
+
+    /* Goes out together with the first message.  */
+}
+
 /* Wait blocking until the protocol setup for this channel is complete.
    Returns false if an error occurred.  */
 bool MsgChannel::wait_for_protocol()
@@ -1092,6 +1967,33 @@ Msg *MsgChannel::get_msg(int timeout)
     case M_BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case M_CHUNK_REFS:
+        m = new ChunkRefsMsg;
+        break;
+    case M_CHUNK_REQUEST:
+        m = new ChunkRequestMsg;
+        break;
+    case M_PUMP_FILES:
+        m = new PumpFilesMsg;
+        break;
+    case M_GET_CAPACITY:
+        m = new GetCapacityMsg;
+        break;
+    case M_CAPACITY:
+        m = new CapacityMsg;
+        break;
+    case M_ENV_MANIFEST:
+        m = new EnvManifestMsg;
+        break;
+    case M_GET_ENV_FILES:
+        m = new GetEnvFilesMsg;
+        break;
+    case M_PRESTAGE_ENV:
+        m = new PrestageEnvMsg;
+        break;
+    case M_GET_ENV_MANIFEST:
+        m = new GetEnvManifestMsg;
+        break;
     case M_TIMEOUT:
         break;
     }
@@ -1122,15 +2024,20 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
     } else {
         *this << (uint32_t) 0;
         m.send_to_channel(this);
-        uint32_t len = htonl(msgtogo - msgtogo_old - 4);
-        memcpy(msgbuf + msgtogo_old, &len, 4);
+        uint32_t len = htonl(msgtogo + external_len - msgtogo_old - 4);
+        memcpy(msgbuf + msgofs + msgtogo_old, &len, 4);
     }
 
-    if ((flags & SendBulkOnly) && msgtogo < 4096) {
+    if (((flags & SendBulkOnly) && msgtogo + external_len < 4096) || (flags & SendQueued)) {
+        materialize_external();
         return true;
     }
 
-    return flush_writebuf((flags & SendBlocking));
+    bool ret = flush_writebuf((flags & SendBlocking));
+
+    /* The payload of a FileChunkMsg belongs to the caller.  */
+    materialize_external();
+    return ret;
 }
 
 #include "getifaddrs.h"
@@ -1441,37 +2348,204 @@ bool DiscoverSched::broadcastData(int port, const char* buf, int len)
     return false;
 }
 
-list<string> get_netnames(int timeout, int port)
+list<string> get_netnames(int timeout, int port)
+{
+    list<string> l;
+    int ask_fd;
+    struct sockaddr_in remote_addr;
+    socklen_t remote_len;
+    time_t time0 = time(0);
+
+    char buf = PROTOCOL_VERSION;
+    ask_fd = open_send_broadcast(port, &buf, 1);
+
+    do {
+        char buf2[BROAD_BUFLEN];
+        bool first = true;
+        /* Wait at least two seconds to give all schedulers a chance to answer
+           (unless that'd be longer than the timeout).*/
+        time_t timeout_time = time(NULL) + min(2 + 1, timeout);
+
+        /* Read/test all arriving packages.  */
+        while (get_broad_answer(ask_fd, first ? timeout : 0, buf2,
+                                &remote_addr, &remote_len)
+               && time(NULL) < timeout_time) {
+            first = false;
+            const char* name;
+            get_broad_data(buf2, &name, NULL, NULL);
+            l.push_back(name);
+        }
+    } while (time(0) - time0 < (timeout / 1000));
+
+    close(ask_fd);
+    return l;
+}
+
+static bool parse_codec(const string &spec, CompressionCodec &codec, int &level)
+{
+    string::size_type colon = spec.find(':');
+    string name = spec.substr(0, colon);
+    bool have_level = colon != string::npos;
+    level = 0;
+
+    if (have_level) {
+        const char *start = spec.c_str() + colon + 1;
+        char *end;
+        level = strtol(start, &end, 10);
+
+        if (end == start || *end) {
+            return false;
+        }
+    }
+
+    if (name == "auto") {
+        codec = Codec_Auto;
+    } else if (name == "none") {
+        codec = Codec_None;
+    } else if (name == "lzo") {
+        codec = Codec_LZO;
+    } else if (name == "zstd") {
+#ifdef HAVE_LIBZSTD
+        codec = Codec_Zstd;
+
+        if (!have_level) {
+            level = DEFAULT_ZSTD_LEVEL;
+        } else if (level > ZSTD_maxCLevel()) {
+            return false;
+        }
+#else
+        log_warning() << "built without zstd support, using lzo" << endl;
+        codec = Codec_LZO;
+#endif
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool set_default_compression(const string &spec)
+{
+    CompressionCodec new_codecs[Payload_Count];
+    int new_levels[Payload_Count];
+
+    for (int i = 0; i < Payload_Count; ++i) {
+        new_codecs[i] = default_codecs[i];
+        new_levels[i] = default_levels[i];
+    }
+
+    string::size_type pos = 0;
+
+    while (pos <= spec.length()) {
+        string::size_type comma = spec.find(',', pos);
+
+        if (comma == string::npos) {
+            comma = spec.length();
+        }
+
+        string item = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        if (item.empty()) {
+            continue;
+        }
+
+        int first = 0;
+        int last = Payload_Count - 1;
+        string::size_type equal = item.find('=');
+
+        if (equal != string::npos) {
+            string payload = item.substr(0, equal);
+            item = item.substr(equal + 1);
+
+            for (first = 0; first < Payload_Count; ++first) {
+                if (payload == payload_names[first]) {
+                    break;
+                }
+            }
+
+            if (first == Payload_Count) {
+                log_error() << "unknown payload type in compression setting: " << payload << endl;
+                return false;
+            }
+
+            last = first;
+        }
+
+        CompressionCodec codec;
+        int level;
+
+        if (!parse_codec(item, codec, level)) {
+            log_error() << "invalid compression setting: " << item << endl;
+            return false;
+        }
+
+        for (int i = first; i <= last; ++i) {
+            new_codecs[i] = codec;
+            new_levels[i] = level;
+        }
+    }
+
+    for (int i = 0; i < Payload_Count; ++i) {
+        default_codecs[i] = new_codecs[i];
+        default_levels[i] = new_levels[i];
+    }
+
+    return true;
+}
+
+bool load_compression_dictionaries(const string &dir)
 {
-    list<string> l;
-    int ask_fd;
-    struct sockaddr_in remote_addr;
-    socklen_t remote_len;
-    time_t time0 = time(0);
+#ifdef HAVE_LIBZSTD
+    bool found = false;
+    uint32_t fingerprint = 0;
 
-    char buf = PROTOCOL_VERSION;
-    ask_fd = open_send_broadcast(port, &buf, 1);
+    for (int i = 0; i < Payload_Count; ++i) {
+        string path = dir + '/' + payload_names[i] + ".zdict";
+        FILE *file = fopen(path.c_str(), "rb");
 
-    do {
-        char buf2[BROAD_BUFLEN];
-        bool first = true;
-        /* Wait at least two seconds to give all schedulers a chance to answer
-           (unless that'd be longer than the timeout).*/
-        time_t timeout_time = time(NULL) + min(2 + 1, timeout);
+        if (!file) {
+            continue;
+        }
 
-        /* Read/test all arriving packages.  */
-        while (get_broad_answer(ask_fd, first ? timeout : 0, buf2,
-                                &remote_addr, &remote_len)
-               && time(NULL) < timeout_time) {
-            first = false;
-            const char* name;
-            get_broad_data(buf2, &name, NULL, NULL);
-            l.push_back(name);
+        string data;
+        char buffer[65536];
+        size_t bytes;
+
+        while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            data.append(buffer, bytes);
         }
-    } while (time(0) - time0 < (timeout / 1000));
 
-    close(ask_fd);
-    return l;
+        fclose(file);
+
+        unsigned int id = ZSTD_getDictID_fromDict(data.data(), data.size());
+
+        // raw content dictionaries have no id, so the receiver couldn't find them
+        if (!id) {
+            log_error() << path << " is not a trained zstd dictionary" << endl;
+            continue;
+        }
+
+        ZstdDictionary *dict = new ZstdDictionary;
+        dict->id = id;
+        dict->data = data;
+        dict->ddict = ZSTD_createDDict(data.data(), data.size());
+        zstd_dictionaries[i] = dict;
+        fingerprint = fingerprint * 31 + id;
+        found = true;
+        trace() << "loaded zstd dictionary " << path << " (id " << id << ")" << endl;
+    }
+
+    if (found) {
+        fingerprint = ((fingerprint >> 16) ^ fingerprint) & 0xffff;
+        zstd_dictionaries_fingerprint = fingerprint ? fingerprint : 1;
+    }
+
+    return found;
+#else
+    log_warning() << "built without zstd support, ignoring dictionaries in " << dir << endl;
+    return false;
+#endif
 }
 
 void Msg::fill_from_channel(MsgChannel *)
@@ -1544,6 +2618,13 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     }
 }
 
+UseCSMsg::~UseCSMsg()
+{
+    if (connection_fd >= 0) {
+        close(connection_fd);
+    }
+}
+
 void UseCSMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
@@ -1559,6 +2640,38 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    if (IS_PROTOCOL_37(c)) {
+        *c >> connection_protocol;
+        *c >> connection_codecs;
+        *c >> connection_dictionaries;
+    } else {
+        connection_protocol = 0;
+        connection_codecs = 0;
+        connection_dictionaries = 0;
+    }
+
+    connection_fd = connection_protocol ? c->takeReceivedFd() : -1;
+
+    if (IS_PROTOCOL_38(c)) {
+        *c >> server_protocol;
+        *c >> server_features;
+    } else {
+        server_protocol = 0;
+        server_features = 0;
+    }
+
+    env_peers.clear();
+
+    if (IS_PROTOCOL_45(c)) {
+        *c >> env_peers;
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c >> server_caches;
+    } else {
+        server_caches = 0;
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -1574,6 +2687,41 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
+
+    if (IS_PROTOCOL_37(c)) {
+        *c << connection_protocol;
+        *c << connection_codecs;
+        *c << connection_dictionaries;
+    }
+
+    if (IS_PROTOCOL_38(c)) {
+        *c << server_protocol;
+        *c << server_features;
+    }
+
+    if (IS_PROTOCOL_45(c)) {
+        *c << env_peers;
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c << server_caches;
+    }
+}
+
+/* Small files sent inside other messages, compressed like file chunks.  */
+static void write_inline_data(MsgChannel *c, const string &data, size_t &compressed,
+                              FilePayload payload)
+{
+    c->writecompressed((const unsigned char *) data.data(), data.size(), compressed, payload);
+}
+
+static void read_inline_data(MsgChannel *c, string &data, size_t &compressed)
+{
+    unsigned char *buf = 0;
+    size_t len = 0;
+    c->readcompressed(&buf, len, compressed);
+    data.assign((const char *) buf, buf ? len : 0);
+    release_chunk_buffer(buf, len);
 }
 
 void CompileFileMsg::fill_from_channel(MsgChannel *c)
@@ -1627,6 +2775,46 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+
+    input_inline = false;
+    input.clear();
+
+    if (IS_PROTOCOL_39(c)) {
+        uint32_t has_input = 0;
+        *c >> has_input;
+
+        if (has_input) {
+            input_inline = true;
+            read_inline_data(c, input, input_compressed);
+        }
+    }
+
+    pump = false;
+
+    if (IS_PROTOCOL_41(c)) {
+        uint32_t _pump = 0;
+        *c >> _pump;
+        pump = _pump;
+
+        if (pump) {
+            list<string> _l3;
+            *c >> _l3;
+
+            for (list<string>::const_iterator it = _l3.begin(); it != _l3.end(); ++it) {
+                l.append(*it, Arg_Local);
+            }
+
+            job->setFlags(l);
+        }
+    }
+
+    batch_more = false;
+
+    if (IS_PROTOCOL_42(c)) {
+        uint32_t _batch_more = 0;
+        *c >> _batch_more;
+        batch_more = _batch_more;
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -1663,6 +2851,26 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+
+    if (IS_PROTOCOL_39(c)) {
+        *c << (uint32_t) input_inline;
+
+        if (input_inline) {
+            write_inline_data(c, input, input_compressed, Payload_Source);
+        }
+    }
+
+    if (IS_PROTOCOL_41(c)) {
+        *c << (uint32_t) pump;
+
+        if (pump) {
+            *c << job->localFlags();
+        }
+    }
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << (uint32_t) batch_more;
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
@@ -1688,27 +2896,40 @@ CompileJob *CompileFileMsg::takeJob()
 void FileChunkMsg::fill_from_channel(MsgChannel *c)
 {
     if (del_buf) {
-        delete [] buffer;
+        release_chunk_buffer(buffer, len);
     }
 
     buffer = 0;
-    del_buf = true;
 
     Msg::fill_from_channel(c);
-    c->readcompressed(&buffer, len, compressed);
+    bool in_destination = false;
+    c->readcompressed(&buffer, len, compressed, &in_destination);
+    del_buf = !in_destination;
 }
 
 void FileChunkMsg::send_to_channel(MsgChannel *c) const
 {
     Msg::send_to_channel(c);
-    c->writecompressed(buffer, len, compressed);
+    c->writecompressed(buffer, len, compressed, payload);
 }
 
 FileChunkMsg::~FileChunkMsg()
 {
     if (del_buf) {
-        delete [] buffer;
+        release_chunk_buffer(buffer, len);
+    }
+}
+
+void FileChunkMsg::assign(const unsigned char *data, size_t _len)
+{
+    if (del_buf) {
+        release_chunk_buffer(buffer, len);
     }
+
+    buffer = get_chunk_buffer(_len);
+    memcpy(buffer, data, _len);
+    len = _len;
+    del_buf = true;
 }
 
 void CompileResultMsg::fill_from_channel(MsgChannel *c)
@@ -1727,6 +2948,27 @@ void CompileResultMsg::fill_from_channel(MsgChannel *c)
         *c >> dwo;
         have_dwo_file = dwo;
     }
+
+    output_inline = false;
+
+    if (IS_PROTOCOL_39(c)) {
+        uint32_t has_output = 0;
+        *c >> has_output;
+        output_inline = has_output;
+        size_t compressed;
+
+        if (output_inline) {
+            read_inline_data(c, object, compressed);
+        }
+
+        if (output_inline && have_dwo_file) {
+            read_inline_data(c, dwo, compressed);
+        }
+    }
+
+    if (IS_PROTOCOL_41(c)) {
+        *c >> dep;
+    }
 }
 
 void CompileResultMsg::send_to_channel(MsgChannel *c) const
@@ -1739,6 +2981,23 @@ void CompileResultMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_35(c)) {
         *c << (uint32_t) have_dwo_file;
     }
+
+    if (IS_PROTOCOL_39(c)) {
+        *c << (uint32_t) output_inline;
+        size_t compressed;
+
+        if (output_inline) {
+            write_inline_data(c, object, compressed, Payload_Object);
+        }
+
+        if (output_inline && have_dwo_file) {
+            write_inline_data(c, dwo, compressed, Payload_Object);
+        }
+    }
+
+    if (IS_PROTOCOL_41(c)) {
+        *c << dep;
+    }
 }
 
 void JobBeginMsg::fill_from_channel(MsgChannel *c)
@@ -1841,6 +3100,9 @@ LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std:
     , chroot_possible(false)
     , nodename(_nodename)
     , host_platform(_host_platform)
+    , protocol_version(PROTOCOL_VERSION)
+    , compression_features(local_compression_features())
+    , caches(0)
 {
 #ifdef HAVE_LIBCAP_NG
     chroot_possible = capng_have_capability(CAPNG_EFFECTIVE, CAP_SYS_CHROOT);
@@ -1868,6 +3130,20 @@ void LoginMsg::fill_from_channel(MsgChannel *c)
     }
 
     noremote = (net_noremote != 0);
+
+    if (IS_PROTOCOL_38(c)) {
+        *c >> protocol_version;
+        *c >> compression_features;
+    } else {
+        protocol_version = 0;
+        compression_features = 0;
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c >> caches;
+    } else {
+        caches = 0;
+    }
 }
 
 void LoginMsg::send_to_channel(MsgChannel *c) const
@@ -1883,6 +3159,15 @@ void LoginMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_26(c)) {
         *c << noremote;
     }
+
+    if (IS_PROTOCOL_38(c)) {
+        *c << protocol_version;
+        *c << compression_features;
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c << caches;
+    }
 }
 
 void ConfCSMsg::fill_from_channel(MsgChannel *c)
@@ -2113,6 +3398,234 @@ void BlacklistHostEnvMsg::send_to_channel(MsgChannel *c) const
     *c << hostname;
 }
 
+/* The digests go as four words, so they don't depend on the byte order.  */
+static void read_chunk_refs(MsgChannel *c, vector<ChunkRef> &refs)
+{
+    uint32_t count = 0;
+    *c >> count;
+    refs.clear();
+
+    if (count > MAX_CHUNK_REFS) {
+        count = 0;
+    }
+
+    refs.resize(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        for (int w = 0; w < 4; ++w) {
+            uint32_t word = 0;
+            *c >> word;
+
+            for (int b = 0; b < 4; ++b) {
+                refs[i].digest[4 * w + b] = (word >> (24 - 8 * b)) & 0xff;
+            }
+        }
+
+        *c >> refs[i].len;
+    }
+}
+
+static void write_chunk_refs(MsgChannel *c, const vector<ChunkRef> &refs)
+{
+    *c << (uint32_t) refs.size();
+
+    for (size_t i = 0; i < refs.size(); ++i) {
+        for (int w = 0; w < 4; ++w) {
+            const unsigned char *d = refs[i].digest + 4 * w;
+            *c << (uint32_t) ((d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3]);
+        }
+
+        *c << refs[i].len;
+    }
+}
+
+void ChunkRefsMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    read_chunk_refs(c, refs);
+}
+
+void ChunkRefsMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    write_chunk_refs(c, refs);
+}
+
+void PumpFilesMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> files;
+    read_chunk_refs(c, refs);
+    *c >> system_dirs;
+}
+
+void PumpFilesMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << files;
+    write_chunk_refs(c, refs);
+    *c << system_dirs;
+}
+
+void ChunkRequestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t count = 0;
+    *c >> enabled;
+    *c >> count;
+    missing.clear();
+
+    if (count > MAX_CHUNK_REFS) {
+        count = 0;
+    }
+
+    missing.resize(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        *c >> missing[i];
+    }
+}
+
+void ChunkRequestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << enabled;
+    *c << (uint32_t) missing.size();
+
+    for (size_t i = 0; i < missing.size(); ++i) {
+        *c << missing[i];
+    }
+}
+
+void CapacityMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> total_remote;
+    *c >> free_remote;
+    *c >> waiting;
+    *c >> local_slots;
+    *c >> busy;
+    *c >> jobserver;
+}
+
+void CapacityMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << total_remote;
+    *c << free_remote;
+    *c << waiting;
+    *c << local_slots;
+    *c << busy;
+    *c << jobserver;
+}
+
+void EnvManifestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> files;
+    uint32_t count = 0;
+    *c >> count;
+    modes.clear();
+
+    if (count > MAX_CHUNK_REFS) {
+        count = 0;
+    }
+
+    modes.resize(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        *c >> modes[i];
+    }
+
+    read_chunk_refs(c, refs);
+    peers.clear();
+
+    if (IS_PROTOCOL_45(c)) {
+        *c >> peers;
+    }
+}
+
+void EnvManifestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << files;
+    *c << (uint32_t) modes.size();
+
+    for (size_t i = 0; i < modes.size(); ++i) {
+        *c << modes[i];
+    }
+
+    write_chunk_refs(c, refs);
+
+    if (IS_PROTOCOL_45(c)) {
+        *c << peers;
+    }
+}
+
+void GetEnvFilesMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t count = 0;
+    *c >> count;
+    modes.clear();
+
+    if (count > MAX_CHUNK_REFS) {
+        count = 0;
+    }
+
+    modes.resize(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        *c >> modes[i];
+    }
+
+    read_chunk_refs(c, refs);
+    *c >> offset;
+}
+
+void GetEnvFilesMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << (uint32_t) modes.size();
+
+    for (size_t i = 0; i < modes.size(); ++i) {
+        *c << modes[i];
+    }
+
+    write_chunk_refs(c, refs);
+    *c << offset;
+}
+
+void PrestageEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> target;
+    *c >> name;
+    *c >> peers;
+}
+
+void PrestageEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << target;
+    *c << name;
+    *c << peers;
+}
+
+void GetEnvManifestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> target;
+    *c >> name;
+}
+
+void GetEnvManifestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << target;
+    *c << name;
+}
+
 /*
 vim:cinoptions={.5s,g0,p5,t0,(0,^-0.5s,n-0.5s:tw=78:cindent:sw=4:
 */
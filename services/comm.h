@@ -32,11 +32,12 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <vector>
 
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 35
+#define PROTOCOL_VERSION 47
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -60,6 +61,18 @@
 #define IS_PROTOCOL_33(c) ((c)->protocol >= 33)
 #define IS_PROTOCOL_34(c) ((c)->protocol >= 34)
 #define IS_PROTOCOL_35(c) ((c)->protocol >= 35)
+#define IS_PROTOCOL_36(c) ((c)->protocol >= 36)
+#define IS_PROTOCOL_37(c) ((c)->protocol >= 37)
+#define IS_PROTOCOL_38(c) ((c)->protocol >= 38)
+#define IS_PROTOCOL_39(c) ((c)->protocol >= 39)
+#define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
+#define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
+#define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
+#define IS_PROTOCOL_47(c) ((c)->protocol >= 47)
 
 enum MsgType {
     // so far unknown
@@ -126,11 +139,52 @@ enum MsgType {
     M_VERIFY_ENV,
     M_VERIFY_ENV_RESULT,
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
-    M_BLACKLIST_HOST_ENV
+    M_BLACKLIST_HOST_ENV,
+    // C --> CS, md5 sums of the next chunks of the preprocessed source
+    M_CHUNK_REFS,
+    // CS --> C, which of these chunks have to be sent
+    M_CHUNK_REQUEST,
+    // C --> CS, the source and headers of a job in pump mode
+    M_PUMP_FILES,
+    // C --> CS, CS --> S, how many more jobs the cluster can take
+    M_GET_CAPACITY,
+    // S --> CS, CS --> C
+    M_CAPACITY,
+    // C --> CS, the files of an environment, instead of its tarball
+    M_ENV_MANIFEST,
+    // CS --> CS, files of environments the other CS has installed
+    M_GET_ENV_FILES,
+    // S --> CS, install an environment from other CS ahead of time
+    M_PRESTAGE_ENV,
+    // CS --> CS, the files of an environment the other CS has installed
+    M_GET_ENV_MANIFEST
 };
 
 class MsgChannel;
 
+// Codecs for FileChunkMsg payloads. Since protocol 36 both sides announce
+// the codecs they can decode right after the version handshake, before that
+// everything is LZO.
+enum CompressionCodec {
+    Codec_None = 0,
+    Codec_LZO = 1,
+    Codec_Zstd = 2,
+    Codec_Count,
+    // not sent, picks codec and level for each chunk from the measured
+    // bandwidth of the link and the cost and ratio of the codecs
+    Codec_Auto = 255
+};
+
+// What a file chunk carries, so that channels can use a different codec,
+// level or zstd dictionary for each kind of data.
+enum FilePayload {
+    Payload_Generic = 0,
+    Payload_Source,      // preprocessed source
+    Payload_Object,      // object and .dwo files
+    Payload_Environment, // environment tarballs
+    Payload_Count
+};
+
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
 
@@ -147,13 +201,28 @@ public:
     enum MsgType type;
 };
 
+// Lets a channel decompress file chunks straight into their final place,
+// e.g. a mapped output file, instead of a temporary buffer.
+class ChunkDestination
+{
+public:
+    virtual ~ChunkDestination() {}
+
+    // memory for LEN more bytes, or 0 to fall back to a buffer
+    virtual unsigned char *reserve(size_t len) = 0;
+    // LEN bytes of the memory returned by the last reserve() were filled
+    virtual void commit(size_t len) = 0;
+};
+
 class MsgChannel
 {
 public:
     enum SendFlags {
         SendBlocking = 1 << 0,
         SendNonBlocking = 1 << 1,
-        SendBulkOnly = 1 << 2
+        SendBulkOnly = 1 << 2,
+        // only queue the message, flushPending() sends it
+        SendQueued = 1 << 3
     };
 
     virtual ~MsgChannel();
@@ -167,6 +236,16 @@ public:
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
 
+    // bytes of sent messages the socket didn't take yet
+    size_t pendingOutput(void) const
+    {
+        return msgtogo + external_len;
+    }
+
+    // writes as much of the pending output as the socket takes without
+    // blocking, false on error
+    bool flushPending(void);
+
     bool has_msg(void) const
     {
         return eof || instate == HAS_MSG;
@@ -184,9 +263,26 @@ public:
         return text_based;
     }
 
-    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
+    // the version exchange with the peer is done
+    bool protocolEstablished(void) const
+    {
+        return instate != NEED_PROTO && protocol > 0;
+    }
+
+    // file descriptors can only be passed over unix sockets
+    bool canPassFds(void) const;
+    // FD is sent along with the next message, the caller keeps owning it
+    void attachFd(int fd);
+    // a file descriptor that came with the messages read so far, or -1,
+    // the caller owns it
+    int takeReceivedFd(void);
+
+    // *in_destination is set if the data went to the chunk destination
+    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen,
+                        bool *in_destination = 0);
     void writecompressed(const unsigned char *in_buf,
-                         size_t _in_len, size_t &_out_len);
+                         size_t _in_len, size_t &_out_len,
+                         FilePayload payload = Payload_Generic);
     void write_environments(const Environments &envs);
     void read_environments(Environments &envs);
     void read_line(std::string &line);
@@ -194,6 +290,19 @@ public:
 
     bool eq_ip(const MsgChannel &s) const;
 
+    // codec and level used for chunks of the given payload type, if the
+    // peer can't decode the codec, LZO is used instead
+    void setCompression(FilePayload payload, CompressionCodec codec, int level);
+    void setCompression(CompressionCodec codec, int level);
+    bool peerSupportsCodec(CompressionCodec codec) const;
+
+    // file chunks received while set are decompressed into DEST, it's not
+    // owned by the channel
+    void setChunkDestination(ChunkDestination *dest)
+    {
+        chunk_destination = dest;
+    }
+
     MsgChannel &operator>>(uint32_t &);
     MsgChannel &operator>>(std::string &);
     MsgChannel &operator>>(std::list<std::string> &);
@@ -211,23 +320,46 @@ public:
     std::string name;
     time_t last_talk;
 
+    // I/O statistics, number of readv/sendmsg calls and bytes transferred
+    unsigned long read_calls;
+    unsigned long write_calls;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+
+    // the codecs (bit mask) and zstd dictionary set the peer announced
+    uint32_t peer_codecs;
+    uint32_t peer_dictionaries;
+
 protected:
-    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false);
+    // ESTABLISHED is the protocol of a connection whose version exchange
+    // was already done, e.g. by the daemon that passed it to us
+    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false,
+               int established = 0);
 
     bool wait_for_protocol();
-    // returns false if there was an error sending something
-    bool flush_writebuf(bool blocking);
+    // sends our side of the version exchange right away assuming the peer
+    // has SERVER_PROTOCOL, its answer is checked when it arrives
+    void assume_protocol(int server_protocol, uint32_t server_features);
+    // returns false if there was an error sending something, with PARTIAL
+    // a full socket isn't an error and the rest stays pending
+    bool flush_writebuf(bool blocking, bool partial = false);
     void writefull(const void *_buf, size_t count);
     // returns false if there was an error in the protocol setup
     bool update_state(void);
     void chop_input(void);
     void chop_output(void);
+    void reserve_input(size_t count);
+    void reserve_output(size_t count);
+    void materialize_external(void);
     bool wait_for_msg(int timeout);
 
     char *msgbuf;
     size_t msgbuflen;
     size_t msgofs;
     size_t msgtogo;
+    // a raw payload sent directly from the caller's memory after msgbuf
+    const void *external_buf;
+    size_t external_len;
     char *inbuf;
     size_t inbuflen;
     size_t inofs;
@@ -243,10 +375,37 @@ protected:
     uint32_t inmsglen;
     bool eof;
     bool text_based;
+    // words of the peer's version exchange still to be checked after
+    // assume_protocol()
+    int assumed_proto_words;
 
 private:
     friend class Service;
 
+    bool compress_chunk(CompressionCodec codec, int level, FilePayload payload,
+                        const unsigned char *in_buf, size_t in_len,
+                        unsigned char *out_buf, size_t &out_len);
+    bool decompress_chunk(CompressionCodec codec,
+                          const unsigned char *in_buf, size_t in_len,
+                          unsigned char *out_buf, size_t &out_len);
+
+    int choose_codec(FilePayload payload, const unsigned char *buf, size_t len,
+                     CompressionCodec &codec, int &level);
+
+    CompressionCodec codecs[Payload_Count];
+    int levels[Payload_Count];
+    // estimated bytes per second the link to the peer can take
+    double bandwidth;
+    unsigned int chunks_compressed;
+    // per-channel codec state (LZO work memory, ZSTD_CCtx, ZSTD_DCtx),
+    // allocated on first use and kept for all chunks
+    void *lzo_wrkmem;
+    void *zstd_cctx;
+    void *zstd_dctx;
+    ChunkDestination *chunk_destination;
+    int fd_to_pass;
+    std::list<int> received_fds;
+
     // deep copied
     struct sockaddr *addr;
     socklen_t addr_len;
@@ -256,9 +415,22 @@ private:
 class Service
 {
 public:
-    static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
+    // if SERVER_PROTOCOL is known, the version exchange is done while the
+    // first messages are already being sent, see MsgChannel::assume_protocol()
+    static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout,
+                                     int server_protocol = 0, uint32_t server_features = 0);
     static MsgChannel *createChannel(const std::string &domain_socket);
     static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
+    // adopts a connection whose protocol setup was already done
+    static MsgChannel *createChannel(int remote_fd, int protocol, uint32_t peer_codecs,
+                                     uint32_t peer_dictionaries);
+
+    // starts a non-blocking connect, returns the socket or -1, it becomes
+    // writable once the connect finished, see createChannelAsync()
+    static int startConnect(const std::string &host, unsigned short p);
+    // creates a channel for a connected socket without waiting for the
+    // version exchange, read_a_bit() until protocolEstablished()
+    static MsgChannel *createChannelAsync(int remote_fd);
 };
 
 // --------------------------------------------------------------------------
@@ -336,6 +508,20 @@ private:
    milliseconds for answers.  */
 std::list<std::string> get_netnames(int waittime = 2000, int port = 8765);
 
+/* Parse a compression specification and make it the default for all channels
+   created afterwards. The format is a comma separated list of
+   [payload=]codec[:level], e.g. "zstd:3" or "lzo,source=zstd:9", where payload
+   is one of source, object or env and codec one of auto (the default), none,
+   lzo or zstd.
+   Returns false if the specification can't be parsed.  */
+bool set_default_compression(const std::string &spec);
+
+/* Load zstd dictionaries trained with "zstd --train" from DIR. The files are
+   named after the payload type they are used for (source.zdict, object.zdict,
+   env.zdict, generic.zdict). Dictionaries are only used for a channel if the
+   peer loaded the same set.  */
+bool load_compression_dictionaries(const std::string &dir);
+
 class PingMsg : public Msg
 {
 public:
@@ -392,7 +578,14 @@ class UseCSMsg : public Msg
 {
 public:
     UseCSMsg()
-        : Msg(M_USE_CS) {}
+        : Msg(M_USE_CS)
+        , connection_protocol(0)
+        , connection_codecs(0)
+        , connection_dictionaries(0)
+        , connection_fd(-1)
+        , server_protocol(0)
+        , server_features(0)
+        , server_caches(0) {}
     UseCSMsg(std::string platform, std::string host, unsigned int p, unsigned int id, bool gotit,
              unsigned int _client_id, unsigned int matched_host_jobs)
         : Msg(M_USE_CS),
@@ -402,7 +595,15 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          connection_protocol(0),
+          connection_codecs(0),
+          connection_dictionaries(0),
+          connection_fd(-1),
+          server_protocol(0),
+          server_features(0),
+          server_caches(0) {}
+    ~UseCSMsg();
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -414,6 +615,23 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    // if not 0, the local daemon passed an already set up connection to the
+    // compile server along with the message, these describe it
+    uint32_t connection_protocol;
+    uint32_t connection_codecs;
+    uint32_t connection_dictionaries;
+    // the passed connection, not part of the message, closed with the
+    // message unless whoever takes it sets it to -1
+    int connection_fd;
+    // the compile server's protocol version and compression features as
+    // known to the scheduler, 0 if unknown
+    uint32_t server_protocol;
+    uint32_t server_features;
+    // if the compile server has to install the environment, "host:port" of
+    // compile servers that have it, the nearest first
+    std::list<std::string> env_peers;
+    // the DaemonCache flags of the compile server, needs protocol 47
+    uint32_t server_caches;
 };
 
 class GetNativeEnvMsg : public Msg
@@ -455,6 +673,10 @@ class CompileFileMsg : public Msg
 public:
     CompileFileMsg(CompileJob *j, bool delete_job = false)
         : Msg(M_COMPILE_FILE)
+        , input_inline(false)
+        , input_compressed(0)
+        , pump(false)
+        , batch_more(false)
         , deleteit(delete_job)
         , job(j) {}
 
@@ -469,6 +691,18 @@ public:
     virtual void send_to_channel(MsgChannel *c) const;
     CompileJob *takeJob();
 
+    // the complete preprocessed input, sent inside the message instead of
+    // as FileChunkMsgs and an EndMsg, needs protocol 39
+    bool input_inline;
+    std::string input;
+    mutable size_t input_compressed;
+    // the job comes with the preprocessor flags, the source and headers
+    // follow as a PumpFilesMsg, needs protocol 41
+    bool pump;
+    // another job for the same environment follows on the connection after
+    // the result of this one, needs protocol 42
+    bool batch_more;
+
 private:
     std::string remote_compiler_name() const;
 
@@ -479,20 +713,25 @@ private:
 class FileChunkMsg : public Msg
 {
 public:
-    FileChunkMsg(unsigned char *_buffer, size_t _len)
+    FileChunkMsg(unsigned char *_buffer, size_t _len, FilePayload _payload = Payload_Generic)
         : Msg(M_FILE_CHUNK)
         , buffer(_buffer)
         , len(_len)
-        , del_buf(false) {}
+        , del_buf(false)
+        , payload(_payload) {}
 
     FileChunkMsg()
         : Msg(M_FILE_CHUNK)
         , buffer(0)
         , len(0)
-        , del_buf(true) {}
+        , del_buf(true)
+        , payload(Payload_Generic) {}
 
     ~FileChunkMsg();
 
+    // copies DATA into a buffer owned by the message
+    void assign(const unsigned char *data, size_t len);
+
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
 
@@ -500,6 +739,8 @@ public:
     size_t len;
     mutable size_t compressed;
     bool del_buf;
+    // only used by the sender to pick the codec, not transferred
+    FilePayload payload;
 
 private:
     FileChunkMsg(const FileChunkMsg &);
@@ -513,7 +754,8 @@ public:
         : Msg(M_COMPILE_RESULT)
         , status(0)
         , was_out_of_memory(false)
-        , have_dwo_file(false) {}
+        , have_dwo_file(false)
+        , output_inline(false) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -523,6 +765,14 @@ public:
     std::string err;
     bool was_out_of_memory;
     bool have_dwo_file;
+    // the object and .dwo file, sent inside the message instead of as
+    // FileChunkMsgs and EndMsgs, needs protocol 39
+    bool output_inline;
+    std::string object;
+    std::string dwo;
+    // the dependency file written while preprocessing a pump mode job,
+    // needs protocol 41
+    std::string dep;
 };
 
 class JobBeginMsg : public Msg
@@ -621,13 +871,24 @@ public:
     uint32_t job_id;
 };
 
+// The caches a daemon keeps, announced since protocol 47.
+enum DaemonCache {
+    // results of compile jobs, see --object-cache
+    DaemonCache_Objects = 1 << 0,
+    // chunks of preprocessed sources, see --chunk-cache
+    DaemonCache_Chunks = 1 << 1
+};
+
 class LoginMsg : public Msg
 {
 public:
     LoginMsg(unsigned int myport, const std::string &_nodename, const std::string _host_platform);
     LoginMsg()
         : Msg(M_LOGIN)
-        , port(0) {}
+        , port(0)
+        , protocol_version(0)
+        , compression_features(0)
+        , caches(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -639,6 +900,12 @@ public:
     bool chroot_possible;
     std::string nodename;
     std::string host_platform;
+    // the daemon's PROTOCOL_VERSION and what it announces in the version
+    // exchange, so clients can skip waiting for it
+    uint32_t protocol_version;
+    uint32_t compression_features;
+    // DaemonCache flags
+    uint32_t caches;
 };
 
 class ConfCSMsg : public Msg
@@ -914,4 +1181,170 @@ public:
     std::string hostname;
 };
 
+struct ChunkRef {
+    unsigned char digest[16];
+    uint32_t len;
+};
+
+// More than anyone sends, so a broken message doesn't allocate much.
+#define MAX_CHUNK_REFS 65536
+
+// The preprocessed source split at content defined boundaries, so the
+// chunks of headers that many files include look the same every time.
+class ChunkRefsMsg : public Msg
+{
+public:
+    ChunkRefsMsg()
+        : Msg(M_CHUNK_REFS) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::vector<ChunkRef> refs;
+};
+
+// The files the preprocessor reads for a job in pump mode, by their absolute
+// path, and the compiler's standard include directories on the client. The
+// CS answers with a ChunkRequestMsg and gets the files it doesn't have as
+// one FileChunkMsg each, followed by an EndMsg.
+class PumpFilesMsg : public Msg
+{
+public:
+    PumpFilesMsg()
+        : Msg(M_PUMP_FILES) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::list<std::string> files;
+    std::vector<ChunkRef> refs;
+    std::list<std::string> system_dirs;
+};
+
+// The answer to a ChunkRefsMsg, PumpFilesMsg or EnvManifestMsg. The missing chunks are sent
+// as FileChunkMsg in order, runs of consecutive chunks may share one message.
+class ChunkRequestMsg : public Msg
+{
+public:
+    ChunkRequestMsg()
+        : Msg(M_CHUNK_REQUEST)
+        , enabled(1) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // indexes into the refs of the missing chunks
+    std::vector<uint32_t> missing;
+    // 0 if the CS keeps no chunks, the rest is better sent as plain chunks
+    uint32_t enabled;
+};
+
+// Asks how many jobs the cluster can take right now. The CS answers its
+// clients from what the scheduler told it last, and asks the scheduler
+// again if that is older than a few seconds.
+class GetCapacityMsg : public Msg
+{
+public:
+    GetCapacityMsg()
+        : Msg(M_GET_CAPACITY) {}
+};
+
+class CapacityMsg : public Msg
+{
+public:
+    CapacityMsg()
+        : Msg(M_CAPACITY)
+        , total_remote(0)
+        , free_remote(0)
+        , waiting(0)
+        , local_slots(0)
+        , busy(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // job slots of the hosts that take remote jobs, and the free ones
+    uint32_t total_remote;
+    uint32_t free_remote;
+    // jobs that wait for a host
+    uint32_t waiting;
+    // filled in by the CS for its clients: its CPUs, the jobs of its
+    // clients that run right now, and the jobserver fifo it fills, if any
+    uint32_t local_slots;
+    uint32_t busy;
+    std::string jobserver;
+};
+
+// Sent after EnvTransferMsg instead of the tarball: the files of the
+// environment with their md5 sums. The CS answers with a ChunkRequestMsg for
+// the files it has in none of its environments, and their contents follow
+// as FileChunkMsg, one file after the other, then an EndMsg.
+class EnvManifestMsg : public Msg
+{
+public:
+    EnvManifestMsg()
+        : Msg(M_ENV_MANIFEST) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // the paths in the environment, their modes and contents
+    std::list<std::string> files;
+    std::vector<uint32_t> modes;
+    std::vector<ChunkRef> refs;
+    // compile servers the CS may get the files from instead, see UseCSMsg.
+    // The ChunkRequestMsg names those it could not get from them then.
+    std::list<std::string> peers;
+};
+
+// Asks a CS for files of its installed environments by their md5 sums and
+// modes. It sends their contents one after the other as FileChunkMsg, the
+// first one from OFFSET on, and ends with an EndMsg - early if it doesn't
+// have a file.
+class GetEnvFilesMsg : public Msg
+{
+public:
+    GetEnvFilesMsg()
+        : Msg(M_GET_ENV_FILES)
+        , offset(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::vector<uint32_t> modes;
+    std::vector<ChunkRef> refs;
+    uint32_t offset;
+};
+
+// Has an idle CS install an environment many jobs use, from the compile
+// servers PEERS that have it, so it's there when the jobs come.
+class PrestageEnvMsg : public Msg
+{
+public:
+    PrestageEnvMsg()
+        : Msg(M_PRESTAGE_ENV) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string target;
+    std::string name;
+    std::list<std::string> peers;
+};
+
+// Asks a CS for the files of an environment it has installed. It answers
+// with an EnvManifestMsg, or an EndMsg if it doesn't have it.
+class GetEnvManifestMsg : public Msg
+{
+public:
+    GetEnvManifestMsg()
+        : Msg(M_GET_ENV_MANIFEST) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string target;
+    std::string name;
+};
+
 #endif
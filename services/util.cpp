@@ -0,0 +1,169 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "util.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+bool read_fully(int fd, void *buf, size_t len)
+{
+    char *p = static_cast<char *>(buf);
+
+    while (len > 0) {
+        ssize_t bytes = read(fd, p, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        p += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+bool write_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = static_cast<const char *>(buf);
+
+    while (len > 0) {
+        ssize_t bytes = write(fd, p, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        p += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+bool read_file(const string &file, string &data, size_t max_size)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    data.clear();
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && size_t(st.st_size) <= max_size) {
+        data.reserve(st.st_size);
+    }
+
+    char buffer[65536];
+
+    for (;;) {
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0 || size_t(bytes) > max_size - data.size()) {
+            close(fd);
+            return false;
+        }
+
+        if (bytes == 0) {
+            break;
+        }
+
+        data.append(buffer, bytes);
+    }
+
+    close(fd);
+    return true;
+}
+
+bool write_file(const string &file, const void *data, size_t len, mode_t mode)
+{
+    int fd = open(file.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, mode);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write_fully(fd, data, len);
+    return close(fd) == 0 && ok;
+}
+
+bool write_file_atomic(const string &file, const string &data, mode_t mode)
+{
+    string tmp_file = file.substr(0, file.rfind('/') + 1) + ".tmp.XXXXXX";
+    vector<char> tmp_name(tmp_file.begin(), tmp_file.end());
+    tmp_name.push_back(0);
+    int fd = mkstemp(&tmp_name[0]);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write_fully(fd, data.data(), data.size()) && fchmod(fd, mode) == 0;
+
+    if (close(fd) != 0 || !ok || rename(&tmp_name[0], file.c_str()) != 0) {
+        unlink(&tmp_name[0]);
+        return false;
+    }
+
+    return true;
+}
+
+string md5_hex(const md5_byte_t digest[16])
+{
+    static const char hex[] = "0123456789abcdef";
+    string result(32, '0');
+
+    for (int i = 0; i < 16; ++i) {
+        result[2 * i] = hex[digest[i] >> 4];
+        result[2 * i + 1] = hex[digest[i] & 15];
+    }
+
+    return result;
+}
+
+string md5_hex(md5_state_t *state)
+{
+    md5_byte_t digest[16];
+    md5_finish(state, digest);
+    return md5_hex(digest);
+}
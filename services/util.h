@@ -21,10 +21,33 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <sys/types.h>
+#include <string>
+
+#include "md5.h"
+
 template<typename T>
 inline T ignore_result(T x __attribute__((unused)))
 {
     return x;
 }
 
+// Read or write all LEN bytes, retrying after EINTR and short counts.
+// Reading fails at EOF before LEN bytes.
+bool read_fully(int fd, void *buf, size_t len);
+bool write_fully(int fd, const void *buf, size_t len);
+
+// The whole contents of FILE, false if it can't be read or has more than
+// MAX_SIZE bytes.
+bool read_file(const std::string &file, std::string &data, size_t max_size = size_t(-1));
+// Creates or truncates FILE with MODE and writes DATA to it.
+bool write_file(const std::string &file, const void *data, size_t len, mode_t mode = 0666);
+// Writes FILE under a temporary name in its directory, .tmp.XXXXXX, and
+// renames it, so that nobody reads it half written.
+bool write_file_atomic(const std::string &file, const std::string &data, mode_t mode);
+
+// The md5 sum DIGEST, or the one STATE finishes with, in lowercase hex.
+std::string md5_hex(const md5_byte_t digest[16]);
+std::string md5_hex(md5_state_t *state);
+
 #endif
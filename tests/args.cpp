@@ -57,7 +57,31 @@ static void test_3() {
    restore_icecc_color_diagnostics();
 }
 
+void test_split(const string &prefix, const string &line, bool ok, const string expected) {
+  list<string> words;
+  bool got_ok = split_command_line(line, words);
+  string got = concat_args(words);
+  if (got_ok != ok || (ok && got != expected)) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: " << got_ok << " \"" << got << "\"\nexpected: " << ok << " \"" << expected << "\"\n";
+    exit(1);
+  }
+}
+
+static void test_4() {
+   test_split("4a", "gcc -DNAME=\"a b\" -c 'dir with/spaces.c' -o x\\ y.o", true,
+              "'gcc, -DNAME=a b, -c, dir with/spaces.c, -o, x y.o'");
+   test_split("4b", "gcc -DS='\"q\"' -DT=\"\\\"x\\\\\" \"\" \t-c\r", true,
+              "'gcc, -DS=\"q\", -DT=\"x\\, , -c'");
+   test_split("4c", "gcc -DX=\"a\\nb\"", true, "'gcc, -DX=a\\nb'");
+   test_split("4d", "gcc -DNAME=\"a b", false, "");
+   test_split("4e", "gcc 'a", false, "");
+   test_split("4f", "gcc a\\", false, "");
+}
+
 int main() {
+  // before test_3, which fails on the -I. that analyse_argv drops and exits
+  test_4();
   test_1();
   test_2();
   test_3();
@@ -0,0 +1,46 @@
+#include "cache.h"
+#include <list>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+void test_run(const string &prefix, const string &data, const string &expected) {
+  list<string> files;
+  parse_line_markers(data, "/src", files);
+  string got;
+  for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+    got += (got.empty() ? "" : " ") + *it;
+  }
+  if (got != expected) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+    exit(1);
+  }
+}
+
+static void test_1() {
+  test_run("1", "# 1 \"main.cpp\"\n# 1 \"<built-in>\"\n# 1 \"/usr/include/stdio.h\" 1 3\nint x;\n"
+           "# 12 \"main.cpp\" 2\n",
+           "/src/main.cpp /usr/include/stdio.h");
+}
+
+static void test_2() {
+  test_run("2", "#line 1 \"a.h\"\n#line 7 \"sub dir/b\\\"c.h\"\n",
+           "/src/a.h /src/sub dir/b\"c.h");
+}
+
+static void test_3() {
+  test_run("3", "# 1 \"main.c\"\n#pragma GCC diagnostic ignored \"-Wfoo\"\n#ident \"v1\"\n"
+           "#pragma message \"hello\"\n# pragma message(\"x\")\nchar *s = \"# 1 \\\"no.h\\\"\";\n"
+           "#line\"no.h\"\n# 1\"no.h\"\n",
+           "/src/main.c");
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  exit(0);
+}
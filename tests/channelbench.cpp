@@ -0,0 +1,183 @@
+/*
+    This file is part of Icecream.
+
+    Measures the throughput of MsgChannel file transfers over a socketpair,
+    similar to how the client sends preprocessed source to a daemon.
+
+    Usage: channelbench [codec [megabytes [chunksize]]]
+    codec is anything ICECC_COMPRESSION accepts (none, lzo, zstd:3, auto).
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "comm.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Something that compresses about like C++ source does.
+static void fill_data(vector<unsigned char> &data)
+{
+    static const char *const words[] = {
+        "int ", "const ", "std::string ", "return ", "if (", ") {\n", "}\n",
+        "template<typename T> ", "namespace ", "void ", "= 0;\n", "->", "#line ",
+        "unsigned ", "struct ", "static ", "(void)", "    ", "size_t ", "\n"
+    };
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < data.size();) {
+        seed = seed * 1103515245 + 12345;
+        const char *word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+
+        for (; *word && i < data.size(); ++word, ++i) {
+            data[i] = *word;
+        }
+    }
+}
+
+static int receive(int fd, size_t total, const vector<unsigned char> &data)
+{
+    MsgChannel *c = Service::createChannel(fd, 0, 0);
+
+    if (!c) {
+        return 1;
+    }
+
+    size_t received = 0;
+    bool good = true;
+
+    while (Msg *m = c->get_msg(30)) {
+        if (m->type == M_END) {
+            delete m;
+            break;
+        }
+
+        if (m->type != M_FILE_CHUNK) {
+            delete m;
+            good = false;
+            break;
+        }
+
+        FileChunkMsg *chunk = static_cast<FileChunkMsg *>(m);
+
+        if (memcmp(chunk->buffer, &data[received % data.size()], chunk->len) != 0) {
+            good = false;
+        }
+
+        received += chunk->len;
+        delete m;
+    }
+
+    if (received != total) {
+        good = false;
+    }
+
+    cout << "receiver: " << c->read_calls << " reads, "
+         << c->read_calls / (c->bytes_read / 1048576.0 + 1e-9) << " reads/MB" << endl;
+    delete c;
+    return good ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *codec = argc > 1 ? argv[1] : "auto";
+    size_t megabytes = argc > 2 ? atoi(argv[2]) : 256;
+    size_t chunksize = argc > 3 ? atoi(argv[3]) : 100000;
+
+    if (!set_default_compression(codec) || !megabytes || !chunksize) {
+        cerr << "usage: channelbench [codec [megabytes [chunksize]]]" << endl;
+        return 2;
+    }
+
+    vector<unsigned char> data(chunksize);
+    fill_data(data);
+    size_t total = megabytes * 1048576;
+    total -= total % chunksize;
+
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        close(sv[0]);
+        _exit(receive(sv[1], total, data));
+    }
+
+    close(sv[1]);
+    MsgChannel *c = Service::createChannel(sv[0], 0, 0);
+
+    if (!c) {
+        return 1;
+    }
+
+    double start = now();
+    size_t compressed = 0;
+
+    for (size_t sent = 0; sent < total; sent += chunksize) {
+        FileChunkMsg chunk(&data[0], chunksize, Payload_Source);
+
+        if (!c->send_msg(chunk)) {
+            cerr << "sending failed" << endl;
+            return 1;
+        }
+
+        compressed += chunk.compressed;
+    }
+
+    c->send_msg(EndMsg());
+    double elapsed = now() - start;
+
+    int status = 1;
+    waitpid(pid, &status, 0);
+    elapsed = max(now() - start, elapsed);
+
+    cout << "sender: " << codec << ", " << megabytes << " MB in "
+         << elapsed << " s, " << megabytes / elapsed << " MB/s, ratio "
+         << (double) compressed / total << ", " << c->write_calls << " writes, "
+         << c->write_calls / (c->bytes_written / 1048576.0 + 1e-9) << " writes/MB" << endl;
+    delete c;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cerr << "receiver got wrong data" << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "createenv.h"
+#include "testutil.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <list>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+// Built by configure from client/icecc-create-env.in, tests run in tests/.
+static string create_env_script() {
+  const char *script = getenv("ICECC_CREATE_ENV");
+  char *path = realpath(script ? script : "../client/icecc-create-env", NULL);
+  string result = path ? path : "";
+  free(path);
+  return result;
+}
+
+// The name of the tarball icecc-create-env creates in DIR.
+static string run_create_env(const string &dir, const string &gcc, const string &gpp) {
+  string script = create_env_script();
+  pid_t pid = script.empty() ? -1 : fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    if (chdir(dir.c_str()) != 0) {
+      _exit(1);
+    }
+    execlp("bash", "bash", script.c_str(), "--gcc", gcc.c_str(), gpp.c_str(), (char *) NULL);
+    _exit(1);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    return string();
+  }
+  string name;
+  DIR *d = opendir(dir.c_str());
+  while (struct dirent *ent = d ? readdir(d) : NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len > 7 && !strcmp(ent->d_name + len - 7, ".tar.gz")) {
+      name = ent->d_name;
+    }
+  }
+  if (d) {
+    closedir(d);
+  }
+  return name;
+}
+
+static bool tarball_has(const string &tarball, const string &file) {
+  string command = "tar tzf '" + tarball + "'";
+  FILE *list = popen(command.c_str(), "r");
+  if (!list) {
+    return false;
+  }
+  bool found = false;
+  char line[4096];
+  while (fgets(line, sizeof(line), list)) {
+    line[strcspn(line, "\n")] = '\0';
+    found = found || file == line;
+  }
+  pclose(list);
+  return found;
+}
+
+// The in-process builder names the environment with the same hash as
+// icecc-create-env, with the files sorted for the locale like sort(1) does.
+void test_run(const string &prefix, const char *locale, const string &gcc, const string &gpp) {
+  if (!setlocale(LC_COLLATE, locale)) {
+    cerr << prefix << " skipped, no locale " << locale << "\n";
+    return;
+  }
+  setenv("LC_ALL", locale, 1);
+
+  string dir = make_temp_dir("createenv");
+  string script_dir = make_temp_dir("createenv");
+  string got = create_gcc_env(dir, gcc, gpp, list<string>());
+  string expected = run_create_env(script_dir, gcc, gpp);
+  bool ld_so_cache = access("/sbin/ldconfig", X_OK) != 0
+                     || tarball_has(dir + "/" + got, "etc/ld.so.cache");
+  remove_dir(dir);
+  remove_dir(script_dir);
+
+  if (got.empty() || got != expected) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+    exit(1);
+  }
+  if (!ld_so_cache) {
+    cerr << prefix << " failed, no etc/ld.so.cache in " << got << "\n";
+    exit(1);
+  }
+}
+
+int main() {
+  string gcc, gpp;
+  if (!find_native_compilers(false, gcc, gpp)) {
+    // the automake exit status for a skipped test
+    exit(77);
+  }
+  test_run("1", "C", gcc, gpp);
+  test_run("2", "en_US.UTF-8", gcc, gpp);
+  test_run("3", "C.UTF-8", gcc, gpp);
+  exit(0);
+}
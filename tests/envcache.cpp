@@ -0,0 +1,129 @@
+#include "envcache.h"
+#include "logging.h"
+#include <map>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+void test_run(const string &prefix, const string &got, const string &expected) {
+  if (got != expected) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+    exit(1);
+  }
+}
+
+// Records the environments evicted in the order they were removed.
+// SIZES are what removing them frees.
+class Remover : public EnvCache::Remover {
+public:
+  explicit Remover(map<string, size_t> &sizes) : sizes(sizes) {}
+  virtual size_t remove(const string &env) {
+    removed += (removed.empty() ? "" : " ") + env;
+    return sizes[env];
+  }
+  map<string, size_t> &sizes;
+  string removed;
+};
+
+static string evict(EnvCache &cache, const string &keep, map<string, size_t> &sizes) {
+  Remover remover(sizes);
+  cache.evict(keep, remover);
+  return remover.removed;
+}
+
+static void test_1() {
+  // jobs hold an environment until each of them released it
+  EnvCache cache;
+  cache.add("a", 10);
+  cache.add("b", 10);
+  cache.acquire("a");
+  cache.acquire("a");
+  test_run("1a", cache.victim(""), "b");
+  cache.release("a");
+  test_run("1b", cache.victim("b"), "");
+  cache.release("a");
+  test_run("1c", cache.victim("b"), "a");
+  // more releases than acquires don't leave it held by fewer than no jobs
+  cache.release("a");
+  cache.acquire("a");
+  test_run("1d", cache.victim("b"), "");
+  cache.release("a");
+  test_run("1e", cache.victim("b"), "a");
+  // of unknown environments are ignored
+  cache.acquire("c");
+  cache.release("c");
+  test_run("1f", toString(cache.contains("c")), "0");
+}
+
+static void test_2() {
+  // pinned and held environments are never chosen, however old
+  EnvCache cache;
+  cache.add("pinned", 10, true);
+  cache.add("held", 10);
+  cache.add("unpinned", 10, true);
+  cache.add("new", 10);
+  cache.acquire("held");
+  cache.setPinned("unpinned", false);
+  cache.touch("pinned");
+  cache.touch("held");
+  test_run("2a", cache.victim(""), "unpinned");
+  test_run("2b", cache.victim("unpinned"), "new");
+  cache.remove("unpinned", 10);
+  test_run("2c", cache.victim("new"), "");
+  // adding it again keeps it pinned
+  cache.add("pinned", 5);
+  cache.release("held");
+  test_run("2d", cache.victim("new"), "held");
+  test_run("2e", toString(cache.size()), "35");
+}
+
+static void test_3() {
+  // over the limit, the least recently used go until it is down to the low watermark
+  EnvCache cache;
+  cache.setLimit(1000, 50);
+  map<string, size_t> sizes;
+  const char *envs[] = { "a", "b", "c", "d", "e" };
+  for (int i = 0; i < 5; ++i) {
+    sizes[envs[i]] = 200;
+    cache.add(envs[i], 200);
+  }
+  test_run("3a", evict(cache, "e", sizes), "");
+  cache.touch("a");
+  sizes["f"] = 150;
+  cache.add("f", 150);
+  test_run("3b", toString(cache.overLimit()), "1");
+  test_run("3c", evict(cache, "f", sizes), "b c d e");
+  test_run("3d", toString(cache.size()), "350");
+  // it stops above the low watermark when the rest is held or the new one
+  cache.acquire("a");
+  sizes["g"] = 700;
+  cache.add("g", 700);
+  test_run("3e", evict(cache, "g", sizes), "f");
+  test_run("3f", toString(cache.size()), "900");
+  test_run("3g", toString(cache.overLimit()), "0");
+}
+
+static void test_4() {
+  // removing an unknown environment changes nothing
+  EnvCache cache;
+  cache.add("a", 100);
+  cache.remove("unknown", 100);
+  test_run("4a", toString(cache.size()), "100");
+  test_run("4b", toString(cache.contains("a")), "1");
+  test_run("4c", cache.victim(""), "a");
+  // what is freed never takes the size below zero
+  cache.remove("a", 150);
+  test_run("4d", toString(cache.size()), "0");
+  test_run("4e", cache.victim(""), "");
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  test_4();
+  exit(0);
+}
@@ -0,0 +1,280 @@
+#include "environment.h"
+#include "testutil.h"
+#include "logging.h"
+#include "md5.h"
+#include "util.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+// A tar stream as icecc-create-env and other tars write them.
+class Tar {
+public:
+  void header(const string &name, char type, size_t size, const string &link = "",
+              bool bad_checksum = false) {
+    char block[512];
+    memset(block, 0, sizeof(block));
+    strncpy(block, name.c_str(), 99);
+    sprintf(block + 100, "%07o", 0644);
+    sprintf(block + 108, "%07o", 0);
+    sprintf(block + 116, "%07o", 0);
+    sprintf(block + 124, "%011lo", (unsigned long) size);
+    sprintf(block + 136, "%011o", 0);
+    block[156] = type;
+    strncpy(block + 157, link.c_str(), 99);
+    memcpy(block + 257, "ustar  ", 8);
+    memset(block + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; ++i) {
+      sum += (unsigned char) block[i];
+    }
+    sprintf(block + 148, "%06o", bad_checksum ? sum + 1 : sum);
+    block[155] = ' ';
+    stream.append(block, sizeof(block));
+  }
+  void data(const string &data) {
+    stream += data;
+    stream.append((512 - data.size() % 512) % 512, '\0');
+  }
+  void file(const string &name, const string &contents) {
+    header(name, '0', contents.size());
+    data(contents);
+  }
+  // a GNU ././@LongLink entry, 'L' for the name of the next entry, 'K' for its link
+  void long_name(char type, const string &name) {
+    header("././@LongLink", type, name.size() + 1);
+    data(name + '\0');
+  }
+  void pax(const string &key, const string &value) {
+    string record = " " + key + "=" + value + "\n";
+    size_t len = record.size() + 1;
+    while (toString(len).size() + record.size() != len) {
+      ++len;
+    }
+    record = toString(len) + record;
+    header("PaxHeaders/x", 'x', record.size());
+    data(record);
+  }
+  void end() {
+    stream.append(1024, '\0');
+  }
+  string stream;
+};
+
+// A file with the contents of the stream, for reading it from the start.
+static int stream_fd(const string &stream) {
+  FILE *f = tmpfile();
+  if (!f || fwrite(stream.data(), 1, stream.size(), f) != stream.size() || fflush(f)) {
+    cerr << "tmpfile failed\n";
+    exit(1);
+  }
+  int fd = dup(fileno(f));
+  fclose(f);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+static string file_contents(const string &path) {
+  string data;
+  if (!read_file(path, data)) {
+    return "<none>";
+  }
+  return data;
+}
+
+static string link_contents(const string &path) {
+  char buf[4096];
+  ssize_t len = readlink(path.c_str(), buf, sizeof(buf));
+  return len < 0 ? "<none>" : string(buf, len);
+}
+
+static string env_hash(const string &contents) {
+  md5_state_t state;
+  md5_init(&state);
+  md5_append(&state, reinterpret_cast<const md5_byte_t *>(contents.data()), contents.size());
+  string line = md5_hex(&state) + "\n";
+  md5_init(&state);
+  md5_append(&state, reinterpret_cast<const md5_byte_t *>(line.data()), line.size());
+  return md5_hex(&state);
+}
+
+static string base;
+
+// Extracts TAR into a fresh environment directory, returned in DIR.
+static bool extract(const Tar &tar, string &dir, string &hash, bool &plain) {
+  static int count = 0;
+  dir = base + "/env" + toString(++count);
+  mkdir(dir.c_str(), 0755);
+  int fd = stream_fd(tar.stream);
+  bool ok = extract_env_tar(fd, dir, base + "/store", hash, plain);
+  close(fd);
+  return ok;
+}
+
+void test_run(const string &prefix, const string &got, const string &expected) {
+  if (got != expected) {
+    cerr << prefix << " failed\n";
+    cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+    remove_dir(base);
+    exit(1);
+  }
+}
+
+static void test_1() {
+  // GNU long names, of a file and of a symlink and its target
+  string long_dir = "usr/lib/" + string(120, 'd');
+  string long_link = "/" + long_dir + "/" + string(110, 't');
+  Tar tar;
+  tar.long_name('L', long_dir + "/libx.so");
+  tar.file(long_dir.substr(0, 99), "libx");
+  tar.long_name('K', long_link);
+  tar.long_name('L', long_dir + "/liby.so");
+  tar.header("liby.so", '2', 0, long_link.substr(0, 99));
+  tar.end();
+  string dir, hash;
+  bool plain;
+  test_run("1a", toString(extract(tar, dir, hash, plain)), "1");
+  test_run("1b", file_contents(dir + "/" + long_dir + "/libx.so"), "libx");
+  test_run("1c", link_contents(dir + "/" + long_dir + "/liby.so"), long_link);
+  test_run("1d", toString(plain), "0");
+}
+
+static void test_2() {
+  // pax extended headers with the path and the link target
+  string long_path = "usr/" + string(150, 'p') + "/cc1";
+  Tar tar;
+  tar.pax("path", long_path);
+  tar.file("cc1", "cc1");
+  tar.pax("path", "usr/bin/as");
+  tar.pax("linkpath", "x86_64-linux-gnu-as");
+  tar.header("as", '2', 0, "as");
+  tar.end();
+  string dir, hash;
+  bool plain;
+  test_run("2a", toString(extract(tar, dir, hash, plain)), "1");
+  test_run("2b", file_contents(dir + "/" + long_path), "cc1");
+  test_run("2c", link_contents(dir + "/usr/bin/as"), "x86_64-linux-gnu-as");
+  test_run("2d", file_contents(dir + "/cc1"), "<none>");
+}
+
+static void test_3() {
+  // leading slashes are taken off like tar does, ../ is not allowed
+  Tar tar;
+  tar.file("/usr/bin/gcc", "gcc");
+  tar.end();
+  string dir, hash;
+  bool plain;
+  test_run("3a", toString(extract(tar, dir, hash, plain)), "1");
+  test_run("3b", file_contents(dir + "/usr/bin/gcc"), "gcc");
+  test_run("3c", toString(plain), "1");
+
+  Tar up;
+  up.file("../escaped", "x");
+  up.end();
+  test_run("3d", toString(extract(up, dir, hash, plain)), "0");
+  test_run("3e", file_contents(base + "/escaped"), "<none>");
+
+  Tar inner;
+  inner.file("usr/../../escaped", "x");
+  inner.end();
+  test_run("3f", toString(extract(inner, dir, hash, plain)), "0");
+  test_run("3g", file_contents(base + "/escaped"), "<none>");
+}
+
+static void test_4() {
+  // a symlink out of the environment must not be written through
+  string outside = base + "/outside";
+  mkdir(outside.c_str(), 0755);
+  write_file(outside + "/victim", "orig", 4);
+
+  Tar dir_link;
+  dir_link.header("out", '2', 0, outside);
+  dir_link.file("out/evil", "evil");
+  dir_link.end();
+  string dir, hash;
+  bool plain;
+  test_run("4a", toString(extract(dir_link, dir, hash, plain)), "0");
+  test_run("4b", file_contents(outside + "/evil"), "<none>");
+
+  // a file replaces a symlink of its name, it doesn't follow it
+  Tar file_link;
+  file_link.header("victim", '2', 0, outside + "/victim");
+  file_link.file("victim", "evil");
+  file_link.end();
+  test_run("4c", toString(extract(file_link, dir, hash, plain)), "1");
+  test_run("4d", file_contents(outside + "/victim"), "orig");
+  test_run("4e", file_contents(dir + "/victim"), "evil");
+}
+
+static void test_5() {
+  // a corrupt header
+  Tar tar;
+  tar.header("usr/bin/gcc", '0', 3, "", true);
+  tar.data("gcc");
+  tar.end();
+  string dir, hash;
+  bool plain;
+  test_run("5a", toString(extract(tar, dir, hash, plain)), "0");
+  test_run("5b", file_contents(dir + "/usr/bin/gcc"), "<none>");
+}
+
+static void test_6() {
+  // the stream ends in a file, and before the end of the archive
+  Tar tar;
+  tar.header("usr/bin/gcc", '0', 1000);
+  tar.data("gcc");
+  string dir, hash;
+  bool plain;
+  test_run("6a", toString(extract(tar, dir, hash, plain)), "0");
+
+  Tar no_end;
+  no_end.file("usr/bin/gcc", "gcc");
+  test_run("6b", toString(extract(no_end, dir, hash, plain)), "0");
+}
+
+// Installs TAR as the environment NAME, from stdin like the install child.
+static int install(const Tar &tar, const string &name) {
+  static int count = 0;
+  string dir = base + "/install" + toString(++count);
+  mkdir(dir.c_str(), 0755);
+  int fd = stream_fd(tar.stream);
+  dup2(fd, STDIN_FILENO);
+  close(fd);
+  return install_from_tar(name, dir, base + "/store", NULL);
+}
+
+static void test_7() {
+  // environments named by the hash of their files must have those files
+  Tar tar;
+  tar.file("usr/bin/gcc", "gcc");
+  tar.end();
+  string dir, hash;
+  bool plain;
+  test_run("7a", toString(extract(tar, dir, hash, plain)), "1");
+  test_run("7b", hash, env_hash("gcc"));
+  test_run("7c", toString(install(tar, env_hash("gcc") + ".tar.gz")), "0");
+  test_run("7d", toString(install(tar, env_hash("g++") + ".tar.gz")), "1");
+  // other names are not checked
+  test_run("7e", toString(install(tar, "gcc-12.tar.gz")), "0");
+}
+
+int main() {
+  base = make_temp_dir("environment");
+  mkdir((base + "/store").c_str(), 0755);
+  test_1();
+  test_2();
+  test_3();
+  test_4();
+  test_5();
+  test_6();
+  test_7();
+  remove_dir(base);
+  exit(0);
+}
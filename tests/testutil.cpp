@@ -0,0 +1,24 @@
+#include "testutil.h"
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+string make_temp_dir(const string &name) {
+  string templ = "/tmp/icecc-test-" + name + "-XXXXXX";
+  vector<char> dir(templ.begin(), templ.end());
+  dir.push_back('\0');
+  if (!mkdtemp(&dir[0])) {
+    cerr << "mkdtemp failed\n";
+    exit(1);
+  }
+  return &dir[0];
+}
+
+void remove_dir(const string &dir) {
+  string command = "rm -rf '" + dir + "'";
+  if (system(command.c_str()) != 0) {
+    cerr << "failed to remove " << dir << "\n";
+  }
+}
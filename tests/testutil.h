@@ -0,0 +1,11 @@
+#ifndef ICECREAM_TESTUTIL_H
+#define ICECREAM_TESTUTIL_H
+
+#include <string>
+
+// A new directory for the files of a test, with NAME in its name.
+std::string make_temp_dir(const std::string &name);
+// Removes DIR and everything in it.
+void remove_dir(const std::string &dir);
+
+#endif